@@ -13,11 +13,46 @@
 #include "rctindex.h"
 #include "txdb.h"
 #include "txmempool.h"
+#include "random.h"
 #include "util.h"
 #include "validation.h"
 
 
-bool VerifyMLSAG(const CTransaction &tx, CValidationState &state)
+bool CAnonInputCheck::operator()()
+{
+    int rv;
+    const CTxIn &txin = ptx->vin[nIn];
+    const std::vector<uint8_t> &vKeyImages = txin.scriptData.stack[0];
+    const std::vector<uint8_t> &vDL = txin.scriptWitness.stack[1];
+    
+    std::vector<const uint8_t*> vpInCommits(vInCommits.size());
+    for (size_t i = 0; i < vInCommits.size(); ++i)
+        vpInCommits[i] = vInCommits[i].data;
+    std::vector<const uint8_t*> vpOutCommits(vOutCommits.size());
+    for (size_t i = 0; i < vOutCommits.size(); ++i)
+        vpOutCommits[i] = vOutCommits[i].data;
+    
+    if (0 != (rv = secp256k1_prepare_mlsag(&vM[0], nullptr,
+        vpOutCommits.size(), vpOutCommits.size(), nCols, nRows,
+        &vpInCommits[0], &vpOutCommits[0], nullptr)))
+    {
+        sRejectReason = "prepare-mlsag-failed";
+        return error("%s: prepare-mlsag-failed %d", __func__, rv);
+    };
+    
+    uint256 txhash = ptx->GetHash();
+    if (0 != (rv = secp256k1_verify_mlsag(secp256k1_ctx_blind,
+        txhash.begin(), nCols, nRows, 
+        &vM[0], &vKeyImages[0], &vDL[0], &vDL[32])))
+    {
+        sRejectReason = "verify-mlsag-failed";
+        return error("%s: verify-mlsag-failed %d", __func__, rv);
+    };
+    
+    return true;
+};
+
+bool VerifyMLSAG(const CTransaction &tx, CValidationState &state, std::vector<std::shared_ptr<CAnonInputCheck> > *pvChecks)
 {
     int rv;
     std::set<int64_t> setHaveI; // Anon prev-outputs can only be used once per transaction.
@@ -49,8 +84,13 @@ bool VerifyMLSAG(const CTransaction &tx, CValidationState &state)
     if (fSplitCommitments)
         vpInputSplitCommits.reserve(tx.vin.size());
     
-    for (const auto &txin : tx.vin)
+    // Ring members are read and checked here, the signatures are verified by the checks once all inputs have passed
+    std::vector<std::shared_ptr<CAnonInputCheck> > vChecks;
+    vChecks.reserve(tx.vin.size());
+    
+    for (uint32_t nIn = 0; nIn < tx.vin.size(); ++nIn)
     {
+        const CTxIn &txin = tx.vin[nIn];
         if (!txin.IsAnonInput())
             return state.DoS(100, false, REJECT_MALFORMED, "bad-anon-input");
         
@@ -86,26 +126,29 @@ bool VerifyMLSAG(const CTransaction &tx, CValidationState &state)
         if (vDL.size() != (1 + (nInputs+1) * nRingSize) * 32 + (fSplitCommitments ? 33 : 0))
             return state.DoS(100, false, REJECT_MALFORMED, "bad-anonin-sig-size");
         
-        std::vector<uint8_t> vM(nCols * nRows * 33);
-        
-        std::vector<secp256k1_pedersen_commitment> vCommitments;
-        vCommitments.reserve(nCols * nInputs);
-        std::vector<const uint8_t*> vpOutCommits;
-        std::vector<const uint8_t*> vpInCommits(nCols * nInputs);
+        std::shared_ptr<CAnonInputCheck> check = std::make_shared<CAnonInputCheck>();
+        check->ptx = &tx;
+        check->nIn = nIn;
+        check->nCols = nCols;
+        check->nRows = nRows;
+        check->vM.resize(nCols * nRows * 33);
+        check->vInCommits.reserve(nCols * nInputs);
         
         if (fSplitCommitments)
         {
-            vpOutCommits.push_back(&vDL[(1 + (nInputs+1) * nRingSize) * 32]);
-            vpInputSplitCommits.push_back(&vDL[(1 + (nInputs+1) * nRingSize) * 32]);
+            const uint8_t *pSplitCommit = &vDL[(1 + (nInputs+1) * nRingSize) * 32];
+            check->vOutCommits.resize(1);
+            memcpy(check->vOutCommits[0].data, pSplitCommit, 33);
+            vpInputSplitCommits.push_back(pSplitCommit);
         } else
         {
-            vpOutCommits.push_back(plainCommitment.data);
+            check->vOutCommits.push_back(plainCommitment);
             
             secp256k1_pedersen_commitment *pc;
             for (auto &txout : tx.vpout)
             {
                 if ((pc = txout->GetPCommitment()))
-                    vpOutCommits.push_back(pc->data);
+                    check->vOutCommits.push_back(*pc);
             };
         };
         
@@ -123,13 +166,12 @@ bool VerifyMLSAG(const CTransaction &tx, CValidationState &state)
                 return state.DoS(100, false, REJECT_MALFORMED, "bad-anonin-dup-i");
             
             CAnonOutput ao;
-            if (!pblocktree->ReadRCTOutput(nIndex, ao))
+            if (!pblocktree->ReadRCTOutputCached(nIndex, ao))
             {
                 return state.DoS(100, false, REJECT_MALFORMED, "bad-anonin-unknown-i");
             };
-            memcpy(&vM[(i+k*nCols)*33], ao.pubkey.begin(), 33);
-            vCommitments.push_back(ao.commitment);
-            vpInCommits[i+k*nCols] = vCommitments.back().data;
+            memcpy(&check->vM[(i+k*nCols)*33], ao.pubkey.begin(), 33);
+            check->vInCommits.push_back(ao.commitment); // at i+k*nCols
         };
         
         uint256 txhashKI;
@@ -164,18 +206,19 @@ bool VerifyMLSAG(const CTransaction &tx, CValidationState &state)
             };
         };
         
-        if (0 != (rv = secp256k1_prepare_mlsag(&vM[0], nullptr,
-            vpOutCommits.size(), vpOutCommits.size(), nCols, nRows,
-            &vpInCommits[0], &vpOutCommits[0], nullptr)))
-            return state.DoS(100, error("%s: prepare-mlsag-failed %d", __func__, rv), REJECT_INVALID, "prepare-mlsag-failed");
-        
-        if (0 != (rv = secp256k1_verify_mlsag(secp256k1_ctx_blind,
-            txhash.begin(), nCols, nRows, 
-            &vM[0], &vKeyImages[0], &vDL[0], &vDL[32])))
-            return state.DoS(100, error("%s: verify-mlsag-failed %d", __func__, rv), REJECT_INVALID, "verify-mlsag-failed");
+        vChecks.push_back(check);
     };
     
-    // Verify commitment sums match
+    if (!pvChecks)
+    {
+        for (auto &check : vChecks)
+        {
+            if (!(*check)())
+                return state.DoS(100, false, REJECT_INVALID, check->sRejectReason);
+        };
+    };
+    
+    // Verify commitment sums match, when the checks are deferred the result is the same in either order
     if (fSplitCommitments)
     {
         std::vector<const uint8_t*> vpOutCommits;
@@ -195,6 +238,8 @@ bool VerifyMLSAG(const CTransaction &tx, CValidationState &state)
             return state.DoS(100, error("%s: verify-commit-tally-failed %d", __func__, rv), REJECT_INVALID, "verify-commit-tally-failed");
     };
     
+    if (pvChecks)
+        pvChecks->insert(pvChecks->end(), vChecks.begin(), vChecks.end());
     
     return true;
 };
@@ -320,6 +365,43 @@ bool RollBackRCTIndex(int64_t nLastValidRCTOutput, std::set<CCmpPubKey> &setKi)
     if (!pblocktree->WriteLastRCTOutput(nLastValidRCTOutput))
         return error("%s: WriteLastRCTOutput failed.", __func__);
     
+    // Not part of a block connect, write through now rather than at the next chainstate flush
+    if (!pblocktree->FlushRCTIndex())
+        return error("%s: FlushRCTIndex failed.", __func__);
+    
     return true;
 };
 
+bool CDecoySelector::Pick(std::set<int64_t> &setHave, int64_t &nIndex) const
+{
+    int64_t nMinIndex = 1;
+    if (GetRandInt(100) < 50) // 50% chance of selecting from the last nGroup1
+    {
+        nMinIndex = std::max((int64_t)1, nMaxIndex - nGroup1);
+    } else
+    if (GetRandInt(100) < 70) // further 70% chance of selecting from the last nGroup2
+    {
+        nMinIndex = std::max((int64_t)1, nMaxIndex - nGroup2);
+    };
+    
+    int64_t nFree;
+    for (;;)
+    {
+        nFree = nMaxIndex - nMinIndex + 1;
+        if (nFree > 0)
+            nFree -= std::distance(setHave.lower_bound(nMinIndex), setHave.upper_bound(nMaxIndex));
+        if (nFree > 0)
+            break;
+        if (nMinIndex <= 1)
+            return false;
+        nMinIndex = 1; // Group is used up, widen to all usable outputs
+    };
+    
+    // Map a random position among the free indices to its index, skipping the used ones below it
+    nIndex = nMinIndex + GetRand(nFree);
+    for (auto it = setHave.lower_bound(nMinIndex); it != setHave.end() && *it <= nIndex; ++it)
+        nIndex++;
+    
+    setHave.insert(nIndex);
+    return true;
+};
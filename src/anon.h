@@ -6,6 +6,7 @@
 #define PARTICL_ANON_H
 
 #include <inttypes.h>
+#include <memory>
 
 #include "primitives/transaction.h"
 #include "consensus/validation.h"
@@ -20,7 +21,54 @@ const size_t MAX_ANON_INPUTS = 32; // To raise see MLSAG_MAX_ROWS also
 const size_t ANON_FEE_MULTIPLIER = 2;
 
 
-bool VerifyMLSAG(const CTransaction &tx, CValidationState &state);
+/**
+ * Closure representing the MLSAG verification of one anon input
+ * The ring members are read by VerifyMLSAG, the signature and key images are referenced in the transaction
+ */
+class CAnonInputCheck
+{
+public:
+    const CTransaction *ptx = nullptr;
+    uint32_t nIn = 0;
+    size_t nCols = 0;
+    size_t nRows = 0;
+    std::vector<uint8_t> vM;                                // ring member pubkeys, last row is filled by prepare_mlsag
+    std::vector<secp256k1_pedersen_commitment> vInCommits;  // ring member commitments
+    std::vector<secp256k1_pedersen_commitment> vOutCommits;
+    std::string sRejectReason;
+
+    bool operator()();
+};
+
+/**
+ * Draws the decoy ring members of anon inputs from the RCT outputs deep enough to be spent.
+ * Heights never decrease with the RCT index, so the usable outputs are the indices up to
+ * nMaxIndex, found upfront. Decoys are picked uniformly from the unused indices of a range,
+ * without retries.
+ */
+class CDecoySelector
+{
+public:
+    /** Decoys are drawn from the last nGroup1 usable outputs, else the last nGroup2, else all */
+    CDecoySelector(int64_t nMaxIndexIn, int64_t nGroup1In, int64_t nGroup2In)
+        : nMaxIndex(nMaxIndexIn), nGroup1(nGroup1In), nGroup2(nGroup2In) {}
+
+    /** Pick an output not in setHave and add it, false if all usable outputs are in setHave */
+    bool Pick(std::set<int64_t> &setHave, int64_t &nIndex) const;
+
+    int64_t GetMaxIndex() const { return nMaxIndex; }
+
+private:
+    int64_t nMaxIndex;
+    int64_t nGroup1;
+    int64_t nGroup2;
+};
+
+/**
+ * If pvChecks is set the MLSAG signatures are not verified, a check is appended for each input instead.
+ * All other checks, including the commitment tally, are done before returning.
+ */
+bool VerifyMLSAG(const CTransaction &tx, CValidationState &state, std::vector<std::shared_ptr<CAnonInputCheck> > *pvChecks = nullptr);
 
 bool AddKeyImagesToMempool(const CTransaction &tx, CTxMemPool &pool);
 bool RemoveKeyImagesFromMempool(const uint256 &hash, const CTxIn &txin, CTxMemPool &pool);
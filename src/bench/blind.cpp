@@ -10,9 +10,16 @@
 #include "blind.h"
 #include "random.h"
 #include "key.h"
+#include "checkqueue.h"
+#include "validation.h"
+#include "consensus/tx_verify.h"
+#include "consensus/validation.h"
+#include "primitives/transaction.h"
 
 #include <secp256k1_rangeproof.h>
 
+#include <boost/thread/thread.hpp>
+
 static void Blind(benchmark::State& state)
 {
     ECC_Start_Blinding();
@@ -60,4 +67,191 @@ static void Blind(benchmark::State& state)
     ECC_Stop_Blinding();
 }
 
+static const size_t N_CT_TXNS = 25;
+static const size_t N_CT_OUTPUTS = 2; // per transaction
+
+static void MakeBlindOutput(CAmount nValue, OUTPUT_PTR<CTxOutCT> &out)
+{
+    CKey ephemeral_key;
+    ephemeral_key.MakeNewKey(true);
+
+    std::vector<uint8_t> vBlind(32);
+    GetStrongRandBytes(&vBlind[0], 32);
+
+    out = MAKE_OUTPUT<CTxOutCT>();
+    CPubKey pkEphem = ephemeral_key.GetPubKey();
+    out->vData.assign(pkEphem.begin(), pkEphem.end());
+    assert(secp256k1_pedersen_commit(secp256k1_ctx_blind, &out->commitment, &vBlind[0], (uint64_t)nValue, secp256k1_generator_h));
+
+    size_t nRangeProofLen = 5134;
+    out->vRangeproof.resize(nRangeProofLen);
+    assert(secp256k1_rangeproof_sign(secp256k1_ctx_blind,
+        &out->vRangeproof[0], &nRangeProofLen,
+        0, &out->commitment,
+        &vBlind[0], ephemeral_key.begin(),
+        2, 32,
+        nValue,
+        nullptr, 0,
+        nullptr, 0,
+        secp256k1_generator_h));
+    out->vRangeproof.resize(nRangeProofLen);
+}
+
+static void MakeBlindBlock(std::vector<CTransactionRef> &vtx)
+{
+    for (size_t i = 0; i < N_CT_TXNS; ++i)
+    {
+        CMutableTransaction txn;
+        txn.nVersion = PARTICL_TXN_VERSION;
+        txn.vin.push_back(CTxIn(GetRandHash(), 0));
+
+        OUTPUT_PTR<CTxOutData> outFee = MAKE_OUTPUT<CTxOutData>();
+        outFee->vData.push_back(DO_FEE);
+        PutVarInt(outFee->vData, 10000);
+        txn.vpout.push_back(outFee);
+
+        for (size_t k = 0; k < N_CT_OUTPUTS; ++k)
+        {
+            OUTPUT_PTR<CTxOutCT> out;
+            MakeBlindOutput((i + 1) * COIN, out);
+            txn.vpout.push_back(out);
+        };
+        vtx.push_back(MakeTransactionRef(txn));
+    };
+}
+
+// Check the transactions of a block of blinded transactions, as CheckBlock does
+static void CheckBlindBlock(benchmark::State& state, int nThreads, bool fWarm)
+{
+    ECC_Start_Blinding();
+
+    std::vector<CTransactionRef> vtx;
+    MakeBlindBlock(vtx);
+
+    CValidationState validationState;
+    if (fWarm)
+    {
+        // The transactions were accepted to the mempool before the block arrived
+        InitRangeproofCache();
+        for (const auto &tx : vtx)
+            assert(CheckTransaction(*tx, validationState));
+    };
+
+    CCheckQueue<CRangeproofBatchCheck> queue(16);
+    boost::thread_group tg;
+    for (int i = 0; i < nThreads - 1; ++i)
+        tg.create_thread([&]{queue.Thread();});
+
+    std::vector<CRangeproofCheck> vChecks;
+    while (state.KeepRunning())
+    {
+        vChecks.clear();
+        for (const auto &tx : vtx)
+            assert(CheckTransaction(*tx, validationState, true, &vChecks, false));
+        assert(vChecks.size() == N_CT_TXNS * N_CT_OUTPUTS);
+        assert(CheckRangeproofs(vChecks, validationState, nThreads > 1 ? &queue : nullptr));
+    };
+
+    tg.interrupt_all();
+    tg.join_all();
+
+    ECC_Stop_Blinding();
+}
+
+// Verify the rangeproofs of 128 blinded outputs, nBatchSize proofs at a time
+static void VerifyRangeproofBatch(benchmark::State& state, size_t nBatchSize)
+{
+    ECC_Start_Blinding();
+
+    const size_t nOutputs = 128;
+    CMutableTransaction txn;
+    txn.nVersion = PARTICL_TXN_VERSION;
+    txn.vin.push_back(CTxIn(GetRandHash(), 0));
+    for (size_t k = 0; k < nOutputs; ++k)
+    {
+        OUTPUT_PTR<CTxOutCT> out;
+        MakeBlindOutput((k + 1) * COIN, out);
+        txn.vpout.push_back(out);
+    };
+    CTransaction tx(txn);
+
+    std::vector<CRangeproofCheck> vChecks;
+    for (const auto &out : tx.vpout)
+        vChecks.push_back(CRangeproofCheck(tx, out.get(), false));
+
+    while (state.KeepRunning())
+    {
+        for (size_t i = 0; i < nOutputs; i += nBatchSize)
+        {
+            CRangeproofBatchCheck batch(vChecks.begin() + i, vChecks.begin() + std::min(i + nBatchSize, nOutputs));
+            assert(batch());
+        };
+    };
+
+    ECC_Stop_Blinding();
+}
+
+// Commit to and sign the rangeproofs of the blinded outputs of one nOutputs output transaction,
+// as the wallet does when building it, one by one or on worker threads
+static void SignBlindOutputs(benchmark::State& state, size_t nOutputs, bool fParallel)
+{
+    ECC_Start_Blinding();
+
+    std::vector<secp256k1_pedersen_commitment> vCommitments(nOutputs);
+    std::vector<std::vector<uint8_t> > vRangeproofs(nOutputs);
+    std::vector<CRangeproofSignData> vProofs(nOutputs);
+    for (size_t k = 0; k < nOutputs; ++k)
+    {
+        CRangeproofSignData &d = vProofs[k];
+        d.pCommitment = &vCommitments[k];
+        d.pvRangeproof = &vRangeproofs[k];
+        d.nValue = (k + 1) * COIN;
+        GetStrongRandBytes(d.blind, 32);
+        GetStrongRandBytes(d.nonce, 32);
+        d.nExponent = 2;
+        d.nBits = 32;
+        assert(0 == SelectRangeProofParameters(d.nValue, d.nMinValue, d.nExponent, d.nBits));
+    };
+
+    while (state.KeepRunning())
+    {
+        if (fParallel)
+        {
+            size_t nFailed;
+            assert(0 == SignRangeproofs(vProofs, nFailed));
+        } else
+        {
+            for (auto &d : vProofs)
+                assert(0 == SignRangeproof(d));
+        };
+    };
+
+    ECC_Stop_Blinding();
+}
+
+static void SignBlindOutputs2(benchmark::State& state) { SignBlindOutputs(state, 2, false); }
+static void SignBlindOutputs2Parallel(benchmark::State& state) { SignBlindOutputs(state, 2, true); }
+static void SignBlindOutputs10(benchmark::State& state) { SignBlindOutputs(state, 10, false); }
+static void SignBlindOutputs10Parallel(benchmark::State& state) { SignBlindOutputs(state, 10, true); }
+
+static void VerifyRangeproofBatch1(benchmark::State& state) { VerifyRangeproofBatch(state, 1); }
+static void VerifyRangeproofBatch16(benchmark::State& state) { VerifyRangeproofBatch(state, 16); }
+static void VerifyRangeproofBatch128(benchmark::State& state) { VerifyRangeproofBatch(state, 128); }
+
+static void CheckBlindBlock1(benchmark::State& state) { CheckBlindBlock(state, 1, false); }
+static void CheckBlindBlock4(benchmark::State& state) { CheckBlindBlock(state, 4, false); }
+static void CheckBlindBlock8(benchmark::State& state) { CheckBlindBlock(state, 8, false); }
+static void CheckBlindBlockWarm(benchmark::State& state) { CheckBlindBlock(state, 1, true); }
+
 BENCHMARK(Blind);
+BENCHMARK(CheckBlindBlock1);
+BENCHMARK(CheckBlindBlock4);
+BENCHMARK(CheckBlindBlock8);
+BENCHMARK(CheckBlindBlockWarm);
+BENCHMARK(VerifyRangeproofBatch1);
+BENCHMARK(VerifyRangeproofBatch16);
+BENCHMARK(VerifyRangeproofBatch128);
+BENCHMARK(SignBlindOutputs2);
+BENCHMARK(SignBlindOutputs2Parallel);
+BENCHMARK(SignBlindOutputs10);
+BENCHMARK(SignBlindOutputs10Parallel);
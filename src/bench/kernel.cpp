@@ -0,0 +1,100 @@
+// Copyright (c) 2017 The Particl Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "chain.h"
+#include "pos/kernel.h"
+#include "random.h"
+#include "util.h"
+
+// Kernels checked per iteration for one timestamp slot, kernels/sec is
+// the candidate count over the time per iteration.
+
+static uint32_t HardBits()
+{
+    arith_uint256 bnTarget = (~arith_uint256(0) >> 200);
+    return bnTarget.GetCompact(); // kernels never pass, every candidate is hashed
+}
+
+static void MakeCandidates(CBlockIndex &indexPrev, size_t nCandidates, std::vector<COutPoint> &vPrevouts, CStakeKernelSearch &search)
+{
+    indexPrev.nHeight = 1000;
+    indexPrev.nTime = 1510000000;
+    indexPrev.bnStakeModifier = GetRandHash();
+    
+    vPrevouts.resize(nCandidates);
+    for (size_t i = 0; i < nCandidates; ++i)
+    {
+        vPrevouts[i] = COutPoint(GetRandHash(), i % 4);
+        assert(search.AddCandidate(indexPrev.bnStakeModifier, HardBits(), i, vPrevouts[i], indexPrev.nTime - 3600, COIN));
+    };
+}
+
+// Per candidate check, as CreateCoinStake did through CheckKernel without the coin lookups
+static void KernelCheck(benchmark::State& state, size_t nCandidates)
+{
+    CBlockIndex indexPrev;
+    std::vector<COutPoint> vPrevouts;
+    CStakeKernelSearch search;
+    MakeCandidates(indexPrev, nCandidates, vPrevouts, search);
+    
+    uint32_t nBits = HardBits(), nTime = indexPrev.nTime;
+    while (state.KeepRunning())
+    {
+        nTime += 16;
+        for (const auto &prevout : vPrevouts)
+        {
+            uint256 hashProofOfStake, targetProofOfStake;
+            assert(!CheckStakeKernelHash(&indexPrev, nBits, indexPrev.nTime - 3600, COIN,
+                prevout, nTime, hashProofOfStake, targetProofOfStake));
+        };
+    };
+}
+
+static void KernelSearch(benchmark::State& state, size_t nCandidates, int nThreads)
+{
+    CBlockIndex indexPrev;
+    std::vector<COutPoint> vPrevouts;
+    CStakeKernelSearch search;
+    MakeCandidates(indexPrev, nCandidates, vPrevouts, search);
+    
+    uint32_t nTime = indexPrev.nTime;
+    while (state.KeepRunning())
+    {
+        nTime += 16;
+        assert(search.Find(nTime, 0, nThreads) == -1);
+    };
+}
+
+static void KernelCheck10k(benchmark::State& state)
+{
+    KernelCheck(state, 10000);
+}
+
+static void KernelSearch10k(benchmark::State& state)
+{
+    KernelSearch(state, 10000, 1);
+}
+
+static void KernelSearch10kThreads(benchmark::State& state)
+{
+    KernelSearch(state, 10000, GetNumCores());
+}
+
+static void KernelSearch1M(benchmark::State& state)
+{
+    KernelSearch(state, 1000000, 1);
+}
+
+static void KernelSearch1MThreads(benchmark::State& state)
+{
+    KernelSearch(state, 1000000, GetNumCores());
+}
+
+BENCHMARK(KernelCheck10k);
+BENCHMARK(KernelSearch10k);
+BENCHMARK(KernelSearch10kThreads);
+BENCHMARK(KernelSearch1M);
+BENCHMARK(KernelSearch1MThreads);
@@ -3,6 +3,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <iostream>
+#include <vector>
 
 #include "bench.h"
 #include "utiltime.h"
@@ -15,43 +16,39 @@
 #include <secp256k1_rangeproof.h>
 #include <secp256k1_mlsag.h>
 
-static void Mlsag(benchmark::State& state)
+// Verify one MLSAG signature over nInputs rows of nCols ring members, the commitment sum is the last row
+static void MlsagVerify(benchmark::State& state, size_t nInputs, size_t nCols)
 {
     ECC_Start_Blinding();
     
-    
-    const size_t nInputs = 2;
-    const size_t nCols = 4;
     const size_t nRows = nInputs+1;
     const size_t nRealCol = 1;
     const size_t nOutputs = 2;
     const size_t nBlinded = 1;
     uint8_t tmp32[32], preimage[32];
     
-    int64_t nValues[] = {1234 * COIN, 1234 * COIN, 2467 * COIN, 1 * COIN};
+    const CAmount nValueOut = 1234 * COIN;
+    const CAmount nFee = 1 * COIN;
     
-    std::vector<CKey> vKeys(2);
-    std::vector<CKey> vBlindsOut(1);
-    std::vector<CKey> vBlindsIn(2);
+    std::vector<CKey> vKeys(nInputs);
+    std::vector<CKey> vBlindsOut(nBlinded);
+    std::vector<CKey> vBlindsIn(nInputs);
     
-    const uint8_t *pkeys[nInputs+1];
-    uint8_t m[nRows * nCols * 33];
-    const uint8_t *pcm_in[nInputs * nCols], *pcm_out[nOutputs], *pblinds[nInputs + nOutputs];
-    secp256k1_pedersen_commitment cm_in[nInputs * nCols];
-    secp256k1_pedersen_commitment cm_out[nOutputs];
+    std::vector<const uint8_t*> pkeys(nInputs+1);
+    std::vector<uint8_t> m(nRows * nCols * 33);
+    std::vector<const uint8_t*> pcm_in(nInputs * nCols), pcm_out(nOutputs), pblinds(nInputs + nOutputs);
+    std::vector<secp256k1_pedersen_commitment> cm_in(nInputs * nCols);
+    std::vector<secp256k1_pedersen_commitment> cm_out(nOutputs);
     uint8_t pc[32];
-    uint8_t ki[nInputs * 33];
-    uint8_t ss[(nInputs+1) * nCols * 33]; // max_rows * max_cols 
-    
-    
-    
+    std::vector<uint8_t> ki(nInputs * 33);
+    std::vector<uint8_t> ss(nRows * nCols * 32);
     
     for (size_t k = 0; k < nBlinded; ++k)
     {
-        vBlindsOut[0].MakeNewKey(true);
+        vBlindsOut[k].MakeNewKey(true);
         pblinds[nInputs + k] = vBlindsOut[k].begin();
         
-        assert(secp256k1_pedersen_commit(secp256k1_ctx_blind, &cm_out[k], pblinds[nInputs + k], nValues[nInputs + k], secp256k1_generator_h));
+        assert(secp256k1_pedersen_commit(secp256k1_ctx_blind, &cm_out[k], pblinds[nInputs + k], nValueOut, secp256k1_generator_h));
         pcm_out[k] = cm_out[k].data;
     };
     
@@ -59,11 +56,10 @@ static void Mlsag(benchmark::State& state)
     for (size_t k = nBlinded; k < nOutputs; ++k)
     {
         // NOTE: fails if value <= 0
-        assert(secp256k1_pedersen_commit(secp256k1_ctx_blind, &cm_out[k], tmp32, nValues[nInputs + k], secp256k1_generator_h));
+        assert(secp256k1_pedersen_commit(secp256k1_ctx_blind, &cm_out[k], tmp32, nFee, secp256k1_generator_h));
         pcm_out[k] = cm_out[k].data;
     };
     
-    
     for (size_t k = 0; k < nInputs; ++k)
     for (size_t i = 0; i < nCols; ++i)
     {
@@ -75,11 +71,12 @@ static void Mlsag(benchmark::State& state)
             CPubKey pk = vKeys[k].GetPubKey();
             memcpy(&m[(i+k*nCols)*33], pk.begin(), 33);
             
-            
+            // First input carries the full value
+            CAmount nValueIn = k == 0 ? nValueOut + nFee : 0;
             vBlindsIn[k].MakeNewKey(true);
             pblinds[k] = vBlindsIn[k].begin();
             
-            assert(secp256k1_pedersen_commit(secp256k1_ctx_blind, &cm_in[i+k*nCols], pblinds[k], nValues[k], secp256k1_generator_h));
+            assert(secp256k1_pedersen_commit(secp256k1_ctx_blind, &cm_in[i+k*nCols], pblinds[k], nValueIn, secp256k1_generator_h));
             pcm_in[i+k*nCols] = cm_in[i+k*nCols].data;
             continue;
         };
@@ -99,27 +96,61 @@ static void Mlsag(benchmark::State& state)
     uint8_t blindSum[32];
     pkeys[nInputs] = blindSum;
     
-    assert(0 == secp256k1_prepare_mlsag(m, blindSum,
+    assert(0 == secp256k1_prepare_mlsag(&m[0], blindSum,
         nOutputs, nBlinded, nCols, nRows,
-        pcm_in, pcm_out, pblinds));
+        &pcm_in[0], &pcm_out[0], &pblinds[0]));
     
     GetRandBytes(tmp32, 32);
     GetRandBytes(preimage, 32);
     
-    assert(0 == secp256k1_generate_mlsag(secp256k1_ctx_blind, ki, pc, ss,
+    assert(0 == secp256k1_generate_mlsag(secp256k1_ctx_blind, &ki[0], pc, &ss[0],
         tmp32, preimage, nCols, nRows, nRealCol,
-        pkeys, m));
-    
-    
+        &pkeys[0], &m[0]));
     
     while (state.KeepRunning())
     {
         assert(0 == secp256k1_verify_mlsag(secp256k1_ctx_blind,
-            preimage, nCols, nRows, 
-            m, ki, pc, ss));
+            preimage, nCols, nRows,
+            &m[0], &ki[0], pc, &ss[0]));
     };
     
     ECC_Stop_Blinding();
 }
 
+static void Mlsag(benchmark::State& state) { MlsagVerify(state, 2, 4); }
+
+// Ring size x inputs, verifications/sec is the inverse of the reported time per iteration
+static void MlsagVerify4x1(benchmark::State& state) { MlsagVerify(state, 1, 4); }
+static void MlsagVerify4x2(benchmark::State& state) { MlsagVerify(state, 2, 4); }
+static void MlsagVerify4x4(benchmark::State& state) { MlsagVerify(state, 4, 4); }
+static void MlsagVerify4x8(benchmark::State& state) { MlsagVerify(state, 8, 4); }
+static void MlsagVerify8x1(benchmark::State& state) { MlsagVerify(state, 1, 8); }
+static void MlsagVerify8x2(benchmark::State& state) { MlsagVerify(state, 2, 8); }
+static void MlsagVerify8x4(benchmark::State& state) { MlsagVerify(state, 4, 8); }
+static void MlsagVerify8x8(benchmark::State& state) { MlsagVerify(state, 8, 8); }
+static void MlsagVerify16x1(benchmark::State& state) { MlsagVerify(state, 1, 16); }
+static void MlsagVerify16x2(benchmark::State& state) { MlsagVerify(state, 2, 16); }
+static void MlsagVerify16x4(benchmark::State& state) { MlsagVerify(state, 4, 16); }
+static void MlsagVerify16x8(benchmark::State& state) { MlsagVerify(state, 8, 16); }
+static void MlsagVerify32x1(benchmark::State& state) { MlsagVerify(state, 1, 32); }
+static void MlsagVerify32x2(benchmark::State& state) { MlsagVerify(state, 2, 32); }
+static void MlsagVerify32x4(benchmark::State& state) { MlsagVerify(state, 4, 32); }
+static void MlsagVerify32x8(benchmark::State& state) { MlsagVerify(state, 8, 32); }
+
 BENCHMARK(Mlsag);
+BENCHMARK(MlsagVerify4x1);
+BENCHMARK(MlsagVerify4x2);
+BENCHMARK(MlsagVerify4x4);
+BENCHMARK(MlsagVerify4x8);
+BENCHMARK(MlsagVerify8x1);
+BENCHMARK(MlsagVerify8x2);
+BENCHMARK(MlsagVerify8x4);
+BENCHMARK(MlsagVerify8x8);
+BENCHMARK(MlsagVerify16x1);
+BENCHMARK(MlsagVerify16x2);
+BENCHMARK(MlsagVerify16x4);
+BENCHMARK(MlsagVerify16x8);
+BENCHMARK(MlsagVerify32x1);
+BENCHMARK(MlsagVerify32x2);
+BENCHMARK(MlsagVerify32x4);
+BENCHMARK(MlsagVerify32x8);
@@ -0,0 +1,198 @@
+// Copyright (c) 2017 The Particl Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "anon.h"
+#include "txdb.h"
+#include "dbwrapper.h"
+#include "random.h"
+#include "fs.h"
+
+static const int64_t N_RCT_OUTPUTS = 100000;
+static const size_t N_LOOKUPS = 1000; // per iteration, about a block of ringsize 16 inputs
+
+static CAnonOutput MakeAnonOutput(int64_t i)
+{
+    CAnonOutput ao;
+    GetRandBytes(ao.pubkey.ncbegin(), 33);
+    GetRandBytes(ao.commitment.data, 33);
+    ao.outpoint = COutPoint(GetRandHash(), 0);
+    ao.nBlockHeight = i / 10;
+    return ao;
+}
+
+static void MakeLookups(std::vector<int64_t> &vLookups)
+{
+    vLookups.resize(N_LOOKUPS);
+    for (auto &i : vLookups)
+        i = 1 + GetRand(N_RCT_OUTPUTS);
+}
+
+// Random ring member lookups from the block index db, as ReadRCTOutput does
+static void RCTOutputReadDB(benchmark::State& state)
+{
+    fs::path pathDB = fs::temp_directory_path() / fs::unique_path();
+    {
+        CDBWrapper db(pathDB, 8 << 20, false, true);
+        CDBBatch batch(db);
+        for (int64_t i = 1; i <= N_RCT_OUTPUTS; ++i)
+            batch.Write(std::make_pair(DB_RCTOUTPUT, i), MakeAnonOutput(i));
+        assert(db.WriteBatch(batch, true));
+
+        std::vector<int64_t> vLookups;
+        MakeLookups(vLookups);
+
+        while (state.KeepRunning())
+        {
+            for (auto i : vLookups)
+            {
+                CAnonOutput ao;
+                assert(db.Read(std::make_pair(DB_RCTOUTPUT, i), ao));
+            };
+        };
+    }
+    fs::remove_all(pathDB);
+}
+
+// The same lookups from the in memory RCT output cache
+static void RCTOutputReadCache(benchmark::State& state)
+{
+    std::vector<CRCTOutputCache::Record> vRecords(N_RCT_OUTPUTS);
+    for (int64_t i = 1; i <= N_RCT_OUTPUTS; ++i)
+    {
+        CAnonOutput ao = MakeAnonOutput(i);
+        CRCTOutputCache::Record &r = vRecords[i-1];
+        memcpy(r.pubkey, ao.pubkey.begin(), 33);
+        memcpy(r.commitment, ao.commitment.data, 33);
+        r.nBlockHeight = ao.nBlockHeight;
+    };
+    CRCTOutputCache cache;
+    cache.Set(vRecords);
+
+    std::vector<int64_t> vLookups;
+    MakeLookups(vLookups);
+
+    while (state.KeepRunning())
+    {
+        for (auto i : vLookups)
+        {
+            CAnonOutput ao;
+            assert(cache.Get(i, ao));
+        };
+    };
+}
+
+// Decoy selection for a ringsize 32 spend of 8 inputs, as PickHidingOutputs
+// and AddAnonInputs do, against the in memory RCT output cache
+static void PickDecoys(benchmark::State& state)
+{
+    std::vector<CRCTOutputCache::Record> vRecords(N_RCT_OUTPUTS);
+    for (int64_t i = 1; i <= N_RCT_OUTPUTS; ++i)
+    {
+        CAnonOutput ao = MakeAnonOutput(i);
+        CRCTOutputCache::Record &r = vRecords[i-1];
+        memcpy(r.pubkey, ao.pubkey.begin(), 33);
+        memcpy(r.commitment, ao.commitment.data, 33);
+        r.nBlockHeight = ao.nBlockHeight;
+    };
+    CRCTOutputCache cache;
+    cache.Set(vRecords);
+    
+    const size_t nInputs = 8, nRingSize = 32;
+    const int nMaxHeight = N_RCT_OUTPUTS / 10 - 12;
+    
+    while (state.KeepRunning())
+    {
+        int64_t nMaxIndex;
+        assert(cache.GetLastAtHeight(nMaxHeight, nMaxIndex));
+        CDecoySelector selector(nMaxIndex, 2400, 24000);
+        
+        std::set<int64_t> setHave;
+        for (size_t k = 0; k < nInputs; ++k)
+            setHave.insert(1 + GetRand(nMaxIndex));
+        
+        for (size_t k = 0; k < nInputs; ++k)
+        for (size_t i = 1; i < nRingSize; ++i)
+        {
+            int64_t nIndex;
+            assert(selector.Pick(setHave, nIndex));
+        };
+        
+        for (auto i : setHave)
+        {
+            CAnonOutput ao;
+            assert(cache.Get(i, ao));
+        };
+    };
+}
+
+static const size_t N_SPENT_KEY_IMAGES = 1000000;
+
+static CCmpPubKey MakeKeyImage(FastRandomContext &rng)
+{
+    std::vector<unsigned char> vch = rng.randbytes(33);
+    vch[0] = 2 + (vch[0] & 1);
+    return CCmpPubKey(vch);
+}
+
+// Double spend checks of unspent key images against 1M spent key images,
+// read from the block index db directly or through the key image filter first
+static void KeyImageCheck(benchmark::State& state, bool fFilter)
+{
+    FastRandomContext rng(true);
+    fs::path pathDB = fs::temp_directory_path() / fs::unique_path();
+    {
+        CDBWrapper db(pathDB, 8 << 20, false, true);
+        std::vector<CCmpPubKey> vSpent;
+        vSpent.reserve(N_SPENT_KEY_IMAGES);
+        uint256 txhash = rng.rand256();
+        for (size_t i = 0; i < N_SPENT_KEY_IMAGES; i += 10000)
+        {
+            CDBBatch batch(db);
+            for (size_t k = 0; k < 10000; ++k)
+            {
+                vSpent.push_back(MakeKeyImage(rng));
+                batch.Write(std::make_pair(DB_RCTKEYIMAGE, vSpent.back()), txhash);
+            };
+            assert(db.WriteBatch(batch));
+        };
+        
+        CCmpPubKeyFilter filter;
+        if (fFilter)
+            filter.Set(N_SPENT_KEY_IMAGES * 2, vSpent);
+        
+        std::vector<CCmpPubKey> vLookups(N_LOOKUPS);
+        for (auto &ki : vLookups)
+            ki = MakeKeyImage(rng);
+        
+        while (state.KeepRunning())
+        {
+            for (const auto &ki : vLookups)
+            {
+                if (!filter.MaybeContains(ki))
+                    continue;
+                uint256 txhashKI;
+                db.Read(std::make_pair(DB_RCTKEYIMAGE, ki), txhashKI);
+            };
+        };
+    }
+    fs::remove_all(pathDB);
+}
+
+static void KeyImageCheckDB(benchmark::State& state)
+{
+    KeyImageCheck(state, false);
+}
+
+static void KeyImageCheckFilter(benchmark::State& state)
+{
+    KeyImageCheck(state, true);
+}
+
+BENCHMARK(RCTOutputReadDB);
+BENCHMARK(RCTOutputReadCache);
+BENCHMARK(PickDecoys);
+BENCHMARK(KeyImageCheckDB);
+BENCHMARK(KeyImageCheckFilter);
@@ -0,0 +1,487 @@
+// Copyright (c) 2017 The Particl Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "fs.h"
+#include "random.h"
+#include "smsg/smessage.h"
+#include "smsg/store.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <algorithm>
+#include <iostream>
+
+#include <boost/thread.hpp>
+
+#include <secp256k1.h>
+
+extern secp256k1_context *secp256k1_context_smsg; // created by SecureMsgStart, which needs a wallet
+
+static const size_t N_MESSAGES = 500;
+static const uint32_t N_PAYLOAD = 1024;
+static const int64_t BUCKET_TIME = 1500000000;
+
+static void MakeMessages(std::vector<std::vector<uint8_t> > &vMessages)
+{
+    vMessages.resize(N_MESSAGES);
+    for (auto &v : vMessages)
+    {
+        v.resize(SMSG_HDR_LEN + N_PAYLOAD);
+        GetRandBytes(&v[0], v.size());
+        SecureMessage *psmsg = (SecureMessage*) &v[0];
+        psmsg->timestamp = BUCKET_TIME;
+        psmsg->nPayload = N_PAYLOAD;
+    };
+};
+
+// Previous path, a file open per message stored or retrieved
+static bool LegacyStore(const fs::path &path, const std::vector<uint8_t> &v, int64_t &ofs)
+{
+    FILE *fp;
+    if (!(fp = fsbridge::fopen(path, "ab")))
+        return false;
+    fseek(fp, 0, SEEK_END);
+    ofs = ftell(fp);
+    bool rv = fwrite(&v[0], sizeof(uint8_t), v.size(), fp) == v.size();
+    fclose(fp);
+    return rv;
+};
+
+static bool LegacyRetrieve(const fs::path &path, int64_t ofs, std::vector<uint8_t> &vchData)
+{
+    FILE *fp;
+    if (!(fp = fsbridge::fopen(path, "rb")))
+        return false;
+
+    SecureMessage smsg;
+    if (fseek(fp, ofs, SEEK_SET) != 0
+        || fread(&smsg.hash[0], sizeof(uint8_t), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
+    {
+        fclose(fp);
+        return false;
+    };
+
+    vchData.resize(SMSG_HDR_LEN + smsg.nPayload);
+    memcpy(&vchData[0], &smsg.hash[0], SMSG_HDR_LEN);
+    bool rv = fread(&vchData[SMSG_HDR_LEN], sizeof(uint8_t), smsg.nPayload, fp) == smsg.nPayload;
+    fclose(fp);
+    return rv;
+};
+
+static void SmsgStoreLegacy(benchmark::State& state)
+{
+    std::vector<std::vector<uint8_t> > vMessages;
+    MakeMessages(vMessages);
+
+    fs::path pathStore = fs::temp_directory_path() / fs::unique_path();
+    fs::create_directories(pathStore);
+    fs::path pathFile = pathStore / (std::to_string(BUCKET_TIME) + "_01.dat");
+
+    int64_t ofs;
+    while (state.KeepRunning())
+    {
+        for (const auto &v : vMessages)
+            assert(LegacyStore(pathFile, v, ofs));
+        fs::remove(pathFile);
+    };
+
+    fs::remove_all(pathStore);
+};
+
+static void SmsgStoreSegment(benchmark::State& state)
+{
+    std::vector<std::vector<uint8_t> > vMessages;
+    MakeMessages(vMessages);
+
+    fs::path pathStore = fs::temp_directory_path() / fs::unique_path();
+    SecMsgFileStore store;
+    store.SetPath(pathStore);
+
+    int64_t ofs;
+    while (state.KeepRunning())
+    {
+        for (const auto &v : vMessages)
+            assert(store.Append(BUCKET_TIME, &v[0], &v[SMSG_HDR_LEN], N_PAYLOAD, ofs));
+        store.FlushAll(true);
+        store.Close(BUCKET_TIME);
+        fs::remove(pathStore / (std::to_string(BUCKET_TIME) + "_01.dat"));
+    };
+
+    fs::remove_all(pathStore);
+};
+
+static void SmsgRetrieveLegacy(benchmark::State& state)
+{
+    std::vector<std::vector<uint8_t> > vMessages;
+    MakeMessages(vMessages);
+
+    fs::path pathStore = fs::temp_directory_path() / fs::unique_path();
+    fs::create_directories(pathStore);
+    fs::path pathFile = pathStore / (std::to_string(BUCKET_TIME) + "_01.dat");
+
+    std::vector<int64_t> vOffsets(N_MESSAGES);
+    for (size_t i = 0; i < N_MESSAGES; ++i)
+        assert(LegacyStore(pathFile, vMessages[i], vOffsets[i]));
+
+    std::vector<uint8_t> vchOne, vchBunch;
+    while (state.KeepRunning())
+    {
+        vchBunch.clear();
+        for (const auto ofs : vOffsets)
+        {
+            assert(LegacyRetrieve(pathFile, ofs, vchOne));
+            vchBunch.insert(vchBunch.end(), vchOne.begin(), vchOne.end());
+        };
+    };
+
+    fs::remove_all(pathStore);
+};
+
+static void SmsgRetrieveSegment(benchmark::State& state)
+{
+    std::vector<std::vector<uint8_t> > vMessages;
+    MakeMessages(vMessages);
+
+    fs::path pathStore = fs::temp_directory_path() / fs::unique_path();
+    SecMsgFileStore store;
+    store.SetPath(pathStore);
+
+    std::vector<int64_t> vOffsets(N_MESSAGES);
+    for (size_t i = 0; i < N_MESSAGES; ++i)
+        assert(store.Append(BUCKET_TIME, &vMessages[i][0], &vMessages[i][SMSG_HDR_LEN], N_PAYLOAD, vOffsets[i]));
+    store.FlushAll(true);
+
+    std::vector<uint8_t> vchBunch;
+    while (state.KeepRunning())
+    {
+        vchBunch.clear();
+        for (const auto ofs : vOffsets)
+            assert(store.Read(BUCKET_TIME, ofs, vchBunch));
+    };
+
+    store.CloseAll();
+    fs::remove_all(pathStore);
+};
+
+static const int64_t N_LOAD_BUCKETS = 24;
+static const size_t N_LOAD_MESSAGES = 200; // per bucket
+
+// A day of buckets, startup loads the tokens of every bucket
+static void MakeLoadStore(SecMsgFileStore &store, const fs::path &pathStore)
+{
+    std::vector<std::vector<uint8_t> > vMessages;
+    MakeMessages(vMessages);
+
+    store.SetPath(pathStore);
+    int64_t ofs;
+    for (int64_t b = 0; b < N_LOAD_BUCKETS; ++b)
+        for (size_t i = 0; i < N_LOAD_MESSAGES; ++i)
+        {
+            const std::vector<uint8_t> &v = vMessages[i % vMessages.size()];
+            assert(store.Append(BUCKET_TIME + b * SMSG_BUCKET_LEN, &v[0], &v[SMSG_HDR_LEN], N_PAYLOAD, ofs));
+        };
+    store.CloseAll();
+};
+
+static void SmsgLoadScan(benchmark::State& state)
+{
+    // Previous startup path, the header of every message is read from the bucket files
+    fs::path pathStore = fs::temp_directory_path() / fs::unique_path();
+    SecMsgFileStore store;
+    MakeLoadStore(store, pathStore);
+
+    std::vector<SecMsgIndexEntry> vEntries;
+    while (state.KeepRunning())
+    {
+        for (int64_t b = 0; b < N_LOAD_BUCKETS; ++b)
+        {
+            vEntries.clear();
+            assert(store.ScanFile(BUCKET_TIME + b * SMSG_BUCKET_LEN, 0, vEntries));
+            assert(vEntries.size() == N_LOAD_MESSAGES);
+        };
+    };
+
+    fs::remove_all(pathStore);
+};
+
+static void SmsgLoadIndex(benchmark::State& state)
+{
+    fs::path pathStore = fs::temp_directory_path() / fs::unique_path();
+    SecMsgFileStore store;
+    MakeLoadStore(store, pathStore);
+
+    std::vector<SecMsgIndexEntry> vEntries;
+    int64_t nFileSize;
+    while (state.KeepRunning())
+    {
+        for (int64_t b = 0; b < N_LOAD_BUCKETS; ++b)
+        {
+            assert(store.LoadIndex(BUCKET_TIME + b * SMSG_BUCKET_LEN, vEntries, nFileSize));
+            assert(vEntries.size() == N_LOAD_MESSAGES);
+        };
+    };
+
+    fs::remove_all(pathStore);
+};
+
+static void SmsgBucketInsert(benchmark::State& state)
+{
+    // Bulk ingestion, bucket is rehashed after every insert as SecureMsgStore does with fUpdateBucket
+    std::vector<SecMsgToken> vTokens(100000);
+    for (size_t i = 0; i < vTokens.size(); ++i)
+    {
+        vTokens[i].timestamp = BUCKET_TIME + i % SMSG_BUCKET_LEN;
+        GetRandBytes(vTokens[i].sample, 8);
+        vTokens[i].offset = i;
+    };
+
+    while (state.KeepRunning())
+    {
+        SecMsgBucket bucket;
+        for (const auto &token : vTokens)
+        {
+            bucket.InsertToken(token);
+            bucket.hashBucket();
+        };
+        assert(bucket.setTokens.size() == vTokens.size());
+    };
+};
+
+static const int N_LOCK_THREADS = 4;
+static const size_t N_LOCK_TOKENS = 20000;  // per thread
+static const int64_t N_LOCK_BUCKETS = 48;
+
+static void MakeLockTokens(std::vector<std::vector<SecMsgToken> > &vTokens)
+{
+    // Peers mostly deliver different buckets at the same time
+    vTokens.resize(N_LOCK_THREADS);
+    for (int t = 0; t < N_LOCK_THREADS; ++t)
+    {
+        vTokens[t].resize(N_LOCK_TOKENS);
+        for (size_t i = 0; i < N_LOCK_TOKENS; ++i)
+        {
+            int64_t nBucket = BUCKET_TIME + ((t + (int64_t)i * N_LOCK_THREADS) % N_LOCK_BUCKETS) * SMSG_BUCKET_LEN;
+            vTokens[t][i].timestamp = nBucket + i % SMSG_BUCKET_LEN;
+            GetRandBytes(vTokens[t][i].sample, 8);
+            vTokens[t][i].offset = i;
+        };
+    };
+};
+
+static void ReportLockBench(const char *name, size_t nInserted, int64_t nStart)
+{
+    double fSeconds = (GetTimeMicros() - nStart) * 0.000001;
+    if (fSeconds > 0)
+        std::cout << name << "-" << N_LOCK_THREADS << "threads-insertspersec,1," << nInserted / fSeconds << ","
+            << nInserted / fSeconds << "," << nInserted / fSeconds << "\n";
+};
+
+// Previous layout, every bucket behind one lock
+static void GlobalLockWorker(CCriticalSection *cs, std::map<int64_t, SecMsgBucket> *pBuckets, const std::vector<SecMsgToken> *pTokens)
+{
+    for (const auto &token : *pTokens)
+    {
+        int64_t nBucket = token.timestamp - (token.timestamp % SMSG_BUCKET_LEN);
+        LOCK(*cs);
+        SecMsgBucket &bkt = (*pBuckets)[nBucket];
+        bkt.InsertToken(token);
+        bkt.hashBucket();
+    };
+};
+
+static void ShardedWorker(SecMsgBucketSet *pBuckets, const std::vector<SecMsgToken> *pTokens)
+{
+    for (const auto &token : *pTokens)
+    {
+        int64_t nBucket = token.timestamp - (token.timestamp % SMSG_BUCKET_LEN);
+        SecMsgBucketShard &shard = pBuckets->GetShard(nBucket);
+        LOCK(shard.cs);
+        SecMsgBucket &bkt = shard.buckets[nBucket];
+        bkt.InsertToken(token);
+        bkt.hashBucket();
+    };
+};
+
+static void SmsgBucketsGlobalLock(benchmark::State& state)
+{
+    std::vector<std::vector<SecMsgToken> > vTokens;
+    MakeLockTokens(vTokens);
+
+    size_t nInserted = 0;
+    int64_t nStart = GetTimeMicros();
+    while (state.KeepRunning())
+    {
+        CCriticalSection cs;
+        std::map<int64_t, SecMsgBucket> buckets;
+        boost::thread_group threadGroup;
+        for (int t = 0; t < N_LOCK_THREADS; ++t)
+            threadGroup.create_thread(boost::bind(&GlobalLockWorker, &cs, &buckets, &vTokens[t]));
+        threadGroup.join_all();
+        nInserted += N_LOCK_THREADS * N_LOCK_TOKENS;
+    };
+    ReportLockBench("SmsgBucketsGlobalLock", nInserted, nStart);
+};
+
+static void SmsgBucketsSharded(benchmark::State& state)
+{
+    std::vector<std::vector<SecMsgToken> > vTokens;
+    MakeLockTokens(vTokens);
+
+    size_t nInserted = 0;
+    int64_t nStart = GetTimeMicros();
+    while (state.KeepRunning())
+    {
+        std::unique_ptr<SecMsgBucketSet> buckets(new SecMsgBucketSet());
+        boost::thread_group threadGroup;
+        for (int t = 0; t < N_LOCK_THREADS; ++t)
+            threadGroup.create_thread(boost::bind(&ShardedWorker, buckets.get(), &vTokens[t]));
+        threadGroup.join_all();
+        nInserted += N_LOCK_THREADS * N_LOCK_TOKENS;
+    };
+    ReportLockBench("SmsgBucketsSharded", nInserted, nStart);
+};
+
+static void SmsgPow(benchmark::State& state, int nThreads)
+{
+    // Fixed messages, every iteration grinds the same nonces
+    const size_t nMessages = 4;
+    std::vector<std::vector<uint8_t> > vMessages(nMessages);
+    for (size_t i = 0; i < nMessages; ++i)
+    {
+        vMessages[i].resize(SMSG_HDR_LEN + N_PAYLOAD);
+        memset(&vMessages[i][0], (int)i, vMessages[i].size());
+        SecureMessage *psmsg = (SecureMessage*) &vMessages[i][0];
+        psmsg->version[0] = 2;
+        psmsg->timestamp = BUCKET_TIME + i;
+        psmsg->nPayload = N_PAYLOAD;
+    };
+
+    bool fEnabled = fSecMsgEnabled;
+    fSecMsgEnabled = true;
+
+    uint64_t nNonces = 0, nSolved = 0;
+    int64_t nStart = GetTimeMicros();
+    while (state.KeepRunning())
+    {
+        for (auto &v : vMessages)
+        {
+            assert(0 == SecureMsgSetHash(&v[0], &v[SMSG_HDR_LEN], N_PAYLOAD, nThreads));
+            assert(0 == SecureMsgValidate(&v[0], &v[SMSG_HDR_LEN], N_PAYLOAD));
+
+            uint32_t nonce;
+            memcpy(&nonce, &((SecureMessage*) &v[0])->nonce[0], 4);
+            nNonces += (uint64_t)nonce + 1;
+            nSolved++;
+        };
+    };
+    double fSeconds = (GetTimeMicros() - nStart) * 0.000001;
+
+    fSecMsgEnabled = fEnabled;
+
+    if (nSolved > 0 && fSeconds > 0)
+    {
+        std::cout << "SmsgPow-" << nThreads << "threads-noncespersec,1," << nNonces / fSeconds << ","
+            << nNonces / fSeconds << "," << nNonces / fSeconds << "\n";
+        std::cout << "SmsgPow-" << nThreads << "threads-mspermessage,1," << fSeconds * 1000 / nSolved << ","
+            << fSeconds * 1000 / nSolved << "," << fSeconds * 1000 / nSolved << "\n";
+    };
+};
+
+static void SmsgPowSingle(benchmark::State& state)
+{
+    SmsgPow(state, 1);
+};
+
+static void SmsgPowThreads(benchmark::State& state)
+{
+    SmsgPow(state, std::max(1, std::min(GetNumCores(), SMSG_MAX_POW_THREADS)));
+};
+
+static void SmsgScan(benchmark::State& state, int nThreads)
+{
+    // Messages to none of the keys, every message is trial decrypted with all of them
+    const size_t nMessages = SMSG_SCAN_BATCH, nKeys = 16;
+
+    std::vector<SecMsgScanKey> vKeys(nKeys);
+    for (auto &sk : vKeys)
+    {
+        sk.key.MakeNewKey(true);
+        sk.address = sk.key.GetPubKey().GetID();
+        sk.fReceiveAnon = true;
+    };
+
+    std::vector<uint8_t> vchBatch;
+    std::vector<size_t> vOffsets;
+    for (size_t i = 0; i < nMessages; ++i)
+    {
+        size_t ofs = vchBatch.size();
+        vOffsets.push_back(ofs);
+        vchBatch.resize(ofs + SMSG_HDR_LEN + N_PAYLOAD);
+        GetRandBytes(&vchBatch[ofs], SMSG_HDR_LEN + N_PAYLOAD);
+
+        CKey keyR;
+        keyR.MakeNewKey(true);
+        CPubKey cpkR = keyR.GetPubKey();
+        SecureMessage *psmsg = (SecureMessage*) &vchBatch[ofs];
+        psmsg->version[0] = 2;
+        psmsg->timestamp = BUCKET_TIME;
+        memcpy(psmsg->cpkR, cpkR.begin(), 33);
+        psmsg->nPayload = N_PAYLOAD;
+    };
+
+    bool fContext = secp256k1_context_smsg;
+    if (!fContext)
+        secp256k1_context_smsg = secp256k1_context_create(SECP256K1_CONTEXT_SIGN);
+
+    std::vector<int> vResult;
+    uint64_t nTrials = 0, nScanned = 0;
+    int64_t nStart = GetTimeMicros();
+    while (state.KeepRunning())
+    {
+        SecureMsgTrialDecryptBatch(vKeys, vchBatch, vOffsets, vResult, nThreads, nTrials);
+        assert(std::count(vResult.begin(), vResult.end(), -1) == (int)nMessages);
+        nScanned += nMessages;
+    };
+    double fSeconds = (GetTimeMicros() - nStart) * 0.000001;
+
+    if (!fContext)
+    {
+        secp256k1_context_destroy(secp256k1_context_smsg);
+        secp256k1_context_smsg = nullptr;
+    };
+
+    if (nScanned > 0 && fSeconds > 0)
+    {
+        std::cout << "SmsgScan-" << nThreads << "threads-trialspersec,1," << nTrials / fSeconds << ","
+            << nTrials / fSeconds << "," << nTrials / fSeconds << "\n";
+        std::cout << "SmsgScan-" << nThreads << "threads-messagespersec,1," << nScanned / fSeconds << ","
+            << nScanned / fSeconds << "," << nScanned / fSeconds << "\n";
+    };
+};
+
+static void SmsgScanSingle(benchmark::State& state)
+{
+    SmsgScan(state, 1);
+};
+
+static void SmsgScanThreads(benchmark::State& state)
+{
+    SmsgScan(state, std::max(1, std::min(GetNumCores(), SMSG_MAX_SCAN_THREADS)));
+};
+
+BENCHMARK(SmsgStoreLegacy);
+BENCHMARK(SmsgStoreSegment);
+BENCHMARK(SmsgRetrieveLegacy);
+BENCHMARK(SmsgRetrieveSegment);
+BENCHMARK(SmsgLoadScan);
+BENCHMARK(SmsgLoadIndex);
+BENCHMARK(SmsgBucketInsert);
+BENCHMARK(SmsgBucketsGlobalLock);
+BENCHMARK(SmsgBucketsSharded);
+BENCHMARK(SmsgPowSingle);
+BENCHMARK(SmsgPowThreads);
+BENCHMARK(SmsgScanSingle);
+BENCHMARK(SmsgScanThreads);
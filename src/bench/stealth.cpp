@@ -0,0 +1,128 @@
+// Copyright (c) 2017 The Particl Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "key.h"
+#include "key/stealth.h"
+#include "pubkey.h"
+#include "util.h"
+
+// Rescan of N_STEALTH_OUTPUTS blinded outputs by a wallet with N_STEALTH_ADDRESSES
+// unprefixed stealth addresses, one output in 32 pays to the wallet.
+static const size_t N_STEALTH_ADDRESSES = 16;
+static const size_t N_STEALTH_OUTPUTS = 512;
+
+struct StealthOutput
+{
+    CKeyID idDest;
+    ec_point pkEphem;
+};
+
+static void MakeStealthScan(std::vector<CStealthAddress> &vAddrs, std::vector<StealthOutput> &vOutputs)
+{
+    vAddrs.resize(N_STEALTH_ADDRESSES);
+    for (auto &sx : vAddrs)
+    {
+        CKey kSpend;
+        sx.scan_secret.MakeNewKey(true);
+        kSpend.MakeNewKey(true);
+        SecretToPublicKey(sx.scan_secret, sx.scan_pubkey);
+        SecretToPublicKey(kSpend, sx.spend_pubkey);
+    };
+    
+    vOutputs.resize(N_STEALTH_OUTPUTS);
+    for (size_t i = 0; i < vOutputs.size(); ++i)
+    {
+        const CStealthAddress &sx = vAddrs[i % vAddrs.size()];
+        CKey kEphem, sShared;
+        ec_point pkSendTo;
+        do {
+            kEphem.MakeNewKey(true);
+        } while (StealthSecret(kEphem, sx.scan_pubkey, sx.spend_pubkey, sShared, pkSendTo) != 0);
+        
+        CPubKey pkEphem = kEphem.GetPubKey();
+        vOutputs[i].pkEphem.assign(pkEphem.begin(), pkEphem.end());
+        if (i % 32 == 0)
+        {
+            vOutputs[i].idDest = CPubKey(pkSendTo).GetID();
+        } else
+        {
+            CKey kOther;
+            kOther.MakeNewKey(true);
+            vOutputs[i].idDest = kOther.GetPubKey().GetID();
+        };
+    };
+}
+
+// Each output tried against every address in turn, as ProcessStealthOutput does
+static void StealthScanSerial(benchmark::State& state)
+{
+    ECC_Start_Stealth();
+    
+    std::vector<CStealthAddress> vAddrs;
+    std::vector<StealthOutput> vOutputs;
+    MakeStealthScan(vAddrs, vOutputs);
+    
+    while (state.KeepRunning())
+    {
+        size_t nMatched = 0;
+        for (const auto &o : vOutputs)
+        {
+            for (const auto &sx : vAddrs)
+            {
+                CKey sShared;
+                ec_point pkExtracted;
+                if (StealthSecret(sx.scan_secret, o.pkEphem, sx.spend_pubkey, sShared, pkExtracted) != 0)
+                    continue;
+                if (CPubKey(pkExtracted).GetID() == o.idDest)
+                {
+                    nMatched++;
+                    break;
+                };
+            };
+        };
+        assert(nMatched == N_STEALTH_OUTPUTS / 32);
+    };
+    
+    ECC_Stop_Stealth();
+}
+
+static void StealthScan(benchmark::State& state, int nThreads)
+{
+    ECC_Start_Stealth();
+    
+    std::vector<CStealthAddress> vAddrs;
+    std::vector<StealthOutput> vOutputs;
+    MakeStealthScan(vAddrs, vOutputs);
+    
+    CStealthScanner scanner;
+    for (const auto &sx : vAddrs)
+        scanner.AddScanKey(sx.scan_secret, sx.spend_pubkey, sx.prefix.number_bits, sx.prefix.bitfield);
+    
+    while (state.KeepRunning())
+    {
+        scanner.ClearOutputs();
+        for (const auto &o : vOutputs)
+            scanner.AddOutput(o.idDest, &o.pkEphem[0], 0, false);
+        scanner.Scan(nThreads);
+        assert(scanner.NumMatched() == N_STEALTH_OUTPUTS / 32);
+    };
+    
+    ECC_Stop_Stealth();
+}
+
+static void StealthScanSingle(benchmark::State& state)
+{
+    StealthScan(state, 1);
+}
+
+static void StealthScanThreads(benchmark::State& state)
+{
+    StealthScan(state, GetNumCores());
+}
+
+BENCHMARK(StealthScanSerial);
+BENCHMARK(StealthScanSingle);
+BENCHMARK(StealthScanThreads);
@@ -12,6 +12,10 @@
 #include "random.h"
 #include "util.h"
 
+#include <atomic>
+#include <system_error>
+#include <thread>
+
 
 secp256k1_context *secp256k1_ctx_blind = nullptr;
 
@@ -122,6 +126,69 @@ int GetRangeProofInfo(const std::vector<uint8_t> &vRangeproof, int &rexp, int &r
         &vRangeproof[0], vRangeproof.size()) == 1));
 };
 
+int SignRangeproof(CRangeproofSignData &d)
+{
+    if (!secp256k1_pedersen_commit(secp256k1_ctx_blind,
+        d.pCommitment, d.blind,
+        d.nValue, secp256k1_generator_h))
+        return 1;
+    
+    size_t nRangeProofLen = 5134;
+    d.pvRangeproof->resize(nRangeProofLen);
+    
+    if (1 != secp256k1_rangeproof_sign(secp256k1_ctx_blind,
+        &(*d.pvRangeproof)[0], &nRangeProofLen,
+        d.nMinValue, d.pCommitment,
+        d.blind, d.nonce,
+        d.nExponent, d.nBits,
+        d.nValue,
+        (const unsigned char*) d.sMessage.data(), d.sMessage.size(),
+        nullptr, 0,
+        secp256k1_generator_h))
+        return 2;
+    
+    d.pvRangeproof->resize(nRangeProofLen);
+    return 0;
+};
+
+int SignRangeproofs(std::vector<CRangeproofSignData> &vData, size_t &nFailed)
+{
+    std::vector<int> vResults(vData.size(), 0);
+    std::atomic<size_t> nNext(0);
+    
+    // Outputs only share the read only blinding context
+    auto worker = [&]() {
+        for (size_t i; (i = nNext++) < vData.size(); )
+            vResults[i] = SignRangeproof(vData[i]);
+    };
+    
+    size_t nThreads = std::min(vData.size(), (size_t)std::max(GetNumCores(), 1));
+    std::vector<std::thread> vThreads;
+    for (size_t k = 1; k < nThreads; ++k)
+    {
+        try {
+            vThreads.emplace_back(worker);
+        } catch (const std::system_error &e) {
+            // Sign the remaining outputs on this thread
+            LogPrintf("%s: Failed to start thread: %s\n", __func__, e.what());
+            break;
+        };
+    };
+    worker();
+    for (auto &t : vThreads)
+        t.join();
+    
+    for (size_t i = 0; i < vResults.size(); ++i)
+    {
+        if (vResults[i] != 0)
+        {
+            nFailed = i;
+            return vResults[i];
+        };
+    };
+    return 0;
+};
+
 void ECC_Start_Blinding()
 {
     assert(secp256k1_ctx_blind == nullptr);
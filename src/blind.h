@@ -6,7 +6,9 @@
 #define PARTICL_BLIND_H
 
 #include <secp256k1.h>
+#include <secp256k1_rangeproof.h>
 #include <inttypes.h>
+#include <string>
 #include <vector>
 
 #include "amount.h"
@@ -17,6 +19,31 @@ int SelectRangeProofParameters(uint64_t nValueIn, uint64_t &minValue, int &expon
 
 int GetRangeProofInfo(const std::vector<uint8_t> &vRangeproof, int &rexp, int &rmantissa, CAmount &min_value, CAmount &max_value);
 
+/**
+ * Inputs to commit to and prove the value of one blinded output.
+ * The blind, nonce and rangeproof parameters are chosen beforehand, signing is deterministic.
+ */
+struct CRangeproofSignData
+{
+    secp256k1_pedersen_commitment *pCommitment = nullptr;
+    std::vector<uint8_t> *pvRangeproof = nullptr;
+    uint64_t nValue = 0;
+    uint8_t blind[32];
+    uint8_t nonce[32];
+    uint64_t nMinValue = 0;
+    int nExponent = 0;
+    int nBits = 0;
+    std::string sMessage;
+};
+
+/** Set the commitment and sign the rangeproof of one output, returns 1 if the commitment failed, 2 if the rangeproof failed */
+int SignRangeproof(CRangeproofSignData &d);
+/**
+ * SignRangeproof for all outputs, spread over worker threads when there are several.
+ * Returns the result of the first failed output and sets nFailed to its index.
+ */
+int SignRangeproofs(std::vector<CRangeproofSignData> &vData, size_t &nFailed);
+
 void ECC_Start_Blinding();
 void ECC_Stop_Blinding();
 
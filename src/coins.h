@@ -135,6 +135,20 @@ public:
     }
 };
 
+class SaltedKeyImageHasher
+{
+private:
+    /** Salt */
+    const uint64_t k0, k1;
+
+public:
+    SaltedKeyImageHasher();
+
+    size_t operator()(const CCmpPubKey& ki) const {
+        return CSipHasher(k0, k1).Write(ki.begin(), 33).Finalize();
+    }
+};
+
 struct CCoinsCacheEntry
 {
     Coin coin; // The actual cached data.
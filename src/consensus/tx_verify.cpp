@@ -14,6 +14,13 @@
 #include "anon.h"
 #include "timedata.h"
 #include "util.h"
+#include "random.h"
+#include "crypto/sha256.h"
+#include "script/sigcache.h"
+
+#include "cuckoocache.h"
+#include <atomic>
+#include <boost/thread.hpp>
 
 
 // TODO remove the following dependencies
@@ -214,21 +221,112 @@ bool CheckStandardOutput(CValidationState &state, const Consensus::Params& conse
     return true;
 }
 
-bool CheckBlindOutput(CValidationState &state, const CTxOutCT *p)
+namespace {
+/**
+ * Valid rangeproof cache, to avoid verifying the rangeproofs of a transaction
+ * twice (once when accepted into memory pool, and again when accepted into the block chain)
+ */
+class CRangeproofCache
 {
-    if (p->vData.size() < 33 || p->vData.size() > 33 + 5)
-        return state.DoS(100, false, REJECT_INVALID, "bad-ctout-ephem-size");
-    
-    size_t nRangeProofLen = 5134;
-    if (p->vRangeproof.size() > nRangeProofLen)
-        return state.DoS(100, false, REJECT_INVALID, "bad-ctout-rangeproof-size");
-    
-    if ((fBusyImporting) && fSkipRangeproof)
+private:
+     //! Entries are SHA256(nonce || commitment || rangeproof):
+    uint256 nonce;
+    typedef CuckooCache::cache<uint256, SignatureCacheHasher> map_type;
+    map_type setValid;
+    boost::shared_mutex cs_rangeproofcache;
+    bool fSetup = false;
+
+public:
+    std::atomic<uint64_t> nHits{0};
+    std::atomic<uint64_t> nMisses{0};
+
+    CRangeproofCache()
+    {
+        GetRandBytes(nonce.begin(), 32);
+    }
+
+    void
+    ComputeEntry(uint256& entry, const secp256k1_pedersen_commitment *commitment, const std::vector<uint8_t> &vRangeproof)
+    {
+        CSHA256().Write(nonce.begin(), 32).Write(commitment->data, 33).Write(vRangeproof.data(), vRangeproof.size()).Finalize(entry.begin());
+    }
+
+    bool
+    Get(const uint256& entry, const bool erase)
+    {
+        boost::shared_lock<boost::shared_mutex> lock(cs_rangeproofcache);
+        return fSetup && setValid.contains(entry, erase);
+    }
+
+    void Set(uint256& entry)
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs_rangeproofcache);
+        if (fSetup)
+            setValid.insert(entry);
+    }
+    uint32_t setup_bytes(size_t n)
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs_rangeproofcache);
+        fSetup = true;
+        return setValid.setup_bytes(n);
+    }
+};
+
+static CRangeproofCache rangeproofCache;
+} // namespace
+
+void InitRangeproofCache()
+{
+    size_t nMaxCacheSize = std::min(std::max((int64_t)0, gArgs.GetArg("-maxrangeproofcachesize", DEFAULT_MAX_RANGEPROOF_CACHE_SIZE)), MAX_MAX_SIG_CACHE_SIZE) * ((size_t) 1 << 20);
+    size_t nElems = rangeproofCache.setup_bytes(nMaxCacheSize);
+    LogPrintf("Using %zu MiB out of %zu requested for rangeproof cache, able to store %zu elements\n",
+            (nElems*sizeof(uint256)) >>20, nMaxCacheSize>>20, nElems);
+}
+
+void GetRangeproofCacheStats(uint64_t &nHits, uint64_t &nMisses)
+{
+    nHits = rangeproofCache.nHits;
+    nMisses = rangeproofCache.nMisses;
+}
+
+static bool GetRangeproof(const CTxOutBase *pout, const secp256k1_pedersen_commitment *&commitment, const std::vector<uint8_t> *&pvRangeproof)
+{
+    switch (pout->nVersion)
+    {
+        case OUTPUT_CT:
+            {
+            const CTxOutCT *p = (const CTxOutCT*) pout;
+            commitment = &p->commitment;
+            pvRangeproof = &p->vRangeproof;
+            }
+            return true;
+        case OUTPUT_RINGCT:
+            {
+            const CTxOutRingCT *p = (const CTxOutRingCT*) pout;
+            commitment = &p->commitment;
+            pvRangeproof = &p->vRangeproof;
+            }
+            return true;
+        default:
+            break;
+    };
+    return false;
+}
+
+static bool VerifyRangeproof(const secp256k1_pedersen_commitment *commitment, const std::vector<uint8_t> &vRangeproof, bool cacheStore)
+{
+    uint256 entry;
+    rangeproofCache.ComputeEntry(entry, commitment, vRangeproof);
+    if (rangeproofCache.Get(entry, !cacheStore))
+    {
+        rangeproofCache.nHits++;
         return true;
-    
+    };
+    rangeproofCache.nMisses++;
+
     uint64_t min_value, max_value;
     int rv = secp256k1_rangeproof_verify(secp256k1_ctx_blind, &min_value, &max_value,
-        &p->commitment, p->vRangeproof.data(), p->vRangeproof.size(),
+        commitment, vRangeproof.data(), vRangeproof.size(),
         nullptr, 0,
         secp256k1_generator_h);
     
@@ -237,12 +335,110 @@ bool CheckBlindOutput(CValidationState &state, const CTxOutCT *p)
             rv, FormatMoney((CAmount)min_value), FormatMoney((CAmount)max_value));
     
     if (rv != 1)
+        return false;
+    
+    if (cacheStore)
+        rangeproofCache.Set(entry);
+    return true;
+}
+
+bool CRangeproofCheck::operator()()
+{
+    const secp256k1_pedersen_commitment *commitment;
+    const std::vector<uint8_t> *pvRangeproof;
+    if (!GetRangeproof(pout, commitment, pvRangeproof))
+        return false;
+    return VerifyRangeproof(commitment, *pvRangeproof, cacheStore);
+}
+
+bool CRangeproofBatchCheck::operator()()
+{
+    std::vector<const secp256k1_pedersen_commitment*> vCommitments;
+    std::vector<const uint8_t*> vProofs;
+    std::vector<size_t> vProofLens;
+    std::vector<uint256> vEntriesStore, vEntriesErase;
+    vCommitments.reserve(vChecks.size());
+    vProofs.reserve(vChecks.size());
+    vProofLens.reserve(vChecks.size());
+
+    // The cache is left untouched until the batch passes, a failed batch is rerun check by check
+    for (const auto &check : vChecks)
+    {
+        const secp256k1_pedersen_commitment *commitment;
+        const std::vector<uint8_t> *pvRangeproof;
+        if (!GetRangeproof(check.pout, commitment, pvRangeproof))
+            return false;
+
+        uint256 entry;
+        rangeproofCache.ComputeEntry(entry, commitment, *pvRangeproof);
+        if (rangeproofCache.Get(entry, false))
+        {
+            if (!check.cacheStore)
+                vEntriesErase.push_back(entry);
+            continue;
+        };
+
+        vCommitments.push_back(commitment);
+        vProofs.push_back(pvRangeproof->data());
+        vProofLens.push_back(pvRangeproof->size());
+        if (check.cacheStore)
+            vEntriesStore.push_back(entry);
+    };
+
+    if (!vCommitments.empty())
+    {
+        std::vector<uint64_t> vMinValues(vCommitments.size()), vMaxValues(vCommitments.size());
+        int rv = secp256k1_rangeproof_verify_batch(secp256k1_ctx_blind, vMinValues.data(), vMaxValues.data(),
+            vCommitments.data(), vProofs.data(), vProofLens.data(), vCommitments.size(),
+            nullptr, 0,
+            secp256k1_generator_h);
+
+        if (LogAcceptCategory(BCLog::RINGCT))
+            LogPrintf("%s: rv, proofs %d, %u\n", __func__, rv, vCommitments.size());
+
+        if (rv != 1)
+            return false;
+    };
+
+    rangeproofCache.nHits += vChecks.size() - vCommitments.size();
+    rangeproofCache.nMisses += vCommitments.size();
+    for (auto &entry : vEntriesErase)
+        rangeproofCache.Get(entry, true);
+    for (auto &entry : vEntriesStore)
+        rangeproofCache.Set(entry);
+    return true;
+}
+
+std::string CRangeproofCheck::GetRejectReason() const
+{
+    return pout && pout->nVersion == OUTPUT_RINGCT ? "bad-rctout-rangeproof-verify" : "bad-ctout-rangeproof-verify";
+}
+
+bool CheckBlindOutput(CValidationState &state, const CTransaction &tx, const CTxOutCT *p, std::vector<CRangeproofCheck> *pvChecks, bool cacheStore)
+{
+    if (p->vData.size() < 33 || p->vData.size() > 33 + 5)
+        return state.DoS(100, false, REJECT_INVALID, "bad-ctout-ephem-size");
+    
+    size_t nRangeProofLen = 5134;
+    if (p->vRangeproof.size() > nRangeProofLen)
+        return state.DoS(100, false, REJECT_INVALID, "bad-ctout-rangeproof-size");
+    
+    if ((fBusyImporting) && fSkipRangeproof)
+        return true;
+    
+    if (pvChecks)
+    {
+        pvChecks->push_back(CRangeproofCheck(tx, p, cacheStore));
+        return true;
+    };
+    
+    if (!VerifyRangeproof(&p->commitment, p->vRangeproof, cacheStore))
         return state.DoS(100, false, REJECT_INVALID, "bad-ctout-rangeproof-verify");
     
     return true;
 }
 
-bool CheckAnonOutput(CValidationState &state, const CTxOutRingCT *p)
+bool CheckAnonOutput(CValidationState &state, const CTransaction &tx, const CTxOutRingCT *p, std::vector<CRangeproofCheck> *pvChecks, bool cacheStore)
 {
     if (Params().NetworkID() == "main")
         return state.DoS(100, false, REJECT_INVALID, "AnonOutput in mainnet");
@@ -257,17 +453,13 @@ bool CheckAnonOutput(CValidationState &state, const CTxOutRingCT *p)
     if ((fBusyImporting) && fSkipRangeproof)
         return true;
     
-    uint64_t min_value, max_value;
-    int rv = secp256k1_rangeproof_verify(secp256k1_ctx_blind, &min_value, &max_value,
-        &p->commitment, p->vRangeproof.data(), p->vRangeproof.size(),
-        nullptr, 0,
-        secp256k1_generator_h);
-    
-    if (LogAcceptCategory(BCLog::RINGCT))
-        LogPrintf("%s: rv, min_value, max_value %d, %s, %s\n", __func__,
-            rv, FormatMoney((CAmount)min_value), FormatMoney((CAmount)max_value));
+    if (pvChecks)
+    {
+        pvChecks->push_back(CRangeproofCheck(tx, p, cacheStore));
+        return true;
+    };
     
-    if (rv != 1)
+    if (!VerifyRangeproof(&p->commitment, p->vRangeproof, cacheStore))
         return state.DoS(100, false, REJECT_INVALID, "bad-rctout-rangeproof-verify");
     
     return true;
@@ -285,7 +477,7 @@ bool CheckDataOutput(CValidationState &state, const CTxOutData *p)
     return true;
 }
 
-bool CheckTransaction(const CTransaction& tx, CValidationState &state, bool fCheckDuplicateInputs)
+bool CheckTransaction(const CTransaction& tx, CValidationState &state, bool fCheckDuplicateInputs, std::vector<CRangeproofCheck> *pvRangeproofChecks, bool fCacheRangeproofs)
 {
     // Basic checks that don't depend on any context
     if (tx.vin.empty())
@@ -316,11 +508,11 @@ bool CheckTransaction(const CTransaction& tx, CValidationState &state, bool fChe
                     nStandardOutputs++;
                     break;
                 case OUTPUT_CT:
-                    if (!CheckBlindOutput(state, (CTxOutCT*) txout.get()))
+                    if (!CheckBlindOutput(state, tx, (CTxOutCT*) txout.get(), pvRangeproofChecks, fCacheRangeproofs))
                         return false;
                     break;
                 case OUTPUT_RINGCT:
-                    if (!CheckAnonOutput(state, (CTxOutRingCT*) txout.get()))
+                    if (!CheckAnonOutput(state, tx, (CTxOutRingCT*) txout.get(), pvRangeproofChecks, fCacheRangeproofs))
                         return false;
                     break;
                 case OUTPUT_DATA:
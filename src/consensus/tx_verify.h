@@ -6,17 +6,82 @@
 #define BITCOIN_CONSENSUS_TX_VERIFY_H
 
 #include <stdint.h>
+#include <string>
 #include <vector>
 
 class CBlockIndex;
 class CCoinsViewCache;
 class CTransaction;
+class CTxOutBase;
 class CValidationState;
 
+/** Default for -maxrangeproofcachesize, in MiB */
+static const unsigned int DEFAULT_MAX_RANGEPROOF_CACHE_SIZE = 8;
+/** Maximum number of rangeproofs verified together as one batch */
+static const unsigned int RANGEPROOF_BATCH_SIZE = 16;
+
+/**
+ * Closure representing one rangeproof verification of a blinded or anon output
+ * Note that this stores references to the transaction and output
+ */
+class CRangeproofCheck
+{
+    friend class CRangeproofBatchCheck;
+private:
+    const CTransaction *ptx;
+    const CTxOutBase *pout;
+    bool cacheStore;
+
+public:
+    CRangeproofCheck() : ptx(nullptr), pout(nullptr), cacheStore(false) {}
+    CRangeproofCheck(const CTransaction &txIn, const CTxOutBase *poutIn, bool cacheIn) : ptx(&txIn), pout(poutIn), cacheStore(cacheIn) {}
+
+    bool operator()();
+
+    void swap(CRangeproofCheck &check) {
+        std::swap(ptx, check.ptx);
+        std::swap(pout, check.pout);
+        std::swap(cacheStore, check.cacheStore);
+    }
+
+    const CTransaction *GetTransaction() const { return ptx; }
+    std::string GetRejectReason() const;
+};
+
+/**
+ * Closure verifying a batch of rangeproof checks together
+ * Fails if any proof of the batch fails, run the checks individually to find which.
+ */
+class CRangeproofBatchCheck
+{
+private:
+    std::vector<CRangeproofCheck> vChecks;
+
+public:
+    CRangeproofBatchCheck() {}
+    CRangeproofBatchCheck(std::vector<CRangeproofCheck>::const_iterator first, std::vector<CRangeproofCheck>::const_iterator last) : vChecks(first, last) {}
+
+    bool operator()();
+
+    void swap(CRangeproofBatchCheck &check) {
+        vChecks.swap(check.vChecks);
+    }
+};
+
 /** Transaction validation functions */
 
-/** Context-independent validity checks */
-bool CheckTransaction(const CTransaction& tx, CValidationState& state, bool fCheckDuplicateInputs=true);
+/**
+ * Context-independent validity checks
+ * If pvRangeproofChecks is set rangeproofs are not verified, a check is appended for each instead.
+ * Rangeproofs are looked up in the rangeproof cache, verified proofs are added to it if fCacheRangeproofs
+ * is set, else matching entries are marked for removal.
+ */
+bool CheckTransaction(const CTransaction& tx, CValidationState& state, bool fCheckDuplicateInputs=true,
+    std::vector<CRangeproofCheck> *pvRangeproofChecks=nullptr, bool fCacheRangeproofs=true);
+
+/** Initialise the rangeproof cache, sized by -maxrangeproofcachesize */
+void InitRangeproofCache();
+void GetRangeproofCacheStats(uint64_t &nHits, uint64_t &nMisses);
 
 namespace Consensus {
 /**
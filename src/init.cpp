@@ -17,6 +17,7 @@
 #include "checkpoints.h"
 #include "compat/sanity.h"
 #include "consensus/validation.h"
+#include "consensus/tx_verify.h"
 #include "fs.h"
 #include "httpserver.h"
 #include "httprpc.h"
@@ -396,6 +397,8 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-prune=<n>", strprintf(_("Reduce storage requirements by enabling pruning (deleting) of old blocks. This allows the pruneblockchain RPC to be called to delete specific blocks, and enables automatic pruning of old blocks if a target size in MiB is provided. This mode is incompatible with -txindex and -rescan. "
             "Warning: Reverting this setting requires re-downloading the entire blockchain. "
             "(default: 0 = disable pruning blocks, 1 = allow manual pruning via RPC, >%u = automatically prune block files to stay under the specified target size in MiB)"), MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024));
+    strUsage += HelpMessageOpt("-rctoutputcache", strprintf(_("Keep the RCT output index in memory (default: %u)"), DEFAULT_RCT_OUTPUT_CACHE));
+    strUsage += HelpMessageOpt("-keyimagefilter", strprintf(_("Keep filters of spent key images and anon outputs in memory to skip db reads for unknown ones (default: %u)"), DEFAULT_KEY_IMAGE_FILTER));
     strUsage += HelpMessageOpt("-reindex-chainstate", _("Rebuild chain state from the currently indexed blocks"));
     strUsage += HelpMessageOpt("-reindex", _("Rebuild chain state and block index from the blk*.dat files on disk"));
     strUsage += HelpMessageOpt("-skiprangeproofverify", _("Skip verifying rangeproofs when reindexing or importing."));
@@ -505,6 +508,7 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-logtimemicros", strprintf("Add microsecond precision to debug timestamps (default: %u)", DEFAULT_LOGTIMEMICROS));
         strUsage += HelpMessageOpt("-mocktime=<n>", "Replace actual time with <n> seconds since epoch (default: 0)");
         strUsage += HelpMessageOpt("-maxsigcachesize=<n>", strprintf("Limit sum of signature cache and script execution cache sizes to <n> MiB (default: %u)", DEFAULT_MAX_SIG_CACHE_SIZE));
+        strUsage += HelpMessageOpt("-maxrangeproofcachesize=<n>", strprintf("Limit rangeproof cache size to <n> MiB (default: %u)", DEFAULT_MAX_RANGEPROOF_CACHE_SIZE));
         strUsage += HelpMessageOpt("-maxtipage=<n>", strprintf("Maximum tip age in seconds to consider node in initial block download (default: %u)", DEFAULT_MAX_TIP_AGE));
     }
     strUsage += HelpMessageOpt("-maxtxfee=<amt>", strprintf(_("Maximum total fees (in %s) to use in a single wallet transaction or raw transaction; setting this too low may abort large transactions (default: %s)"),
@@ -1291,11 +1295,14 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     InitSignatureCache();
     InitScriptExecutionCache();
+    InitRangeproofCache();
 
     LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
     if (nScriptCheckThreads) {
         for (int i=0; i<nScriptCheckThreads-1; i++)
             threadGroup.create_thread(&ThreadScriptCheck);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadRangeproofCheck);
     }
 
     // Start the lightweight task scheduler thread
@@ -1556,6 +1563,13 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
                     break;
                 }
 
+                if (gArgs.GetBoolArg("-rctoutputcache", DEFAULT_RCT_OUTPUT_CACHE)
+                    && !pblocktree->LoadRCTOutputCache())
+                    LogPrintf("Failed to load RCT outputs into memory, reading from the block index db.\n");
+                if (gArgs.GetBoolArg("-keyimagefilter", DEFAULT_KEY_IMAGE_FILTER)
+                    && !pblocktree->LoadRCTIndexFilters())
+                    LogPrintf("Failed to load the RCT index filters, reading from the block index db.\n");
+
                 // At this point blocktree args are consistent with what's on disk.
                 // If we're not mid-reindex (based on disk + args), add a genesis block on disk
                 // (otherwise we use the one already on disk).
@@ -13,7 +13,10 @@
 
 #include "support/allocators/secure.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <thread>
 #include <secp256k1.h>
 
 secp256k1_context *secp256k1_ctx_stealth = nullptr;
@@ -427,3 +430,153 @@ void ECC_Stop_Stealth()
     };
 };
 
+
+void CStealthScanner::AddScanKey(const CKey &kScan, const ec_point &pkSpend, uint8_t nPrefixBits, uint32_t nPrefix)
+{
+    ScanKey k;
+    k.kScan = kScan;
+    k.pkSpend = pkSpend;
+    k.nPrefixBits = nPrefixBits;
+    k.nPrefix = nPrefix;
+    vKeys.push_back(k);
+};
+
+void CStealthScanner::AddOutput(const CKeyID &idDest, const uint8_t *pEphemPK, uint32_t nPrefix, bool fHavePrefix)
+{
+    assert(!fScanned);
+    
+    Output o;
+    o.idDest = idDest;
+    memcpy(o.ephemPK, pEphemPK, EC_COMPRESSED_SIZE);
+    o.nPrefix = fHavePrefix ? nPrefix : 0;
+    o.fHavePrefix = fHavePrefix;
+    o.fMatched = false;
+    vOutputs.push_back(o);
+};
+
+void CStealthScanner::ClearOutputs()
+{
+    vOutputs.clear();
+    fScanned = false;
+};
+
+void CStealthScanner::Clear()
+{
+    vKeys.clear();
+    ClearOutputs();
+};
+
+bool CStealthScanner::Output::operator <(const Output &y) const
+{
+    if (idDest != y.idDest)
+        return idDest < y.idDest;
+    int c = memcmp(ephemPK, y.ephemPK, EC_COMPRESSED_SIZE);
+    if (c != 0)
+        return c < 0;
+    if (fHavePrefix != y.fHavePrefix)
+        return fHavePrefix < y.fHavePrefix;
+    return nPrefix < y.nPrefix;
+};
+
+bool CStealthScanner::CheckOutput(const Output &o) const
+{
+    ec_point pkEphem(o.ephemPK, o.ephemPK + EC_COMPRESSED_SIZE), pkExtracted;
+    CKey sShared;
+    
+    for (const auto &k : vKeys)
+    {
+        if (!MatchPrefix(k.nPrefixBits, k.nPrefix, o.nPrefix, o.fHavePrefix))
+            continue;
+        
+        if (StealthSecret(k.kScan, pkEphem, k.pkSpend, sShared, pkExtracted) != 0)
+            continue;
+        
+        CPubKey pkE(pkExtracted);
+        if (pkE.IsValid() && pkE.GetID() == o.idDest)
+            return true;
+    };
+    
+    return false;
+};
+
+void CStealthScanner::Scan(int nThreads)
+{
+    assert(!fScanned);
+    
+    // Only the read only stealth context is shared between threads
+    std::atomic<size_t> nNextChunk(0);
+    size_t nChunks = (vOutputs.size() + STEALTH_SCAN_CHUNK_SIZE - 1) / STEALTH_SCAN_CHUNK_SIZE;
+    auto worker = [&]() {
+        for (size_t k; (k = nNextChunk++) < nChunks; )
+        {
+            size_t nBegin = k * STEALTH_SCAN_CHUNK_SIZE;
+            size_t nEnd = std::min(nBegin + STEALTH_SCAN_CHUNK_SIZE, vOutputs.size());
+            for (size_t i = nBegin; i < nEnd; ++i)
+                vOutputs[i].fMatched = CheckOutput(vOutputs[i]);
+        };
+    };
+    
+    nThreads = std::min((size_t)std::max(nThreads, 1), std::max(nChunks, (size_t)1));
+    std::vector<std::thread> vThreads;
+    for (int k = 1; k < nThreads; ++k)
+    {
+        try {
+            vThreads.emplace_back(worker);
+        } catch (const std::system_error &e) {
+            // Scan the remaining chunks on this thread
+            LogPrintf("%s: Failed to start thread: %s\n", __func__, e.what());
+            break;
+        };
+    };
+    worker();
+    for (auto &t : vThreads)
+        t.join();
+    
+    std::sort(vOutputs.begin(), vOutputs.end());
+    fScanned = true;
+};
+
+bool CStealthScanner::IsUnmatched(const CKeyID &idDest, const uint8_t *pEphemPK, uint32_t nPrefix, bool fHavePrefix) const
+{
+    if (!fScanned)
+        return false;
+    
+    Output o;
+    o.idDest = idDest;
+    memcpy(o.ephemPK, pEphemPK, EC_COMPRESSED_SIZE);
+    o.nPrefix = fHavePrefix ? nPrefix : 0;
+    o.fHavePrefix = fHavePrefix;
+    
+    std::vector<Output>::const_iterator it = std::lower_bound(vOutputs.begin(), vOutputs.end(), o);
+    if (it == vOutputs.end() || o < *it)
+        return false; // not scanned
+    
+    return !it->fMatched;
+};
+
+bool CStealthScanner::SameKeys(const CStealthScanner &other) const
+{
+    if (vKeys.size() != other.vKeys.size())
+        return false;
+    
+    for (size_t i = 0; i < vKeys.size(); ++i)
+    {
+        const ScanKey &a = vKeys[i], &b = other.vKeys[i];
+        if (!(a.kScan == b.kScan)
+            || a.pkSpend != b.pkSpend
+            || a.nPrefixBits != b.nPrefixBits
+            || a.nPrefix != b.nPrefix)
+            return false;
+    };
+    
+    return true;
+};
+
+size_t CStealthScanner::NumMatched() const
+{
+    size_t n = 0;
+    for (const auto &o : vOutputs)
+        if (o.fMatched)
+            n++;
+    return n;
+};
@@ -143,6 +143,79 @@ uint32_t FillStealthPrefix(uint8_t nBits, uint32_t nBitfield);
 
 bool ExtractStealthPrefix(const char *pPrefix, uint32_t &nPrefix);
 
+inline bool MatchPrefix(uint32_t nAddrBits, uint32_t addrPrefix, uint32_t outputPrefix, bool fHavePrefix)
+{
+    if (nAddrBits < 1) // addresses without prefixes scan all incoming stealth outputs
+        return true;
+    if (!fHavePrefix) // don't check when address has a prefix and no prefix on output
+        return false;
+    
+    uint32_t mask = SetStealthMask(nAddrBits);
+    
+    return (addrPrefix & mask) == (outputPrefix & mask);
+};
+
+/** Outputs per chunk taken by a stealth scan thread */
+const size_t STEALTH_SCAN_CHUNK_SIZE = 64;
+
+/**
+ * Checks batches of stealth outputs against a copy of a wallet's scan keys.
+ * The EC multiplications need no wallet state, so outputs from many blocks can be
+ * checked over multiple threads without the wallet lock, leaving only the matches
+ * to be processed by the wallet.
+ */
+class CStealthScanner
+{
+public:
+    void AddScanKey(const CKey &kScan, const ec_point &pkSpend, uint8_t nPrefixBits, uint32_t nPrefix);
+    void AddOutput(const CKeyID &idDest, const uint8_t *pEphemPK, uint32_t nPrefix, bool fHavePrefix);
+    
+    /** Clears the outputs, keeping the scan keys */
+    void ClearOutputs();
+    void Clear();
+    
+    /** Check the outputs over up to nThreads threads, outputs can't be added after until cleared */
+    void Scan(int nThreads=1);
+    
+    /** True if the output was scanned and matched none of the scan keys */
+    bool IsUnmatched(const CKeyID &idDest, const uint8_t *pEphemPK, uint32_t nPrefix, bool fHavePrefix) const;
+    
+    /** True if both scanners hold the same scan keys in the same order */
+    bool SameKeys(const CStealthScanner &other) const;
+    
+    size_t NumKeys() const { return vKeys.size(); }
+    size_t NumOutputs() const { return vOutputs.size(); }
+    size_t NumMatched() const;
+
+private:
+    class ScanKey
+    {
+    public:
+        CKey kScan;
+        ec_point pkSpend;
+        uint8_t nPrefixBits;
+        uint32_t nPrefix;
+    };
+    
+    class Output
+    {
+    public:
+        CKeyID idDest;
+        uint8_t ephemPK[EC_COMPRESSED_SIZE];
+        uint32_t nPrefix;
+        bool fHavePrefix;
+        bool fMatched;
+        
+        bool operator <(const Output &y) const;
+    };
+    
+    bool CheckOutput(const Output &o) const;
+    
+    std::vector<ScanKey> vKeys;
+    std::vector<Output> vOutputs;
+    bool fScanned = false; // vOutputs is checked and sorted
+};
+
 void ECC_Start_Stealth();
 void ECC_Stop_Stealth();
 
@@ -588,6 +588,8 @@ public:
         lastMatched     = 0;
         ignoreUntil     = 0;
         nWakeCounter    = 0;
+        nVersion        = 0;
+        nInvVersion     = 0;
         fEnabled        = false;
     };
     
@@ -598,6 +600,8 @@ public:
     int64_t                     lastMatched;
     int64_t                     ignoreUntil;
     uint32_t                    nWakeCounter;
+    uint32_t                    nVersion;       // smsg protocol version sent with smsgPing/smsgPong, 0 if none
+    uint64_t                    nInvVersion;    // version of the last smsgInv snapshot sent
     bool                        fEnabled;
     
 };
@@ -19,6 +19,11 @@
 #include "policy/policy.h"
 #include "consensus/validation.h"
 #include "coins.h"
+#include "crypto/common.h"
+
+#include <atomic>
+#include <system_error>
+#include <thread>
 
 /** 
  * Stake Modifier (hash modifier of proof-of-stake):
@@ -305,3 +310,161 @@ bool CheckKernel(const CBlockIndex *pindexPrev, unsigned int nBits, int64_t nTim
         amount, prevout, nTime, hashProofOfStake, targetProofOfStake);
 }
 
+bool CStakeKernelSearch::Prepare(const CBlockIndex *pindexPrev, uint32_t nBits, const std::vector<COutPoint> &vPrevouts)
+{
+    AssertLockHeld(cs_main);
+    
+    if (hashPrevBlock == pindexPrev->GetBlockHash()
+        && nPrevBits == nBits
+        && vPrevPrevouts == vPrevouts)
+        return true;
+    
+    Clear();
+    vCandidates.reserve(vPrevouts.size());
+    
+    int nRequiredDepth = std::min((int)(Params().GetStakeMinConfirmations()-1), (int)(pindexPrev->nHeight / 2));
+    for (size_t i = 0; i < vPrevouts.size(); ++i)
+    {
+        const COutPoint &prevout = vPrevouts[i];
+        
+        Coin coin;
+        if (!pcoinsTip->GetCoin(prevout, coin)
+            || coin.nType != OUTPUT_STANDARD
+            || coin.IsSpent())
+        {
+            LogPrint(BCLog::POS, "%s: Unusable prevout %s:%d\n", __func__, prevout.hash.ToString(), prevout.n);
+            continue;
+        };
+        
+        CBlockIndex *pindex = chainActive[coin.nHeight];
+        if (!pindex
+            || nRequiredDepth > pindexPrev->nHeight - (int)coin.nHeight)
+            continue;
+        
+        if (!AddCandidate(pindexPrev->bnStakeModifier, nBits, i, prevout, pindex->GetBlockTime(), coin.out.nValue))
+            return false;
+    };
+    
+    hashPrevBlock = pindexPrev->GetBlockHash();
+    nPrevBits = nBits;
+    vPrevPrevouts = vPrevouts;
+    
+    return true;
+}
+
+bool CStakeKernelSearch::AddCandidate(const uint256 &bnStakeModifier, uint32_t nBits, size_t nInput,
+    const COutPoint &prevout, uint32_t nBlockFromTime, CAmount nValue)
+{
+    arith_uint256 bnTarget;
+    bool fNegative;
+    bool fOverflow;
+    
+    bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
+    if (fNegative || fOverflow || bnTarget == 0)
+        return error("%s: SetCompact failed.", __func__);
+    
+    CStakeKernelCandidate c;
+    c.nInput = nInput;
+    c.prevout = prevout;
+    c.nBlockFromTime = nBlockFromTime;
+    c.bnTarget = bnTarget * arith_uint256(nValue);
+    
+    // Same layout as the CDataStream in CheckStakeKernelHash
+    uint8_t head[64];
+    memcpy(&head[0], bnStakeModifier.begin(), 32);
+    WriteLE32(&head[32], nBlockFromTime);
+    memcpy(&head[36], prevout.hash.begin(), 28);
+    c.hasher.Write(head, 64);
+    
+    memcpy(&c.tail[0], prevout.hash.begin() + 28, 4);
+    WriteLE32(&c.tail[4], prevout.n);
+    
+    vCandidates.push_back(c);
+    return true;
+}
+
+void CStakeKernelSearch::Clear()
+{
+    hashPrevBlock.SetNull();
+    nPrevBits = 0;
+    vPrevPrevouts.clear();
+    vCandidates.clear();
+}
+
+uint256 CStakeKernelSearch::GetKernelHash(size_t i, uint32_t nTime) const
+{
+    const CStakeKernelCandidate &c = vCandidates[i];
+    
+    uint8_t tail[12];
+    memcpy(&tail[0], c.tail, 8);
+    WriteLE32(&tail[8], nTime);
+    
+    uint256 hash;
+    CSHA256 hasher(c.hasher);
+    hasher.Write(tail, 12).Finalize(hash.begin());
+    CSHA256().Write(hash.begin(), 32).Finalize(hash.begin());
+    return hash;
+}
+
+bool CStakeKernelSearch::CheckRange(size_t nBegin, size_t nEnd, uint32_t nTime, size_t &nFound) const
+{
+    for (size_t i = nBegin; i < nEnd; ++i)
+    {
+        if (nTime < vCandidates[i].nBlockFromTime)
+            continue;
+        if (UintToArith256(GetKernelHash(i, nTime)) <= vCandidates[i].bnTarget)
+        {
+            nFound = i;
+            return true;
+        };
+    };
+    return false;
+}
+
+int64_t CStakeKernelSearch::Find(uint32_t nTime, size_t nStart, int nThreads) const
+{
+    if (nStart >= vCandidates.size())
+        return -1;
+    
+    size_t nFound;
+    size_t nChunks = (vCandidates.size() - nStart + KERNEL_SEARCH_CHUNK_SIZE - 1) / KERNEL_SEARCH_CHUNK_SIZE;
+    if (nThreads < 2 || nChunks < 2)
+        return CheckRange(nStart, vCandidates.size(), nTime, nFound) ? (int64_t)nFound : -1;
+    
+    // Chunks are taken in order, a thread can stop once a hit below its next chunk is found
+    std::atomic<size_t> nNextChunk(0);
+    std::atomic<size_t> nFirstHit(vCandidates.size());
+    auto worker = [&]() {
+        for (size_t k; (k = nNextChunk++) < nChunks; )
+        {
+            size_t nBegin = nStart + k * KERNEL_SEARCH_CHUNK_SIZE;
+            if (nBegin >= nFirstHit)
+                break;
+            
+            size_t nEnd = std::min(nBegin + KERNEL_SEARCH_CHUNK_SIZE, vCandidates.size()), nHit;
+            if (!CheckRange(nBegin, nEnd, nTime, nHit))
+                continue;
+            
+            size_t nPrev = nFirstHit;
+            while (nHit < nPrev && !nFirstHit.compare_exchange_weak(nPrev, nHit));
+        };
+    };
+    
+    nThreads = std::min((size_t)nThreads, nChunks);
+    std::vector<std::thread> vThreads;
+    for (int k = 1; k < nThreads; ++k)
+    {
+        try {
+            vThreads.emplace_back(worker);
+        } catch (const std::system_error &e) {
+            // Search the remaining chunks on this thread
+            LogPrintf("%s: Failed to start thread: %s\n", __func__, e.what());
+            break;
+        };
+    };
+    worker();
+    for (auto &t : vThreads)
+        t.join();
+    
+    return nFirstHit < vCandidates.size() ? (int64_t)nFirstHit : -1;
+}
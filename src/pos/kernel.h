@@ -7,6 +7,11 @@
 #define PPCOIN_KERNEL_H
 
 #include "validation.h"
+#include "arith_uint256.h"
+#include "crypto/sha256.h"
+
+/** Candidates hashed per thread and task by CStakeKernelSearch::Find */
+static const size_t KERNEL_SEARCH_CHUNK_SIZE = 4096;
 
 
 // Compute the hash modifier for proof-of-stake
@@ -41,4 +46,58 @@ bool CheckCoinStakeTimestamp(int nHeight, int64_t nTimeBlock);
  */
 bool CheckKernel(const CBlockIndex *pindexPrev, unsigned int nBits, int64_t nTime, const COutPoint &prevout, int64_t* pBlockTime = nullptr);
 
+/** The parts of a stake kernel fixed while the tip is unchanged */
+class CStakeKernelCandidate
+{
+public:
+    size_t nInput; // index into the prevouts passed to CStakeKernelSearch::Prepare
+    COutPoint prevout;
+    uint32_t nBlockFromTime;
+    arith_uint256 bnTarget; // weighted by the output value
+    CSHA256 hasher; // midstate of the first 64 bytes: modifier, block from time and 28 bytes of prevout hash
+    uint8_t tail[8]; // last 4 bytes of prevout hash and prevout n, nTime follows
+};
+
+/**
+ * Searches stake candidates for a kernel meeting the target, as CheckKernel does for one output.
+ * Coins, depths and the fixed part of each kernel hash are processed once per tip by Prepare,
+ * each Find then hashes only the last 12 bytes of every kernel.
+ */
+class CStakeKernelSearch
+{
+public:
+    /**
+     * Prepare a search on pindexPrev, skipping prevouts that can't stake.
+     * Does nothing if the tip, nBits and vPrevouts match the last call.
+     * Requires cs_main.
+     */
+    bool Prepare(const CBlockIndex *pindexPrev, uint32_t nBits, const std::vector<COutPoint> &vPrevouts);
+    
+    /** Add a candidate, Prepare does this for each prevout that can stake */
+    bool AddCandidate(const uint256 &bnStakeModifier, uint32_t nBits, size_t nInput,
+        const COutPoint &prevout, uint32_t nBlockFromTime, CAmount nValue);
+    void Clear();
+    
+    /**
+     * Return the index of the first candidate from nStart meeting its target at nTime, -1 if none.
+     * Sets over KERNEL_SEARCH_CHUNK_SIZE candidates are split over up to nThreads threads.
+     */
+    int64_t Find(uint32_t nTime, size_t nStart=0, int nThreads=1) const;
+    
+    /** Kernel hash of candidate i at nTime, equal to hashProofOfStake from CheckStakeKernelHash */
+    uint256 GetKernelHash(size_t i, uint32_t nTime) const;
+    
+    size_t size() const { return vCandidates.size(); }
+    const CStakeKernelCandidate &operator[](size_t i) const { return vCandidates[i]; }
+
+private:
+    bool CheckRange(size_t nBegin, size_t nEnd, uint32_t nTime, size_t &nFound) const;
+    
+    uint256 hashPrevBlock;
+    uint32_t nPrevBits = 0;
+    std::vector<COutPoint> vPrevPrevouts;
+    
+    std::vector<CStakeKernelCandidate> vCandidates;
+};
+
 #endif // PPCOIN_KERNEL_H
@@ -384,6 +384,28 @@ void ThreadStakeMiner(size_t nThreadID, std::vector<CWalletRef> &vpwallets, size
                 continue;
             };
 
+            pwallet->nIsStaking = CHDWallet::IS_STAKING;
+            nWaitFor = nMinerSleep;
+            fIsStaking = true;
+            
+            // Only assemble a block once a kernel is found for the slot
+            if (!pwallet->FindStakeKernel(nSearchTime))
+            {
+                pwallet->nLastCoinStakeSearchTime = nSearchTime;
+                
+                int nRequiredDepth = std::min((int)(Params().GetStakeMinConfirmations()-1), (int)(nBestHeight / 2));
+                if (pwallet->deepestTxnDepth < nRequiredDepth-4)
+                {
+                    size_t nSleep = (nRequiredDepth - pwallet->deepestTxnDepth) / 4;
+                    pwallet->nIsStaking = CHDWallet::NOT_STAKING_DEPTH;
+                    nWaitFor = std::min(nWaitFor, (size_t)(nSleep * 1000));
+                    //condWaitFor(nSleep * 1000);
+                    pwallet->nLastCoinStakeSearchTime = nSearchTime + nSleep * 1000;
+                    LogPrint(BCLog::POS, "%s: Wallet %d, no outputs with required depth, sleeping for %ds.\n", __func__, i, nSleep);
+                };
+                continue;
+            };
+            
             if (!pblocktemplate.get())
             {
                 pblocktemplate = BlockAssembler(Params()).CreateNewBlock(coinbaseScript);
@@ -403,32 +425,18 @@ void ThreadStakeMiner(size_t nThreadID, std::vector<CWalletRef> &vpwallets, size
                     LogPrint(BCLog::POS, "%s: ImportOutputs failed.\n", __func__);
                     continue;
                 };
+                pwallet->nStakeTemplatesBuilt++;
             };
 
-            pwallet->nIsStaking = CHDWallet::IS_STAKING;
-            nWaitFor = nMinerSleep;
-            fIsStaking = true;
             if (pwallet->SignBlock(pblocktemplate.get(), nBestHeight+1, nSearchTime))
             {
                 CBlock *pblock = &pblocktemplate->block;
                 if (CheckStake(pblock))
                 {
+                     pwallet->nStakesFound++;
                      nTimeLastStake = GetTime();
                      break;
                 };
-            } else
-            {
-                int nRequiredDepth = std::min((int)(Params().GetStakeMinConfirmations()-1), (int)(nBestHeight / 2));
-                if (pwallet->deepestTxnDepth < nRequiredDepth-4)
-                {
-                    size_t nSleep = (nRequiredDepth - pwallet->deepestTxnDepth) / 4;
-                    pwallet->nIsStaking = CHDWallet::NOT_STAKING_DEPTH;
-                    nWaitFor = std::min(nWaitFor, (size_t)(nSleep * 1000));
-                    //condWaitFor(nSleep * 1000);
-                    pwallet->nLastCoinStakeSearchTime = nSearchTime + nSleep * 1000;
-                    LogPrint(BCLog::POS, "%s: Wallet %d, no outputs with required depth, sleeping for %ds.\n", __func__, i, nSleep);
-                    continue;
-                };
             };
         };
 
@@ -12,6 +12,7 @@
 #include "checkpoints.h"
 #include "coins.h"
 #include "consensus/validation.h"
+#include "consensus/tx_verify.h"
 #include "validation.h"
 #include "core_io.h"
 #include "policy/feerate.h"
@@ -1589,6 +1590,11 @@ UniValue mempoolInfoToJSON()
     ret.push_back(Pair("maxmempool", (int64_t) maxmempool));
     ret.push_back(Pair("mempoolminfee", ValueFromAmount(mempool.GetMinFee(maxmempool).GetFeePerK())));
 
+    uint64_t nRangeproofHits, nRangeproofMisses;
+    GetRangeproofCacheStats(nRangeproofHits, nRangeproofMisses);
+    ret.push_back(Pair("rangeproofcachehits", (int64_t) nRangeproofHits));
+    ret.push_back(Pair("rangeproofcachemisses", (int64_t) nRangeproofMisses));
+
     return ret;
 }
 
@@ -1604,7 +1610,9 @@ UniValue getmempoolinfo(const JSONRPCRequest& request)
             "  \"bytes\": xxxxx,              (numeric) Sum of all virtual transaction sizes as defined in BIP 141. Differs from actual serialized size because witness data is discounted\n"
             "  \"usage\": xxxxx,              (numeric) Total memory usage for the mempool\n"
             "  \"maxmempool\": xxxxx,         (numeric) Maximum memory usage for the mempool\n"
-            "  \"mempoolminfee\": xxxxx       (numeric) Minimum feerate (" + CURRENCY_UNIT + " per KB) for tx to be accepted\n"
+            "  \"mempoolminfee\": xxxxx,      (numeric) Minimum feerate (" + CURRENCY_UNIT + " per KB) for tx to be accepted\n"
+            "  \"rangeproofcachehits\": xxxxx,   (numeric) Rangeproofs found in the rangeproof cache since startup\n"
+            "  \"rangeproofcachemisses\": xxxxx  (numeric) Rangeproofs verified since startup\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getmempoolinfo", "")
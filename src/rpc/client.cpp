@@ -189,6 +189,9 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "walletsettings", 1, "json" },
     
     { "getnewextaddress", 1, "childno" },
+
+    { "smsginbox", 1, "options" },
+    { "smsgoutbox", 1, "options" },
     
     { "listunspentanon", 0, "minconf" },
     { "listunspentanon", 1, "maxconf" },
@@ -10,6 +10,7 @@
 
 #include "smsg/smessage.h"
 #include "smsg/db.h"
+#include "smsg/store.h"
 #include "script/ismine.h"
 #include "utilstrencodings.h"
 
@@ -439,6 +440,49 @@ UniValue smsgscanbuckets(const JSONRPCRequest &request)
     return result;
 }
 
+UniValue smsgscanstats(const JSONRPCRequest &request)
+{
+    if (request.fHelp || request.params.size() != 0)
+        throw std::runtime_error(
+            "smsgscanstats \n"
+            "Display trial decryption statistics for incoming and rescanned messages,\n"
+            "and the progress of scanning the messages received while the wallet was locked.");
+
+    if (!fSecMsgEnabled)
+        throw std::runtime_error("Secure messaging is disabled.");
+
+    UniValue result(UniValue::VOBJ);
+
+    LOCK(cs_smsg);
+    const SecMsgScanStats &stats = smsgScanStats;
+    double fSeconds = stats.nTimeMicros * 0.000001;
+
+    result.pushKV("messages scanned", std::to_string(stats.nScanned));
+    result.pushKV("messages matched", std::to_string(stats.nReceived));
+    result.pushKV("key trials", std::to_string(stats.nTrials));
+    result.pushKV("scan time ms", std::to_string(stats.nTimeMicros / 1000));
+    result.pushKV("messages per second", strprintf("%.2f", fSeconds > 0 ? stats.nScanned / fSeconds : 0.0));
+    result.pushKV("scan threads", std::to_string(nSmsgScanThreads));
+
+    const SecMsgUnlockScan &unlock = smsgUnlockScan;
+    UniValue objUnlock(UniValue::VOBJ);
+    objUnlock.pushKV("running", unlock.fRunning ? "true" : "false");
+    objUnlock.pushKV("files", std::to_string(unlock.nFiles));
+    objUnlock.pushKV("files done", std::to_string(unlock.nFilesDone));
+    objUnlock.pushKV("bytes", std::to_string(unlock.nBytes));
+    objUnlock.pushKV("bytes done", std::to_string(unlock.nBytesDone));
+    objUnlock.pushKV("progress", strprintf("%.2f", unlock.nBytes > 0 ? unlock.nBytesDone * 100.0 / unlock.nBytes : 100.0));
+    objUnlock.pushKV("messages scanned", std::to_string(unlock.nMessages));
+    objUnlock.pushKV("messages received", std::to_string(unlock.nFound));
+    if (unlock.fRunning)
+        objUnlock.pushKV("time ms", std::to_string(GetTimeMillis() - unlock.nTimeStarted));
+    else if (unlock.nTimeFinished > 0)
+        objUnlock.pushKV("time ms", std::to_string(unlock.nTimeFinished - unlock.nTimeStarted));
+    result.pushKV("unlock scan", objUnlock);
+
+    return result;
+}
+
 UniValue smsgaddkey(const JSONRPCRequest &request)
 {
     if (request.fHelp || request.params.size() != 2)
@@ -631,13 +675,61 @@ UniValue smsgsendanon(const JSONRPCRequest &request)
     return result;
 }
 
+static void ParseListOptions(const UniValue &options, SecMsgQuery &q)
+{
+    if (options.isNull())
+        return;
+
+    RPCTypeCheckObj(options,
+        {
+            {"offset",  UniValueType(UniValue::VNUM)},
+            {"count",   UniValueType(UniValue::VNUM)},
+            {"since",   UniValueType(UniValue::VNUM)},
+            {"address", UniValueType(UniValue::VSTR)},
+        }, true, true);
+
+    if (options.exists("offset"))
+    {
+        int nOffset = options["offset"].get_int();
+        if (nOffset < 0)
+            throw std::runtime_error("offset must be positive.");
+        q.nOffset = nOffset;
+    };
+    if (options.exists("count"))
+    {
+        int nCount = options["count"].get_int();
+        if (nCount < 0)
+            throw std::runtime_error("count must be positive.");
+        q.nCount = nCount;
+    };
+    if (options.exists("since"))
+        q.nSince = options["since"].get_int64();
+    if (options.exists("address"))
+    {
+        CBitcoinAddress coinAddress(options["address"].get_str());
+        if (!coinAddress.GetKeyID(q.address))
+            throw std::runtime_error("Invalid address.");
+        q.fAddress = true;
+    };
+};
+
+static const char *HelpListOptions =
+    "options:\n"
+    "{\n"
+    "  \"offset\": n,         (numeric) skip the first n matching messages, oldest received first\n"
+    "  \"count\": n,          (numeric) return at most n messages, default all\n"
+    "  \"since\": time,       (numeric) messages received at or after time\n"
+    "  \"address\": \"addr\",  (string) messages sent to addr\n"
+    "}\n";
+
 UniValue smsginbox(const JSONRPCRequest &request)
 {
-    if (request.fHelp || request.params.size() > 1) // defaults to read
+    if (request.fHelp || request.params.size() > 2) // defaults to read
         throw std::runtime_error(
-            "smsginbox [all|unread|clear]\n"
-            "Decrypt and display all received messages.\n"
-            "Warning: clear will delete all messages.");
+            "smsginbox [all|unread|clear] [options]\n"
+            "Decrypt and display received messages, unread shows only unread messages and marks them as read.\n"
+            "Warning: clear will delete all messages.\n"
+            + std::string(HelpListOptions));
 
     if (!fSecMsgEnabled)
         throw std::runtime_error("Secure messaging is disabled.");
@@ -676,10 +768,11 @@ UniValue smsginbox(const JSONRPCRequest &request)
         {
             dbInbox.TxnBegin();
 
+            SecMsgStored smsgStored;
             leveldb::Iterator *it = dbInbox.pdb->NewIterator(leveldb::ReadOptions());
-            while (dbInbox.NextSmesgKey(it, sPrefix, chKey))
+            while (dbInbox.NextSmesg(it, sPrefix, chKey, smsgStored))
             {
-                dbInbox.EraseSmesg(chKey);
+                dbInbox.EraseSmesg(chKey, &smsgStored);
                 nMessages++;
             };
             delete it;
@@ -692,18 +785,25 @@ UniValue smsginbox(const JSONRPCRequest &request)
         {
             int fCheckReadStatus = mode == "unread" ? 1 : 0;
 
+            SecMsgQuery q;
+            q.fUnreadOnly = fCheckReadStatus;
+            ParseListOptions(request.params.size() > 1 ? request.params[1] : NullUniValue, q);
+
+            std::vector<SecMsgListed> vListed;
+            if (!dbInbox.ListSmesg('i', q, vListed))
+                throw std::runtime_error("Could not read DB.");
+
             SecMsgStored smsgStored;
             MessageData msg;
 
             dbInbox.TxnBegin();
 
-            leveldb::Iterator *it = dbInbox.pdb->NewIterator(leveldb::ReadOptions());
             UniValue messageList(UniValue::VARR);
 
-            while (dbInbox.NextSmesg(it, sPrefix, chKey, smsgStored))
+            for (auto &listed : vListed)
             {
-                if (fCheckReadStatus
-                    && !(smsgStored.status & SMSG_MASK_UNREAD))
+                memcpy(chKey, listed.chKey, 18);
+                if (!dbInbox.ReadSmesg(chKey, smsgStored))
                     continue;
 
                 uint32_t nPayload = smsgStored.vchMessage.size() - SMSG_HDR_LEN;
@@ -732,7 +832,6 @@ UniValue smsginbox(const JSONRPCRequest &request)
                 };
                 nMessages++;
             };
-            delete it;
             dbInbox.TxnCommit();
 
             result.pushKV("messages", messageList);
@@ -753,11 +852,12 @@ UniValue smsginbox(const JSONRPCRequest &request)
 
 UniValue smsgoutbox(const JSONRPCRequest &request)
 {
-    if (request.fHelp || request.params.size() > 1) // defaults to read
+    if (request.fHelp || request.params.size() > 2) // defaults to read
         throw std::runtime_error(
-            "smsgoutbox [all|clear]\n"
-            "Decrypt and display all sent messages.\n"
-            "Warning: clear will delete all sent messages.");
+            "smsgoutbox [all|clear] [options]\n"
+            "Decrypt and display sent messages.\n"
+            "Warning: clear will delete all sent messages.\n"
+            + std::string(HelpListOptions));
 
     if (!fSecMsgEnabled)
         throw std::runtime_error("Secure messaging is disabled.");
@@ -794,10 +894,11 @@ UniValue smsgoutbox(const JSONRPCRequest &request)
         {
             dbOutbox.TxnBegin();
 
+            SecMsgStored smsgStored;
             leveldb::Iterator *it = dbOutbox.pdb->NewIterator(leveldb::ReadOptions());
-            while (dbOutbox.NextSmesgKey(it, sPrefix, chKey))
+            while (dbOutbox.NextSmesg(it, sPrefix, chKey, smsgStored))
             {
-                dbOutbox.EraseSmesg(chKey);
+                dbOutbox.EraseSmesg(chKey, &smsgStored);
                 nMessages++;
             };
             delete it;
@@ -808,14 +909,24 @@ UniValue smsgoutbox(const JSONRPCRequest &request)
         } else
         if (mode == "all")
         {
+            SecMsgQuery q;
+            ParseListOptions(request.params.size() > 1 ? request.params[1] : NullUniValue, q);
+
+            std::vector<SecMsgListed> vListed;
+            if (!dbOutbox.ListSmesg('s', q, vListed))
+                throw std::runtime_error("Could not read DB.");
+
             SecMsgStored smsgStored;
             MessageData msg;
-            leveldb::Iterator *it = dbOutbox.pdb->NewIterator(leveldb::ReadOptions());
 
             UniValue messageList(UniValue::VARR);
 
-            while (dbOutbox.NextSmesg(it, sPrefix, chKey, smsgStored))
+            for (auto &listed : vListed)
             {
+                memcpy(chKey, listed.chKey, 18);
+                if (!dbOutbox.ReadSmesg(chKey, smsgStored))
+                    continue;
+
                 uint32_t nPayload = smsgStored.vchMessage.size() - SMSG_HDR_LEN;
 
                 if (SecureMsgDecrypt(false, smsgStored.addrOutbox, &smsgStored.vchMessage[0], &smsgStored.vchMessage[SMSG_HDR_LEN], nPayload, msg) == 0)
@@ -836,7 +947,6 @@ UniValue smsgoutbox(const JSONRPCRequest &request)
                 };
                 nMessages++;
             };
-            delete it;
 
             result.pushKV("messages" ,messageList);
             result.pushKV("result", strprintf("%u", nMessages));
@@ -879,28 +989,36 @@ UniValue smsgbuckets(const JSONRPCRequest &request)
         uint32_t nMessages = 0;
         uint64_t nBytes = 0;
         {
-            LOCK(cs_smsg);
-            std::map<int64_t, SecMsgBucket>::iterator it;
-            it = smsgBuckets.begin();
+            smsgStore.FlushAll(false); // include pending messages in file sizes
 
-            for (it = smsgBuckets.begin(); it != smsgBuckets.end(); ++it)
+            // Copy out a shard at a time, listed in bucket order
+            struct BucketInfo { size_t nMessages; uint64_t nDigest; int64_t timeChanged; };
+            std::map<int64_t, BucketInfo> mapBuckets;
+            for (auto &shard : smsgBuckets.vShards)
             {
-                std::set<SecMsgToken>& tokenSet = it->second.setTokens;
+                LOCK(shard.cs);
+                for (const auto &item : shard.buckets)
+                    mapBuckets[item.first] = {item.second.setTokens.size(), item.second.nDigest, item.second.timeChanged};
+            } // shard.cs
 
-                std::string sBucket = std::to_string(it->first);
+            for (const auto &item : mapBuckets)
+            {
+                const BucketInfo &info = item.second;
+
+                std::string sBucket = std::to_string(item.first);
                 std::string sFile = sBucket + "_01.dat";
 
-                std::string sHash = std::to_string(it->second.hash);
+                std::string sHash = strprintf("%016x", info.nDigest);
 
                 nBuckets++;
-                nMessages += tokenSet.size();
+                nMessages += info.nMessages;
 
                 UniValue objM(UniValue::VOBJ);
                 objM.pushKV("bucket", sBucket);
-                objM.pushKV("time", part::GetTimeString(it->first, cbuf, sizeof(cbuf)));
-                objM.pushKV("no. messages", strprintf("%u", tokenSet.size()));
+                objM.pushKV("time", part::GetTimeString(item.first, cbuf, sizeof(cbuf)));
+                objM.pushKV("no. messages", strprintf("%u", info.nMessages));
                 objM.pushKV("hash", sHash);
-                objM.pushKV("last changed", part::GetTimeString(it->second.timeChanged, cbuf, sizeof(cbuf)));
+                objM.pushKV("last changed", part::GetTimeString(info.timeChanged, cbuf, sizeof(cbuf)));
 
                 boost::filesystem::path fullPath = GetDataDir() / "smsgstore" / sFile;
 
@@ -908,7 +1026,7 @@ UniValue smsgbuckets(const JSONRPCRequest &request)
                 if (!boost::filesystem::exists(fullPath))
                 {
                     // If there is a file for an empty bucket something is wrong.
-                    if (tokenSet.size() == 0)
+                    if (info.nMessages == 0)
                         objM.pushKV("file size", "Empty bucket.");
                     else
                         objM.pushKV("file size, error", "File not found.");
@@ -928,7 +1046,7 @@ UniValue smsgbuckets(const JSONRPCRequest &request)
 
                 result.pushKV("bucket", objM);
             };
-        }; // cs_smsg
+        };
 
 
         std::string snBuckets = std::to_string(nBuckets);
@@ -940,29 +1058,35 @@ UniValue smsgbuckets(const JSONRPCRequest &request)
         objM.pushKV("size", part::BytesReadable(nBytes));
         result.pushKV("total", objM);
 
+        UniValue objR(UniValue::VOBJ);
+        objR.pushKV("sketches sent", std::to_string(smsgReconStats.nSketchesSent.load()));
+        objR.pushKV("sketch bytes sent", std::to_string(smsgReconStats.nSketchBytes.load()));
+        objR.pushKV("sketches received", std::to_string(smsgReconStats.nSketchesReceived.load()));
+        objR.pushKV("decoded", std::to_string(smsgReconStats.nDecoded.load()));
+        objR.pushKV("retried", std::to_string(smsgReconStats.nRetried.load()));
+        objR.pushKV("failed", std::to_string(smsgReconStats.nFailed.load()));
+        objR.pushKV("bytes saved", std::to_string(smsgReconStats.nBytesSaved.load()));
+        result.pushKV("reconciliation", objR);
+
+        UniValue objI(UniValue::VOBJ);
+        objI.pushKV("version", std::to_string(nSmsgInvVersion.load()));
+        objI.pushKV("rebuilds", std::to_string(smsgInvStats.nRebuilds.load()));
+        objI.pushKV("sends", std::to_string(smsgInvStats.nSends.load()));
+        objI.pushKV("unchanged", std::to_string(smsgInvStats.nUnchanged.load()));
+        objI.pushKV("headers sent", std::to_string(smsgInvStats.nEntries.load()));
+        result.pushKV("inventory", objI);
+
     } else
     if (mode == "dump")
     {
+        for (auto &shard : smsgBuckets.vShards)
         {
-            LOCK(cs_smsg);
-            std::map<int64_t, SecMsgBucket>::iterator it;
-            it = smsgBuckets.begin();
-
-            for (it = smsgBuckets.begin(); it != smsgBuckets.end(); ++it)
-            {
-                std::string sFile = std::to_string(it->first) + "_01.dat";
-
-                try {
-                    boost::filesystem::path fullPath = GetDataDir() / "smsgstore" / sFile;
-                    boost::filesystem::remove(fullPath);
-                } catch (const boost::filesystem::filesystem_error& ex)
-                {
-                    //objM.push_back(Pair("file size, error", ex.what()));
-                    LogPrintf("Error removing bucket file %s.\n", ex.what());
-                };
-            };
-            smsgBuckets.clear();
-        }; // cs_smsg
+            LOCK(shard.cs);
+            for (const auto &item : shard.buckets)
+                smsgStore.Remove(item.first);
+            shard.buckets.clear();
+        }; // shard.cs
+        nSmsgInvVersion++;
 
         result.pushKV("result", "Removed all buckets.");
 
@@ -1320,12 +1444,13 @@ static const CRPCCommand commands[] =
     { "smsg",               "smsglocalkeys",          &smsglocalkeys,          true, {} },
     { "smsg",               "smsgscanchain",          &smsgscanchain,          true, {} },
     { "smsg",               "smsgscanbuckets",        &smsgscanbuckets,        true, {} },
+    { "smsg",               "smsgscanstats",          &smsgscanstats,          true, {} },
     { "smsg",               "smsgaddkey",             &smsgaddkey,             true, {} },
     { "smsg",               "smsggetpubkey",          &smsggetpubkey,          true, {} },
     { "smsg",               "smsgsend",               &smsgsend,               true, {} },
     { "smsg",               "smsgsendanon",           &smsgsendanon,           true, {} },
-    { "smsg",               "smsginbox",              &smsginbox,              true, {} },
-    { "smsg",               "smsgoutbox",             &smsgoutbox,             true, {} },
+    { "smsg",               "smsginbox",              &smsginbox,              true, {"mode","options"} },
+    { "smsg",               "smsgoutbox",             &smsgoutbox,             true, {"mode","options"} },
     { "smsg",               "smsgbuckets",            &smsgbuckets,            true, {} },
     { "smsg",               "smsgview",               &smsgview,               true, {} },
 
@@ -394,14 +394,126 @@ int secp256k1_generate_mlsag(const secp256k1_context *ctx,
     return 0;
 }
 
-int secp256k1_verify_mlsag(const secp256k1_context *ctx,
+/* Odd multiples of a point that is multiplied in every column of the ring (a key image).
+ * Stored affine, so they can be added to a point built on any other table's Z denominator. */
+typedef struct {
+    secp256k1_ge pre[ECMULT_TABLE_SIZE(WINDOW_A)];
+#ifdef USE_ENDOMORPHISM
+    secp256k1_ge pre_lam[ECMULT_TABLE_SIZE(WINDOW_A)];
+#endif
+} mlsag_ecmult_table;
+
+static void mlsag_ecmult_table_init(mlsag_ecmult_table *t, const secp256k1_ge *a)
+{
+    secp256k1_gej prej[ECMULT_TABLE_SIZE(WINDOW_A)];
+    secp256k1_fe zr[ECMULT_TABLE_SIZE(WINDOW_A)];
+    secp256k1_gej aj;
+#ifdef USE_ENDOMORPHISM
+    int i;
+#endif
+    
+    secp256k1_gej_set_ge(&aj, a);
+    secp256k1_ecmult_odd_multiples_table(ECMULT_TABLE_SIZE(WINDOW_A), prej, zr, &aj);
+    secp256k1_ge_set_table_gej_var(t->pre, prej, zr, ECMULT_TABLE_SIZE(WINDOW_A));
+#ifdef USE_ENDOMORPHISM
+    for (i = 0; i < ECMULT_TABLE_SIZE(WINDOW_A); i++)
+        secp256k1_ge_mul_lambda(&t->pre_lam[i], &t->pre[i]);
+#endif
+}
+
+/* r = a * na + b * nb, where the odd multiples of b are precomputed in tb.
+ * Strauss' method, both wnafs are added in over a single run of doublings.
+ * As in secp256k1_ecmult the multiples of a share a global Z, the affine multiples of b
+ * are added with secp256k1_gej_add_zinv_var and the result corrected once at the end. */
+static void mlsag_ecmult_2(secp256k1_gej *r, const secp256k1_gej *a, const secp256k1_scalar *na,
+    const mlsag_ecmult_table *tb, const secp256k1_scalar *nb)
+{
+    secp256k1_ge pre_a[ECMULT_TABLE_SIZE(WINDOW_A)];
+    secp256k1_ge tmpa;
+    secp256k1_fe Z;
+#ifdef USE_ENDOMORPHISM
+    secp256k1_ge pre_a_lam[ECMULT_TABLE_SIZE(WINDOW_A)];
+    secp256k1_scalar na_1, na_lam, nb_1, nb_lam;
+    int wnaf_na_1[130], wnaf_na_lam[130], wnaf_nb_1[130], wnaf_nb_lam[130];
+    int bits_na_1, bits_na_lam, bits_nb_1, bits_nb_lam;
+#else
+    int wnaf_na[256], wnaf_nb[256];
+    int bits_na, bits_nb;
+#endif
+    int i, n, bits;
+    
+#ifdef USE_ENDOMORPHISM
+    secp256k1_scalar_split_lambda(&na_1, &na_lam, na);
+    secp256k1_scalar_split_lambda(&nb_1, &nb_lam, nb);
+    bits_na_1   = secp256k1_ecmult_wnaf(wnaf_na_1,   130, &na_1,   WINDOW_A);
+    bits_na_lam = secp256k1_ecmult_wnaf(wnaf_na_lam, 130, &na_lam, WINDOW_A);
+    bits_nb_1   = secp256k1_ecmult_wnaf(wnaf_nb_1,   130, &nb_1,   WINDOW_A);
+    bits_nb_lam = secp256k1_ecmult_wnaf(wnaf_nb_lam, 130, &nb_lam, WINDOW_A);
+    bits = bits_na_1;
+    if (bits_na_lam > bits)
+        bits = bits_na_lam;
+    if (bits_nb_1 > bits)
+        bits = bits_nb_1;
+    if (bits_nb_lam > bits)
+        bits = bits_nb_lam;
+#else
+    bits_na = secp256k1_ecmult_wnaf(wnaf_na, 256, na, WINDOW_A);
+    bits_nb = secp256k1_ecmult_wnaf(wnaf_nb, 256, nb, WINDOW_A);
+    bits = bits_na > bits_nb ? bits_na : bits_nb;
+#endif
+    
+    secp256k1_ecmult_odd_multiples_table_globalz_windowa(pre_a, &Z, a);
+#ifdef USE_ENDOMORPHISM
+    for (i = 0; i < ECMULT_TABLE_SIZE(WINDOW_A); i++)
+        secp256k1_ge_mul_lambda(&pre_a_lam[i], &pre_a[i]);
+#endif
+    
+    secp256k1_gej_set_infinity(r);
+    
+    for (i = bits - 1; i >= 0; i--)
+    {
+        secp256k1_gej_double_var(r, r, NULL);
+#ifdef USE_ENDOMORPHISM
+        if (i < bits_na_1 && (n = wnaf_na_1[i])) {
+            ECMULT_TABLE_GET_GE(&tmpa, pre_a, n, WINDOW_A);
+            secp256k1_gej_add_ge_var(r, r, &tmpa, NULL);
+        }
+        if (i < bits_na_lam && (n = wnaf_na_lam[i])) {
+            ECMULT_TABLE_GET_GE(&tmpa, pre_a_lam, n, WINDOW_A);
+            secp256k1_gej_add_ge_var(r, r, &tmpa, NULL);
+        }
+        if (i < bits_nb_1 && (n = wnaf_nb_1[i])) {
+            ECMULT_TABLE_GET_GE(&tmpa, tb->pre, n, WINDOW_A);
+            secp256k1_gej_add_zinv_var(r, r, &tmpa, &Z);
+        }
+        if (i < bits_nb_lam && (n = wnaf_nb_lam[i])) {
+            ECMULT_TABLE_GET_GE(&tmpa, tb->pre_lam, n, WINDOW_A);
+            secp256k1_gej_add_zinv_var(r, r, &tmpa, &Z);
+        }
+#else
+        if (i < bits_na && (n = wnaf_na[i])) {
+            ECMULT_TABLE_GET_GE(&tmpa, pre_a, n, WINDOW_A);
+            secp256k1_gej_add_ge_var(r, r, &tmpa, NULL);
+        }
+        if (i < bits_nb && (n = wnaf_nb[i])) {
+            ECMULT_TABLE_GET_GE(&tmpa, tb->pre, n, WINDOW_A);
+            secp256k1_gej_add_zinv_var(r, r, &tmpa, &Z);
+        }
+#endif
+    }
+    
+    if (!r->infinity)
+        secp256k1_fe_mul(&r->z, &r->z, &Z);
+}
+
+static int verify_mlsag_tables(const secp256k1_context *ctx, mlsag_ecmult_table *ki_tables,
     const uint8_t *preimage, size_t nCols, size_t nRows,
     const uint8_t *pk, const uint8_t *ki, const uint8_t *pc, const uint8_t *ps)
 {
     secp256k1_sha256_t sha256_m, sha256_pre;
     secp256k1_scalar zero, clast, cSig, ss;
     secp256k1_ge ge1;
-    secp256k1_gej gej1, gej2, L, R;
+    secp256k1_gej gej1, L, R;
     size_t dsRows = nRows-1; /* TODO: pass in dsRows explicitly? */
     uint8_t tmp[33];
     size_t i, k, clen;
@@ -415,6 +527,14 @@ int secp256k1_verify_mlsag(const secp256k1_context *ctx,
     
     cSig = clast;
     
+    /* The key images are multiplied in every column, parse them and build their tables once */
+    for (k = 0; k < dsRows; ++k)
+    {
+        if (!secp256k1_eckey_pubkey_parse(&ge1, &ki[k * 33], 33))
+            return 1;
+        mlsag_ecmult_table_init(&ki_tables[k], &ge1);
+    };
+    
     secp256k1_sha256_initialize(&sha256_m);
     secp256k1_sha256_write(&sha256_m, preimage, 32);
     sha256_pre = sha256_m;
@@ -438,14 +558,7 @@ int secp256k1_verify_mlsag(const secp256k1_context *ctx,
             if (0 != hash_to_curve(&ge1, &pk[(i + k*nCols)*33], 33)) /* H(pk[k][i]) */
                 return 1;
             secp256k1_gej_set_ge(&gej1, &ge1);
-            secp256k1_ecmult(&ctx->ecmult_ctx, &gej1, &gej1, &ss, &zero); /* gej1 = H(pk[k][i]) * ss */
-            
-            if (!secp256k1_eckey_pubkey_parse(&ge1, &ki[k * 33], 33))
-                return 1;
-            secp256k1_gej_set_ge(&gej2, &ge1);
-            secp256k1_ecmult(&ctx->ecmult_ctx, &gej2, &gej2, &clast, &zero); /* gej2 = ki[k] * clast */
-            
-            secp256k1_gej_add_var(&R, &gej1, &gej2, NULL);  /* R =  gej1 + gej2 */
+            mlsag_ecmult_2(&R, &gej1, &ss, &ki_tables[k], &clast);
             
             secp256k1_sha256_write(&sha256_m, &pk[(i + k*nCols)*33], 33); /* pk[k][i] */
             secp256k1_ge_set_gej(&ge1, &L);
@@ -487,4 +600,21 @@ int secp256k1_verify_mlsag(const secp256k1_context *ctx,
     return secp256k1_scalar_is_zero(&zero) ? 0 : 2; /* return 0 on success, 2 on failure */
 }
 
+int secp256k1_verify_mlsag(const secp256k1_context *ctx,
+    const uint8_t *preimage, size_t nCols, size_t nRows,
+    const uint8_t *pk, const uint8_t *ki, const uint8_t *pc, const uint8_t *ps)
+{
+    mlsag_ecmult_table *ki_tables;
+    int rv;
+    
+    if (nRows < 1)
+        return 1;
+    
+    ki_tables = (mlsag_ecmult_table*)checked_malloc(&ctx->error_callback, sizeof(mlsag_ecmult_table) * nRows); /* one spare, never zero sized */
+    rv = verify_mlsag_tables(ctx, ki_tables, preimage, nCols, nRows, pk, ki, pc, ps);
+    free(ki_tables);
+    
+    return rv;
+}
+
 #endif
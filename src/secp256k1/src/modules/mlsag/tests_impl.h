@@ -181,10 +181,46 @@ void test_mlsag(void)
 }
 
 
+void test_mlsag_ecmult_2(void)
+{
+    /* a * na + b * nb must match two separate multiplications */
+    secp256k1_scalar na, nb, zero;
+    secp256k1_gej aj, bj, r, r1, r2;
+    secp256k1_ge a, b;
+    mlsag_ecmult_table tb;
+    
+    secp256k1_scalar_set_int(&zero, 0);
+    random_group_element_test(&a);
+    random_group_element_test(&b);
+    random_scalar_order_test(&na);
+    random_scalar_order_test(&nb);
+    
+    secp256k1_gej_set_ge(&aj, &a);
+    secp256k1_gej_set_ge(&bj, &b);
+    mlsag_ecmult_table_init(&tb, &b);
+    mlsag_ecmult_2(&r, &aj, &na, &tb, &nb);
+    
+    secp256k1_ecmult(&ctx->ecmult_ctx, &r1, &aj, &na, &zero);
+    secp256k1_ecmult(&ctx->ecmult_ctx, &r2, &bj, &nb, &zero);
+    secp256k1_gej_add_var(&r1, &r1, &r2, NULL);
+    secp256k1_gej_neg(&r1, &r1);
+    secp256k1_gej_add_var(&r1, &r1, &r, NULL);
+    CHECK(secp256k1_gej_is_infinity(&r1));
+    
+    /* Zero scalars */
+    mlsag_ecmult_2(&r, &aj, &zero, &tb, &zero);
+    CHECK(secp256k1_gej_is_infinity(&r));
+    mlsag_ecmult_2(&r, &aj, &zero, &tb, &nb);
+    secp256k1_gej_neg(&r2, &r2);
+    secp256k1_gej_add_var(&r, &r, &r2, NULL);
+    CHECK(secp256k1_gej_is_infinity(&r));
+}
+
 void run_mlsag_tests(void) {
     int i;
     
     for (i = 0; i < mlsag_count; i++) {
+        test_mlsag_ecmult_2();
         test_mlsag();
     }
 }
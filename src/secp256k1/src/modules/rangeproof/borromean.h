@@ -17,6 +17,21 @@
 int secp256k1_borromean_verify(const secp256k1_ecmult_context* ecmult_ctx, secp256k1_scalar *evalues, const unsigned char *e0, const secp256k1_scalar *s,
  const secp256k1_gej *pubs, const size_t *rsizes, size_t nrings, const unsigned char *m, size_t mlen);
 
+/** One signature of a batch, as passed to secp256k1_borromean_verify. */
+typedef struct {
+    const unsigned char *e0;
+    const secp256k1_scalar *s;
+    const secp256k1_gej *pubs;
+    const size_t *rsizes;
+    size_t nrings;
+    const unsigned char *m;
+    size_t mlen;
+} secp256k1_borromean_sig;
+
+/** Verify n signatures, results[i] is set to the outcome of sigs[i]. Returns 1 if all verified. */
+int secp256k1_borromean_verify_batch(const secp256k1_ecmult_context* ecmult_ctx, const secp256k1_callback *cb, int *results,
+ const secp256k1_borromean_sig *sigs, size_t n);
+
 int secp256k1_borromean_sign(const secp256k1_ecmult_context* ecmult_ctx, const secp256k1_ecmult_gen_context *ecmult_gen_ctx,
  unsigned char *e0, secp256k1_scalar *s, const secp256k1_gej *pubs, const secp256k1_scalar *k, const secp256k1_scalar *sec,
  const size_t *rsizes, const size_t *secidx, size_t nrings, const unsigned char *m, size_t mlen);
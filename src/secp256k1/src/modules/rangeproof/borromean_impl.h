@@ -109,6 +109,137 @@ int secp256k1_borromean_verify(const secp256k1_ecmult_context* ecmult_ctx, secp2
     return memcmp(e0, tmp, 32) == 0;
 }
 
+typedef struct {
+    secp256k1_scalar ens;
+    size_t sig;
+    size_t ring;
+    size_t count; /* Index of the ring's first pubkey. */
+    int overflow;
+    unsigned char r[33]; /* Last point of the ring, hashed into e0. */
+} secp256k1_borromean_batch_ring;
+
+/*  Every ring of every signature is stepped in lockstep: the r points of step j of all rings are computed
+ *  first and brought to affine with a single batch inversion before being hashed into the next challenges.
+ *  Each signature is checked exactly as secp256k1_borromean_verify would.
+ */
+int secp256k1_borromean_verify_batch(const secp256k1_ecmult_context* ecmult_ctx, const secp256k1_callback *cb, int *results,
+ const secp256k1_borromean_sig *sigs, size_t n) {
+    secp256k1_borromean_batch_ring *rings;
+    secp256k1_borromean_batch_ring *br;
+    secp256k1_gej *rgej;
+    secp256k1_ge *rge;
+    size_t *active;
+    secp256k1_sha256_t sha256_e0;
+    unsigned char tmp[33];
+    size_t i;
+    size_t j;
+    size_t a;
+    size_t count;
+    size_t size;
+    size_t nrings;
+    size_t nactive;
+    size_t maxsize;
+    int ret;
+    VERIFY_CHECK(ecmult_ctx != NULL);
+    VERIFY_CHECK(results != NULL);
+    VERIFY_CHECK(sigs != NULL);
+    nrings = 0;
+    for (i = 0; i < n; i++) {
+        VERIFY_CHECK(sigs[i].nrings > 0);
+        nrings += sigs[i].nrings;
+    }
+    if (nrings == 0) {
+        return 1;
+    }
+    rings = (secp256k1_borromean_batch_ring*)checked_malloc(cb, sizeof(secp256k1_borromean_batch_ring) * nrings);
+    rgej = (secp256k1_gej*)checked_malloc(cb, sizeof(secp256k1_gej) * nrings);
+    rge = (secp256k1_ge*)checked_malloc(cb, sizeof(secp256k1_ge) * nrings);
+    active = (size_t*)checked_malloc(cb, sizeof(size_t) * nrings);
+    maxsize = 0;
+    br = rings;
+    for (i = 0; i < n; i++) {
+        results[i] = 1;
+        count = 0;
+        for (j = 0; j < sigs[i].nrings; j++, br++) {
+            VERIFY_CHECK(INT_MAX - count > sigs[i].rsizes[j]);
+            br->sig = i;
+            br->ring = j;
+            br->count = count;
+            memset(br->r, 0, sizeof(br->r));
+            secp256k1_borromean_hash(tmp, sigs[i].m, sigs[i].mlen, sigs[i].e0, 32, j, 0);
+            secp256k1_scalar_set_b32(&br->ens, tmp, &br->overflow);
+            count += sigs[i].rsizes[j];
+            if (sigs[i].rsizes[j] > maxsize) {
+                maxsize = sigs[i].rsizes[j];
+            }
+        }
+    }
+    for (j = 0; j < maxsize; j++) {
+        nactive = 0;
+        for (a = 0; a < nrings; a++) {
+            const secp256k1_borromean_sig *sig;
+            br = &rings[a];
+            sig = &sigs[br->sig];
+            if (!results[br->sig] || j >= sig->rsizes[br->ring]) {
+                continue;
+            }
+            count = br->count + j;
+            if (br->overflow || secp256k1_scalar_is_zero(&sig->s[count]) || secp256k1_scalar_is_zero(&br->ens) || secp256k1_gej_is_infinity(&sig->pubs[count])) {
+                results[br->sig] = 0;
+                continue;
+            }
+            secp256k1_ecmult(ecmult_ctx, &rgej[nactive], &sig->pubs[count], &br->ens, &sig->s[count]);
+            if (secp256k1_gej_is_infinity(&rgej[nactive])) {
+                results[br->sig] = 0;
+                continue;
+            }
+            active[nactive++] = a;
+        }
+        if (nactive == 0) {
+            continue;
+        }
+        secp256k1_ge_set_all_gej_var(rge, rgej, nactive, cb);
+        for (a = 0; a < nactive; a++) {
+            const secp256k1_borromean_sig *sig;
+            br = &rings[active[a]];
+            sig = &sigs[br->sig];
+            if (!results[br->sig]) {
+                continue;
+            }
+            secp256k1_eckey_pubkey_serialize(&rge[a], tmp, &size, 1);
+            if (j != sig->rsizes[br->ring] - 1) {
+                secp256k1_borromean_hash(tmp, sig->m, sig->mlen, tmp, 33, br->ring, j + 1);
+                secp256k1_scalar_set_b32(&br->ens, tmp, &br->overflow);
+            } else {
+                memcpy(br->r, tmp, 33);
+            }
+        }
+    }
+    ret = 1;
+    br = rings;
+    for (i = 0; i < n; i++) {
+        if (!results[i]) {
+            /* Rings of a failed signature may not have reached their last point. */
+            br += sigs[i].nrings;
+            ret = 0;
+            continue;
+        }
+        secp256k1_sha256_initialize(&sha256_e0);
+        for (j = 0; j < sigs[i].nrings; j++, br++) {
+            secp256k1_sha256_write(&sha256_e0, br->r, 33);
+        }
+        secp256k1_sha256_write(&sha256_e0, sigs[i].m, sigs[i].mlen);
+        secp256k1_sha256_finalize(&sha256_e0, tmp);
+        results[i] = memcmp(sigs[i].e0, tmp, 32) == 0;
+        ret &= results[i];
+    }
+    free(active);
+    free(rge);
+    free(rgej);
+    free(rings);
+    return ret;
+}
+
 int secp256k1_borromean_sign(const secp256k1_ecmult_context* ecmult_ctx, const secp256k1_ecmult_gen_context *ecmult_gen_ctx,
  unsigned char *e0, secp256k1_scalar *s, const secp256k1_gej *pubs, const secp256k1_scalar *k, const secp256k1_scalar *sec,
  const size_t *rsizes, const size_t *secidx, size_t nrings, const unsigned char *m, size_t mlen) {
@@ -263,6 +263,34 @@ int secp256k1_rangeproof_verify(const secp256k1_context* ctx, uint64_t *min_valu
      NULL, NULL, NULL, NULL, NULL, min_value, max_value, &commitp, proof, plen, extra_commit, extra_commit_len, &genp);
 }
 
+int secp256k1_rangeproof_verify_batch(const secp256k1_context* ctx, uint64_t *min_values, uint64_t *max_values,
+ const secp256k1_pedersen_commitment * const *commits, const unsigned char * const *proofs, const size_t *plens, size_t n,
+ const unsigned char *extra_commit, size_t extra_commit_len, const secp256k1_generator* gen) {
+    secp256k1_ge *commitp;
+    secp256k1_ge genp;
+    size_t i;
+    int ret;
+    ARG_CHECK(ctx != NULL);
+    ARG_CHECK(min_values != NULL);
+    ARG_CHECK(max_values != NULL);
+    ARG_CHECK(commits != NULL);
+    ARG_CHECK(proofs != NULL);
+    ARG_CHECK(plens != NULL);
+    ARG_CHECK(secp256k1_ecmult_context_is_built(&ctx->ecmult_ctx));
+    if (n == 0) {
+        return 1;
+    }
+    commitp = (secp256k1_ge*)checked_malloc(&ctx->error_callback, sizeof(secp256k1_ge) * n);
+    for (i = 0; i < n; i++) {
+        secp256k1_pedersen_commitment_load(&commitp[i], commits[i]);
+    }
+    secp256k1_generator_load(&genp, gen);
+    ret = secp256k1_rangeproof_verify_batch_impl(&ctx->ecmult_ctx, &ctx->error_callback,
+     min_values, max_values, commitp, proofs, plens, n, extra_commit, extra_commit_len, &genp);
+    free(commitp);
+    return ret;
+}
+
 int secp256k1_rangeproof_sign(const secp256k1_context* ctx, unsigned char *proof, size_t *plen, uint64_t min_value,
  const secp256k1_pedersen_commitment *commit, const unsigned char *blind, const unsigned char *nonce, int exp, int min_bits, uint64_t value,
  const unsigned char *message, size_t msg_len, const unsigned char *extra_commit, size_t extra_commit_len, const secp256k1_generator* gen){
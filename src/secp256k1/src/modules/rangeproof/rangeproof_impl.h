@@ -537,19 +537,13 @@ SECP256K1_INLINE static int secp256k1_rangeproof_getheader_impl(size_t *offset,
     return 1;
 }
 
-/* Verifies range proof (len plen) for commit, the min/max values proven are put in the min/max arguments; returns 0 on failure 1 on success.*/
-SECP256K1_INLINE static int secp256k1_rangeproof_verify_impl(const secp256k1_ecmult_context* ecmult_ctx,
- const secp256k1_ecmult_gen_context* ecmult_gen_ctx,
- unsigned char *blindout, uint64_t *value_out, unsigned char *message_out, size_t *outlen, const unsigned char *nonce,
- uint64_t *min_value, uint64_t *max_value, const secp256k1_ge *commit, const unsigned char *proof, size_t plen, const unsigned char *extra_commit, size_t extra_commit_len, const secp256k1_ge* genp) {
+/* Parse a proof and expand its ring pubkeys, m is set to the message signed by the borromean signature. */
+SECP256K1_INLINE static int secp256k1_rangeproof_verify_prepare(secp256k1_gej *pubs, secp256k1_scalar *s, size_t *rsizes, size_t *nrings,
+ unsigned char *m, const unsigned char **e0, size_t *offset_post_header, uint64_t *scale, uint64_t *min_value, uint64_t *max_value,
+ const secp256k1_ge *commit, const unsigned char *proof, size_t plen, const unsigned char *extra_commit, size_t extra_commit_len, const secp256k1_ge* genp) {
     secp256k1_gej accj;
-    secp256k1_gej pubs[128];
     secp256k1_ge c;
-    secp256k1_scalar s[128];
-    secp256k1_scalar evalues[128]; /* Challenges, only used during proof rewind. */
     secp256k1_sha256_t sha256_m;
-    size_t rsizes[32];
-    int ret;
     size_t i;
     int exp;
     int mantissa;
@@ -557,16 +551,12 @@ SECP256K1_INLINE static int secp256k1_rangeproof_verify_impl(const secp256k1_ecm
     size_t rings;
     int overflow;
     size_t npub;
-    int offset_post_header;
-    uint64_t scale;
     unsigned char signs[31];
-    unsigned char m[33];
-    const unsigned char *e0;
     offset = 0;
-    if (!secp256k1_rangeproof_getheader_impl(&offset, &exp, &mantissa, &scale, min_value, max_value, proof, plen)) {
+    if (!secp256k1_rangeproof_getheader_impl(&offset, &exp, &mantissa, scale, min_value, max_value, proof, plen)) {
         return 0;
     }
-    offset_post_header = offset;
+    *offset_post_header = offset;
     rings = 1;
     rsizes[0] = 1;
     npub = 1;
@@ -630,7 +620,7 @@ SECP256K1_INLINE static int secp256k1_rangeproof_verify_impl(const secp256k1_ecm
     }
     secp256k1_rangeproof_pub_expand(pubs, exp, rsizes, rings, genp);
     npub += rsizes[rings - 1];
-    e0 = &proof[offset];
+    *e0 = &proof[offset];
     offset += 32;
     for (i = 0; i < npub; i++) {
         secp256k1_scalar_set_b32(&s[i], &proof[offset], &overflow);
@@ -647,6 +637,30 @@ SECP256K1_INLINE static int secp256k1_rangeproof_verify_impl(const secp256k1_ecm
         secp256k1_sha256_write(&sha256_m, extra_commit, extra_commit_len);
     }
     secp256k1_sha256_finalize(&sha256_m, m);
+    *nrings = rings;
+    return 1;
+}
+
+/* Verifies range proof (len plen) for commit, the min/max values proven are put in the min/max arguments; returns 0 on failure 1 on success.*/
+SECP256K1_INLINE static int secp256k1_rangeproof_verify_impl(const secp256k1_ecmult_context* ecmult_ctx,
+ const secp256k1_ecmult_gen_context* ecmult_gen_ctx,
+ unsigned char *blindout, uint64_t *value_out, unsigned char *message_out, size_t *outlen, const unsigned char *nonce,
+ uint64_t *min_value, uint64_t *max_value, const secp256k1_ge *commit, const unsigned char *proof, size_t plen, const unsigned char *extra_commit, size_t extra_commit_len, const secp256k1_ge* genp) {
+    secp256k1_gej accj;
+    secp256k1_gej pubs[128];
+    secp256k1_scalar s[128];
+    secp256k1_scalar evalues[128]; /* Challenges, only used during proof rewind. */
+    size_t rsizes[32];
+    int ret;
+    size_t rings;
+    size_t offset_post_header;
+    uint64_t scale;
+    unsigned char m[33];
+    const unsigned char *e0;
+    if (!secp256k1_rangeproof_verify_prepare(pubs, s, rsizes, &rings, m, &e0, &offset_post_header, &scale, min_value, max_value,
+     commit, proof, plen, extra_commit, extra_commit_len, genp)) {
+        return 0;
+    }
     ret = secp256k1_borromean_verify(ecmult_ctx, nonce ? evalues : NULL, e0, s, pubs, rsizes, rings, m, 32);
     if (ret && nonce) {
         /* Given the nonce, try rewinding the witness to recover its initial state. */
@@ -680,4 +694,47 @@ SECP256K1_INLINE static int secp256k1_rangeproof_verify_impl(const secp256k1_ecm
     return ret;
 }
 
+typedef struct {
+    secp256k1_gej pubs[128];
+    secp256k1_scalar s[128];
+    size_t rsizes[32];
+    unsigned char m[33];
+} secp256k1_rangeproof_batch_entry;
+
+/* Verifies n range proofs together, the borromean signatures share their batch inversions; returns 1 if all proofs are valid. */
+SECP256K1_INLINE static int secp256k1_rangeproof_verify_batch_impl(const secp256k1_ecmult_context* ecmult_ctx, const secp256k1_callback *cb,
+ uint64_t *min_values, uint64_t *max_values, const secp256k1_ge *commits, const unsigned char * const *proofs, const size_t *plens, size_t n,
+ const unsigned char *extra_commit, size_t extra_commit_len, const secp256k1_ge* genp) {
+    secp256k1_rangeproof_batch_entry *entries;
+    secp256k1_borromean_sig *sigs;
+    int *results;
+    size_t offset_post_header;
+    uint64_t scale;
+    size_t i;
+    int ret;
+    entries = (secp256k1_rangeproof_batch_entry*)checked_malloc(cb, sizeof(secp256k1_rangeproof_batch_entry) * n);
+    sigs = (secp256k1_borromean_sig*)checked_malloc(cb, sizeof(secp256k1_borromean_sig) * n);
+    results = (int*)checked_malloc(cb, sizeof(int) * n);
+    ret = 1;
+    for (i = 0; i < n; i++) {
+        if (!secp256k1_rangeproof_verify_prepare(entries[i].pubs, entries[i].s, entries[i].rsizes, &sigs[i].nrings, entries[i].m, &sigs[i].e0,
+         &offset_post_header, &scale, &min_values[i], &max_values[i], &commits[i], proofs[i], plens[i], extra_commit, extra_commit_len, genp)) {
+            ret = 0;
+            break;
+        }
+        sigs[i].s = entries[i].s;
+        sigs[i].pubs = entries[i].pubs;
+        sigs[i].rsizes = entries[i].rsizes;
+        sigs[i].m = entries[i].m;
+        sigs[i].mlen = 32;
+    }
+    if (ret) {
+        ret = secp256k1_borromean_verify_batch(ecmult_ctx, cb, results, sigs, n);
+    }
+    free(results);
+    free(sigs);
+    free(entries);
+    return ret;
+}
+
 #endif
@@ -88,6 +88,8 @@ static void test_borromean(void) {
     size_t i;
     size_t j;
     int c;
+    secp256k1_borromean_sig sigs[2];
+    int results[2];
     secp256k1_rand256_test(m);
     nrings = 1 + (secp256k1_rand32()&7);
     c = 0;
@@ -122,9 +124,21 @@ static void test_borromean(void) {
     }
     CHECK(secp256k1_borromean_sign(&ctx->ecmult_ctx, &ctx->ecmult_gen_ctx, e0, s, pubs, k, sec, rsizes, secidx, nrings, m, 32));
     CHECK(secp256k1_borromean_verify(&ctx->ecmult_ctx, NULL, e0, s, pubs, rsizes, nrings, m, 32));
+    sigs[0].e0 = e0;
+    sigs[0].s = s;
+    sigs[0].pubs = pubs;
+    sigs[0].rsizes = rsizes;
+    sigs[0].nrings = nrings;
+    sigs[0].m = m;
+    sigs[0].mlen = 32;
+    sigs[1] = sigs[0];
+    CHECK(secp256k1_borromean_verify_batch(&ctx->ecmult_ctx, &ctx->error_callback, results, sigs, 2));
+    CHECK(results[0] && results[1]);
     i = secp256k1_rand32() % c;
     secp256k1_scalar_negate(&s[i],&s[i]);
     CHECK(!secp256k1_borromean_verify(&ctx->ecmult_ctx, NULL, e0, s, pubs, rsizes, nrings, m, 32));
+    CHECK(!secp256k1_borromean_verify_batch(&ctx->ecmult_ctx, &ctx->error_callback, results, sigs, 2));
+    CHECK(!results[0] && !results[1]);
     secp256k1_scalar_negate(&s[i],&s[i]);
     secp256k1_scalar_set_int(&one, 1);
     for(j = 0; j < 4; j++) {
@@ -355,6 +369,43 @@ void test_multiple_generators(void) {
     CHECK(secp256k1_pedersen_verify_tally(ctx, &commit_ptr[0], n_inputs, &commit_ptr[n_inputs], n_outputs));
 }
 
+static void test_rangeproof_batch(void) {
+    secp256k1_pedersen_commitment commits[3];
+    const secp256k1_pedersen_commitment *pcommits[3];
+    unsigned char proofs[3][5134];
+    const unsigned char *pproofs[3];
+    size_t plens[3];
+    unsigned char blind[32];
+    uint64_t minv[3];
+    uint64_t maxv[3];
+    uint64_t minv1;
+    uint64_t maxv1;
+    size_t i;
+    for (i = 0; i < 3; i++) {
+        uint64_t v = secp256k1_rand32() >> (i * 8);
+        secp256k1_rand256(blind);
+        CHECK(secp256k1_pedersen_commit(ctx, &commits[i], blind, v, secp256k1_generator_h));
+        plens[i] = 5134;
+        CHECK(secp256k1_rangeproof_sign(ctx, proofs[i], &plens[i], 0, &commits[i], blind, commits[i].data, 0, 0, v, NULL, 0, NULL, 0, secp256k1_generator_h));
+        pcommits[i] = &commits[i];
+        pproofs[i] = proofs[i];
+    }
+    CHECK(secp256k1_rangeproof_verify_batch(ctx, minv, maxv, pcommits, pproofs, plens, 3, NULL, 0, secp256k1_generator_h));
+    for (i = 0; i < 3; i++) {
+        CHECK(secp256k1_rangeproof_verify(ctx, &minv1, &maxv1, &commits[i], proofs[i], plens[i], NULL, 0, secp256k1_generator_h));
+        CHECK(minv[i] == minv1);
+        CHECK(maxv[i] == maxv1);
+    }
+    CHECK(secp256k1_rangeproof_verify_batch(ctx, minv, maxv, pcommits, pproofs, plens, 0, NULL, 0, secp256k1_generator_h));
+    /* One bad proof fails the batch */
+    proofs[1][plens[1] - 1] ^= 1;
+    CHECK(!secp256k1_rangeproof_verify_batch(ctx, minv, maxv, pcommits, pproofs, plens, 3, NULL, 0, secp256k1_generator_h));
+    CHECK(!secp256k1_rangeproof_verify(ctx, &minv1, &maxv1, &commits[1], proofs[1], plens[1], NULL, 0, secp256k1_generator_h));
+    proofs[1][plens[1] - 1] ^= 1;
+    pcommits[2] = &commits[0];
+    CHECK(!secp256k1_rangeproof_verify_batch(ctx, minv, maxv, pcommits, pproofs, plens, 3, NULL, 0, secp256k1_generator_h));
+}
+
 void run_rangeproof_tests(void) {
     int i;
     for (i = 0; i < 10*count; i++) {
@@ -364,6 +415,7 @@ void run_rangeproof_tests(void) {
         test_borromean();
     }
     test_rangeproof();
+    test_rangeproof_batch();
     test_multiple_generators();
 }
 
@@ -7,11 +7,43 @@
 #include "sync.h"
 #include "serialize.h"
 #include "clientversion.h"
+#include "crypto/common.h"
 
 
 CCriticalSection cs_smsgDB;
 leveldb::DB *smsgDB = nullptr;
 
+SecMsgMeta::SecMsgMeta(const SecMsgStored &smsgStored)
+{
+    timeReceived = smsgStored.timeReceived;
+    status = smsgStored.status;
+    addrTo = smsgStored.addrTo;
+};
+
+static bool IsIndexed(const uint8_t *chKey)
+{
+    // inbox and outbox
+    return chKey[1] == 'm' && (chKey[0] == 'i' || chKey[0] == 's');
+};
+
+static std::string IndexKey(char type, char folder, const CKeyID *pAddress, int64_t nTime, const uint8_t *pSuffix)
+{
+    std::string sKey;
+    sKey.reserve(2 + 20 + 8 + 16);
+    sKey.push_back(type);
+    sKey.push_back(folder);
+    if (pAddress)
+        sKey.append((const char*)pAddress->begin(), 20);
+
+    uint8_t chTime[8];
+    WriteBE64(chTime, (uint64_t)std::max(nTime, (int64_t)0));
+    sKey.append((const char*)chTime, 8);
+
+    if (pSuffix)
+        sKey.append((const char*)pSuffix, 16);
+    return sKey;
+};
+
 bool SecMsgDB::Open(const char *pszMode)
 {
     if (smsgDB)
@@ -331,12 +363,17 @@ bool SecMsgDB::WriteSmesg(uint8_t *chKey, SecMsgStored &smsgStored)
     if (activeBatch)
     {
         activeBatch->Put(ssKey.str(), ssValue.str());
+        IndexSmesg(*activeBatch, chKey, smsgStored, false);
         return true;
     };
 
+    leveldb::WriteBatch batch;
+    batch.Put(ssKey.str(), ssValue.str());
+    IndexSmesg(batch, chKey, smsgStored, false);
+
     leveldb::WriteOptions writeOptions;
     writeOptions.sync = true;
-    leveldb::Status s = pdb->Put(writeOptions, ssKey.str(), ssValue.str());
+    leveldb::Status s = pdb->Write(writeOptions, &batch);
     if (!s.ok())
         return error("SecMsgDB write failed: %s\n", s.ToString());
 
@@ -364,23 +401,261 @@ bool SecMsgDB::ExistsSmesg(uint8_t *chKey)
     return true;
 };
 
-bool SecMsgDB::EraseSmesg(uint8_t *chKey)
+bool SecMsgDB::EraseSmesg(uint8_t *chKey, const SecMsgStored *pStored)
 {
     CDataStream ssKey(SER_DISK, CLIENT_VERSION);
     ssKey.write((const char*)chKey, 18);
 
+    // Index keys are derived from the stored message
+    SecMsgStored smsgStored;
+    bool fIndexed = false;
+    if (IsIndexed(chKey))
+    {
+        if (pStored)
+        {
+            smsgStored = *pStored;
+            fIndexed = true;
+        } else
+        {
+            fIndexed = ReadSmesg(chKey, smsgStored);
+        };
+    };
+
     if (activeBatch)
     {
         activeBatch->Delete(ssKey.str());
+        if (fIndexed)
+            IndexSmesg(*activeBatch, chKey, smsgStored, true);
         return true;
     };
 
+    leveldb::WriteBatch batch;
+    batch.Delete(ssKey.str());
+    if (fIndexed)
+        IndexSmesg(batch, chKey, smsgStored, true);
+
     leveldb::WriteOptions writeOptions;
     writeOptions.sync = true;
-    leveldb::Status s = pdb->Delete(writeOptions, ssKey.str());
+    leveldb::Status s = pdb->Write(writeOptions, &batch);
 
     if (s.ok() || s.IsNotFound())
         return true;
     return error("SecMsgDB erase failed: %s\n", s.ToString());
 };
 
+
+bool SecMsgDB::ReadUnlockScan(std::map<std::string, int64_t> &mapProgress)
+{
+    if (!pdb)
+        return false;
+
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << 'w';
+    ssKey << 'l';
+    std::string strValue;
+
+    leveldb::Status s = pdb->Get(leveldb::ReadOptions(), ssKey.str(), &strValue);
+    if (!s.ok())
+    {
+        if (s.IsNotFound())
+            return false;
+        return error("LevelDB read failure: %s\n", s.ToString());
+    };
+
+    try {
+        CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+        ssValue >> mapProgress;
+    } catch (std::exception &e) {
+        LogPrintf("SecMsgDB::ReadUnlockScan() unserialize threw: %s.\n", e.what());
+        return false;
+    };
+
+    return true;
+};
+
+bool SecMsgDB::WriteUnlockScan(const std::map<std::string, int64_t> &mapProgress)
+{
+    if (!pdb)
+        return false;
+
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << 'w';
+    ssKey << 'l';
+
+    leveldb::WriteOptions writeOptions;
+    writeOptions.sync = true;
+    leveldb::Status s;
+    if (mapProgress.size() < 1)
+    {
+        s = pdb->Delete(writeOptions, ssKey.str());
+    } else
+    {
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue << mapProgress;
+        s = pdb->Put(writeOptions, ssKey.str(), ssValue.str());
+    };
+
+    if (!s.ok() && !s.IsNotFound())
+        return error("SecMsgDB write failed: %s\n", s.ToString());
+
+    return true;
+};
+
+void SecMsgDB::IndexSmesg(leveldb::WriteBatch &batch, const uint8_t *chKey, const SecMsgStored &smsgStored, bool fErase)
+{
+    if (!IsIndexed(chKey))
+        return;
+
+    char folder = chKey[0];
+    std::string sTime = IndexKey('x', folder, nullptr, smsgStored.timeReceived, &chKey[2]);
+    std::string sUnread = IndexKey('u', folder, nullptr, smsgStored.timeReceived, &chKey[2]);
+    std::string sAddress = IndexKey('a', folder, &smsgStored.addrTo, smsgStored.timeReceived, &chKey[2]);
+
+    if (fErase)
+    {
+        batch.Delete(sTime);
+        batch.Delete(sUnread);
+        batch.Delete(sAddress);
+        return;
+    };
+
+    CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+    ssValue << SecMsgMeta(smsgStored);
+
+    batch.Put(sTime, ssValue.str());
+    batch.Put(sAddress, ssValue.str());
+    if (smsgStored.status & SMSG_MASK_UNREAD)
+        batch.Put(sUnread, ssValue.str());
+    else
+        batch.Delete(sUnread);
+};
+
+bool SecMsgDB::ListSmesg(char folder, const SecMsgQuery &q, std::vector<SecMsgListed> &vListed)
+{
+    if (!pdb)
+        return false;
+
+    // Walk the narrowest index, the other filters are tested on the index value
+    char type = q.fAddress ? 'a' : q.fUnreadOnly ? 'u' : 'x';
+    std::string sSeek = IndexKey(type, folder, q.fAddress ? &q.address : nullptr, q.nSince, nullptr);
+    size_t nPrefix = sSeek.size() - 8;
+    size_t nKeySize = sSeek.size() + 16;
+
+    size_t nSkipped = 0;
+    leveldb::Iterator *it = pdb->NewIterator(leveldb::ReadOptions());
+    for (it->Seek(sSeek); it->Valid(); it->Next())
+    {
+        leveldb::Slice key = it->key();
+        if (key.size() != nKeySize
+            || memcmp(key.data(), sSeek.data(), nPrefix) != 0)
+            break;
+
+        SecMsgListed listed;
+        try {
+            CDataStream ssValue(it->value().data(), it->value().data() + it->value().size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> listed.meta;
+        } catch (std::exception &e) {
+            LogPrintf("SecMsgDB::ListSmesg() unserialize threw: %s.\n", e.what());
+            continue;
+        };
+
+        if (q.fUnreadOnly
+            && !(listed.meta.status & SMSG_MASK_UNREAD))
+            continue;
+
+        if (nSkipped < q.nOffset)
+        {
+            nSkipped++;
+            continue;
+        };
+
+        listed.chKey[0] = folder;
+        listed.chKey[1] = 'm';
+        memcpy(&listed.chKey[2], key.data() + nKeySize - 16, 16);
+        vListed.push_back(listed);
+
+        if (q.nCount > 0
+            && vListed.size() >= q.nCount)
+            break;
+    };
+    delete it;
+
+    return true;
+};
+
+bool SecMsgDB::HaveIndex()
+{
+    if (!pdb)
+        return false;
+
+    std::string strValue;
+    leveldb::Status s = pdb->Get(leveldb::ReadOptions(), std::string("xv"), &strValue);
+    if (!s.ok())
+        return false;
+
+    uint32_t nVersion = 0;
+    try {
+        CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+        ssValue >> nVersion;
+    } catch (std::exception &e) {
+        return false;
+    };
+
+    return nVersion >= SMSG_DB_INDEX_VERSION;
+};
+
+bool SecMsgDB::BuildIndex()
+{
+    // Index messages stored before the index existed
+    if (!pdb)
+        return false;
+
+    LogPrintf("Indexing smsg inbox and outbox.\n");
+
+    leveldb::WriteOptions writeOptions;
+    writeOptions.sync = true;
+
+    size_t nIndexed = 0;
+    const char *aPrefixes[] = {"im", "sm"};
+    for (const char *pPrefix : aPrefixes)
+    {
+        std::string sPrefix(pPrefix);
+        uint8_t chKey[18];
+        SecMsgStored smsgStored;
+
+        leveldb::WriteBatch batch;
+        size_t nBatch = 0;
+        leveldb::Iterator *it = pdb->NewIterator(leveldb::ReadOptions());
+        while (NextSmesg(it, sPrefix, chKey, smsgStored))
+        {
+            IndexSmesg(batch, chKey, smsgStored, false);
+            nIndexed++;
+
+            if (++nBatch >= 1000)
+            {
+                leveldb::Status s = pdb->Write(writeOptions, &batch);
+                if (!s.ok())
+                {
+                    delete it;
+                    return error("SecMsgDB index write failed: %s\n", s.ToString());
+                };
+                batch.Clear();
+                nBatch = 0;
+            };
+        };
+        delete it;
+
+        leveldb::Status s = pdb->Write(writeOptions, &batch);
+        if (!s.ok())
+            return error("SecMsgDB index write failed: %s\n", s.ToString());
+    };
+
+    CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+    ssValue << SMSG_DB_INDEX_VERSION;
+    leveldb::Status s = pdb->Put(writeOptions, std::string("xv"), ssValue.str());
+    if (!s.ok())
+        return error("SecMsgDB write failed: %s\n", s.ToString());
+
+    LogPrintf("Indexed %u messages.\n", nIndexed);
+    return true;
+};
@@ -8,13 +8,62 @@
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
 
+#include <map>
+#include <string>
+#include <vector>
+
 #include "sync.h"
 #include "serialize.h"
 #include "streams.h"
+#include "pubkey.h"
 
 class SecMsgStored;
-class CKeyID;
-class CPubKey;
+
+const uint32_t SMSG_DB_INDEX_VERSION = 1;
+
+/*
+    Inbox (im) and outbox (sm) messages are indexed by received time (x),
+    unread status (u) and addrTo (a), the index value holds SecMsgMeta so
+    listing doesn't read the stored messages.
+    index key: type, folder ('i' or 's'), [addrTo], timeReceived big endian, chKey[2..18]
+*/
+class SecMsgMeta
+{
+public:
+    SecMsgMeta() {};
+    SecMsgMeta(const SecMsgStored &smsgStored);
+
+    int64_t timeReceived = 0;
+    char    status = 0;
+    CKeyID  addrTo;
+
+    ADD_SERIALIZE_METHODS;
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream &s, Operation ser_action)
+    {
+        READWRITE(timeReceived);
+        READWRITE(status);
+        READWRITE(addrTo);
+    };
+};
+
+class SecMsgQuery
+{
+public:
+    bool    fUnreadOnly = false;
+    bool    fAddress = false;
+    CKeyID  address;            // addrTo, owned address for the inbox, recipient for the outbox
+    int64_t nSince = 0;         // timeReceived
+    size_t  nOffset = 0;
+    size_t  nCount = 0;         // 0 for all
+};
+
+class SecMsgListed
+{
+public:
+    uint8_t    chKey[18];
+    SecMsgMeta meta;
+};
 
 extern CCriticalSection cs_smsgDB;
 extern leveldb::DB *smsgDB;
@@ -51,7 +100,18 @@ public:
     bool ReadSmesg(uint8_t *chKey, SecMsgStored &smsgStored);
     bool WriteSmesg(uint8_t *chKey, SecMsgStored &smsgStored);
     bool ExistsSmesg(uint8_t *chKey);
-    bool EraseSmesg(uint8_t *chKey);
+    bool EraseSmesg(uint8_t *chKey, const SecMsgStored *pStored = nullptr); // pStored saves reading the message to unindex
+
+    // Keys of inbox (folder 'i') or outbox (folder 's') messages matching q, oldest received first
+    bool ListSmesg(char folder, const SecMsgQuery &q, std::vector<SecMsgListed> &vListed);
+    bool HaveIndex();
+    bool BuildIndex();
+
+    // Offsets scanned to in the wallet locked bucket files, by file name
+    bool ReadUnlockScan(std::map<std::string, int64_t> &mapProgress);
+    bool WriteUnlockScan(const std::map<std::string, int64_t> &mapProgress);
+
+    void IndexSmesg(leveldb::WriteBatch &batch, const uint8_t *chKey, const SecMsgStored &smsgStored, bool fErase);
 
     leveldb::DB *pdb;       // points to the global instance
     leveldb::WriteBatch *activeBatch;
@@ -0,0 +1,187 @@
+// Copyright (c) 2017 The Particl Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "smsg/recon.h"
+#include "smsg/smessage.h"
+
+#include "hash.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <string.h>
+
+static const uint64_t SMSG_RECON_SALT_INDEX = 0x736d73672d696478ULL;
+static const uint64_t SMSG_RECON_SALT_CHECK = 0x736d73672d636b73ULL;
+
+
+static void TokenKey(const SecMsgToken &token, uint8_t *key)
+{
+    memcpy(key, &token.timestamp, 8);
+    memcpy(key+8, token.sample, 8);
+};
+
+SecMsgSketch::SecMsgSketch(int64_t nBucket_, uint32_t nCells_)
+{
+    nBucket = nBucket_;
+    nCells = nCells_;
+    vCells.resize(nCells);
+};
+
+uint32_t SecMsgSketch::CellsFor(uint32_t nDiff)
+{
+    // ~1.5 cells per differing token, rounded up to fill the 3 subtables
+    uint32_t nPerTable = (nDiff + 1) / 2 + 2;
+    uint32_t n = 3 * nPerTable;
+
+    if (n < SMSG_RECON_MIN_CELLS)
+        return SMSG_RECON_MIN_CELLS;
+    if (n > SMSG_RECON_MAX_CELLS)
+        return SMSG_RECON_MAX_CELLS;
+    return n;
+};
+
+static uint32_t CapCells(uint32_t nCells, uint32_t nPeer)
+{
+    // 16 byte sketch header, 16 bytes per token in the peer's list
+    size_t nMaxBytes = (size_t)nPeer * 16 / 2;
+    if (16 + SecMsgSketch::SerializedSize(nCells) >= nMaxBytes)
+    {
+        size_t nMaxCells = nMaxBytes > 16 ? (nMaxBytes - 16 - 1) / SMSG_RECON_CELL_SIZE : 0;
+        nCells = nMaxCells - nMaxCells % 3;
+    };
+
+    return nCells < SMSG_RECON_MIN_CELLS ? 0 : nCells;
+};
+
+uint32_t SecMsgSketch::CellsForBucket(uint32_t nPeer, uint32_t nHave, bool fRetry)
+{
+    // Differing messages on both sides cancel out in the counts, the slack covers a few of them
+    uint32_t nDiff = nPeer > nHave ? nPeer - nHave : nHave - nPeer;
+    uint32_t nCells = CapCells(CellsFor(nDiff + SMSG_RECON_SLACK), nPeer);
+    if (!fRetry || nCells == 0)
+        return nCells;
+
+    uint32_t nRetryCells = CapCells(std::min(nCells * 2, SMSG_RECON_MAX_CELLS), nPeer);
+    return nRetryCells > nCells ? nRetryCells : 0;
+};
+
+uint32_t SecMsgSketch::Check(const uint8_t *key) const
+{
+    return (uint32_t) CSipHasher(nBucket, SMSG_RECON_SALT_CHECK).Write(key, 16).Finalize();
+};
+
+void SecMsgSketch::Toggle(const uint8_t *key, int32_t nDir)
+{
+    uint32_t nPerTable = nCells / 3;
+    if (nPerTable < 1)
+        return;
+
+    uint64_t h = CSipHasher(nBucket, SMSG_RECON_SALT_INDEX).Write(key, 16).Finalize();
+    uint32_t nCheck = Check(key);
+
+    for (uint32_t k = 0; k < 3; ++k)
+    {
+        Cell &c = vCells[k * nPerTable + ((h >> (21 * k)) & 0x1FFFFF) % nPerTable];
+        c.nCount += nDir;
+        for (int i = 0; i < 16; ++i)
+            c.key[i] ^= key[i];
+        c.nCheck ^= nCheck;
+    };
+};
+
+void SecMsgSketch::Insert(const SecMsgToken &token)
+{
+    uint8_t key[16];
+    TokenKey(token, key);
+    Toggle(key, 1);
+};
+
+void SecMsgSketch::Subtract(const SecMsgSketch &other)
+{
+    assert(nCells == other.nCells && nBucket == other.nBucket);
+
+    for (uint32_t i = 0; i < nCells; ++i)
+    {
+        Cell &c = vCells[i];
+        const Cell &o = other.vCells[i];
+        c.nCount -= o.nCount;
+        for (int k = 0; k < 16; ++k)
+            c.key[k] ^= o.key[k];
+        c.nCheck ^= o.nCheck;
+    };
+};
+
+bool SecMsgSketch::Decode(std::vector<SecMsgToken> &vHave, std::vector<SecMsgToken> &vMissing) const
+{
+    SecMsgSketch work(*this);
+
+    // A sketch from a misbehaving peer could keep producing pure cells
+    size_t nMaxPeel = nCells;
+    size_t nPeeled = 0;
+
+    bool fProgress = true;
+    while (fProgress)
+    {
+        fProgress = false;
+        for (uint32_t i = 0; i < nCells; ++i)
+        {
+            const Cell &c = work.vCells[i];
+            if ((c.nCount != 1 && c.nCount != -1)
+                || work.Check(c.key) != c.nCheck)
+                continue;
+
+            if (++nPeeled > nMaxPeel)
+                return false;
+
+            SecMsgToken token;
+            memcpy(&token.timestamp, c.key, 8);
+            memcpy(token.sample, c.key+8, 8);
+            token.offset = 0;
+
+            int32_t nDir = c.nCount;
+            if (nDir == 1)
+                vHave.push_back(token);
+            else
+                vMissing.push_back(token);
+
+            uint8_t key[16];
+            memcpy(key, c.key, 16); // c is modified by Toggle
+            work.Toggle(key, -nDir);
+            fProgress = true;
+        };
+    };
+
+    for (const auto &c : work.vCells)
+    {
+        if (c.nCount != 0 || c.nCheck != 0)
+            return false;
+        for (int k = 0; k < 16; ++k)
+            if (c.key[k] != 0)
+                return false;
+    };
+
+    return true;
+};
+
+void SecMsgSketch::Write(uint8_t *p) const
+{
+    for (const auto &c : vCells)
+    {
+        memcpy(p, &c.nCount, 4);
+        memcpy(p+4, c.key, 16);
+        memcpy(p+20, &c.nCheck, 4);
+        p += SMSG_RECON_CELL_SIZE;
+    };
+};
+
+void SecMsgSketch::Read(const uint8_t *p)
+{
+    for (auto &c : vCells)
+    {
+        memcpy(&c.nCount, p, 4);
+        memcpy(c.key, p+4, 16);
+        memcpy(&c.nCheck, p+20, 4);
+        p += SMSG_RECON_CELL_SIZE;
+    };
+};
@@ -0,0 +1,83 @@
+// Copyright (c) 2017 The Particl Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef PARTICL_SMSG_RECON_H
+#define PARTICL_SMSG_RECON_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+class SecMsgToken;
+
+const size_t   SMSG_RECON_CELL_SIZE = 4 + 16 + 4;   // count, key (timestamp + sample), checksum
+const uint32_t SMSG_RECON_MIN_CELLS = 12;
+const uint32_t SMSG_RECON_MAX_CELLS = 3 * 512;
+const uint32_t SMSG_RECON_SLACK     = 4;            // added to the estimated difference when sizing a sketch
+const uint32_t SMSG_RECON_RETRY     = 0x80000000;   // set in the cell count of a sketch sent again after the peer failed to decode it
+const size_t   SMSG_RECON_MAX_MSG   = 1024 * 1024;  // remaining buckets are requested with smsgShow
+
+/*
+    Invertible bloom lookup table over the tokens of one bucket.
+
+    A node sends the sketch of its bucket, the peer subtracts it from the sketch
+    of its own copy of the bucket and decodes the tokens that differ, bandwidth
+    depends on the difference instead of the number of messages in the bucket.
+    Cells are split into 3 subtables, a token is added to one cell of each.
+    Hashes are keyed on the bucket time, both sides must use the same nCells.
+*/
+class SecMsgSketch
+{
+public:
+    SecMsgSketch(int64_t nBucket_, uint32_t nCells_);
+
+    // Cells needed to decode nDiff differing tokens with high probability
+    static uint32_t CellsFor(uint32_t nDiff);
+
+    /*
+        Cells for a sketch of nHave tokens sent to a peer with nPeer tokens in the bucket.
+        Sized for the difference in counts plus SMSG_RECON_SLACK, fRetry doubles the sketch
+        for a second attempt after the peer failed to decode the first.
+        Capped to half the size of the peer's token list, returns 0 if no sketch is worth sending.
+    */
+    static uint32_t CellsForBucket(uint32_t nPeer, uint32_t nHave, bool fRetry = false);
+
+    static size_t SerializedSize(uint32_t nCells) { return nCells * SMSG_RECON_CELL_SIZE; };
+
+    void Insert(const SecMsgToken &token);
+
+    // this -= other
+    void Subtract(const SecMsgSketch &other);
+
+    /*
+        Peel the difference.
+        vHave:      tokens inserted here and not in the subtracted sketch
+        vMissing:   tokens in the subtracted sketch and not here
+        Returns false if the difference is too large for the sketch.
+        Only timestamp and sample are set in the returned tokens.
+    */
+    bool Decode(std::vector<SecMsgToken> &vHave, std::vector<SecMsgToken> &vMissing) const;
+
+    void Write(uint8_t *p) const;
+    void Read(const uint8_t *p);
+
+    uint32_t GetCells() const { return nCells; };
+
+private:
+    struct Cell
+    {
+        int32_t  nCount = 0;
+        uint8_t  key[16] = {0};
+        uint32_t nCheck = 0;
+    };
+
+    void Toggle(const uint8_t *key, int32_t nDir);
+    uint32_t Check(const uint8_t *key) const;
+
+    int64_t nBucket;
+    uint32_t nCells;
+    std::vector<Cell> vCells;
+};
+
+#endif // PARTICL_SMSG_RECON_H
@@ -10,7 +10,8 @@ Notes:
     Wallet Locked
         A copy of each incoming message is stored in bucket files ending in _wl.dat
         wl (wallet locked) bucket files are deleted if they expire, like normal buckets
-        When the wallet is unlocked all the messages in wl files are scanned.
+        When the wallet is unlocked all the messages in wl files are scanned on the smsg-unlock thread
+        The offset scanned to in each wl file is kept in smsgdb, an interrupted scan resumes from there
 
     Address Whitelist
         Owned Addresses are stored in smsgAddresses vector
@@ -26,6 +27,9 @@ Notes:
 
 #include <stdint.h>
 #include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
 #include <map>
 #include <stdexcept>
 #include <errno.h>
@@ -49,6 +53,7 @@ Notes:
 #include "sync.h"
 #include "random.h"
 #include "chain.h"
+#include "checkqueue.h"
 #include "netmessagemaker.h"
 #include "fs.h"
 
@@ -57,6 +62,7 @@ Notes:
 #endif
 
 #include "utilstrencodings.h"
+#include "utiltime.h"
 #include "clientversion.h"
 
 
@@ -67,6 +73,8 @@ Notes:
 
 #include "smsg/crypter.h"
 #include "smsg/db.h"
+#include "smsg/store.h"
+#include "smsg/recon.h"
 
 
 boost::thread_group threadGroupSmsg;
@@ -74,12 +82,30 @@ boost::thread_group threadGroupSmsg;
 boost::signals2::signal<void (SecMsgStored& inboxHdr)>  NotifySecMsgInboxChanged;
 boost::signals2::signal<void (SecMsgStored& outboxHdr)> NotifySecMsgOutboxChanged;
 boost::signals2::signal<void ()> NotifySecMsgWalletUnlocked;
+boost::signals2::signal<void (uint32_t nFilesDone, uint32_t nFiles)> NotifySecMsgUnlockScanProgress;
 
 bool fSecMsgEnabled = false;
+int nSmsgPowThreads = SMSG_DEFAULT_POW_THREADS;
+int nSmsgScanThreads = 1;
+bool fSmsgRecon = true;
 
-std::map<int64_t, SecMsgBucket> smsgBuckets;
+SecMsgBucketSet                 smsgBuckets;
 std::vector<SecMsgAddress>      smsgAddresses;
 SecMsgOptions                   smsgOptions;
+SecMsgFileStore                 smsgStore;      // open bucket files
+SecMsgReconStats                smsgReconStats;
+SecMsgInvStats                  smsgInvStats;
+std::atomic<uint64_t>           nSmsgInvVersion(1);
+SecMsgScanStats                 smsgScanStats;  // guarded by cs_smsg
+SecMsgUnlockScan                smsgUnlockScan; // guarded by cs_smsg
+
+static boost::mutex mtxUnlockScan;
+static boost::condition_variable condUnlockScan;
+static bool fUnlockScanRequested = false;       // guarded by mtxUnlockScan
+
+static CCriticalSection cs_smsgInv;
+static std::shared_ptr<const SecMsgInventory> smsgInv;  // guarded by cs_smsgInv
+static bool fInvLegacy = false;                         // guarded by cs_smsgInv, a legacy peer has asked for entries
 
 
 CCriticalSection cs_smsg;
@@ -96,8 +122,42 @@ CWallet *pwalletSmsg = nullptr;
 typedef std::vector<unsigned char> valtype; // script/ismine.cpp
 
 
+static uint64_t SecureMsgTokenDigest(const SecMsgToken &token)
+{
+    uint64_t sample;
+    memcpy(&sample, token.sample, 8);
+    return CSipHasher(0x736d73672d646967ULL, 0x6573742d746f6b6eULL).Write((uint64_t)token.timestamp).Write(sample).Finalize();
+};
+
+bool SecMsgBucket::InsertToken(const SecMsgToken &token)
+{
+    if (!setTokens.insert(token).second)
+        return false;
+
+    nDigest += SecureMsgTokenDigest(token);
+    fHashStale = true;
+    return true;
+};
+
 void SecMsgBucket::hashBucket()
 {
+    if (nDigest != nDigestHashed)
+    {
+        LogPrint(BCLog::SMSG, "Bucket digest updated from %016x to %016x.\n", nDigestHashed, nDigest);
+
+        nDigestHashed = nDigest;
+        timeChanged = GetTime();
+        nSmsgInvVersion++;
+    };
+
+    LogPrint(BCLog::SMSG, "Bucket has %u messages, digest %016x\n", setTokens.size(), nDigest);
+};
+
+uint32_t SecMsgBucket::GetLegacyHash()
+{
+    if (!fHashStale)
+        return hash;
+
     void *state = XXH32_init(1);
 
     std::set<SecMsgToken>::iterator it;
@@ -106,17 +166,31 @@ void SecMsgBucket::hashBucket()
         XXH32_update(state, it->sample, 8);
     };
 
-    uint32_t hash_new = XXH32_digest(state);
+    hash = XXH32_digest(state);
+    fHashStale = false;
 
-    if (hash != hash_new)
-    {
-        LogPrint(BCLog::SMSG, "Bucket hash updated from %u to %u.\n", hash, hash_new);
+    return hash;
+};
 
-        hash = hash_new;
-        timeChanged = GetTime();
+size_t SecMsgBucketSet::Size()
+{
+    size_t n = 0;
+    for (auto &shard : vShards)
+    {
+        LOCK(shard.cs);
+        n += shard.buckets.size();
     };
+    return n;
+};
 
-    LogPrint(BCLog::SMSG, "Hashed %u messages, hash %u\n", setTokens.size(), hash_new);
+void SecMsgBucketSet::Clear()
+{
+    for (auto &shard : vShards)
+    {
+        LOCK(shard.cs);
+        shard.buckets.clear();
+    };
+    nSmsgInvVersion++;
 };
 
 
@@ -138,9 +212,10 @@ void ThreadSecureMsg()
         vTimedOutLocks.resize(0);
 
         int64_t cutoffTime = now - SMSG_RETENTION;
+        for (auto &shard : smsgBuckets.vShards)
         {
-            LOCK(cs_smsg);
-            for (std::map<int64_t, SecMsgBucket>::iterator it(smsgBuckets.begin()); it != smsgBuckets.end(); )
+            LOCK(shard.cs);
+            for (std::map<int64_t, SecMsgBucket>::iterator it(shard.buckets.begin()); it != shard.buckets.end(); )
             {
                 //if (fDebugSmsg)
                 //    LogPrintf("Checking bucket %d, size %u \n", it->first, it->second.setTokens.size());
@@ -149,33 +224,18 @@ void ThreadSecureMsg()
                 {
                     LogPrint(BCLog::SMSG, "Removing bucket %d \n", it->first);
 
-                    std::string fileName = std::to_string(it->first);
-
-                    fs::path fullPath = GetDataDir() / "smsgstore" / (fileName + "_01.dat");
-                    if (fs::exists(fullPath))
-                    {
-                        try { fs::remove(fullPath);
-                        } catch (const fs::filesystem_error &ex)
-                        {
-                            LogPrintf("Error removing bucket file %s.\n", ex.what());
-                        };
-                    } else
-                    {
-                        LogPrintf("Path %s does not exist \n", fullPath.string());
-                    };
+                    smsgStore.Remove(it->first);
 
-                    // Look for a wl file, it stores incoming messages when wallet is locked
-                    fullPath = GetDataDir() / "smsgstore" / (fileName + "_01_wl.dat");
-                    if (fs::exists(fullPath))
+                    // Remove the wl file if any, it stores incoming messages when wallet is locked
+                    fs::path fullPath = GetDataDir() / "smsgstore" / (std::to_string(it->first) + "_01_wl.dat");
+                    try { fs::remove(fullPath);
+                    } catch (const fs::filesystem_error &ex)
                     {
-                        try { fs::remove(fullPath);
-                        } catch (const fs::filesystem_error &ex)
-                        {
-                            LogPrintf("Error removing wallet locked file %s.\n", ex.what());
-                        };
+                        LogPrintf("Error removing wallet locked file %s.\n", ex.what());
                     };
 
-                    smsgBuckets.erase(it++);
+                    shard.buckets.erase(it++);
+                    nSmsgInvVersion++;
                 } else
                 {
                     if (it->second.nLockCount > 0) // Tick down nLockCount, so will eventually expire if peer never sends data
@@ -192,7 +252,14 @@ void ThreadSecureMsg()
                     ++it;
                 };
             };
-        } // cs_smsg
+        } // shard.cs
+
+        // Commit messages appended since the last tick
+        if (!smsgStore.FlushAll(true))
+            LogPrintf("SecureMsgThread: Failed to flush message store.\n");
+
+        // Drop unreferenced messages from the bucket files loaded on startup
+        SecureMsgCompactBuckets();
 
         for (std::vector<std::pair<int64_t, NodeId> >::iterator it(vTimedOutLocks.begin()); it != vTimedOutLocks.end(); it++)
         {
@@ -293,14 +360,11 @@ void ThreadSecureMsgPow()
             };
 
             // Add to message store
+            if (SecureMsgStore(pHeader, pPayload, psmsg->nPayload, true) != 0)
             {
-                LOCK(cs_smsg);
-                if (SecureMsgStore(pHeader, pPayload, psmsg->nPayload, true) != 0)
-                {
-                    LogPrintf("SecMsgPow: Could not place message in buckets, message removed.\n");
-                    continue;
-                };
-            }
+                LogPrintf("SecMsgPow: Could not place message in buckets, message removed.\n");
+                continue;
+            };
 
             // Test if message was sent to self
             if (SecureMsgScanMessage(pHeader, pPayload, psmsg->nPayload, true) != 0)
@@ -316,6 +380,32 @@ void ThreadSecureMsgPow()
     };
 };
 
+#ifdef ENABLE_WALLET
+static int SecureMsgUnlockScan();
+
+void ThreadSecureMsgUnlockScan()
+{
+    // Scans the wallet locked files when requested by SecureMsgWalletUnlocked
+
+    while (fSecMsgEnabled)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mtxUnlockScan);
+            while (!fUnlockScanRequested)
+                condUnlockScan.wait(lock); // interrupted on shutdown
+            fUnlockScanRequested = false;
+        }
+
+        // Leave the wl files for the next unlock if the wallet was locked again
+        if (SecureMsgUnlockScan() != 0)
+            continue;
+
+        // Notify gui
+        NotifySecMsgWalletUnlocked();
+    };
+};
+#endif
+
 std::string SecureMsgGetHelpString(bool showDebug)
 {
     std::string strUsage;
@@ -326,6 +416,11 @@ std::string SecureMsgGetHelpString(bool showDebug)
     strUsage += HelpMessageOpt("-smsgscanchain", _("Scan the block chain for public key addresses on startup. (default: false)"));
     strUsage += HelpMessageOpt("-smsgscanincoming", _("Scan incoming blocks for public key addresses. (default: false)"));
     strUsage += HelpMessageOpt("-smsgnotify=<cmd>", _("Execute command when a message is received. (%s in cmd is replaced by receiving address)"));
+    strUsage += HelpMessageOpt("-smsgpowthreads=<n>", strprintf(_("Set the number of threads used for the proof of work of outgoing messages (%d to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
+        -GetNumCores(), SMSG_MAX_POW_THREADS, SMSG_DEFAULT_POW_THREADS));
+    strUsage += HelpMessageOpt("-smsgscanthreads=<n>", strprintf(_("Set the number of threads used to trial decrypt messages when rescanning (%d to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
+        -GetNumCores(), SMSG_MAX_SCAN_THREADS, SMSG_DEFAULT_SCAN_THREADS));
+    strUsage += HelpMessageOpt("-smsgrecon", _("Request mismatched buckets from capable peers as sketches of the difference. (default: true)"));
 
     return strUsage;
 };
@@ -360,16 +455,26 @@ int SecureMsgBuildBucketSet()
             continue;
 
         std::string fileType = (*itd).path().extension().string();
+        std::string fileName = (*itd).path().filename().string();
 
-        if (fileType.compare(".dat") != 0)
+        if (fileType.compare(".tmp") == 0)
+        {
+            // Left by an interrupted compaction or index write
+            LogPrintf("Removing incomplete file %s.\n", fileName);
+            try {
+                fs::remove((*itd).path());
+            } catch (const fs::filesystem_error &ex) {
+                LogPrintf("Error removing file %s, %s.\n", fileName, ex.what());
+            };
             continue;
+        };
 
-        std::string fileName = (*itd).path().filename().string();
+        if (fileType.compare(".dat") != 0
+            && fileType.compare(".idx") != 0)
+            continue;
 
         LogPrint(BCLog::SMSG, "Processing file: %s.\n", fileName);
 
-        nFiles++;
-
         // TODO files must be split if > 2GB
         // time_noFile.dat
         size_t sep = fileName.find_first_of("_");
@@ -395,79 +500,116 @@ int SecureMsgBuildBucketSet()
             continue;
         };
 
+        if (fileType.compare(".idx") == 0) // read with the bucket file
+            continue;
+
+        nFiles++;
+
         if (boost::algorithm::ends_with(fileName, "_wl.dat"))
         {
             LogPrint(BCLog::SMSG, "Skipping wallet locked file: %s.\n", fileName);
             continue;
         };
 
-        size_t nTokenSetSize = 0;
-        SecureMessage smsg;
+        // Tokens come from the index, the bucket file is only read past the end of the index
+        std::vector<SecMsgIndexEntry> vEntries;
+        int64_t nFileSize;
+        if (!smsgStore.LoadIndex(fileTime, vEntries, nFileSize))
         {
-            LOCK(cs_smsg);
+            LogPrintf("Error loading bucket file %s.\n", fileName);
+            continue;
+        };
 
-            std::set<SecMsgToken>& tokenSet = smsgBuckets[fileTime].setTokens;
+        size_t nTokenSetSize = 0;
+        {
+            SecMsgBucketShard &shard = smsgBuckets.GetShard(fileTime);
+            LOCK(shard.cs);
 
-            FILE *fp;
-            if (!(fp = fopen((*itd).path().string().c_str(), "rb")))
-            {
-                LogPrintf("Error opening file: %s\n", strerror(errno));
-                continue;
-            };
+            SecMsgBucket &bucket = shard.buckets[fileTime];
 
-            for (;;)
+            int64_t nLiveBytes = 0;
+            for (const auto &entry : vEntries)
             {
-                long int ofs = ftell(fp);
-                SecMsgToken token;
-                token.offset = ofs;
-                errno = 0;
-                if (fread(&smsg.hash[0], sizeof(uint8_t), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
-                {
-                    if (errno != 0)
-                    {
-                        LogPrintf("fread header failed: %s\n", strerror(errno));
-                    } else
-                    {
-                        //LogPrintf("End of file.\n");
-                    };
-                    break;
-                };
-                token.timestamp = smsg.timestamp;
-
-                if (smsg.nPayload < 8)
+                if (entry.nPayload < 8)
                     continue;
 
-                if (fread(token.sample, sizeof(uint8_t), 8, fp) != 8)
-                {
-                    LogPrintf("fread data failed: %s\n", strerror(errno));
-                    break;
-                };
-
-                if (fseek(fp, smsg.nPayload-8, SEEK_CUR) != 0)
-                {
-                    LogPrintf("fseek, strerror: %s.\n", strerror(errno));
-                    break;
-                };
+                SecMsgToken token;
+                token.timestamp = entry.timestamp;
+                memcpy(token.sample, entry.sample, 8);
+                token.offset = entry.nOffset;
 
-                tokenSet.insert(token);
+                if (bucket.InsertToken(token))
+                    nLiveBytes += SMSG_HDR_LEN + entry.nPayload;
             };
 
-            fclose(fp);
+            bucket.hashBucket();
 
-            smsgBuckets[fileTime].hashBucket();
+            // Duplicate, invalid and truncated messages are dropped by SecureMsgCompactBuckets
+            bucket.nDeadBytes = nFileSize - nLiveBytes;
+            if (bucket.nDeadBytes > 0)
+                LogPrint(BCLog::SMSG, "Bucket %d has %d bytes to compact.\n", fileTime, bucket.nDeadBytes);
 
-            nTokenSetSize = tokenSet.size();
-        } // cs_smsg
+            nTokenSetSize = bucket.setTokens.size();
+        } // shard.cs
 
         nMessages += nTokenSetSize;
         LogPrint(BCLog::SMSG, "Bucket %d contains %u messages.\n", fileTime, nTokenSetSize);
     };
 
-    LogPrintf("Processed %u files, loaded %u buckets containing %u messages.\n", nFiles, smsgBuckets.size(), nMessages);
+    LogPrintf("Processed %u files, loaded %u buckets containing %u messages.\n", nFiles, smsgBuckets.Size(), nMessages);
 
     return 0;
 };
 
+int SecureMsgCompactBuckets()
+{
+    /*
+        Rewrite the bucket files holding messages no token points to, one shard locked at a time.
+        Token offsets change, the tokens and bucket digest don't.
+
+        Returns the number of buckets compacted
+    */
+
+    int nCompacted = 0;
+    for (auto &shard : smsgBuckets.vShards)
+    {
+        LOCK(shard.cs);
+        for (auto &item : shard.buckets)
+        {
+            SecMsgBucket &bkt = item.second;
+            if (bkt.nDeadBytes < 1)
+                continue;
+
+            std::vector<int64_t> vOffsets;
+            vOffsets.reserve(bkt.setTokens.size());
+            for (const auto &token : bkt.setTokens)
+                vOffsets.push_back(token.offset);
+
+            if (!smsgStore.Compact(item.first, vOffsets))
+            {
+                LogPrintf("Error compacting bucket %d.\n", item.first);
+                bkt.nDeadBytes = 0; // try again on the next startup
+                continue;
+            };
+
+            std::set<SecMsgToken> setTokens;
+            size_t i = 0;
+            for (auto token : bkt.setTokens)
+            {
+                token.offset = vOffsets[i++];
+                setTokens.insert(setTokens.end(), token);
+            };
+            bkt.setTokens.swap(setTokens);
+
+            LogPrint(BCLog::SMSG, "Compacted bucket %d, dropped %d bytes.\n", item.first, bkt.nDeadBytes);
+            bkt.nDeadBytes = 0;
+            nCompacted++;
+        };
+    } // shard.cs
+
+    return nCompacted;
+};
+
 /*
 SecureMsgAddWalletAddresses
     Enumerates the AddressBook, filters out anon outputs and checks the "real addresses"
@@ -688,6 +830,18 @@ bool SecureMsgStart(CWallet *pwallet, bool fDontStart, bool fScanChain)
     fSecMsgEnabled = true;
     g_connman->SetLocalServices(ServiceFlags(g_connman->GetLocalServices() | NODE_SMSG));
 
+    nSmsgPowThreads = gArgs.GetArg("-smsgpowthreads", SMSG_DEFAULT_POW_THREADS);
+    if (nSmsgPowThreads <= 0)
+        nSmsgPowThreads += GetNumCores();
+    nSmsgPowThreads = std::max(1, std::min(nSmsgPowThreads, SMSG_MAX_POW_THREADS));
+    LogPrint(BCLog::SMSG, "Using %d proof of work threads.\n", nSmsgPowThreads);
+    fSmsgRecon = gArgs.GetBoolArg("-smsgrecon", true);
+
+    nSmsgScanThreads = gArgs.GetArg("-smsgscanthreads", SMSG_DEFAULT_SCAN_THREADS);
+    if (nSmsgScanThreads <= 0)
+        nSmsgScanThreads += GetNumCores();
+    nSmsgScanThreads = std::max(1, std::min(nSmsgScanThreads, SMSG_MAX_SCAN_THREADS));
+
     if (SecureMsgReadIni() != 0)
         LogPrintf("Failed to read smsg.ini\n");
 
@@ -722,6 +876,20 @@ bool SecureMsgStart(CWallet *pwallet, bool fDontStart, bool fScanChain)
         SecureMsgScanBlockChain();
     };
 
+    {
+        LOCK(cs_smsg);
+        smsgStore.SetPath(GetDataDir() / "smsgstore");
+    }
+
+    {
+        LOCK(cs_smsgDB);
+        SecMsgDB db;
+        if (db.Open("cr+")
+            && !db.HaveIndex()
+            && !db.BuildIndex())
+            LogPrintf("%s: Failed to index the inbox and outbox.\n", __func__);
+    } // cs_smsgDB
+
     if (SecureMsgBuildBucketSet() != 0)
     {
         fSecMsgEnabled = false;
@@ -730,10 +898,15 @@ bool SecureMsgStart(CWallet *pwallet, bool fDontStart, bool fScanChain)
 
     threadGroupSmsg.create_thread(boost::bind(&TraceThread<void (*)()>, "smsg", &ThreadSecureMsg));
     threadGroupSmsg.create_thread(boost::bind(&TraceThread<void (*)()>, "smsg-pow", &ThreadSecureMsgPow));
+#ifdef ENABLE_WALLET
+    threadGroupSmsg.create_thread(boost::bind(&TraceThread<void (*)()>, "smsg-unlock", &ThreadSecureMsgUnlockScan));
+#endif
 
     return true;
 };
 
+static void SecureMsgStopScanThreads();
+
 bool SecureMsgShutdown()
 {
     if (!fSecMsgEnabled)
@@ -749,6 +922,12 @@ bool SecureMsgShutdown()
 
     threadGroupSmsg.interrupt_all();
     threadGroupSmsg.join_all();
+    SecureMsgStopScanThreads();
+
+    {
+        LOCK(cs_smsg);
+        smsgStore.CloseAll();
+    }
 
     if (smsgDB)
     {
@@ -778,7 +957,7 @@ bool SecureMsgEnable(CWallet *pwallet)
         LOCK(cs_smsg);
 
         smsgAddresses.clear(); // should be empty already
-        smsgBuckets.clear(); // should be empty already
+        smsgBuckets.Clear(); // should be empty already
         
         if (!SecureMsgStart(pwallet, false, false))
             return error("%s: SecureMsgStart failed.\n", __func__);
@@ -792,9 +971,9 @@ bool SecureMsgEnable(CWallet *pwallet)
             if (!(pnode->GetLocalServices() & NODE_SMSG))
                 continue;
             g_connman->PushMessage(pnode,
-                CNetMsgMaker(INIT_PROTO_VERSION).Make("smsgPing"));
+                CNetMsgMaker(INIT_PROTO_VERSION).Make("smsgPing", SMSG_PROTOCOL_VERSION));
             g_connman->PushMessage(pnode,
-                CNetMsgMaker(INIT_PROTO_VERSION).Make("smsgPong")); // Send pong as have missed initial ping sent by peer when it connected
+                CNetMsgMaker(INIT_PROTO_VERSION).Make("smsgPong", SMSG_PROTOCOL_VERSION)); // Send pong as have missed initial ping sent by peer when it connected
         };
     } // g_connman->cs_vNodes
 
@@ -811,18 +990,14 @@ bool SecureMsgDisable()
         return false;
     };
 
+    // Joins the smsg threads, which take cs_smsg, so must be called without it
+    if (!SecureMsgShutdown())
+        return error("%s: SecureMsgShutdown failed.\n", __func__);
+
     {
         LOCK(cs_smsg);
 
-        if (!SecureMsgShutdown())
-            return error("%s: SecureMsgShutdown failed.\n", __func__);
-
-        // Clear smsgBuckets
-        std::map<int64_t, SecMsgBucket>::iterator it;
-        it = smsgBuckets.begin();
-        for (it = smsgBuckets.begin(); it != smsgBuckets.end(); ++it)
-            it->second.setTokens.clear();
-        smsgBuckets.clear();
+        smsgBuckets.Clear();
         smsgAddresses.clear();
     } // cs_smsg
 
@@ -845,6 +1020,59 @@ bool SecureMsgDisable()
 };
 
 
+static void SecureMsgReadPeerVersion(CNode *pfrom, CDataStream &vRecv)
+{
+    // Older peers send smsgPing and smsgPong without data
+    uint32_t nVersion = 0;
+    if (vRecv.size() >= 4)
+        vRecv >> nVersion;
+
+    LOCK(pfrom->smsgData.cs_smsg_net);
+    pfrom->smsgData.nVersion = nVersion;
+    LogPrint(BCLog::SMSG, "Peer %d smsg protocol version %u.\n", pfrom->GetId(), nVersion);
+};
+
+static bool SecureMsgAppendHave(int64_t time, const std::set<SecMsgToken> &tokenSet, std::vector<uint8_t> &vchDataOut)
+{
+    // smsgHave: bucket time followed by timestamp and sample of each token
+    try { vchDataOut.resize(8 + 16 * tokenSet.size());
+    } catch (std::exception &e) {
+        LogPrintf("vchDataOut.resize %u threw: %s.\n", 8 + 16 * tokenSet.size(), e.what());
+        return false;
+    };
+    memcpy(&vchDataOut[0], &time, 8);
+
+    uint8_t *p = &vchDataOut[8];
+    for (const auto &token : tokenSet)
+    {
+        memcpy(p, &token.timestamp, 8);
+        memcpy(p+8, &token.sample, 8);
+        p += 16;
+    };
+    return true;
+};
+
+static void SecureMsgAppendSketch(int64_t time, const std::set<SecMsgToken> &tokenSet, uint32_t nCells, bool fRetry, std::vector<uint8_t> &vchRecon)
+{
+    // smsgRecon entry: bucket time, token count, cell count and the sketch
+    SecMsgSketch sketch(time, nCells);
+    for (const auto &token : tokenSet)
+        sketch.Insert(token);
+
+    uint32_t nHave = tokenSet.size();
+    uint32_t nCellsFlagged = nCells | (fRetry ? SMSG_RECON_RETRY : 0);
+    size_t nSketchBytes = 16 + SecMsgSketch::SerializedSize(nCells);
+    size_t sz = vchRecon.size();
+    vchRecon.resize(sz + nSketchBytes);
+    memcpy(&vchRecon[sz], &time, 8);
+    memcpy(&vchRecon[sz+8], &nHave, 4);
+    memcpy(&vchRecon[sz+12], &nCellsFlagged, 4);
+    sketch.Write(&vchRecon[sz+16]);
+
+    smsgReconStats.nSketchesSent++;
+    smsgReconStats.nSketchBytes += nSketchBytes;
+};
+
 int SecureMsgReceiveData(CNode *pfrom, const std::string &strCommand, CDataStream &vRecv)
 {
     /*
@@ -875,6 +1103,14 @@ int SecureMsgReceiveData(CNode *pfrom, const std::string &strCommand, CDataStrea
         + smsgShow =
             (1) received a list of requested bucket hashes which the other party does not have.
             (2) respond with smsgHave - contains all the message hashes within the requested buckets. 
+        + smsgRecon =
+            (1) received sketches of the other node's copy of buckets, sent instead of smsgShow to peers of SMSG_MIN_RECON_VERSION.
+            (2) respond with smsgHave - contains only the message hashes the other node is missing,
+                or all the message hashes within the bucket if the sketch could not be decoded.
+                Peers of SMSG_MIN_RECON_RETRY_VERSION are first sent smsgRetry for a sketch that could not be decoded.
+        + smsgRetry =
+            (1) received a list of buckets the other node could not decode a sketch of.
+            (2) respond with smsgRecon - a sketch of twice the size, or smsgShow if that's not worth sending.
         + smsgHave =
             (1) A list of all the message hashes which a node has in response to smsgShow.
         + smsgWant =
@@ -909,6 +1145,7 @@ int SecureMsgReceiveData(CNode *pfrom, const std::string &strCommand, CDataStrea
 
         int64_t now = GetTime();
 
+        bool fRecon;
         {
             LOCK(pfrom->smsgData.cs_smsg_net);
 
@@ -917,13 +1154,17 @@ int SecureMsgReceiveData(CNode *pfrom, const std::string &strCommand, CDataStrea
                 LogPrint(BCLog::SMSG, "Node is ignoring peer %d until %d.\n", pfrom->GetId(), pfrom->smsgData.ignoreUntil);
                 return 1;
             };
+            fRecon = fSmsgRecon && pfrom->smsgData.nVersion >= SMSG_MIN_RECON_VERSION;
         }
 
-        uint32_t nBuckets       = smsgBuckets.size();
         uint32_t nLocked        = 0;    // no. of locked buckets on this node
         uint32_t nInvBuckets;           // no. of bucket headers sent by peer in smsgInv
         memcpy(&nInvBuckets, &vchData[0], 4);
-        LogPrint(BCLog::SMSG, "Remote node sent %d bucket headers, this has %d.\n", nInvBuckets, nBuckets);
+        bool fDigest = nInvBuckets & SMSG_INV_DIGEST; // entries hold 64 bit digests instead of 32 bit hashes
+        nInvBuckets &= ~SMSG_INV_DIGEST;
+        size_t nEntryLen = fDigest ? 20 : 16;
+        if (LogAcceptCategory(BCLog::SMSG))
+            LogPrintf("Remote node sent %d bucket headers, this has %d.\n", nInvBuckets, smsgBuckets.Size());
 
 
         // Check no of buckets:
@@ -934,7 +1175,7 @@ int SecureMsgReceiveData(CNode *pfrom, const std::string &strCommand, CDataStrea
             return 1;
         };
 
-        if (vchData.size() < 4 + nInvBuckets*16)
+        if (vchData.size() < 4 + nInvBuckets*nEntryLen)
         {
             LogPrintf("Remote node did not send enough data.\n");
             Misbehaving(pfrom->GetId(), 1);
@@ -946,16 +1187,23 @@ int SecureMsgReceiveData(CNode *pfrom, const std::string &strCommand, CDataStrea
         vchDataOut.resize(4);
         uint32_t nShowBuckets = 0;
 
+        std::vector<uint8_t> vchRecon(4);
+        uint32_t nReconBuckets = 0;
+
         uint8_t *p = &vchData[4];
         for (uint32_t i = 0; i < nInvBuckets; ++i)
         {
             int64_t time;
-            uint32_t ncontent, hash;
+            uint32_t ncontent, hash = 0;
+            uint64_t digest = 0;
             memcpy(&time, p, 8);
             memcpy(&ncontent, p+8, 4);
-            memcpy(&hash, p+12, 4);
+            if (fDigest)
+                memcpy(&digest, p+12, 8);
+            else
+                memcpy(&hash, p+12, 4);
 
-            p += 16;
+            p += nEntryLen;
 
             // Check time valid:
             if (time < now - SMSG_RETENTION)
@@ -979,26 +1227,54 @@ int SecureMsgReceiveData(CNode *pfrom, const std::string &strCommand, CDataStrea
                 continue;
             };
 
-            if (LogAcceptCategory(BCLog::SMSG))
-            {
-                LogPrintf("peer bucket %d %u %u.\n", time, ncontent, hash);
-                LogPrintf("this bucket %d %u %u.\n", time, smsgBuckets[time].setTokens.size(), smsgBuckets[time].hash);
-            };
             {
-                LOCK(cs_smsg);
-                if (smsgBuckets[time].nLockCount > 0)
+                SecMsgBucketShard &shard = smsgBuckets.GetShard(time);
+                LOCK(shard.cs);
+                SecMsgBucket &bucket = shard.buckets[time];
+
+                if (LogAcceptCategory(BCLog::SMSG))
+                {
+                    if (fDigest)
+                    {
+                        LogPrintf("peer bucket %d %u %016x.\n", time, ncontent, digest);
+                        LogPrintf("this bucket %d %u %016x.\n", time, bucket.setTokens.size(), bucket.nDigest);
+                    } else
+                    {
+                        LogPrintf("peer bucket %d %u %u.\n", time, ncontent, hash);
+                        LogPrintf("this bucket %d %u %u.\n", time, bucket.setTokens.size(), bucket.GetLegacyHash());
+                    };
+                };
+
+                if (bucket.nLockCount > 0)
                 {
-                    LogPrint(BCLog::SMSG, "Bucket is locked %u, waiting for peer %u to send data.\n", smsgBuckets[time].nLockCount, smsgBuckets[time].nLockPeerId);
+                    LogPrint(BCLog::SMSG, "Bucket is locked %u, waiting for peer %u to send data.\n", bucket.nLockCount, bucket.nLockPeerId);
                     nLocked++;
                     continue;
                 };
 
                 // If this node has more than the peer node, peer node will pull from this
                 //  if then peer node has more this node will pull fom peer
-                if (smsgBuckets[time].setTokens.size() < ncontent
-                    || (smsgBuckets[time].setTokens.size() == ncontent
-                        && smsgBuckets[time].hash != hash)) // if same amount in buckets check hash
+                if (bucket.setTokens.size() < ncontent
+                    || (bucket.setTokens.size() == ncontent
+                        && (fDigest ? bucket.nDigest != digest
+                            : bucket.GetLegacyHash() != hash))) // if same amount in buckets check hash
                 {
+                    if (fRecon)
+                    {
+                        // Worth it if much smaller than the peer's token list
+                        uint32_t nCells = SecMsgSketch::CellsForBucket(ncontent, bucket.setTokens.size());
+                        size_t nSketchBytes = 16 + SecMsgSketch::SerializedSize(nCells);
+
+                        if (nCells > 0
+                            && vchRecon.size() + nSketchBytes <= SMSG_RECON_MAX_MSG)
+                        {
+                            LogPrint(BCLog::SMSG, "Requesting difference of bucket %d, %u cells.\n", time, nCells);
+                            SecureMsgAppendSketch(time, bucket.setTokens, nCells, false, vchRecon);
+                            nReconBuckets++;
+                            continue;
+                        };
+                    };
+
                     LogPrint(BCLog::SMSG, "Requesting contents of bucket %d.\n", time);
 
                     uint32_t sz = vchDataOut.size();
@@ -1007,7 +1283,14 @@ int SecureMsgReceiveData(CNode *pfrom, const std::string &strCommand, CDataStrea
 
                     nShowBuckets++;
                 };
-            } // cs_smsg
+            } // shard.cs
+        };
+
+        if (nReconBuckets > 0)
+        {
+            memcpy(&vchRecon[0], &nReconBuckets, 4);
+            g_connman->PushMessage(pfrom,
+                CNetMsgMaker(INIT_PROTO_VERSION).Make("smsgRecon", vchRecon));
         };
 
         // TODO: should include hash?
@@ -1017,6 +1300,10 @@ int SecureMsgReceiveData(CNode *pfrom, const std::string &strCommand, CDataStrea
             g_connman->PushMessage(pfrom,
                 CNetMsgMaker(INIT_PROTO_VERSION).Make("smsgShow", vchDataOut));
         } else
+        if (nReconBuckets > 0)
+        {
+            LogPrint(BCLog::SMSG, "Requested difference of %u buckets.\n", nReconBuckets);
+        } else
         if (nLocked < 1) // Don't report buckets as matched if any are locked
         {
             // Peer has no buckets we want, don't send them again until something changes
@@ -1050,7 +1337,6 @@ int SecureMsgReceiveData(CNode *pfrom, const std::string &strCommand, CDataStrea
         LogPrint(BCLog::SMSG, "smsgShow: peer wants to see content of %u buckets.\n", nBuckets);
 
         std::map<int64_t, SecMsgBucket>::iterator itb;
-        std::set<SecMsgToken>::iterator it;
 
         std::vector<uint8_t> vchDataOut;
         int64_t time;
@@ -1060,106 +1346,318 @@ int SecureMsgReceiveData(CNode *pfrom, const std::string &strCommand, CDataStrea
             memcpy(&time, pIn, 8);
 
             {
-                LOCK(cs_smsg);
-                itb = smsgBuckets.find(time);
-                if (itb == smsgBuckets.end())
+                SecMsgBucketShard &shard = smsgBuckets.GetShard(time);
+                LOCK(shard.cs);
+                itb = shard.buckets.find(time);
+                if (itb == shard.buckets.end())
                 {
                     LogPrint(BCLog::SMSG, "Don't have bucket %d.\n", time);
                     continue;
                 };
 
-                std::set<SecMsgToken>& tokenSet = (*itb).second.setTokens;
-
-                try { vchDataOut.resize(8 + 16 * tokenSet.size());
-                } catch (std::exception &e) {
-                    LogPrintf("vchDataOut.resize %u threw: %s.\n", 8 + 16 * tokenSet.size(), e.what());
+                if (!SecureMsgAppendHave(time, itb->second.setTokens, vchDataOut))
                     continue;
-                };
-                memcpy(&vchDataOut[0], &time, 8);
-
-                uint8_t *p = &vchDataOut[8];
-                for (it = tokenSet.begin(); it != tokenSet.end(); ++it)
-                {
-                    memcpy(p, &it->timestamp, 8);
-                    memcpy(p+8, &it->sample, 8);
-
-                    p += 16;
-                };
-            }
+            } // shard.cs
             g_connman->PushMessage(pfrom,
                 CNetMsgMaker(INIT_PROTO_VERSION).Make("smsgHave", vchDataOut));
         };
     } else
-    if (strCommand == "smsgHave")
+    if (strCommand == "smsgRecon")
     {
-        // Peer has these messages in bucket
         std::vector<uint8_t> vchData;
         vRecv >> vchData;
 
-        if (vchData.size() < 8)
-            return 1;
-
-        int n = (vchData.size() - 8) / 16;
-
-        int64_t time;
-        memcpy(&time, &vchData[0], 8);
-
-        // Check time valid:
-        int64_t now = GetTime();
-        if (time < now - SMSG_RETENTION)
+        if (vchData.size() < 4)
         {
-            LogPrint(BCLog::SMSG, "Not interested in peer bucket %d, has expired.\n", time);
+            Misbehaving(pfrom->GetId(), 1);
             return 1;
         };
-        if (time > now + SMSG_TIME_LEEWAY)
+
+        uint32_t nBuckets;
+        memcpy(&nBuckets, &vchData[0], 4);
+
+        if (nBuckets > (SMSG_RETENTION / SMSG_BUCKET_LEN) + 1)
         {
-            LogPrint(BCLog::SMSG, "Not interested in peer bucket %d, in the future.\n", time);
+            LogPrintf("Peer sent more bucket sketches than possible %u.\n", nBuckets);
             Misbehaving(pfrom->GetId(), 1);
             return 1;
         };
 
-        std::vector<uint8_t> vchDataOut;
+        LogPrint(BCLog::SMSG, "smsgRecon: peer sent sketches of %u buckets.\n", nBuckets);
 
+        bool fRetry;
         {
-            LOCK(cs_smsg);
-            if (smsgBuckets[time].nLockCount > 0)
+            LOCK(pfrom->smsgData.cs_smsg_net);
+            fRetry = pfrom->smsgData.nVersion >= SMSG_MIN_RECON_RETRY_VERSION;
+        }
+
+        std::vector<uint8_t> vchRetry(4);
+        uint32_t nRetryBuckets = 0;
+
+        size_t ofs = 4;
+        for (uint32_t i = 0; i < nBuckets; ++i)
+        {
+            int64_t time;
+            uint32_t nPeerTokens, nCells;
+
+            if (vchData.size() < ofs + 16)
             {
-                LogPrint(BCLog::SMSG, "Bucket %d lock count %u, waiting for message data from peer %u.\n", time, smsgBuckets[time].nLockCount, smsgBuckets[time].nLockPeerId);
+                Misbehaving(pfrom->GetId(), 1);
                 return 1;
             };
+            memcpy(&time, &vchData[ofs], 8);
+            memcpy(&nPeerTokens, &vchData[ofs+8], 4);
+            memcpy(&nCells, &vchData[ofs+12], 4);
+            ofs += 16;
 
-            LogPrint(BCLog::SMSG, "Sifting through bucket %d.\n", time);
+            bool fRetried = nCells & SMSG_RECON_RETRY;
+            nCells &= ~SMSG_RECON_RETRY;
 
-            vchDataOut.resize(8);
-            memcpy(&vchDataOut[0], &vchData[0], 8);
+            if (nCells < SMSG_RECON_MIN_CELLS || nCells > SMSG_RECON_MAX_CELLS || nCells % 3 != 0
+                || vchData.size() < ofs + SecMsgSketch::SerializedSize(nCells))
+            {
+                LogPrintf("Peer sent invalid sketch, %u cells.\n", nCells);
+                Misbehaving(pfrom->GetId(), 1);
+                return 1;
+            };
 
-            std::set<SecMsgToken>& tokenSet = smsgBuckets[time].setTokens;
-            std::set<SecMsgToken>::iterator it;
-            SecMsgToken token;
-            uint8_t *p = &vchData[8];
+            SecMsgSketch sketchPeer(time, nCells);
+            sketchPeer.Read(&vchData[ofs]);
+            ofs += SecMsgSketch::SerializedSize(nCells);
 
-            for (int i = 0; i < n; ++i)
+            std::vector<uint8_t> vchDataOut;
             {
-                memcpy(&token.timestamp, p, 8);
-                memcpy(&token.sample, p+8, 8);
-
-                it = tokenSet.find(token);
-                if (it == tokenSet.end())
+                SecMsgBucketShard &shard = smsgBuckets.GetShard(time);
+                LOCK(shard.cs);
+                std::map<int64_t, SecMsgBucket>::iterator itb = shard.buckets.find(time);
+                if (itb == shard.buckets.end())
                 {
-                    int nd = vchDataOut.size();
-                    try {
-                        vchDataOut.resize(nd + 16);
-                    } catch (std::exception& e) {
-                        LogPrintf("vchDataOut.resize %d threw: %s.\n", nd + 16, e.what());
-                        continue;
-                    };
-
-                    memcpy(&vchDataOut[nd], p, 16);
+                    LogPrint(BCLog::SMSG, "Don't have bucket %d.\n", time);
+                    continue;
+                };
+
+                std::set<SecMsgToken> &tokenSet = itb->second.setTokens;
+
+                SecMsgSketch sketch(time, nCells);
+                for (const auto &token : tokenSet)
+                    sketch.Insert(token);
+                sketch.Subtract(sketchPeer);
+
+                smsgReconStats.nSketchesReceived++;
+                int64_t nFullBytes = 8 + 16 * tokenSet.size();
+                int64_t nSketchBytes = 16 + SecMsgSketch::SerializedSize(nCells);
+
+                std::vector<SecMsgToken> vHave, vMissing;
+                if (sketch.Decode(vHave, vMissing))
+                {
+                    LogPrint(BCLog::SMSG, "Bucket %d, peer is missing %u, this node is missing %u.\n", time, vHave.size(), vMissing.size());
+
+                    vchDataOut.resize(8 + 16 * vHave.size());
+                    memcpy(&vchDataOut[0], &time, 8);
+                    uint8_t *p = &vchDataOut[8];
+                    for (const auto &token : vHave)
+                    {
+                        memcpy(p, &token.timestamp, 8);
+                        memcpy(p+8, &token.sample, 8);
+                        p += 16;
+                    };
+
+                    smsgReconStats.nDecoded++;
+                    smsgReconStats.nBytesSaved += nFullBytes - nSketchBytes - (int64_t)vchDataOut.size();
+                } else
+                if (fRetry && !fRetried
+                    && SecMsgSketch::CellsForBucket(tokenSet.size(), nPeerTokens, true) > 0)
+                {
+                    LogPrint(BCLog::SMSG, "Could not decode sketch of bucket %d, asking for a larger sketch.\n", time);
+
+                    // smsgRetry entry: bucket time and the token count of this node
+                    uint32_t nHave = tokenSet.size();
+                    size_t sz = vchRetry.size();
+                    vchRetry.resize(sz + 12);
+                    memcpy(&vchRetry[sz], &time, 8);
+                    memcpy(&vchRetry[sz+8], &nHave, 4);
+                    nRetryBuckets++;
+
+                    smsgReconStats.nRetried++;
+                    smsgReconStats.nBytesSaved -= nSketchBytes + 12;
+                    continue;
+                } else
+                {
+                    LogPrint(BCLog::SMSG, "Could not decode sketch of bucket %d, sending all %u tokens.\n", time, tokenSet.size());
+
+                    if (!SecureMsgAppendHave(time, tokenSet, vchDataOut))
+                        continue;
+
+                    smsgReconStats.nFailed++;
+                    smsgReconStats.nBytesSaved -= nSketchBytes;
+                };
+            } // shard.cs
+
+            if (vchDataOut.size() > 8)
+                g_connman->PushMessage(pfrom,
+                    CNetMsgMaker(INIT_PROTO_VERSION).Make("smsgHave", vchDataOut));
+        };
+
+        if (nRetryBuckets > 0)
+        {
+            memcpy(&vchRetry[0], &nRetryBuckets, 4);
+            g_connman->PushMessage(pfrom,
+                CNetMsgMaker(INIT_PROTO_VERSION).Make("smsgRetry", vchRetry));
+        };
+    } else
+    if (strCommand == "smsgRetry")
+    {
+        std::vector<uint8_t> vchData;
+        vRecv >> vchData;
+
+        if (vchData.size() < 4)
+        {
+            Misbehaving(pfrom->GetId(), 1);
+            return 1;
+        };
+
+        uint32_t nBuckets;
+        memcpy(&nBuckets, &vchData[0], 4);
+
+        if (nBuckets > (SMSG_RETENTION / SMSG_BUCKET_LEN) + 1
+            || vchData.size() < 4 + (size_t)nBuckets * 12)
+        {
+            LogPrintf("Peer sent invalid sketch retry request, %u buckets.\n", nBuckets);
+            Misbehaving(pfrom->GetId(), 1);
+            return 1;
+        };
+
+        LogPrint(BCLog::SMSG, "smsgRetry: peer could not decode sketches of %u buckets.\n", nBuckets);
+
+        std::vector<uint8_t> vchRecon(4);
+        uint32_t nReconBuckets = 0;
+
+        std::vector<uint8_t> vchDataOut(4);
+        uint32_t nShowBuckets = 0;
+
+        const uint8_t *p = &vchData[4];
+        for (uint32_t i = 0; i < nBuckets; ++i, p += 12)
+        {
+            int64_t time;
+            uint32_t nPeerTokens;
+            memcpy(&time, p, 8);
+            memcpy(&nPeerTokens, p+8, 4);
+
+            {
+                SecMsgBucketShard &shard = smsgBuckets.GetShard(time);
+                LOCK(shard.cs);
+                std::map<int64_t, SecMsgBucket>::iterator itb = shard.buckets.find(time);
+                if (itb == shard.buckets.end()
+                    || itb->second.nLockCount > 0)
+                    continue;
+
+                const std::set<SecMsgToken> &tokenSet = itb->second.setTokens;
+                uint32_t nCells = SecMsgSketch::CellsForBucket(nPeerTokens, tokenSet.size(), true);
+                size_t nSketchBytes = 16 + SecMsgSketch::SerializedSize(nCells);
+
+                if (nCells > 0
+                    && vchRecon.size() + nSketchBytes <= SMSG_RECON_MAX_MSG)
+                {
+                    LogPrint(BCLog::SMSG, "Requesting difference of bucket %d again, %u cells.\n", time, nCells);
+                    SecureMsgAppendSketch(time, tokenSet, nCells, true, vchRecon);
+                    nReconBuckets++;
+                    continue;
+                };
+            } // shard.cs
+
+            LogPrint(BCLog::SMSG, "Requesting contents of bucket %d.\n", time);
+            size_t sz = vchDataOut.size();
+            vchDataOut.resize(sz + 8);
+            memcpy(&vchDataOut[sz], &time, 8);
+            nShowBuckets++;
+        };
+
+        if (nReconBuckets > 0)
+        {
+            memcpy(&vchRecon[0], &nReconBuckets, 4);
+            g_connman->PushMessage(pfrom,
+                CNetMsgMaker(INIT_PROTO_VERSION).Make("smsgRecon", vchRecon));
+        };
+
+        if (nShowBuckets > 0)
+        {
+            memcpy(&vchDataOut[0], &nShowBuckets, 4);
+            g_connman->PushMessage(pfrom,
+                CNetMsgMaker(INIT_PROTO_VERSION).Make("smsgShow", vchDataOut));
+        };
+    } else
+    if (strCommand == "smsgHave")
+    {
+        // Peer has these messages in bucket
+        std::vector<uint8_t> vchData;
+        vRecv >> vchData;
+
+        if (vchData.size() < 8)
+            return 1;
+
+        int n = (vchData.size() - 8) / 16;
+
+        int64_t time;
+        memcpy(&time, &vchData[0], 8);
+
+        // Check time valid:
+        int64_t now = GetTime();
+        if (time < now - SMSG_RETENTION)
+        {
+            LogPrint(BCLog::SMSG, "Not interested in peer bucket %d, has expired.\n", time);
+            return 1;
+        };
+        if (time > now + SMSG_TIME_LEEWAY)
+        {
+            LogPrint(BCLog::SMSG, "Not interested in peer bucket %d, in the future.\n", time);
+            Misbehaving(pfrom->GetId(), 1);
+            return 1;
+        };
+
+        std::vector<uint8_t> vchDataOut;
+
+        SecMsgBucketShard &shard = smsgBuckets.GetShard(time);
+        {
+            LOCK(shard.cs);
+            SecMsgBucket &bucket = shard.buckets[time];
+            if (bucket.nLockCount > 0)
+            {
+                LogPrint(BCLog::SMSG, "Bucket %d lock count %u, waiting for message data from peer %u.\n", time, bucket.nLockCount, bucket.nLockPeerId);
+                return 1;
+            };
+
+            LogPrint(BCLog::SMSG, "Sifting through bucket %d.\n", time);
+
+            vchDataOut.resize(8);
+            memcpy(&vchDataOut[0], &vchData[0], 8);
+
+            std::set<SecMsgToken>& tokenSet = bucket.setTokens;
+            std::set<SecMsgToken>::iterator it;
+            SecMsgToken token;
+            uint8_t *p = &vchData[8];
+
+            for (int i = 0; i < n; ++i)
+            {
+                memcpy(&token.timestamp, p, 8);
+                memcpy(&token.sample, p+8, 8);
+
+                it = tokenSet.find(token);
+                if (it == tokenSet.end())
+                {
+                    int nd = vchDataOut.size();
+                    try {
+                        vchDataOut.resize(nd + 16);
+                    } catch (std::exception& e) {
+                        LogPrintf("vchDataOut.resize %d threw: %s.\n", nd + 16, e.what());
+                        continue;
+                    };
+
+                    memcpy(&vchDataOut[nd], p, 16);
                 };
 
                 p += 16;
             };
-        } // cs_smsg
+        } // shard.cs
 
         if (vchDataOut.size() > 8)
         {
@@ -1169,9 +1667,10 @@ int SecureMsgReceiveData(CNode *pfrom, const std::string &strCommand, CDataStrea
                 LogPrintf("Locking bucket %u for peer %d.\n", time, pfrom->GetId());
             };
             {
-                LOCK(cs_smsg);
-                smsgBuckets[time].nLockCount   = 3; // lock this bucket for at most 3 * SMSG_THREAD_DELAY seconds, unset when peer sends smsgMsg
-                smsgBuckets[time].nLockPeerId  = pfrom->GetId();
+                LOCK(shard.cs);
+                SecMsgBucket &bucket = shard.buckets[time];
+                bucket.nLockCount   = 3; // lock this bucket for at most 3 * SMSG_THREAD_DELAY seconds, unset when peer sends smsgMsg
+                bucket.nLockPeerId  = pfrom->GetId();
             }
             g_connman->PushMessage(pfrom,
                 CNetMsgMaker(INIT_PROTO_VERSION).Make("smsgWant", vchDataOut));
@@ -1185,7 +1684,6 @@ int SecureMsgReceiveData(CNode *pfrom, const std::string &strCommand, CDataStrea
         if (vchData.size() < 8)
             return 1;
 
-        std::vector<uint8_t> vchOne;
         std::vector<uint8_t> vchBunch;
 
         vchBunch.resize(4+8); // nmessages + bucketTime
@@ -1200,9 +1698,10 @@ int SecureMsgReceiveData(CNode *pfrom, const std::string &strCommand, CDataStrea
         std::map<int64_t, SecMsgBucket>::iterator itb;
 
         {
-            LOCK(cs_smsg);
-            itb = smsgBuckets.find(time);
-            if (itb == smsgBuckets.end())
+            SecMsgBucketShard &shard = smsgBuckets.GetShard(time);
+            LOCK(shard.cs);
+            itb = shard.buckets.find(time);
+            if (itb == shard.buckets.end())
             {
                 LogPrint(BCLog::SMSG, "Don't have bucket %d.\n", time);
                 return 1;
@@ -1226,11 +1725,10 @@ int SecureMsgReceiveData(CNode *pfrom, const std::string &strCommand, CDataStrea
                     //LogPrintf("Have message at %d.\n", it->offset); // DEBUG
                     token.offset = it->offset;
 
-                    // Place in vchOne so if SecureMsgRetrieve fails it won't corrupt vchBunch
-                    if (SecureMsgRetrieve(token, vchOne) == 0)
+                    // Appends straight from the bucket file, leaves vchBunch unchanged on failure
+                    if (smsgStore.Read(time, token.offset, vchBunch))
                     {
                         nBunch++;
-                        vchBunch.insert(vchBunch.end(), vchOne.begin(), vchOne.end()); // append
                     } else
                     {
                         LogPrintf("SecureMsgRetrieve failed %d.\n", token.timestamp);
@@ -1245,7 +1743,7 @@ int SecureMsgReceiveData(CNode *pfrom, const std::string &strCommand, CDataStrea
                 };
                 p += 16;
             };
-        } // cs_smsg
+        } // shard.cs
 
         if (nBunch > 0)
         {
@@ -1303,12 +1801,14 @@ int SecureMsgReceiveData(CNode *pfrom, const std::string &strCommand, CDataStrea
     if (strCommand == "smsgPing")
     {
         // smsgPing is the initial message, send reply
+        SecureMsgReadPeerVersion(pfrom, vRecv);
         g_connman->PushMessage(pfrom,
-            CNetMsgMaker(INIT_PROTO_VERSION).Make("smsgPong"));
+            CNetMsgMaker(INIT_PROTO_VERSION).Make("smsgPong", SMSG_PROTOCOL_VERSION));
     } else
     if (strCommand == "smsgPong")
     {
         LogPrint(BCLog::SMSG, "Peer replied, secure messaging enabled.\n");
+        SecureMsgReadPeerVersion(pfrom, vRecv);
 
         {
             LOCK(pfrom->smsgData.cs_smsg_net);
@@ -1358,6 +1858,81 @@ int SecureMsgReceiveData(CNode *pfrom, const std::string &strCommand, CDataStrea
     return 0;
 };
 
+std::shared_ptr<const SecMsgInventory> SecureMsgGetInventory(bool fLegacy)
+{
+    /*
+        Returns the current smsgInv snapshot, rebuilding it if a bucket has changed.
+        Legacy entries are only kept once a peer below SMSG_MIN_DIGEST_VERSION has asked.
+    */
+
+    LOCK(cs_smsgInv);
+
+    bool fForce = false;
+    if (fLegacy && !fInvLegacy)
+    {
+        fInvLegacy = true;
+        fForce = true;
+    };
+
+    if (smsgInv && !fForce
+        && smsgInv->nVersion == nSmsgInvVersion.load())
+        return smsgInv;
+
+    std::shared_ptr<SecMsgInventory> inv = std::make_shared<SecMsgInventory>();
+    inv->nTimeBuilt = GetTime();
+    inv->nVersion = nSmsgInvVersion.load(); // read before the buckets, changes made while reading bump it again
+
+    struct Entry { int64_t timeChanged; int64_t time; uint32_t nMessages; uint64_t nDigest; uint32_t nHash; };
+    std::vector<Entry> vEntries;
+    for (auto &shard : smsgBuckets.vShards)
+    {
+        LOCK(shard.cs);
+        for (auto &item : shard.buckets)
+        {
+            SecMsgBucket &bkt = item.second;
+            if (bkt.setTokens.size() < 1) // this bucket is empty
+                continue;
+            vEntries.push_back({bkt.timeChanged, item.first, (uint32_t)bkt.setTokens.size(), bkt.nDigest,
+                fInvLegacy ? bkt.GetLegacyHash() : 0});
+        };
+    } // shard.cs
+
+    std::sort(vEntries.begin(), vEntries.end(), [](const Entry &a, const Entry &b)
+    {
+        return a.timeChanged < b.timeChanged || (a.timeChanged == b.timeChanged && a.time < b.time);
+    });
+
+    inv->vTimeChanged.reserve(vEntries.size());
+    inv->vchDigest.resize(vEntries.size() * 20);
+    if (fInvLegacy)
+        inv->vchLegacy.resize(vEntries.size() * 16);
+
+    for (size_t i = 0; i < vEntries.size(); ++i)
+    {
+        const Entry &e = vEntries[i];
+        inv->vTimeChanged.push_back(e.timeChanged);
+
+        uint8_t *p = &inv->vchDigest[i * 20];
+        memcpy(p, &e.time, 8);
+        memcpy(p+8, &e.nMessages, 4);
+        memcpy(p+12, &e.nDigest, 8);
+
+        if (fInvLegacy)
+        {
+            p = &inv->vchLegacy[i * 16];
+            memcpy(p, &e.time, 8);
+            memcpy(p+8, &e.nMessages, 4);
+            memcpy(p+12, &e.nHash, 4);
+        };
+    };
+
+    LogPrint(BCLog::SMSG, "%s: Rebuilt inventory version %d, %u buckets.\n", __func__, inv->nVersion, vEntries.size());
+
+    smsgInvStats.nRebuilds++;
+    smsgInv = inv;
+    return smsgInv;
+};
+
 bool SecureMsgSendData(CNode *pto, bool fSendTrickle)
 {
     /*
@@ -1377,7 +1952,7 @@ bool SecureMsgSendData(CNode *pto, bool fSendTrickle)
         LogPrint(BCLog::SMSG, "SecureMsgSendData() new node %s, peer id %u.\n", pto->GetAddrName(), pto->GetId());
         // Send smsgPing once, do nothing until receive 1st smsgPong (then set fEnabled)
         g_connman->PushMessage(pto,
-            CNetMsgMaker(INIT_PROTO_VERSION).Make("smsgPing"));
+            CNetMsgMaker(INIT_PROTO_VERSION).Make("smsgPing", SMSG_PROTOCOL_VERSION));
         pto->smsgData.lastSeen = GetTime();
         return true;
     } else
@@ -1388,87 +1963,48 @@ bool SecureMsgSendData(CNode *pto, bool fSendTrickle)
         return true;
     };
 
-    {
-        LOCK(cs_smsg);
-        std::map<int64_t, SecMsgBucket>::iterator it;
-
-        uint32_t nBuckets = smsgBuckets.size();
-        if (nBuckets > 0) // no need to send keep alive pkts, coin messages already do that
-        {
-            std::vector<uint8_t> vchData;
-            // should reserve?
-            vchData.reserve(4 + nBuckets*16); // timestamp + size + hash
-
-            uint32_t nBucketsShown = 0;
-            vchData.resize(4);
-
-            /*
-            Get time before loop and after looping through messages set nLastMatched to time before loop.
-            This prevents scenario where:
-                Loop()
-                    message = locked and  thus skipped
-                   message become free and nTimeChanged is updated
-                End loop
-
-                nLastMatched = GetTime()
-                => bucket that became free in loop is now skipped :/
-
-            Scenario 2:
-                Same as one but time is updated before
-
-                    bucket nTimeChanged is updated but not unlocked yet
-                    now = GetTime()
-                    Loop of buckets skips message
-
-                But this is nanoseconds, very unlikely.
-
-             */
-
-            for (it = smsgBuckets.begin(); it != smsgBuckets.end(); ++it)
-            {
-                SecMsgBucket &bkt = it->second;
+    // Peers of SMSG_MIN_DIGEST_VERSION are sent the 64 bit digest, older peers the 32 bit hash
+    bool fDigest = pto->smsgData.nVersion >= SMSG_MIN_DIGEST_VERSION;
+    std::shared_ptr<const SecMsgInventory> inv = SecureMsgGetInventory(!fDigest);
 
-                uint32_t nMessages = bkt.setTokens.size();
+    if (pto->smsgData.nInvVersion == inv->nVersion)
+    {
+        // No bucket has changed since the peer was last sent the inventory
+        smsgInvStats.nUnchanged++;
+    } else
+    {
+        size_t nEntryLen = fDigest ? 20 : 16;
+        const std::vector<uint8_t> &vchEntries = fDigest ? inv->vchDigest : inv->vchLegacy;
 
-                if (bkt.timeChanged < pto->smsgData.lastMatched     // peer was last sent all buckets at time of lastMatched. It should have this bucket
-                    || nMessages < 1)                               // this bucket is empty
-                    continue;
+        // Peer was last sent all buckets at time of lastMatched. It should have the buckets changed before
+        size_t nFirst = std::lower_bound(inv->vTimeChanged.begin(), inv->vTimeChanged.end(), pto->smsgData.lastMatched) - inv->vTimeChanged.begin();
+        uint32_t nBucketsShown = inv->vTimeChanged.size() - nFirst;
 
-                uint32_t hash = bkt.hash;
+        if (nBucketsShown > 0) // no need to send keep alive pkts, coin messages already do that
+        {
+            std::vector<uint8_t> vchData(4 + nBucketsShown * nEntryLen); // count + (timestamp + size + hash) per bucket
+            uint32_t nCount = fDigest ? nBucketsShown | SMSG_INV_DIGEST : nBucketsShown;
+            memcpy(&vchData[0], &nCount, 4);
+            memcpy(&vchData[4], &vchEntries[nFirst * nEntryLen], nBucketsShown * nEntryLen);
 
-                if (LogAcceptCategory(BCLog::SMSG))
-                    LogPrintf("Preparing bucket with hash %d for transfer to node %u. timeChanged=%d > lastMatched=%d\n", hash, pto->GetId(), bkt.timeChanged, pto->smsgData.lastMatched);
-                
-                size_t sz = vchData.size();
-                try { vchData.resize(vchData.size() + 16); } catch (std::exception& e)
-                {
-                    LogPrintf("vchData.resize %u threw: %s.\n", vchData.size() + 16, e.what());
-                    continue;
-                };
-                
-                uint8_t *p = &vchData[sz];
-                memcpy(p, &it->first, 8);
-                memcpy(p+8, &nMessages, 4);
-                memcpy(p+12, &hash, 4);
-
-                nBucketsShown++;
-                //if (fDebug)
-                //    LogPrintf("Sending bucket %d, size %d \n", it->first, it->second.size());
-            };
+            LogPrint(BCLog::SMSG, "Sending %d bucket headers to node %u, changed since %d.\n", nBucketsShown, pto->GetId(), pto->smsgData.lastMatched);
 
-            if (vchData.size() > 4)
-            {
-                memcpy(&vchData[0], &nBucketsShown, 4);
-                LogPrint(BCLog::SMSG, "Sending %d bucket headers.\n", nBucketsShown);
+            g_connman->PushMessage(pto,
+                CNetMsgMaker(INIT_PROTO_VERSION).Make("smsgInv", vchData));
 
-                g_connman->PushMessage(pto,
-                    CNetMsgMaker(INIT_PROTO_VERSION).Make("smsgInv", vchData));
-            };
+            smsgInvStats.nSends++;
+            smsgInvStats.nEntries += nBucketsShown;
         };
-    } // cs_smsg
+
+        /*
+            Buckets changed while the snapshot was built are either in it or have
+            bumped nSmsgInvVersion, their timeChanged is at least nTimeBuilt.
+        */
+        pto->smsgData.nInvVersion = inv->nVersion;
+        pto->smsgData.lastMatched = inv->nTimeBuilt;
+    };
 
     pto->smsgData.lastSeen = now;
-    pto->smsgData.lastMatched = now; //bug fix smsg 3
 
     return true;
 };
@@ -1687,174 +2223,637 @@ bool SecureMsgScanBlockChain()
     return true;
 };
 
-bool SecureMsgScanBuckets()
-{
-    LogPrint(BCLog::SMSG, "SecureMsgScanBuckets()\n");
-
 #ifdef ENABLE_WALLET
-    if (!fSecMsgEnabled
-        || !pwalletSmsg
-        || pwalletSmsg->IsLocked())
-        return false;
-
-    int64_t  mStart         = GetTimeMillis();
-    int64_t  now            = GetTime();
-    uint32_t nFiles         = 0;
-    uint32_t nMessages      = 0;
-    uint32_t nFoundMessages = 0;
+static std::vector<SecMsgScanKey> vScanKeys;        // receive keys, guarded by cs_smsg, cleared when the wallet locks
+static std::vector<SecMsgAddress> vScanKeysFrom;    // smsgAddresses when vScanKeys was built
 
-    fs::path pathSmsgDir = GetDataDir() / "smsgstore";
-    fs::directory_iterator itend;
+static bool SecureMsgUpdateScanKeys()
+{
+    /*
+        Fetch the private keys of the receive enabled addresses once,
+        instead of per message and address.
+        Rebuilt when smsgAddresses changes or after an unlock, cs_smsg must be held.
+    */
+    AssertLockHeld(cs_smsg);
 
-    if (!fs::exists(pathSmsgDir)
-        || !fs::is_directory(pathSmsgDir))
+    bool fChanged = vScanKeysFrom.size() != smsgAddresses.size();
+    for (size_t i = 0; !fChanged && i < smsgAddresses.size(); ++i)
     {
-        LogPrintf("Message store directory does not exist.\n");
-        return 0; // not an error
+        const SecMsgAddress &a = smsgAddresses[i], &b = vScanKeysFrom[i];
+        fChanged = a.address != b.address
+            || a.fReceiveEnabled != b.fReceiveEnabled
+            || a.fReceiveAnon != b.fReceiveAnon;
     };
 
-    SecureMessage smsg;
-    std::vector<uint8_t> vchData;
+    if (!fChanged)
+        return true;
 
-    for (fs::directory_iterator itd(pathSmsgDir); itd != itend; ++itd)
+    vScanKeys.clear();
+    for (const auto &addr : smsgAddresses)
     {
-        if (!fs::is_regular_file(itd->status()))
+        // Watch only addresses can't receive
+        if (!addr.fReceiveEnabled
+            || !pwalletSmsg->HaveKey(addr.address))
             continue;
 
-        std::string fileType = (*itd).path().extension().string();
-
-        if (fileType.compare(".dat") != 0)
+        SecMsgScanKey sk;
+        sk.address = addr.address;
+        sk.fReceiveAnon = addr.fReceiveAnon;
+        if (!pwalletSmsg->GetKey(addr.address, sk.key))
+        {
+            LogPrint(BCLog::SMSG, "%s: Could not get private key for %s.\n", __func__, CBitcoinAddress(addr.address).ToString());
             continue;
+        };
+        vScanKeys.push_back(sk);
+    };
+    vScanKeysFrom = smsgAddresses;
 
-        std::string fileName = (*itd).path().filename().string();
+    LogPrint(BCLog::SMSG, "%s: %u receive keys.\n", __func__, vScanKeys.size());
+    return true;
+};
+#endif
 
+static int SecureMsgTrialDecrypt(const std::vector<SecMsgScanKey> &vKeys,
+    const uint8_t *pHeader, const uint8_t *pPayload, uint32_t nPayload, uint64_t &nTrials)
+{
+    /*
+        Compute the shared secret and check the MAC with each key, R is parsed once per message.
+        No AES work is done here.
 
-        LogPrint(BCLog::SMSG, "Processing file: %s.\n", fileName);
+        returns
+            index in vKeys of the key the MAC verifies with
+            -1 no match
+    */
+    const SecureMessage *psmsg = (const SecureMessage*) pHeader;
 
-        nFiles++;
+    if (psmsg->version[0] != 2)
+        return -1;
 
-        // TODO files must be split if > 2GB
-        // time_noFile.dat
-        size_t sep = fileName.find_first_of("_");
-        if (sep == std::string::npos)
-            continue;
+    secp256k1_pubkey R;
+    if (!secp256k1_ec_pubkey_parse(secp256k1_context_smsg, &R, psmsg->cpkR, 33))
+        return -1;
 
-        std::string stime = fileName.substr(0, sep);
-        int64_t fileTime;
-        if (!ParseInt64(stime, &fileTime))
-        {
-            LogPrintf("%s: ParseInt64 failed %s.\n", __func__, stime);
+    int rv = -1;
+    uint8_t P[32];
+    uint8_t H[64];  // key_e | key_m
+    uint8_t MAC[32];
+    for (size_t i = 0; i < vKeys.size(); ++i)
+    {
+        nTrials++;
+        if (!secp256k1_ecdh(secp256k1_context_smsg, P, &R, vKeys[i].key.begin()))
             continue;
-        };
 
-        if (fileTime < now - SMSG_RETENTION)
+        CSHA512().Write(P, 32).Finalize(H);
+
+        CHMAC_SHA256 ctx(&H[32], 32);
+        ctx.Write((const uint8_t*) &psmsg->timestamp, sizeof(psmsg->timestamp));
+        ctx.Write((const uint8_t*) psmsg->iv, sizeof(psmsg->iv));
+        ctx.Write(pPayload, nPayload);
+        ctx.Finalize(MAC);
+
+        if (part::memcmp_nta(MAC, psmsg->mac, 32) == 0)
         {
-            LogPrintf("Dropping file %s, expired.\n", fileName);
-            try {
-                fs::remove((*itd).path());
-            } catch (const fs::filesystem_error &ex)
-            {
-                LogPrintf("Error removing bucket file %s, %s.\n", fileName, ex.what());
-            };
+            rv = i;
+            break;
+        };
+    };
+
+    memory_cleanse(P, sizeof(P));
+    memory_cleanse(H, sizeof(H));
+
+    return rv;
+};
+
+class CSecMsgTrialCheck
+{
+    // A message to trial decrypt on smsgScanQueue
+public:
+    const std::vector<SecMsgScanKey> *pvKeys = nullptr;
+    const uint8_t *pHeader = nullptr;
+    int *pResult = nullptr;
+    std::atomic<uint64_t> *pnTrials = nullptr;
+
+    bool operator()()
+    {
+        uint64_t nTrials = 0;
+        const SecureMessage *psmsg = (const SecureMessage*) pHeader;
+        *pResult = SecureMsgTrialDecrypt(*pvKeys, pHeader, pHeader + SMSG_HDR_LEN, psmsg->nPayload, nTrials);
+        pnTrials->fetch_add(nTrials);
+        return true;
+    };
+
+    void swap(CSecMsgTrialCheck &check)
+    {
+        std::swap(pvKeys, check.pvKeys);
+        std::swap(pHeader, check.pHeader);
+        std::swap(pResult, check.pResult);
+        std::swap(pnTrials, check.pnTrials);
+    };
+};
+
+static CCheckQueue<CSecMsgTrialCheck> smsgScanQueue(16);
+static boost::thread_group threadGroupSmsgScan;     // workers of smsgScanQueue, kept across batches
+static int nSmsgScanWorkers = 0;                    // guarded by smsgScanQueue.ControlMutex
+
+static void ThreadSecureMsgScan()
+{
+    smsgScanQueue.Thread();
+};
+
+static void SecureMsgStopScanThreads()
+{
+    boost::unique_lock<boost::mutex> lock(smsgScanQueue.ControlMutex);
+    threadGroupSmsgScan.interrupt_all();
+    threadGroupSmsgScan.join_all();
+    nSmsgScanWorkers = 0;
+};
+
+void SecureMsgTrialDecryptBatch(const std::vector<SecMsgScanKey> &vKeys, const std::vector<uint8_t> &vchData,
+    const std::vector<size_t> &vOffsets, std::vector<int> &vResult, int nThreads, uint64_t &nTrials)
+{
+    /*
+        Trial decrypt messages laid out back to back in vchData (header + payload).
+        With nThreads > 1 the calling thread is joined by nThreads-1 smsg-scan workers,
+        started on first use and kept until SecureMsgShutdown.
+    */
+    vResult.assign(vOffsets.size(), -1);
+    std::atomic<uint64_t> nTrialsBatch(0);
+
+    std::vector<CSecMsgTrialCheck> vChecks(vOffsets.size());
+    for (size_t i = 0; i < vOffsets.size(); ++i)
+    {
+        vChecks[i].pvKeys = &vKeys;
+        vChecks[i].pHeader = &vchData[vOffsets[i]];
+        vChecks[i].pResult = &vResult[i];
+        vChecks[i].pnTrials = &nTrialsBatch;
+    };
+
+    if (nThreads <= 1 || vChecks.size() < 2)
+    {
+        for (auto &check : vChecks)
+            check();
+    } else
+    {
+        CCheckQueueControl<CSecMsgTrialCheck> control(&smsgScanQueue);
+        for (; nSmsgScanWorkers < std::min(nThreads, SMSG_MAX_SCAN_THREADS) - 1; ++nSmsgScanWorkers)
+            threadGroupSmsgScan.create_thread(boost::bind(&TraceThread<void (*)()>, "smsg-scan", &ThreadSecureMsgScan));
+        control.Add(vChecks);
+        control.Wait();
+    };
+
+    nTrials += nTrialsBatch.load();
+};
+
+#ifdef ENABLE_WALLET
+static int SecureMsgReceivedWith(const SecMsgScanKey &sk, uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, bool reportToGui);
+
+static int SecureMsgScanBatch(std::vector<uint8_t> &vchData, const std::vector<size_t> &vOffsets, uint32_t &nFound)
+{
+    /*
+        Trial decrypt messages laid out back to back in vchData (header + payload)
+        across nSmsgScanThreads, save the messages a receive key matches to the inbox.
+
+        returns
+            0 success
+            1 error
+    */
+    if (vOffsets.size() < 1)
+        return 0;
+
+    std::vector<SecMsgScanKey> vKeys;
+    {
+        LOCK(cs_smsg);
+        if (!pwalletSmsg || pwalletSmsg->IsLocked())
+            return errorN(1, "%s: Wallet is locked.", __func__);
+        SecureMsgUpdateScanKeys();
+        vKeys = vScanKeys; // copy, workers run without cs_smsg
+    }
+
+    std::vector<int> vResult;
+    uint64_t nTrials = 0;
+    int64_t nStart = GetTimeMicros();
+    SecureMsgTrialDecryptBatch(vKeys, vchData, vOffsets, vResult, nSmsgScanThreads, nTrials);
+
+    size_t nMatched = 0;
+    for (size_t i = 0; i < vOffsets.size(); ++i)
+    {
+        if (vResult[i] < 0)
             continue;
+        nMatched++;
+
+        uint8_t *pHeader = &vchData[vOffsets[i]];
+        SecureMessage *psmsg = (SecureMessage*) pHeader;
+        if (SecureMsgReceivedWith(vKeys[vResult[i]], pHeader, pHeader + SMSG_HDR_LEN, psmsg->nPayload, false) == 0)
+            nFound++;
+    };
+
+    {
+        LOCK(cs_smsg);
+        smsgScanStats.nScanned += vOffsets.size();
+        smsgScanStats.nReceived += nMatched;
+        smsgScanStats.nTrials += nTrials;
+        smsgScanStats.nTimeMicros += GetTimeMicros() - nStart;
+    }
+
+    return 0;
+};
+
+static bool SecureMsgReadBatch(FILE *fp, std::vector<uint8_t> &vchBatch, std::vector<size_t> &vOffsets)
+{
+    /*
+        Read up to SMSG_SCAN_BATCH messages from fp back to back into vchBatch,
+        vchBatch ends after the last complete message read.
+
+        returns false at the end of the file or on a bad record
+    */
+    vchBatch.clear();
+    vOffsets.clear();
+    vOffsets.reserve(SMSG_SCAN_BATCH);
+
+    while (vOffsets.size() < SMSG_SCAN_BATCH)
+    {
+        size_t ofs = vchBatch.size();
+
+        try { vchBatch.resize(ofs + SMSG_HDR_LEN); } catch (std::exception &e)
+        {
+            LogPrintf("%s: Could not resize vchBatch, %u, %s\n", __func__, ofs + SMSG_HDR_LEN, e.what());
+            vchBatch.resize(ofs);
+            return false;
         };
 
-        if (boost::algorithm::ends_with(fileName, "_wl.dat"))
+        errno = 0;
+        if (fread(&vchBatch[ofs], sizeof(uint8_t), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
         {
-            LogPrint(BCLog::SMSG, "Skipping wallet locked file: %s.\n", fileName);
+            if (errno != 0)
+                LogPrintf("fread header failed: %s\n", strerror(errno));
+            vchBatch.resize(ofs);
+            return false;
+        };
+
+        uint32_t nPayload = ((SecureMessage*) &vchBatch[ofs])->nPayload;
+        if (nPayload > SMSG_MAX_MSG_WORST)
+        {
+            LogPrintf("%s: Bad payload size %u.\n", __func__, nPayload);
+            vchBatch.resize(ofs);
+            return false;
+        };
+
+        vchBatch.resize(ofs + SMSG_HDR_LEN + nPayload);
+        if (fread(&vchBatch[ofs + SMSG_HDR_LEN], sizeof(uint8_t), nPayload, fp) != nPayload)
+        {
+            LogPrintf("fread data failed: %s\n", strerror(errno));
+            vchBatch.resize(ofs);
+            return false;
+        };
+
+        vOffsets.push_back(ofs);
+    };
+
+    return true;
+};
+
+static int SecureMsgScanFile(const fs::path &path, uint32_t &nMessages, uint32_t &nFound)
+{
+    /*
+        Trial decrypt all messages in a bucket file, SMSG_SCAN_BATCH at a time.
+
+        returns
+            0 success
+            1 error
+    */
+    FILE *fp;
+    errno = 0;
+    if (!(fp = fsbridge::fopen(path, "rb")))
+        return errorN(1, "%s: Error opening file: %s", __func__, strerror(errno));
+
+    std::vector<uint8_t> vchBatch;
+    std::vector<size_t> vOffsets;
+
+    int rv = 0;
+    bool fMore = true;
+    while (fMore)
+    {
+        fMore = SecureMsgReadBatch(fp, vchBatch, vOffsets);
+
+        if (SecureMsgScanBatch(vchBatch, vOffsets, nFound) != 0)
+        {
+            rv = 1;
+            break;
+        };
+        nMessages += vOffsets.size();
+    };
+
+    fclose(fp);
+    return rv;
+};
+
+class SecMsgUnlockFile
+{
+public:
+    fs::path path;
+    std::string fileName;
+    int64_t nOffset;        // resume from, read from the checkpoint
+};
+
+class SecMsgScanJob
+{
+public:
+    size_t nFile;           // index in the vector of SecMsgUnlockFile
+    int64_t nOffsetEnd;     // file position after the batch
+    bool fEnd;              // last batch read from the file
+    std::vector<uint8_t> vchData;
+    std::vector<size_t> vOffsets;
+};
+
+class SecMsgScanQueue
+{
+public:
+    boost::mutex mtx;
+    boost::condition_variable condProduced;
+    boost::condition_variable condConsumed;
+    std::deque<SecMsgScanJob> jobs;
+    bool fStop = false;     // set by the consumer
+    bool fDone = false;     // set by the reader
+};
+
+static void SecureMsgUnlockScanReader(const std::vector<SecMsgUnlockFile> *pvFiles, SecMsgScanQueue *pq)
+{
+    // Read the wallet locked files ahead of the trial decryption, at most SMSG_UNLOCK_QUEUE batches
+    for (size_t i = 0; i < pvFiles->size(); ++i)
+    {
+        const SecMsgUnlockFile &f = (*pvFiles)[i];
+
+        FILE *fp;
+        errno = 0;
+        if (!(fp = fsbridge::fopen(f.path, "rb")))
+        {
+            LogPrintf("%s: Error opening file %s: %s\n", __func__, f.fileName, strerror(errno));
             continue;
         };
 
+        if (f.nOffset > 0
+            && fseek(fp, f.nOffset, SEEK_SET) != 0)
         {
-            LOCK(cs_smsg);
-            FILE *fp;
-            errno = 0;
-            if (!(fp = fopen((*itd).path().string().c_str(), "rb")))
+            LogPrintf("%s: Error seeking file %s to %d.\n", __func__, f.fileName, f.nOffset);
+            fclose(fp);
+            continue;
+        };
+
+        int64_t nOffset = f.nOffset;
+        bool fMore = true;
+        while (fMore)
+        {
+            SecMsgScanJob job;
+            job.nFile = i;
+            fMore = SecureMsgReadBatch(fp, job.vchData, job.vOffsets);
+            nOffset += job.vchData.size();
+            job.nOffsetEnd = nOffset;
+            job.fEnd = !fMore;
+
+            boost::unique_lock<boost::mutex> lock(pq->mtx);
+            while (!pq->fStop && pq->jobs.size() >= SMSG_UNLOCK_QUEUE)
+                pq->condConsumed.wait(lock);
+            if (pq->fStop)
             {
-                LogPrintf("Error opening file: %s\n", strerror(errno));
+                fclose(fp);
+                return;
+            };
+            pq->jobs.push_back(std::move(job));
+            pq->condProduced.notify_one();
+        };
+
+        fclose(fp);
+    };
+
+    boost::unique_lock<boost::mutex> lock(pq->mtx);
+    pq->fDone = true;
+    pq->condProduced.notify_one();
+};
+
+static int SecureMsgUnlockScan()
+{
+    /*
+        Scan messages received while the wallet was locked.
+        The wl files are read on another thread while the batches read are trial
+        decrypted across nSmsgScanThreads. The offset scanned to in each file is
+        checkpointed in the db after every batch, so the scan resumes there if the
+        wallet is locked again or the node stops.
+
+        returns
+            0 success
+            1 error
+            2 interrupted
+    */
+
+    // Shutdown is polled, the reader thread must be joined before returning
+    boost::this_thread::disable_interruption di;
+
+    LogPrintf("%s: Scanning wallet locked files.\n", __func__);
+
+    int64_t now = GetTime();
+    fs::path pathSmsgDir = GetDataDir() / "smsgstore";
+
+    std::map<std::string, int64_t> mapProgress;
+    {
+        LOCK(cs_smsgDB);
+        SecMsgDB db;
+        if (db.Open("cr+"))
+            db.ReadUnlockScan(mapProgress);
+    } // cs_smsgDB
+
+    std::vector<SecMsgUnlockFile> vFiles;
+    std::map<std::string, int64_t> mapResume;
+    uint64_t nBytes = 0;
+
+    if (fs::exists(pathSmsgDir)
+        && fs::is_directory(pathSmsgDir))
+    {
+        fs::directory_iterator itend;
+        for (fs::directory_iterator itd(pathSmsgDir); itd != itend; ++itd)
+        {
+            if (!fs::is_regular_file(itd->status()))
+                continue;
+
+            std::string fileName = (*itd).path().filename().string();
+
+            if (!boost::algorithm::ends_with(fileName, "_wl.dat"))
+                continue;
+
+            // time_noFile_wl.dat
+            size_t sep = fileName.find_first_of("_");
+            if (sep == std::string::npos)
+                continue;
+
+            std::string stime = fileName.substr(0, sep);
+            int64_t fileTime;
+            if (!ParseInt64(stime, &fileTime))
+            {
+                LogPrintf("%s: ParseInt64 failed %s.\n", __func__, stime);
                 continue;
             };
 
-            for (;;)
+            if (fileTime < now - SMSG_RETENTION)
             {
-                errno = 0;
-                if (fread(&smsg.hash[0], sizeof(uint8_t), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
+                LogPrintf("Dropping wallet locked file %s, expired.\n", fileName);
+                try {
+                    fs::remove((*itd).path());
+                } catch (const fs::filesystem_error &ex)
                 {
-                    if (errno != 0)
-                    {
-                        LogPrintf("fread header failed: %s\n", strerror(errno));
-                    } else
-                    {
-                        //LogPrintf("End of file.\n");
-                    };
-                    break;
+                    LogPrintf("Error removing wl file %s - %s\n", fileName, ex.what());
                 };
+                continue;
+            };
 
-                try { vchData.resize(smsg.nPayload); } catch (std::exception &e)
-                {
-                    LogPrintf("SecureMsgWalletUnlocked(): Could not resize vchData, %u, %s\n", smsg.nPayload, e.what());
-                    fclose(fp);
-                    return 1;
-                };
+            SecMsgUnlockFile f;
+            f.path = (*itd).path();
+            f.fileName = fileName;
+            f.nOffset = 0;
 
-                if (fread(&vchData[0], sizeof(uint8_t), smsg.nPayload, fp) != smsg.nPayload)
-                {
-                    LogPrintf("fread data failed: %s\n", strerror(errno));
-                    break;
-                };
+            int64_t nSize = fs::file_size(f.path);
+            std::map<std::string, int64_t>::iterator mi = mapProgress.find(fileName);
+            if (mi != mapProgress.end()
+                && mi->second <= nSize)
+            {
+                f.nOffset = mi->second;
+                mapResume[fileName] = f.nOffset;
+                LogPrint(BCLog::SMSG, "Resuming file %s at %d.\n", fileName, f.nOffset);
+            };
 
-                // Don't report to gui,
-                int rv = SecureMsgScanMessage(&smsg.hash[0], &vchData[0], smsg.nPayload, false);
+            nBytes += nSize - f.nOffset;
+            vFiles.push_back(f);
+        };
+    };
 
-                if (rv == 0)
-                {
-                    nFoundMessages++;
-                } else
-                if (rv != 0)
-                {
-                    // SecureMsgScanMessage failed
-                };
+    // Oldest first, checkpoints of files removed since are dropped
+    std::sort(vFiles.begin(), vFiles.end(),
+        [](const SecMsgUnlockFile &a, const SecMsgUnlockFile &b) { return a.fileName < b.fileName; });
+    mapProgress = mapResume;
+
+    {
+        LOCK(cs_smsg);
+        smsgUnlockScan = SecMsgUnlockScan();
+        smsgUnlockScan.fRunning = true;
+        smsgUnlockScan.nFiles = vFiles.size();
+        smsgUnlockScan.nBytes = nBytes;
+        smsgUnlockScan.nTimeStarted = GetTimeMillis();
+    }
 
-                nMessages++;
+    SecMsgScanQueue queue;
+    boost::thread threadReader(boost::bind(&SecureMsgUnlockScanReader, &vFiles, &queue));
+
+    int rv = 0;
+    uint32_t nFilesDone = 0;
+    for (;;)
+    {
+        SecMsgScanJob job;
+        {
+            boost::unique_lock<boost::mutex> lock(queue.mtx);
+            while (queue.jobs.empty() && !queue.fDone)
+                queue.condProduced.wait(lock);
+            if (queue.jobs.empty())
+                break;
+            job = std::move(queue.jobs.front());
+            queue.jobs.pop_front();
+            queue.condConsumed.notify_one();
+        }
+
+        if (!fSecMsgEnabled
+            || boost::this_thread::interruption_requested()
+            || !pwalletSmsg
+            || pwalletSmsg->IsLocked())
+        {
+            rv = 2;
+            break;
+        };
+
+        uint32_t nFound = 0;
+        if (SecureMsgScanBatch(job.vchData, job.vOffsets, nFound) != 0)
+        {
+            rv = 1;
+            break;
+        };
+
+        const SecMsgUnlockFile &f = vFiles[job.nFile];
+        {
+            LOCK(cs_smsg);
+
+            // Messages are only appended to wl files while the wallet is locked,
+            // cs_smsg holds off incoming messages until the file is gone.
+            bool fRemove = false;
+            if (job.fEnd && !pwalletSmsg->IsLocked())
+            {
+                boost::system::error_code ec;
+                fRemove = (int64_t)fs::file_size(f.path, ec) == job.nOffsetEnd;
             };
 
-            fclose(fp);
+            if (fRemove)
+                mapProgress.erase(f.fileName);
+            else
+                mapProgress[f.fileName] = job.nOffsetEnd;
 
-            // Remove wl file when scanned
-            try {
-                fs::remove((*itd).path());
-            } catch (const boost::filesystem::filesystem_error &ex)
             {
-                LogPrintf("Error removing wl file %s - %s\n", fileName, ex.what());
-                return 1;
+                LOCK(cs_smsgDB);
+                SecMsgDB db;
+                if (!db.Open("cr+")
+                    || !db.WriteUnlockScan(mapProgress))
+                    LogPrintf("%s: Failed to write checkpoint for %s.\n", __func__, f.fileName);
+            } // cs_smsgDB
+
+            // Remove wl file when scanned, after the checkpoint as a new file could reuse the name
+            if (fRemove)
+            {
+                try {
+                    fs::remove(f.path);
+                } catch (const fs::filesystem_error &ex)
+                {
+                    LogPrintf("Error removing wl file %s - %s\n", f.fileName, ex.what());
+                };
             };
+
+            if (job.fEnd)
+                nFilesDone++;
+            smsgUnlockScan.nFilesDone = nFilesDone;
+            smsgUnlockScan.nBytesDone += job.vchData.size();
+            smsgUnlockScan.nMessages += job.vOffsets.size();
+            smsgUnlockScan.nFound += nFound;
         } // cs_smsg
+
+        NotifySecMsgUnlockScanProgress(nFilesDone, vFiles.size());
     };
 
-    LogPrintf("Processed %u files, scanned %u messages, received %u messages.\n", nFiles, nMessages, nFoundMessages);
-    LogPrintf("Took %d ms\n", GetTimeMillis() - mStart);
-#endif
-    return true;
-}
+    {
+        boost::unique_lock<boost::mutex> lock(queue.mtx);
+        queue.fStop = true;
+        queue.condConsumed.notify_one();
+    }
+    threadReader.join();
 
+    {
+        LOCK(cs_smsg);
+        smsgUnlockScan.fRunning = false;
+        if (rv == 0)
+            smsgUnlockScan.nTimeFinished = GetTimeMillis();
 
-int SecureMsgWalletUnlocked()
-{
-#ifdef ENABLE_WALLET
-    /*
-    When the wallet is unlocked, scan messages received while wallet was locked.
-    */
-    if (!fSecMsgEnabled || !pwalletSmsg)
-        return 0;
+        LogPrintf("Processed %u files, scanned %u messages, received %u messages%s.\n",
+            smsgUnlockScan.nFilesDone, smsgUnlockScan.nMessages, smsgUnlockScan.nFound,
+            rv == 0 ? "" : ", stopped");
+    }
 
-    LogPrintf("SecureMsgWalletUnlocked()\n");
+    return rv;
+};
+#endif
 
-    if (pwalletSmsg->IsLocked())
-    {
-        LogPrintf("Error: Wallet is locked.\n");
-        return 1;
-    };
+bool SecureMsgScanBuckets()
+{
+    LogPrint(BCLog::SMSG, "SecureMsgScanBuckets()\n");
+
+#ifdef ENABLE_WALLET
+    if (!fSecMsgEnabled
+        || !pwalletSmsg
+        || pwalletSmsg->IsLocked())
+        return false;
 
+    int64_t  mStart         = GetTimeMillis();
     int64_t  now            = GetTime();
     uint32_t nFiles         = 0;
     uint32_t nMessages      = 0;
@@ -1870,25 +2869,25 @@ int SecureMsgWalletUnlocked()
         return 0; // not an error
     };
 
-    SecureMessage smsg;
-    std::vector<uint8_t> vchData;
-
     for (fs::directory_iterator itd(pathSmsgDir); itd != itend; ++itd)
     {
         if (!fs::is_regular_file(itd->status()))
             continue;
 
-        std::string fileName = (*itd).path().filename().string();
+        std::string fileType = (*itd).path().extension().string();
 
-        if (!boost::algorithm::ends_with(fileName, "_wl.dat"))
+        if (fileType.compare(".dat") != 0)
             continue;
 
+        std::string fileName = (*itd).path().filename().string();
+
+
         LogPrint(BCLog::SMSG, "Processing file: %s.\n", fileName);
 
         nFiles++;
 
         // TODO files must be split if > 2GB
-        // time_noFile_wl.dat
+        // time_noFile.dat
         size_t sep = fileName.find_first_of("_");
         if (sep == std::string::npos)
             continue;
@@ -1903,92 +2902,89 @@ int SecureMsgWalletUnlocked()
 
         if (fileTime < now - SMSG_RETENTION)
         {
-            LogPrintf("Dropping wallet locked file %s, expired.\n", fileName);
+            LogPrintf("Dropping file %s, expired.\n", fileName);
             try {
                 fs::remove((*itd).path());
             } catch (const fs::filesystem_error &ex)
             {
-                LogPrintf("Error removing wl file %s - %s\n", fileName, ex.what());
-                return 1;
+                LogPrintf("Error removing bucket file %s, %s.\n", fileName, ex.what());
             };
             continue;
         };
 
+        if (boost::algorithm::ends_with(fileName, "_wl.dat"))
+        {
+            LogPrint(BCLog::SMSG, "Skipping wallet locked file: %s.\n", fileName);
+            continue;
+        };
+
         {
             LOCK(cs_smsg);
-            FILE *fp;
-            errno = 0;
-            if (!(fp = fopen((*itd).path().string().c_str(), "rb")))
+            smsgStore.Close(fileTime); // write out pending messages, file is removed below
+
+            if (SecureMsgScanFile((*itd).path(), nMessages, nFoundMessages) != 0)
             {
-                LogPrintf("Error opening file: %s\n", strerror(errno));
+                LogPrintf("Error scanning file %s.\n", fileName);
                 continue;
             };
 
-            for (;;)
-            {
-                errno = 0;
-                if (fread(&smsg.hash[0], sizeof(uint8_t), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
-                {
-                    if (errno != 0)
-                    {
-                        LogPrintf("fread header failed: %s\n", strerror(errno));
-                    } else
-                    {
-                        //LogPrintf("End of file.\n");
-                    };
-                    break;
-                };
-
-                try { vchData.resize(smsg.nPayload); } catch (std::exception &e)
-                {
-                    LogPrintf("%s: Could not resize vchData, %u, %s\n", __func__, smsg.nPayload, e.what());
-                    fclose(fp);
-                    return 1;
-                };
-
-                if (fread(&vchData[0], sizeof(uint8_t), smsg.nPayload, fp) != smsg.nPayload)
-                {
-                    LogPrintf("fread data failed: %s\n", strerror(errno));
-                    break;
-                };
+            // Remove wl file when scanned
+            smsgStore.Remove(fileTime);
+        } // cs_smsg
+    };
 
-                // Don't report to gui,
-                int rv = SecureMsgScanMessage(&smsg.hash[0], &vchData[0], smsg.nPayload, false);
+    LogPrintf("Processed %u files, scanned %u messages, received %u messages.\n", nFiles, nMessages, nFoundMessages);
+    LogPrintf("Took %d ms\n", GetTimeMillis() - mStart);
+#endif
+    return true;
+}
 
-                if (rv == 0)
-                {
-                    nFoundMessages++;
-                } else
-                if (rv != 0)
-                {
-                    // SecureMsgScanMessage failed
-                };
 
-                nMessages++;
-            };
+int SecureMsgWalletUnlocked()
+{
+#ifdef ENABLE_WALLET
+    /*
+    When the wallet is unlocked, scan messages received while wallet was locked.
+    The scan runs on the smsg-unlock thread, progress is shown by smsgscanstats.
+    */
+    if (!fSecMsgEnabled || !pwalletSmsg)
+        return 0;
 
-            fclose(fp);
+    LogPrintf("SecureMsgWalletUnlocked()\n");
 
-            // Remove wl file when scanned
-            try {
-                fs::remove((*itd).path());
-            } catch (const fs::filesystem_error &ex)
-            {
-                LogPrintf("Error removing wl file %s - %s\n", fileName, ex.what());
-                return 1;
-            };
-        } // cs_smsg
+    if (pwalletSmsg->IsLocked())
+    {
+        LogPrintf("Error: Wallet is locked.\n");
+        return 1;
     };
 
-    LogPrintf("Processed %u files, scanned %u messages, received %u messages.\n", nFiles, nMessages, nFoundMessages);
+    {
+        // Fetch the receive keys again on the next scan, GetKey fails while locked
+        LOCK(cs_smsg);
+        vScanKeys.clear();
+        vScanKeysFrom.clear();
+    }
 
-    // Notify gui
-    NotifySecMsgWalletUnlocked();
+    {
+        boost::unique_lock<boost::mutex> lock(mtxUnlockScan);
+        fUnlockScanRequested = true;
+    }
+    condUnlockScan.notify_one();
 #endif
     return 0;
 };
 
 
+void SecureMsgWalletLocked()
+{
+#ifdef ENABLE_WALLET
+    // Don't keep private keys in memory while the wallet is locked
+    LOCK(cs_smsg);
+    vScanKeys.clear();
+    vScanKeysFrom.clear();
+#endif
+};
+
 int SecureMsgWalletKeyChanged(CKeyID &keyId, const std::string &sLabel, ChangeType mode)
 {
     /*
@@ -2042,6 +3038,89 @@ int SecureMsgWalletKeyChanged(CKeyID &keyId, const std::string &sLabel, ChangeTy
     return 0;
 };
 
+#ifdef ENABLE_WALLET
+static int SecureMsgReceivedWith(const SecMsgScanKey &sk, uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, bool reportToGui)
+{
+    /*
+    Message MAC verified with sk, add to inbox db.
+
+    returns
+        0 success,
+        1 error
+        2 not accepted, sender is anonymous and address doesn't receive anon messages
+    */
+
+    CKeyID addressTo = sk.address;
+    MessageData msg; // placeholder
+
+    if (!sk.fReceiveAnon)
+    {
+        // Have to do full decrypt to see address from
+        if (SecureMsgDecrypt(false, addressTo, pHeader, pPayload, nPayload, msg) != 0)
+            return 1;
+        if (msg.sFromAddress.compare("anon") == 0)
+            return 2;
+    };
+
+    if (LogAcceptCategory(BCLog::SMSG))
+        LogPrintf("Decrypted message with %s.\n", CBitcoinAddress(addressTo).ToString());
+
+    // Save to inbox
+    SecureMessage *psmsg = (SecureMessage*) pHeader;
+    std::string sPrefix("im");
+    uint8_t chKey[18];
+    memcpy(&chKey[0],  sPrefix.data(),    2);
+    memcpy(&chKey[2],  &psmsg->timestamp, 8);
+    memcpy(&chKey[10], pPayload,          8);
+
+    SecMsgStored smsgInbox;
+    smsgInbox.timeReceived  = GetTime();
+    smsgInbox.status        = (SMSG_MASK_UNREAD) & 0xFF;
+    smsgInbox.addrTo        = addressTo;
+
+    // Data may not be contiguous
+    try { smsgInbox.vchMessage.resize(SMSG_HDR_LEN + nPayload); } catch (std::exception &e)
+    {
+        LogPrintf("SecureMsgScanMessage(): Could not resize vchData, %u, %s\n", SMSG_HDR_LEN + nPayload, e.what());
+        return 1;
+    };
+    memcpy(&smsgInbox.vchMessage[0], pHeader, SMSG_HDR_LEN);
+    memcpy(&smsgInbox.vchMessage[SMSG_HDR_LEN], pPayload, nPayload);
+
+    {
+        LOCK(cs_smsgDB);
+        SecMsgDB dbInbox;
+
+        if (dbInbox.Open("cw"))
+        {
+            if (dbInbox.ExistsSmesg(chKey))
+            {
+                LogPrint(BCLog::SMSG, "Message already exists in inbox db.\n");
+            } else
+            {
+                dbInbox.WriteSmesg(chKey, smsgInbox);
+
+                if (reportToGui)
+                    NotifySecMsgInboxChanged(smsgInbox);
+                LogPrintf("SecureMsg saved to inbox, received with %s.\n", CBitcoinAddress(addressTo).ToString());
+            };
+        };
+    } // cs_smsgDB
+
+    // notify an external script when a message comes in
+    std::string strCmd = gArgs.GetArg("-smsgnotify", "");
+
+    //TODO: Format message
+    if (!strCmd.empty())
+    {
+        boost::replace_all(strCmd, "%s", CBitcoinAddress(addressTo).ToString());
+        boost::thread t(runCommand, strCmd); // thread runs free
+    };
+
+    return 0;
+};
+#endif
+
 int SecureMsgScanMessage(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, bool reportToGui)
 {
 #ifdef ENABLE_WALLET
@@ -2067,107 +3146,42 @@ int SecureMsgScanMessage(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload,
         return 0;
     };
 
-    if (pwalletSmsg->IsLocked())
-    {
-        LogPrint(BCLog::SMSG, "%s: Wallet is locked, storing message to scan later.\n", __func__);
-
-        int rv;
-        if ((rv = SecureMsgStoreUnscanned(pHeader, pPayload, nPayload)) != 0)
-            return 1;
-
-        return 3;
-    };
-
-    CKeyID addressTo;
-    MessageData msg; // placeholder
-    bool fOwnMessage = false;
-
-    for (std::vector<SecMsgAddress>::iterator it = smsgAddresses.begin(); it != smsgAddresses.end(); ++it)
     {
-        if (!it->fReceiveEnabled)
-            continue;
-
-        addressTo = it->address;
-
-        if (!it->fReceiveAnon)
+        // cs_smsg keeps the unlock scan from removing the file being appended to
+        LOCK(cs_smsg);
+        if (pwalletSmsg->IsLocked())
         {
-            // Have to do full decrypt to see address from
-            if (SecureMsgDecrypt(false, addressTo, pHeader, pPayload, nPayload, msg) == 0)
-            {
-                if (LogAcceptCategory(BCLog::SMSG))
-                    LogPrintf("Decrypted message with %s.\n", CBitcoinAddress(addressTo).ToString());
+            LogPrint(BCLog::SMSG, "%s: Wallet is locked, storing message to scan later.\n", __func__);
 
-                if (msg.sFromAddress.compare("anon") != 0)
-                    fOwnMessage = true;
-                break;
-            };
-        } else
-        {
-            if (SecureMsgDecrypt(true, addressTo, pHeader, pPayload, nPayload, msg) == 0)
-            {
-                if (LogAcceptCategory(BCLog::SMSG))
-                    LogPrintf("Decrypted message with %s.\n", CBitcoinAddress(addressTo).ToString());
+            int rv;
+            if ((rv = SecureMsgStoreUnscanned(pHeader, pPayload, nPayload)) != 0)
+                return 1;
 
-                fOwnMessage = true;
-                break;
-            };
-        }
-    };
+            return 3;
+        };
+    } // cs_smsg
 
-    if (fOwnMessage)
+    SecMsgScanKey sk;
     {
-        // Save to inbox
-        SecureMessage *psmsg = (SecureMessage*) pHeader;
-        std::string sPrefix("im");
-        uint8_t chKey[18];
-        memcpy(&chKey[0],  sPrefix.data(),    2);
-        memcpy(&chKey[2],  &psmsg->timestamp, 8);
-        memcpy(&chKey[10], pPayload,          8);
-
-        SecMsgStored smsgInbox;
-        smsgInbox.timeReceived  = GetTime();
-        smsgInbox.status        = (SMSG_MASK_UNREAD) & 0xFF;
-        smsgInbox.addrTo        = addressTo;
-
-        // Data may not be contiguous
-        try { smsgInbox.vchMessage.resize(SMSG_HDR_LEN + nPayload); } catch (std::exception &e)
-        {
-            LogPrintf("SecureMsgScanMessage(): Could not resize vchData, %u, %s\n", SMSG_HDR_LEN + nPayload, e.what());
-            return 1;
-        };
-        memcpy(&smsgInbox.vchMessage[0], pHeader, SMSG_HDR_LEN);
-        memcpy(&smsgInbox.vchMessage[SMSG_HDR_LEN], pPayload, nPayload);
+        LOCK(cs_smsg);
+        SecureMsgUpdateScanKeys();
 
-        {
-            LOCK(cs_smsgDB);
-            SecMsgDB dbInbox;
+        uint64_t nTrials = 0;
+        int64_t nStart = GetTimeMicros();
+        int nKey = SecureMsgTrialDecrypt(vScanKeys, pHeader, pPayload, nPayload, nTrials);
 
-            if (dbInbox.Open("cw"))
-            {
-                if (dbInbox.ExistsSmesg(chKey))
-                {
-                    LogPrint(BCLog::SMSG, "Message already exists in inbox db.\n");
-                } else
-                {
-                    dbInbox.WriteSmesg(chKey, smsgInbox);
+        smsgScanStats.nScanned++;
+        smsgScanStats.nTrials += nTrials;
+        smsgScanStats.nTimeMicros += GetTimeMicros() - nStart;
 
-                    if (reportToGui)
-                        NotifySecMsgInboxChanged(smsgInbox);
-                    LogPrintf("SecureMsg saved to inbox, received with %s.\n", CBitcoinAddress(addressTo).ToString());
-                };
-            };
-        } // cs_smsgDB
+        if (nKey < 0)
+            return 0;
 
-        // notify an external script when a message comes in
-        std::string strCmd = gArgs.GetArg("-smsgnotify", "");
+        smsgScanStats.nReceived++;
+        sk = vScanKeys[nKey];
+    }
 
-        //TODO: Format message
-        if (!strCmd.empty())
-        {
-            boost::replace_all(strCmd, "%s", CBitcoinAddress(addressTo).ToString());
-            boost::thread t(runCommand, strCmd); // thread runs free
-        };
-    };
+    SecureMsgReceivedWith(sk, pHeader, pPayload, nPayload, reportToGui);
 #endif
     return 0;
 };
@@ -2300,54 +3314,11 @@ int SecureMsgRetrieve(SecMsgToken &token, std::vector<uint8_t> &vchData)
 {
     LogPrint(BCLog::SMSG, "SecureMsgRetrieve() %d.\n", token.timestamp);
 
-    // Has cs_smsg lock from SecureMsgReceiveData
-
-    fs::path pathSmsgDir = GetDataDir() / "smsgstore";
-
-    //LogPrintf("token.offset %d.\n", token.offset); // DEBUG
     int64_t bucket = token.timestamp - (token.timestamp % SMSG_BUCKET_LEN);
-    std::string fileName = std::to_string(bucket) + "_01.dat";
-    fs::path fullpath = pathSmsgDir / fileName;
-
-    //LogPrintf("bucket %d.\n", bucket);
-    //LogPrintf("bucket d %d.\n", bucket);
-    //LogPrintf("fileName %s.\n", fileName);
-
-    FILE *fp;
-    errno = 0;
-    if (!(fp = fopen(fullpath.string().c_str(), "rb")))
-        return errorN(1, "%s - Can't open file: %s\nPath %s.", __func__, strerror(errno), fullpath.string());
-
-    errno = 0;
-    if (fseek(fp, token.offset, SEEK_SET) != 0)
-    {
-        fclose(fp);
-        return errorN(1, "%s - fseek, strerror: %s.", __func__, strerror(errno));
-    };
-
-    SecureMessage smsg;
-    errno = 0;
-    if (fread(&smsg.hash[0], sizeof(uint8_t), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
-    {
-        fclose(fp);
-        return errorN(1, "%s - read header failed, strerror: %s.", __func__, strerror(errno));
-    };
-
-    try {vchData.resize(SMSG_HDR_LEN + smsg.nPayload);} catch (std::exception &e)
-    {
-        fclose(fp);
-        return errorN(1, "%s - Could not resize vchData, %u, %s.", __func__, SMSG_HDR_LEN + smsg.nPayload, e.what());
-    };
-
-    memcpy(&vchData[0], &smsg.hash[0], SMSG_HDR_LEN);
-    errno = 0;
-    if (fread(&vchData[SMSG_HDR_LEN], sizeof(uint8_t), smsg.nPayload, fp) != smsg.nPayload)
-    {
-        fclose(fp);
-        return errorN(1, "%s - fread data failed: %s. Wanted %u bytes.", __func__, strerror(errno), smsg.nPayload);
-    };
 
-    fclose(fp);
+    vchData.clear();
+    if (!smsgStore.Read(bucket, token.offset, vchData))
+        return errorN(1, "%s - Read from bucket %d failed, offset %d.", __func__, bucket, token.offset);
 
     return 0;
 };
@@ -2381,6 +3352,7 @@ int SecureMsgReceive(CNode *pfrom, std::vector<uint8_t> &vchData)
         return 1;
     };
 
+    SecMsgBucketShard &shard = smsgBuckets.GetShard(bktTime);
     std::map<int64_t, SecMsgBucket>::iterator itb;
 
     if (nBunch == 0 || nBunch > 500)
@@ -2389,12 +3361,12 @@ int SecureMsgReceive(CNode *pfrom, std::vector<uint8_t> &vchData)
         Misbehaving(pfrom->GetId(), 1);
 
         {
-            LOCK(cs_smsg);
+            LOCK(shard.cs);
             // Release lock on bucket if it exists
-            itb = smsgBuckets.find(bktTime);
-            if (itb != smsgBuckets.end())
+            itb = shard.buckets.find(bktTime);
+            if (itb != shard.buckets.end())
                 itb->second.nLockCount = 0;
-        } // cs_smsg
+        } // shard.cs
         return 1;
     };
 
@@ -2424,29 +3396,26 @@ int SecureMsgReceive(CNode *pfrom, std::vector<uint8_t> &vchData)
             continue;
         };
 
+        // Store message, but don't hash bucket
+        if (SecureMsgStore(&vchData[n], &vchData[n + SMSG_HDR_LEN], psmsg->nPayload, false) != 0)
         {
-            LOCK(cs_smsg);
-            // Store message, but don't hash bucket
-            if (SecureMsgStore(&vchData[n], &vchData[n + SMSG_HDR_LEN], psmsg->nPayload, false) != 0)
-            {
-                // message dropped
-                break; // continue?
-            };
+            // message dropped
+            break; // continue?
+        };
 
-            if (SecureMsgScanMessage(&vchData[n], &vchData[n + SMSG_HDR_LEN], psmsg->nPayload, true) != 0)
-            {
-                // message recipient is not this node (or failed)
-            };
-        } // cs_smsg
+        if (SecureMsgScanMessage(&vchData[n], &vchData[n + SMSG_HDR_LEN], psmsg->nPayload, true) != 0)
+        {
+            // message recipient is not this node (or failed)
+        };
 
         n += SMSG_HDR_LEN + psmsg->nPayload;
     };
 
     {
-        LOCK(cs_smsg);
+        LOCK(shard.cs);
         // If messages have been added, bucket must exist now
-        itb = smsgBuckets.find(bktTime);
-        if (itb == smsgBuckets.end())
+        itb = shard.buckets.find(bktTime);
+        if (itb == shard.buckets.end())
         {
             LogPrint(BCLog::SMSG, "Don't have bucket %d.\n", bktTime);
             return 1;
@@ -2455,7 +3424,7 @@ int SecureMsgReceive(CNode *pfrom, std::vector<uint8_t> &vchData)
         itb->second.nLockCount  = 0; // This node has received data from peer, release lock
         itb->second.nLockPeerId = 0;
         itb->second.hashBucket();
-    } // cs_smsg
+    } // shard.cs
 
     return 0;
 };
@@ -2518,11 +3487,7 @@ int SecureMsgStoreUnscanned(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPaylo
 
 int SecureMsgStore(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, bool fUpdateBucket)
 {
-    if (LogAcceptCategory(BCLog::SMSG))
-    {
-        LogPrintf("SecureMsgStore()\n");
-        AssertLockHeld(cs_smsg);
-    };
+    LogPrint(BCLog::SMSG, "SecureMsgStore()\n");
 
     if (!pHeader
         || !pPayload)
@@ -2532,17 +3497,6 @@ int SecureMsgStore(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, bool
 
     SecureMessage *psmsg = (SecureMessage*) pHeader;
 
-
-    long int ofs;
-    fs::path pathSmsgDir;
-    try {
-        pathSmsgDir = GetDataDir() / "smsgstore";
-        fs::create_directory(pathSmsgDir);
-    } catch (const fs::filesystem_error& ex)
-    {
-        return errorN(1, "Failed to create directory %s - %s.", pathSmsgDir.string(), ex.what());
-    };
-
     int64_t now = GetTime();
     if (psmsg->timestamp > now + SMSG_TIME_LEEWAY)
         return errorN(1, "%s: Message > now.", __func__);
@@ -2553,7 +3507,11 @@ int SecureMsgStore(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, bool
 
     SecMsgToken token(psmsg->timestamp, pPayload, nPayload, 0);
 
-    std::set<SecMsgToken>& tokenSet = smsgBuckets[bucket].setTokens;
+    SecMsgBucketShard &shard = smsgBuckets.GetShard(bucket);
+    LOCK(shard.cs);
+    SecMsgBucket &bkt = shard.buckets[bucket];
+
+    std::set<SecMsgToken>& tokenSet = bkt.setTokens;
     std::set<SecMsgToken>::iterator it;
     it = tokenSet.find(token);
     if (it != tokenSet.end())
@@ -2584,42 +3542,17 @@ int SecureMsgStore(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, bool
         return 1;
     };
 
-    std::string fileName = std::to_string(bucket) + "_01.dat";
-    fs::path fullpath = pathSmsgDir / fileName;
-
-    FILE *fp;
-    errno = 0;
-    if (!(fp = fopen(fullpath.string().c_str(), "ab")))
-    {
-        return errorN(1, "fopen failed: %s.", strerror(errno));
-    };
-
-    // On windows ftell will always return 0 after fopen(ab), call fseek to set.
-    errno = 0;
-    if (fseek(fp, 0, SEEK_END) != 0)
-    {
-        fclose(fp);
-        return errorN(1, "fseek failed: %s.", strerror(errno));
-    };
-    
-    ofs = ftell(fp);
-
-    if (fwrite(pHeader,  sizeof(uint8_t), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN
-     || fwrite(pPayload, sizeof(uint8_t),     nPayload, fp) != nPayload)
-    {
-        fclose(fp);
-        return errorN(1, "fwrite failed: %s.", strerror(errno));
-    };
-
-    fclose(fp);
+    int64_t ofs;
+    if (!smsgStore.Append(bucket, pHeader, pPayload, nPayload, ofs))
+        return errorN(1, "%s: Could not append to bucket file %d.", __func__, bucket);
 
     token.offset = ofs;
 
     //LogPrintf("token.offset: %d\n", token.offset); // DEBUG
-    tokenSet.insert(token);
+    bkt.InsertToken(token);
 
     if (fUpdateBucket)
-        smsgBuckets[bucket].hashBucket();
+        bkt.hashBucket();
 
     LogPrint(BCLog::SMSG, "SecureMsg added to bucket %d.\n", bucket);
 
@@ -2684,11 +3617,72 @@ int SecureMsgValidate(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload)
     return rv;
 };
 
+static bool SecureMsgTestPow(const uint8_t *pHeader, const uint8_t *pPayload, uint32_t nPayload, uint32_t nonce, uint8_t *sha256Hash)
+{
+    // pHeader must already contain nonce
+    uint8_t civ[32];
+    for (int i = 0; i < 32; i+=4)
+        memcpy(civ+i, &nonce, 4);
+
+    CHMAC_SHA256 ctx(&civ[0], 32);
+    ctx.Write(pHeader+4, SMSG_HDR_LEN-4);
+    ctx.Write(pPayload, nPayload);
+    ctx.Finalize(sha256Hash);
+
+    return sha256Hash[31] == 0
+        && sha256Hash[30] == 0
+        && (~(sha256Hash[29]) & ((1<<0) | (1<<1) | (1<<2)));
+};
+
+static void SecureMsgPowWorker(const uint8_t *pHeader, const uint8_t *pPayload, uint32_t nPayload,
+    uint32_t nFirst, uint32_t nStep, std::atomic<uint64_t> *pnBest, std::atomic<uint64_t> *pnTried)
+{
+    /*
+        Try nonces nFirst, nFirst + nStep, ... until a valid nonce is found or
+        the nonce passes the lowest valid nonce found by any worker.
+        The result is the same as a serial search from 0.
+    */
+
+    uint8_t header[SMSG_HDR_LEN];
+    memcpy(header, pHeader, SMSG_HDR_LEN);
+    SecureMessage *psmsg = (SecureMessage*) header;
+
+    uint8_t sha256Hash[32];
+    uint64_t nTried = 0;
+
+    for (uint64_t n = nFirst; n <= 0xFFFFFFFF; n += nStep)
+    {
+        if (n >= pnBest->load(std::memory_order_relaxed)
+            || !fSecMsgEnabled)
+            break;
+
+        uint32_t nonce = (uint32_t) n;
+        memcpy(&psmsg->nonce[0], &nonce, 4);
+        nTried++;
+
+        if (!SecureMsgTestPow(header, pPayload, nPayload, nonce, sha256Hash))
+            continue;
+
+        uint64_t nBest = pnBest->load();
+        while (n < nBest && !pnBest->compare_exchange_weak(nBest, n))
+        {};
+        break;
+    };
+
+    pnTried->fetch_add(nTried);
+};
+
 int SecureMsgSetHash(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload)
+{
+    return SecureMsgSetHash(pHeader, pPayload, nPayload, nSmsgPowThreads);
+};
+
+int SecureMsgSetHash(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, int nThreads)
 {
     /*  proof of work and checksum
 
         May run in a thread, if shutdown detected, return.
+        The nonce range is split over nThreads workers.
 
         returns:
             0 success
@@ -2700,63 +3694,23 @@ int SecureMsgSetHash(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload)
     SecureMessage* psmsg = (SecureMessage*) pHeader;
 
     int64_t nStart = GetTimeMillis();
-    uint8_t civ[32];
     uint8_t sha256Hash[32];
 
-    bool found = false;
+    nThreads = std::max(1, std::min(nThreads, SMSG_MAX_POW_THREADS));
 
-    uint32_t nonce = 0;
+    std::atomic<uint64_t> nBest(UINT64_MAX);
+    std::atomic<uint64_t> nTried(0);
 
-    //CBigNum bnTarget(2);
-    //bnTarget = bnTarget.pow(256 - 40);
-
-    // Break for HMAC_CTX_cleanup
-    for (;;)
+    if (nThreads == 1)
     {
-        if (!fSecMsgEnabled)
-           break;
-
-        //psmsg->timestamp = GetTime();
-        //memcpy(&psmsg->timestamp, &now, 8);
-        memcpy(&psmsg->nonce[0], &nonce, 4);
-
-        for (int i = 0; i < 32; i+=4)
-            memcpy(civ+i, &nonce, 4);
-
-        CHMAC_SHA256 ctx(&civ[0], 32);
-        ctx.Write((uint8_t*) pHeader+4, SMSG_HDR_LEN-4);
-        ctx.Write((uint8_t*) pPayload, nPayload);
-        ctx.Finalize(sha256Hash);
-
-        /*
-        if (CBigNum(vchHash) <= bnTarget)
-        {
-            found = true;
-            if (fDebugSmsg)
-                LogPrintf("Match %u\n", nonce);
-            break;
-        };
-        */
-
-        if (sha256Hash[31] == 0
-            && sha256Hash[30] == 0
-            && (~(sha256Hash[29]) & ((1<<0) | (1<<1) | (1<<2)) ))
-        //    && sha256Hash[29] == 0)
-        {
-            found = true;
-            //if (fDebugSmsg)
-            //    LogPrintf("Match %u\n", nonce);
-            break;
-        };
-
-        //if (nonce >= UINT32_MAX)
-        if (nonce >= 4294967295U)
-        {
-            LogPrint(BCLog::SMSG, "No match %u\n", nonce);
-            break;
-            //return 1;
-        };
-        nonce++;
+        SecureMsgPowWorker(pHeader, pPayload, nPayload, 0, 1, &nBest, &nTried);
+    } else
+    {
+        boost::thread_group threadGroupPow;
+        for (int i = 0; i < nThreads; ++i)
+            threadGroupPow.create_thread(boost::bind(&SecureMsgPowWorker,
+                pHeader, pPayload, nPayload, i, nThreads, &nBest, &nTried));
+        threadGroupPow.join_all();
     };
 
     if (!fSecMsgEnabled)
@@ -2765,15 +3719,22 @@ int SecureMsgSetHash(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload)
         return 2;
     };
 
-    if (!found)
+    if (nBest.load() > 0xFFFFFFFF)
     {
-        LogPrint(BCLog::SMSG, "%s: Failed, took %d ms, nonce %u\n", __func__, GetTimeMillis() - nStart, nonce);
+        LogPrint(BCLog::SMSG, "%s: Failed, took %d ms, tried %u nonces\n", __func__, GetTimeMillis() - nStart, nTried.load());
         return 1;
     };
 
+    uint32_t nonce = (uint32_t) nBest.load();
+    memcpy(&psmsg->nonce[0], &nonce, 4);
+    if (!SecureMsgTestPow(pHeader, pPayload, nPayload, nonce, sha256Hash))
+        return errorN(1, "%s: Nonce %u does not verify.", __func__, nonce);
+
     memcpy(psmsg->hash, sha256Hash, 4);
 
-    LogPrint(BCLog::SMSG, "%s: Took %d ms, nonce %u\n", __func__, GetTimeMillis() - nStart, nonce);
+    int64_t nTime = GetTimeMillis() - nStart;
+    LogPrint(BCLog::SMSG, "%s: Took %d ms, nonce %u, %d threads, %d nonces/s\n", __func__,
+        nTime, nonce, nThreads, nTime > 0 ? (int64_t)(nTried.load() * 1000 / nTime) : 0);
 
     return 0;
 };
@@ -12,6 +12,9 @@
 #include "serialize.h"
 #include "ui_interface.h"
 
+#include <atomic>
+#include <memory>
+
 
 
 const unsigned int SMSG_HDR_LEN        = 104;               // length of unencrypted header, 4 + 2 + 1 + 8 + 16 + 33 + 32 + 4 + 4
@@ -33,9 +36,25 @@ const unsigned int SMSG_MAX_AMSG_BYTES = 512;               // the user input pa
 // max size of payload worst case compression
 const unsigned int SMSG_MAX_MSG_WORST = LZ4_COMPRESSBOUND(SMSG_MAX_MSG_BYTES+SMSG_PL_HDR_LEN);
 
+const uint32_t SMSG_PROTOCOL_VERSION  = 3;                 // sent with smsgPing and smsgPong, peers that send none are version 0
+const uint32_t SMSG_MIN_RECON_VERSION = 1;                 // peer understands smsgRecon
+const uint32_t SMSG_MIN_RECON_RETRY_VERSION = 3;           // peer understands smsgRetry and sketches flagged SMSG_RECON_RETRY
+const uint32_t SMSG_MIN_DIGEST_VERSION = 2;                // peer sends and understands smsgInv with 64 bit bucket digests
+const uint32_t SMSG_INV_DIGEST        = 0x80000000;        // set in the smsgInv bucket count when entries hold digests
+
+const int SMSG_DEFAULT_POW_THREADS     = 1;
+const int SMSG_MAX_POW_THREADS         = 16;
+const int SMSG_DEFAULT_SCAN_THREADS    = 0;                 // 0 = one per core
+const int SMSG_MAX_SCAN_THREADS        = 16;
+const size_t SMSG_SCAN_BATCH           = 256;               // messages trial decrypted together when rescanning
+const size_t SMSG_BUCKET_SHARDS        = 16;                // smsgBuckets locks
+const size_t SMSG_UNLOCK_QUEUE         = 4;                 // batches read ahead of the trial decryption when the wallet is unlocked
+
 #define SMSG_MASK_UNREAD            (1 << 0)
 
 extern bool fSecMsgEnabled;
+extern int nSmsgPowThreads;
+extern int nSmsgScanThreads;
 
 class CWallet;
 class SecMsgStored;
@@ -46,19 +65,34 @@ extern boost::signals2::signal<void (SecMsgStored& inboxHdr)> NotifySecMsgInboxC
 // Outbox db changed, called with lock cs_smsgDB held.
 extern boost::signals2::signal<void (SecMsgStored& outboxHdr)> NotifySecMsgOutboxChanged;
 
-// Wallet unlocked, called after all messages received while locked have been processed.
+// Wallet unlocked, called from the unlock scan thread after all messages received while locked have been processed.
 extern boost::signals2::signal<void ()> NotifySecMsgWalletUnlocked;
 
+// Unlock scan progress, called from the unlock scan thread after each batch.
+extern boost::signals2::signal<void (uint32_t nFilesDone, uint32_t nFiles)> NotifySecMsgUnlockScanProgress;
+
 class SecMsgBucket;
+class SecMsgBucketSet;
 class SecMsgAddress;
 class SecMsgOptions;
+class SecMsgFileStore;
+class SecMsgReconStats;
+class SecMsgInvStats;
+class SecMsgScanStats;
+class SecMsgUnlockScan;
 
-extern std::map<int64_t, SecMsgBucket>  smsgBuckets;
+extern SecMsgBucketSet                  smsgBuckets;
 extern std::vector<SecMsgAddress>       smsgAddresses;
 extern SecMsgOptions                    smsgOptions;
+extern SecMsgFileStore                  smsgStore;
+extern SecMsgReconStats                 smsgReconStats;
+extern SecMsgInvStats                   smsgInvStats;
+extern std::atomic<uint64_t>            nSmsgInvVersion;    // bumped when a bucket's timeChanged advances or a bucket is removed
+extern SecMsgScanStats                  smsgScanStats;
+extern SecMsgUnlockScan                 smsgUnlockScan;
 extern CWallet                          *pwalletSmsg;
 
-extern CCriticalSection cs_smsg;            // all except inbox and outbox
+extern CCriticalSection cs_smsg;            // all except inbox, outbox, smsgBuckets and smsgStore
 
 #pragma pack(push, 1)
 class SecureMessage
@@ -136,19 +170,121 @@ public:
     {
         timeChanged     = 0;
         hash            = 0;
+        nDigest         = 0;
+        nDigestHashed   = 0;
+        fHashStale      = false;
         nLockCount      = 0;
         nLockPeerId     = 0;
+        nDeadBytes      = 0;
     };
 
+    // Returns false if the token is already in the bucket
+    bool InsertToken(const SecMsgToken &token);
+
+    // Call after inserting tokens, sets timeChanged if the contents changed
     void hashBucket();
 
+    // Hash sent to peers below SMSG_MIN_DIGEST_VERSION, only recomputed if tokens were inserted since
+    uint32_t GetLegacyHash();
+
     int64_t               timeChanged;
-    uint32_t              hash;           // token set should get ordered the same on each node
+    uint32_t              hash;           // legacy, XXH32 of the samples in set order, valid if !fHashStale
+    uint64_t              nDigest;        // sum of the token digests, order independent
+    uint64_t              nDigestHashed;  // nDigest at the last hashBucket
+    bool                  fHashStale;
     uint32_t              nLockCount;     // set when smsgWant first sent, unset at end of smsgMsg, ticks down in ThreadSecureMsg()
     NodeId                nLockPeerId;    // id of peer that bucket is locked for
+    int64_t               nDeadBytes;     // bytes in the bucket file no token points to, set when loaded
     std::set<SecMsgToken> setTokens;
 };
 
+class SecMsgBucketShard
+{
+public:
+    CCriticalSection                cs;
+    std::map<int64_t, SecMsgBucket> buckets;
+};
+
+/*
+    Buckets by time, split over SMSG_BUCKET_SHARDS maps with a lock each, so
+    peers working on different buckets don't serialise on one lock.
+    Consecutive buckets fall in different shards.
+    Lock order: cs_smsg, a shard, smsgStore. Never hold two shard locks.
+*/
+class SecMsgBucketSet
+{
+public:
+    SecMsgBucketShard &GetShard(int64_t nBucket)
+    {
+        return vShards[((uint64_t)nBucket / SMSG_BUCKET_LEN) % SMSG_BUCKET_SHARDS];
+    };
+
+    // Lock each shard in turn
+    size_t Size();
+    void Clear();
+
+    SecMsgBucketShard vShards[SMSG_BUCKET_SHARDS];
+};
+
+class SecMsgReconStats
+{
+public:
+    std::atomic<uint64_t> nSketchesSent{0};
+    std::atomic<uint64_t> nSketchBytes{0};  // sent, including the bucket headers
+    std::atomic<uint64_t> nSketchesReceived{0};
+    std::atomic<uint64_t> nDecoded{0};
+    std::atomic<uint64_t> nRetried{0};      // asked the peer for a larger sketch
+    std::atomic<uint64_t> nFailed{0};       // fell back to the full token list
+    std::atomic<int64_t>  nBytesSaved{0};   // against sending the full token list, negative if sketches failed
+};
+
+/*
+    smsgInv entries of the non empty buckets, shared by all peers.
+    Rebuilt when nSmsgInvVersion moves, entries are ordered by timeChanged
+    so the entries for a peer are the suffix from its lastMatched.
+*/
+class SecMsgInventory
+{
+public:
+    uint64_t             nVersion   = 0;
+    int64_t              nTimeBuilt = 0;    // taken before the buckets were read
+    std::vector<int64_t> vTimeChanged;      // ascending, one per entry
+    std::vector<uint8_t> vchDigest;         // 20 byte entries, time + count + digest
+    std::vector<uint8_t> vchLegacy;         // 16 byte entries, time + count + hash, only built once a peer below SMSG_MIN_DIGEST_VERSION asks
+};
+
+class SecMsgInvStats
+{
+public:
+    std::atomic<uint64_t> nRebuilds{0};
+    std::atomic<uint64_t> nSends{0};        // smsgInv messages sent
+    std::atomic<uint64_t> nUnchanged{0};    // send cycles skipped, peer was sent the current snapshot
+    std::atomic<uint64_t> nEntries{0};      // bucket headers sent
+};
+
+class SecMsgScanStats
+{
+public:
+    uint64_t nScanned           = 0;    // messages trial decrypted with the receive keys
+    uint64_t nReceived          = 0;    // messages a receive key's MAC verified with
+    uint64_t nTrials            = 0;    // shared secrets computed, one per message and key
+    int64_t  nTimeMicros        = 0;    // spent trial decrypting
+};
+
+class SecMsgUnlockScan
+{
+public:
+    bool     fRunning           = false;
+    uint32_t nFiles             = 0;    // wallet locked files found when the scan started
+    uint32_t nFilesDone         = 0;
+    uint64_t nBytes             = 0;    // left to scan, files resumed from a checkpoint count from there
+    uint64_t nBytesDone         = 0;
+    uint32_t nMessages          = 0;
+    uint32_t nFound             = 0;
+    int64_t  nTimeStarted       = 0;    // ms
+    int64_t  nTimeFinished      = 0;    // ms, 0 while running or if interrupted
+};
+
 class CBitcoinAddress_B : public CBitcoinAddress
 {
 public:
@@ -196,6 +332,14 @@ public:
     };
 };
 
+class SecMsgScanKey
+{
+public:
+    CKeyID  address;
+    CKey    key;
+    bool    fReceiveAnon;
+};
+
 class SecMsgOptions
 {
 public:
@@ -253,6 +397,7 @@ public:
 std::string SecureMsgGetHelpString(bool showDebug);
 
 int SecureMsgBuildBucketSet();
+int SecureMsgCompactBuckets();
 int SecureMsgAddWalletAddresses();
 
 int SecureMsgReadIni();
@@ -265,6 +410,7 @@ bool SecureMsgEnable(CWallet *pwallet);
 bool SecureMsgDisable();
 
 int SecureMsgReceiveData(CNode *pfrom, const std::string &strCommand, CDataStream &vRecv);
+std::shared_ptr<const SecMsgInventory> SecureMsgGetInventory(bool fLegacy);
 bool SecureMsgSendData(CNode *pto, bool fSendTrickle);
 
 bool SecureMsgScanBlock(const CBlock &block);
@@ -273,9 +419,13 @@ bool SecureMsgScanBlockChain();
 bool SecureMsgScanBuckets();
 
 int SecureMsgWalletUnlocked();
+void SecureMsgWalletLocked();
 int SecureMsgWalletKeyChanged(CKeyID &keyId, const std::string &sLabel, ChangeType mode);
 
 int SecureMsgScanMessage(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, bool reportToGui);
+/** Set vResult to the index in vKeys of the key each message at vOffsets in vchData decrypts with, or -1 */
+void SecureMsgTrialDecryptBatch(const std::vector<SecMsgScanKey> &vKeys, const std::vector<uint8_t> &vchData,
+    const std::vector<size_t> &vOffsets, std::vector<int> &vResult, int nThreads, uint64_t &nTrials);
 
 int SecureMsgGetStoredKey(CKeyID &ckid, CPubKey &cpkOut);
 int SecureMsgGetLocalKey(CKeyID &ckid, CPubKey &cpkOut);
@@ -296,6 +446,7 @@ int SecureMsgSend(CKeyID &addressFrom, CKeyID &addressTo, std::string &message,
 
 int SecureMsgValidate(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload);
 int SecureMsgSetHash (uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload);
+int SecureMsgSetHash (uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, int nThreads);
 
 int SecureMsgEncrypt(SecureMessage &smsg, const CKeyID &addressFrom, const CKeyID &addressTo, const std::string &message);
 
@@ -0,0 +1,585 @@
+// Copyright (c) 2017 The Particl Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "smsg/store.h"
+#include "smsg/smessage.h"
+
+#include "compat.h"
+#include "util.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+
+
+int64_t SecMsgIndexEntry::End() const
+{
+    return nOffset + SMSG_HDR_LEN + nPayload;
+};
+
+void SecMsgIndexEntry::Write(uint8_t *p) const
+{
+    memcpy(p, &nOffset, 8);
+    memcpy(p+8, &timestamp, 8);
+    memcpy(p+16, sample, 8);
+    memcpy(p+24, &nPayload, 4);
+};
+
+void SecMsgIndexEntry::Read(const uint8_t *p)
+{
+    memcpy(&nOffset, p, 8);
+    memcpy(&timestamp, p+8, 8);
+    memcpy(sample, p+16, 8);
+    memcpy(&nPayload, p+24, 4);
+};
+
+static void IndexEntryFromMessage(int64_t nOffset, const uint8_t *pHeader, const uint8_t *pPayload, uint32_t nPayload, SecMsgIndexEntry &entry)
+{
+    entry.nOffset = nOffset;
+    entry.timestamp = ((SecureMessage*) pHeader)->timestamp;
+    entry.nPayload = nPayload;
+    if (nPayload < 8) // payload will always be > 8, same as SecMsgToken
+        memset(entry.sample, 0, 8);
+    else
+        memcpy(entry.sample, pPayload, 8);
+};
+
+
+bool SecMsgBucketFile::Open(const fs::path &path, const fs::path &pathIndex)
+{
+    if (fp)
+        return true;
+
+    errno = 0;
+    if (!(fp = fsbridge::fopen(path, "a+b")))
+        return error("%s: fopen failed: %s.", __func__, strerror(errno));
+
+    // On windows ftell will always return 0 after fopen(ab), call fseek to set.
+    errno = 0;
+    if (fseek(fp, 0, SEEK_END) != 0)
+    {
+        fclose(fp);
+        fp = nullptr;
+        return error("%s: fseek failed: %s.", __func__, strerror(errno));
+    };
+
+    nFileSize = ftell(fp);
+    fUnsynced = false;
+    vPending.clear();
+    vPendingIndex.clear();
+
+    // A new bucket file starts a new index, an index left behind would point into it
+    errno = 0;
+    if (!(fpIndex = fsbridge::fopen(pathIndex, nFileSize == 0 ? "wb" : "ab")))
+    {
+        fclose(fp);
+        fp = nullptr;
+        return error("%s: fopen index failed: %s.", __func__, strerror(errno));
+    };
+
+    return true;
+};
+
+void SecMsgBucketFile::Close()
+{
+    if (!fp)
+        return;
+
+    Flush(true);
+    Unmap();
+
+    fclose(fp);
+    fp = nullptr;
+    std::vector<uint8_t>().swap(vPending);
+
+    fclose(fpIndex);
+    fpIndex = nullptr;
+    std::vector<uint8_t>().swap(vPendingIndex);
+};
+
+bool SecMsgBucketFile::Append(const uint8_t *pHeader, const uint8_t *pPayload, uint32_t nPayload, int64_t &nOffset)
+{
+    if (!fp)
+        return error("%s: File is not open.", __func__);
+
+    nOffset = nFileSize + vPending.size();
+
+    vPending.insert(vPending.end(), pHeader, pHeader + SMSG_HDR_LEN);
+    vPending.insert(vPending.end(), pPayload, pPayload + nPayload);
+
+    SecMsgIndexEntry entry;
+    IndexEntryFromMessage(nOffset, pHeader, pPayload, nPayload, entry);
+    size_t nIndexPos = vPendingIndex.size();
+    vPendingIndex.resize(nIndexPos + SMSG_INDEX_RECORD_LEN);
+    entry.Write(&vPendingIndex[nIndexPos]);
+
+    if (vPending.size() >= SMSG_STORE_WRITE_BUFFER)
+        return Flush(false);
+
+    return true;
+};
+
+bool SecMsgBucketFile::Flush(bool fSync)
+{
+    if (!fp)
+        return false;
+
+    if (vPending.size() > 0)
+    {
+        errno = 0;
+        if (fseek(fp, 0, SEEK_END) != 0) // Required between reads and writes on the same stream
+            return error("%s: fseek failed: %s.", __func__, strerror(errno));
+
+        if (fwrite(&vPending[0], sizeof(uint8_t), vPending.size(), fp) != vPending.size())
+            return error("%s: fwrite failed: %s.", __func__, strerror(errno));
+
+        nFileSize += vPending.size();
+        vPending.clear();
+        fUnsynced = true;
+    };
+
+    if (fflush(fp) != 0)
+        return error("%s: fflush failed: %s.", __func__, strerror(errno));
+
+    // After the messages, a record is never written before the message it points to
+    if (vPendingIndex.size() > 0)
+    {
+        if (fwrite(&vPendingIndex[0], sizeof(uint8_t), vPendingIndex.size(), fpIndex) != vPendingIndex.size())
+            return error("%s: fwrite index failed: %s.", __func__, strerror(errno));
+        vPendingIndex.clear();
+    };
+
+    if (fflush(fpIndex) != 0)
+        return error("%s: fflush index failed: %s.", __func__, strerror(errno));
+
+    if (fSync && fUnsynced)
+    {
+        FileCommit(fp);
+        FileCommit(fpIndex);
+        fUnsynced = false;
+    };
+
+    return true;
+};
+
+const uint8_t *SecMsgBucketFile::Slice(int64_t nOffset, size_t nLen)
+{
+    if (!fp || nOffset < 0)
+        return nullptr;
+
+    if (nOffset >= nFileSize)
+    {
+        // Not written out yet
+        size_t nPos = nOffset - nFileSize;
+        if (nPos + nLen > vPending.size())
+            return nullptr;
+        return &vPending[nPos];
+    };
+
+    if ((uint64_t)nOffset + nLen > (uint64_t)nFileSize)
+        return nullptr;
+
+#ifdef WIN32
+    try { vRead.resize(nLen); } catch (std::exception &e)
+    {
+        LogPrintf("%s: Could not resize vRead, %u, %s.\n", __func__, nLen, e.what());
+        return nullptr;
+    };
+
+    errno = 0;
+    if (fseek(fp, nOffset, SEEK_SET) != 0
+        || fread(&vRead[0], sizeof(uint8_t), nLen, fp) != nLen)
+    {
+        LogPrintf("%s: fread failed: %s.\n", __func__, strerror(errno));
+        return nullptr;
+    };
+    return &vRead[0];
+#else
+    if (nOffset + nLen > nMapped
+        && !Map(nFileSize))
+        return nullptr;
+
+    return pMap + nOffset;
+#endif
+};
+
+bool SecMsgBucketFile::Map(size_t nLen)
+{
+#ifndef WIN32
+    Unmap();
+
+    if (nLen < 1)
+        return false;
+
+    void *p = mmap(nullptr, nLen, PROT_READ, MAP_SHARED, fileno(fp), 0);
+    if (p == MAP_FAILED)
+        return error("%s: mmap failed: %s.", __func__, strerror(errno));
+
+    pMap = (uint8_t*) p;
+    nMapped = nLen;
+#endif
+    return true;
+};
+
+void SecMsgBucketFile::Unmap()
+{
+#ifndef WIN32
+    if (pMap)
+        munmap(pMap, nMapped);
+#endif
+    pMap = nullptr;
+    nMapped = 0;
+};
+
+
+void SecMsgFileStore::SetPath(const fs::path &path)
+{
+    LOCK(cs_store);
+    CloseAll();
+    pathStore = path;
+};
+
+SecMsgBucketFile *SecMsgFileStore::Get(int64_t nBucket)
+{
+    AssertLockHeld(cs_store);
+    std::map<int64_t, std::unique_ptr<SecMsgBucketFile> >::iterator it = mapFiles.find(nBucket);
+    if (it != mapFiles.end())
+    {
+        it->second->nLastUsed = ++nUseCounter;
+        return it->second.get();
+    };
+
+    if (mapFiles.size() >= SMSG_STORE_MAX_OPEN)
+    {
+        std::map<int64_t, std::unique_ptr<SecMsgBucketFile> >::iterator itOldest = mapFiles.begin();
+        for (it = mapFiles.begin(); it != mapFiles.end(); ++it)
+        {
+            if (it->second->nLastUsed < itOldest->second->nLastUsed)
+                itOldest = it;
+        };
+        mapFiles.erase(itOldest); // ~SecMsgBucketFile flushes
+    };
+
+    try {
+        fs::create_directory(pathStore);
+    } catch (const fs::filesystem_error &ex)
+    {
+        LogPrintf("%s: Failed to create directory %s - %s.\n", __func__, pathStore.string(), ex.what());
+        return nullptr;
+    };
+
+    std::unique_ptr<SecMsgBucketFile> file(new SecMsgBucketFile());
+    if (!file->Open(PathFile(nBucket), PathIndex(nBucket)))
+        return nullptr;
+
+    file->nLastUsed = ++nUseCounter;
+    SecMsgBucketFile *p = file.get();
+    mapFiles[nBucket] = std::move(file);
+
+    return p;
+};
+
+bool SecMsgFileStore::Append(int64_t nBucket, const uint8_t *pHeader, const uint8_t *pPayload, uint32_t nPayload, int64_t &nOffset)
+{
+    LOCK(cs_store);
+    SecMsgBucketFile *file = Get(nBucket);
+    if (!file)
+        return false;
+
+    return file->Append(pHeader, pPayload, nPayload, nOffset);
+};
+
+bool SecMsgFileStore::Read(int64_t nBucket, int64_t nOffset, std::vector<uint8_t> &vchData)
+{
+    LOCK(cs_store);
+    SecMsgBucketFile *file = Get(nBucket);
+    if (!file)
+        return false;
+
+    const uint8_t *p;
+    if (!(p = file->Slice(nOffset, SMSG_HDR_LEN)))
+        return error("%s: Bad offset %d in bucket %d.", __func__, nOffset, nBucket);
+
+    uint32_t nPayload = ((SecureMessage*) p)->nPayload;
+    if (nPayload > SMSG_MAX_MSG_WORST)
+        return error("%s: Bad payload size %u in bucket %d.", __func__, nPayload, nBucket);
+
+    if (!(p = file->Slice(nOffset, SMSG_HDR_LEN + nPayload)))
+        return error("%s: Truncated message at %d in bucket %d.", __func__, nOffset, nBucket);
+
+    try { vchData.insert(vchData.end(), p, p + SMSG_HDR_LEN + nPayload); } catch (std::exception &e)
+    {
+        return error("%s: Could not resize vchData, %u, %s.", __func__, SMSG_HDR_LEN + nPayload, e.what());
+    };
+
+    return true;
+};
+
+bool SecMsgFileStore::FlushAll(bool fSync)
+{
+    LOCK(cs_store);
+    bool fRet = true;
+    for (auto &file : mapFiles)
+    {
+        if (!file.second->Flush(fSync))
+            fRet = false;
+    };
+    return fRet;
+};
+
+void SecMsgFileStore::Close(int64_t nBucket)
+{
+    LOCK(cs_store);
+    mapFiles.erase(nBucket);
+};
+
+void SecMsgFileStore::CloseAll()
+{
+    LOCK(cs_store);
+    mapFiles.clear();
+};
+
+void SecMsgFileStore::Remove(int64_t nBucket)
+{
+    LOCK(cs_store);
+    mapFiles.erase(nBucket);
+
+    try {
+        fs::remove(PathFile(nBucket));
+        fs::remove(PathIndex(nBucket));
+    } catch (const fs::filesystem_error &ex)
+    {
+        LogPrintf("Error removing bucket file %d, %s.\n", nBucket, ex.what());
+    };
+};
+
+fs::path SecMsgFileStore::PathFile(int64_t nBucket) const
+{
+    return pathStore / (std::to_string(nBucket) + "_01.dat");
+};
+
+fs::path SecMsgFileStore::PathIndex(int64_t nBucket) const
+{
+    return pathStore / (std::to_string(nBucket) + "_01.idx");
+};
+
+bool SecMsgFileStore::LoadIndex(int64_t nBucket, std::vector<SecMsgIndexEntry> &vEntries, int64_t &nFileSize)
+{
+    LOCK(cs_store);
+    mapFiles.erase(nBucket); // write out pending messages
+
+    vEntries.clear();
+    try {
+        nFileSize = fs::file_size(PathFile(nBucket));
+    } catch (const fs::filesystem_error &ex)
+    {
+        return error("%s: Bucket %d, %s.", __func__, nBucket, ex.what());
+    };
+
+    int64_t nCovered = 0;
+    int64_t nIndexSize = -1;
+    FILE *fp;
+    if ((fp = fsbridge::fopen(PathIndex(nBucket), "rb")))
+    {
+        uint8_t record[SMSG_INDEX_RECORD_LEN];
+        while (fread(record, sizeof(uint8_t), SMSG_INDEX_RECORD_LEN, fp) == SMSG_INDEX_RECORD_LEN)
+        {
+            SecMsgIndexEntry entry;
+            entry.Read(record);
+
+            // Records must cover the bucket file from the start without gaps, anything else is read from the file
+            if (entry.nOffset != nCovered
+                || entry.nPayload > SMSG_MAX_MSG_WORST
+                || entry.End() > nFileSize)
+                break;
+
+            nCovered = entry.End();
+            vEntries.push_back(entry);
+        };
+
+        if (fseek(fp, 0, SEEK_END) == 0)
+            nIndexSize = ftell(fp);
+        fclose(fp);
+    };
+
+    if (nCovered < nFileSize
+        && !ScanFile(nBucket, nCovered, vEntries))
+        return false;
+
+    if (nIndexSize != (int64_t)(vEntries.size() * SMSG_INDEX_RECORD_LEN))
+    {
+        LogPrint(BCLog::SMSG, "Rewriting index of bucket %d, %u messages, %d bytes read from the bucket file.\n",
+            nBucket, vEntries.size(), nFileSize - nCovered);
+        if (!WriteIndex(nBucket, vEntries))
+            return false;
+    };
+
+    return true;
+};
+
+bool SecMsgFileStore::ScanFile(int64_t nBucket, int64_t nFrom, std::vector<SecMsgIndexEntry> &vEntries)
+{
+    LOCK(cs_store);
+    mapFiles.erase(nBucket); // write out pending messages
+
+    FILE *fp;
+    errno = 0;
+    if (!(fp = fsbridge::fopen(PathFile(nBucket), "rb")))
+        return error("%s: fopen failed: %s.", __func__, strerror(errno));
+
+    int64_t nSize = 0;
+    if (fseek(fp, 0, SEEK_END) != 0
+        || (nSize = ftell(fp)) < 0
+        || fseek(fp, nFrom, SEEK_SET) != 0)
+    {
+        fclose(fp);
+        return error("%s: fseek failed: %s.", __func__, strerror(errno));
+    };
+
+    SecureMessage smsg;
+    uint8_t sample[8];
+    int64_t nOffset = nFrom;
+    for (;;)
+    {
+        errno = 0;
+        if (fread(&smsg.hash[0], sizeof(uint8_t), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
+        {
+            if (errno != 0)
+                LogPrintf("%s: fread header failed: %s\n", __func__, strerror(errno));
+            break;
+        };
+
+        if (smsg.nPayload > SMSG_MAX_MSG_WORST)
+        {
+            LogPrintf("%s: Bad payload size %u at %d in bucket %d.\n", __func__, smsg.nPayload, nOffset, nBucket);
+            break;
+        };
+
+        size_t nSample = std::min(smsg.nPayload, (uint32_t)8);
+        if (fread(sample, sizeof(uint8_t), nSample, fp) != nSample
+            || fseek(fp, smsg.nPayload - nSample, SEEK_CUR) != 0)
+        {
+            LogPrintf("%s: Truncated message at %d in bucket %d.\n", __func__, nOffset, nBucket);
+            break;
+        };
+
+        SecMsgIndexEntry entry;
+        IndexEntryFromMessage(nOffset, &smsg.hash[0], sample, smsg.nPayload, entry);
+
+        // fseek can move past the end of the file
+        if (entry.End() > nSize)
+        {
+            LogPrintf("%s: Truncated message at %d in bucket %d.\n", __func__, nOffset, nBucket);
+            break;
+        };
+
+        nOffset = entry.End();
+        vEntries.push_back(entry);
+    };
+
+    fclose(fp);
+    return true;
+};
+
+bool SecMsgFileStore::WriteIndex(int64_t nBucket, const std::vector<SecMsgIndexEntry> &vEntries)
+{
+    AssertLockHeld(cs_store);
+
+    std::vector<uint8_t> vchIndex(vEntries.size() * SMSG_INDEX_RECORD_LEN);
+    for (size_t i = 0; i < vEntries.size(); ++i)
+        vEntries[i].Write(&vchIndex[i * SMSG_INDEX_RECORD_LEN]);
+
+    fs::path pathIndex = PathIndex(nBucket);
+    fs::path pathTmp = pathIndex;
+    pathTmp += ".tmp";
+
+    FILE *fp;
+    errno = 0;
+    if (!(fp = fsbridge::fopen(pathTmp, "wb")))
+        return error("%s: fopen failed: %s.", __func__, strerror(errno));
+
+    if (vchIndex.size() > 0
+        && fwrite(&vchIndex[0], sizeof(uint8_t), vchIndex.size(), fp) != vchIndex.size())
+    {
+        fclose(fp);
+        return error("%s: fwrite failed: %s.", __func__, strerror(errno));
+    };
+
+    FileCommit(fp);
+    fclose(fp);
+
+    if (!RenameOver(pathTmp, pathIndex))
+        return error("%s: Rename failed for bucket %d.", __func__, nBucket);
+
+    return true;
+};
+
+bool SecMsgFileStore::Compact(int64_t nBucket, std::vector<int64_t> &vOffsets)
+{
+    LOCK(cs_store);
+
+    SecMsgBucketFile *file = Get(nBucket);
+    if (!file)
+        return false;
+    if (!file->Flush(false))
+        return false;
+
+    fs::path pathFile = PathFile(nBucket);
+    fs::path pathTmp = pathFile;
+    pathTmp += ".tmp";
+
+    FILE *fp;
+    errno = 0;
+    if (!(fp = fsbridge::fopen(pathTmp, "wb")))
+        return error("%s: fopen failed: %s.", __func__, strerror(errno));
+
+    std::vector<SecMsgIndexEntry> vEntries;
+    vEntries.reserve(vOffsets.size());
+    int64_t nOut = 0;
+    for (const auto nOffset : vOffsets)
+    {
+        const uint8_t *p;
+        uint32_t nPayload = 0;
+        if (!(p = file->Slice(nOffset, SMSG_HDR_LEN))
+            || (nPayload = ((SecureMessage*) p)->nPayload) > SMSG_MAX_MSG_WORST
+            || !(p = file->Slice(nOffset, SMSG_HDR_LEN + nPayload))
+            || fwrite(p, sizeof(uint8_t), SMSG_HDR_LEN + nPayload, fp) != SMSG_HDR_LEN + nPayload)
+        {
+            fclose(fp);
+            boost::system::error_code ec;
+            fs::remove(pathTmp, ec);
+            return error("%s: Could not copy message at %d in bucket %d.", __func__, nOffset, nBucket);
+        };
+
+        SecMsgIndexEntry entry;
+        IndexEntryFromMessage(nOut, p, p + SMSG_HDR_LEN, nPayload, entry);
+        nOut = entry.End();
+        vEntries.push_back(entry);
+    };
+
+    FileCommit(fp);
+    fclose(fp);
+
+    // Without an index the bucket file is scanned on startup, the old index must not outlive the old file
+    mapFiles.erase(nBucket);
+    boost::system::error_code ec;
+    fs::remove(PathIndex(nBucket), ec);
+    if (ec)
+    {
+        fs::remove(pathTmp, ec);
+        return error("%s: Could not remove index of bucket %d.", __func__, nBucket);
+    };
+
+    if (!RenameOver(pathTmp, pathFile))
+        return error("%s: Rename failed for bucket %d.", __func__, nBucket);
+
+    for (size_t i = 0; i < vEntries.size(); ++i)
+        vOffsets[i] = vEntries[i].nOffset;
+
+    // The bucket file has been replaced, a missing index is rebuilt on startup
+    if (!WriteIndex(nBucket, vEntries))
+        LogPrintf("%s: Index of bucket %d not written.\n", __func__, nBucket);
+
+    return true;
+};
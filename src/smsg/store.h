@@ -0,0 +1,144 @@
+// Copyright (c) 2017 The Particl Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef PARTICL_SMSG_STORE_H
+#define PARTICL_SMSG_STORE_H
+
+#include "fs.h"
+#include "sync.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <map>
+#include <memory>
+#include <vector>
+
+const size_t SMSG_STORE_WRITE_BUFFER = 256 * 1024;  // pending appends are written out when they exceed this
+const size_t SMSG_STORE_MAX_OPEN     = 64;          // max bucket files held open, least recently used is closed first
+const size_t SMSG_INDEX_RECORD_LEN   = 8 + 8 + 8 + 4;   // offset, timestamp, sample, nPayload
+
+/*
+    A message in a bucket file, as recorded in the bucket's index file
+    (smsgstore/<bucket>_01.idx).
+    The index lets the token set be loaded without reading the bucket file.
+*/
+class SecMsgIndexEntry
+{
+public:
+    int64_t  nOffset = 0;
+    int64_t  timestamp = 0;
+    uint8_t  sample[8] = {0};
+    uint32_t nPayload = 0;
+
+    int64_t End() const;    // offset of the next message
+
+    void Write(uint8_t *p) const;
+    void Read(const uint8_t *p);
+};
+
+/*
+    An open bucket file (smsgstore/<bucket>_01.dat) and its index.
+
+    Appends are collected in vPending and written out by Flush(),
+    reads are served from a read only mapping of the file or from vPending.
+    A message is always either wholly in the file or wholly in vPending.
+    Index records are written after the messages they point to, a record
+    past the end of the bucket file is dropped when the index is loaded.
+*/
+class SecMsgBucketFile
+{
+public:
+    SecMsgBucketFile() {};
+    ~SecMsgBucketFile() { Close(); };
+
+    bool Open(const fs::path &path, const fs::path &pathIndex);
+    void Close();
+
+    bool Append(const uint8_t *pHeader, const uint8_t *pPayload, uint32_t nPayload, int64_t &nOffset);
+    bool Flush(bool fSync);
+
+    // Returned pointer is valid until the next call to Append, Flush or Close
+    const uint8_t *Slice(int64_t nOffset, size_t nLen);
+
+    int64_t nLastUsed = 0;
+
+private:
+    bool Map(size_t nLen);
+    void Unmap();
+
+    FILE *fp = nullptr;
+    FILE *fpIndex = nullptr;
+    int64_t nFileSize = 0;              // bytes in the file, excluding vPending
+    bool fUnsynced = false;             // written but not yet committed to disk
+    std::vector<uint8_t> vPending;
+    std::vector<uint8_t> vPendingIndex;
+    uint8_t *pMap = nullptr;
+    size_t nMapped = 0;
+#ifdef WIN32
+    std::vector<uint8_t> vRead;
+#endif
+};
+
+/*
+    Keeps bucket files open for the retention window so SecureMsgStore and
+    SecureMsgRetrieve don't reopen a file per message.
+    Addressed by bucket time and SecMsgToken.offset, the on disk format is unchanged.
+
+    Thread safe, taken after a smsgBuckets shard lock when both are held.
+*/
+class SecMsgFileStore
+{
+public:
+    void SetPath(const fs::path &path);
+
+    bool Append(int64_t nBucket, const uint8_t *pHeader, const uint8_t *pPayload, uint32_t nPayload, int64_t &nOffset);
+
+    // Appends the message at nOffset (header + payload) to vchData
+    bool Read(int64_t nBucket, int64_t nOffset, std::vector<uint8_t> &vchData);
+
+    // fSync: also commit to disk, called periodically from ThreadSecureMsg
+    bool FlushAll(bool fSync);
+
+    // Close before the file is removed or read by other means
+    void Close(int64_t nBucket);
+    void CloseAll();
+
+    // Close and delete the bucket file and its index
+    void Remove(int64_t nBucket);
+
+    /*
+        Messages in the bucket file, read from the index.
+        Messages past the end of the index are read from the bucket file and the
+        index is rewritten, as it is when the index is missing or doesn't match.
+        nFileSize is set to the size of the bucket file.
+    */
+    bool LoadIndex(int64_t nBucket, std::vector<SecMsgIndexEntry> &vEntries, int64_t &nFileSize);
+
+    // Read the headers of the messages in the bucket file from nFrom, the path taken without an index
+    bool ScanFile(int64_t nBucket, int64_t nFrom, std::vector<SecMsgIndexEntry> &vEntries);
+
+    /*
+        Rewrite the bucket file with only the messages at the offsets in vOffsets,
+        in that order, vOffsets is set to the new offsets.
+        The new file and index replace the old ones once complete.
+    */
+    bool Compact(int64_t nBucket, std::vector<int64_t> &vOffsets);
+
+    size_t CountOpen() const { LOCK(cs_store); return mapFiles.size(); };
+
+    fs::path PathFile(int64_t nBucket) const;
+    fs::path PathIndex(int64_t nBucket) const;
+
+private:
+    SecMsgBucketFile *Get(int64_t nBucket);
+    bool WriteIndex(int64_t nBucket, const std::vector<SecMsgIndexEntry> &vEntries);
+
+    mutable CCriticalSection cs_store;
+
+    fs::path pathStore;
+    int64_t nUseCounter = 0;
+    std::map<int64_t, std::unique_ptr<SecMsgBucketFile> > mapFiles;
+};
+
+#endif // PARTICL_SMSG_STORE_H
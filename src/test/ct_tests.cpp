@@ -13,6 +13,13 @@
 #include <boost/test/unit_test.hpp>
 
 #include "blind.h"
+#include "checkqueue.h"
+#include "validation.h"
+#include "consensus/tx_verify.h"
+#include "consensus/validation.h"
+#include "primitives/transaction.h"
+
+#include <boost/thread/thread.hpp>
 
 BOOST_FIXTURE_TEST_SUITE(ct_tests, BasicTestingSetup)
 
@@ -181,6 +188,62 @@ BOOST_AUTO_TEST_CASE(ct_parameters_test)
     };
 }
 
+BOOST_AUTO_TEST_CASE(ct_sign_rangeproofs_test)
+{
+    ECC_Start_Blinding();
+    
+    // Proofs signed on worker threads must match the proofs signed one by one
+    const size_t nOutputs = 6;
+    std::vector<secp256k1_pedersen_commitment> vCommitments(nOutputs * 2);
+    std::vector<std::vector<uint8_t> > vRangeproofs(nOutputs * 2);
+    std::vector<CRangeproofSignData> vSerial(nOutputs), vParallel(nOutputs);
+    
+    for (size_t k = 0; k < nOutputs; ++k)
+    {
+        CRangeproofSignData &d = vSerial[k];
+        d.nValue = (k + 1) * COIN + k;
+        GetStrongRandBytes(d.blind, 32);
+        GetStrongRandBytes(d.nonce, 32);
+        d.nExponent = 2;
+        d.nBits = 32;
+        BOOST_CHECK(0 == SelectRangeProofParameters(d.nValue, d.nMinValue, d.nExponent, d.nBits));
+        d.sMessage = "narration";
+        
+        vParallel[k] = d;
+        vSerial[k].pCommitment = &vCommitments[k];
+        vSerial[k].pvRangeproof = &vRangeproofs[k];
+        vParallel[k].pCommitment = &vCommitments[nOutputs + k];
+        vParallel[k].pvRangeproof = &vRangeproofs[nOutputs + k];
+        
+        BOOST_CHECK(0 == SignRangeproof(vSerial[k]));
+    };
+    
+    size_t nFailed = 0;
+    BOOST_CHECK(0 == SignRangeproofs(vParallel, nFailed));
+    
+    for (size_t k = 0; k < nOutputs; ++k)
+    {
+        BOOST_CHECK(memcmp(vCommitments[k].data, vCommitments[nOutputs + k].data, 33) == 0);
+        BOOST_CHECK(vRangeproofs[k].size() > 0);
+        BOOST_CHECK(vRangeproofs[k] == vRangeproofs[nOutputs + k]);
+        
+        uint64_t min_value, max_value;
+        BOOST_CHECK(1 == secp256k1_rangeproof_verify(secp256k1_ctx_blind, &min_value, &max_value,
+            &vCommitments[nOutputs + k], vRangeproofs[nOutputs + k].data(), vRangeproofs[nOutputs + k].size(),
+            nullptr, 0, secp256k1_generator_h));
+    };
+    
+    // The first failed output is reported
+    vParallel[3].nValue = 0;
+    vParallel[3].nMinValue = 1;
+    vParallel[4].nValue = 0;
+    vParallel[4].nMinValue = 1;
+    BOOST_CHECK(2 == SignRangeproofs(vParallel, nFailed));
+    BOOST_CHECK(nFailed == 3);
+    
+    ECC_Stop_Blinding();
+}
+
 BOOST_AUTO_TEST_CASE(ct_commitment_test)
 {
     secp256k1_context *ctx = secp256k1_context_create(SECP256K1_CONTEXT_SIGN | SECP256K1_CONTEXT_VERIFY);
@@ -206,4 +269,82 @@ BOOST_AUTO_TEST_CASE(ct_commitment_test)
     secp256k1_context_destroy(ctx);
 }
 
+BOOST_AUTO_TEST_CASE(ct_deferred_rangeproof_test)
+{
+    ECC_Start_Blinding();
+
+    CMutableTransaction txn;
+    txn.nVersion = PARTICL_TXN_VERSION;
+    txn.vin.push_back(CTxIn(GetRandHash(), 0));
+
+    OUTPUT_PTR<CTxOutData> outFee = MAKE_OUTPUT<CTxOutData>();
+    outFee->vData.push_back(DO_FEE);
+    PutVarInt(outFee->vData, 10000);
+    txn.vpout.push_back(outFee);
+
+    for (size_t k = 0; k < 4; ++k)
+    {
+        CKey ephemeral_key;
+        ephemeral_key.MakeNewKey(true);
+        uint8_t blind[32];
+        GetStrongRandBytes(blind, 32);
+        CAmount nValue = (k + 1) * COIN;
+
+        OUTPUT_PTR<CTxOutCT> out = MAKE_OUTPUT<CTxOutCT>();
+        CPubKey pkEphem = ephemeral_key.GetPubKey();
+        out->vData.assign(pkEphem.begin(), pkEphem.end());
+        BOOST_REQUIRE(secp256k1_pedersen_commit(secp256k1_ctx_blind, &out->commitment, blind, nValue, secp256k1_generator_h));
+
+        size_t nRangeProofLen = 5134;
+        out->vRangeproof.resize(nRangeProofLen);
+        BOOST_REQUIRE(secp256k1_rangeproof_sign(secp256k1_ctx_blind,
+            &out->vRangeproof[0], &nRangeProofLen, 0, &out->commitment,
+            blind, ephemeral_key.begin(), 2, 32, nValue,
+            nullptr, 0, nullptr, 0, secp256k1_generator_h));
+        out->vRangeproof.resize(nRangeProofLen);
+        txn.vpout.push_back(out);
+    };
+
+    CCheckQueue<CRangeproofBatchCheck> queue(2);
+    boost::thread_group tg;
+    for (size_t i = 0; i < 2; ++i)
+        tg.create_thread([&]{queue.Thread();});
+
+    CTransaction tx(txn);
+    CValidationState state;
+    std::vector<CRangeproofCheck> vChecks;
+    BOOST_CHECK(CheckTransaction(tx, state, true, &vChecks));
+    BOOST_CHECK(vChecks.size() == 4);
+    BOOST_CHECK(CheckRangeproofs(vChecks, state, &queue));
+    BOOST_CHECK(CheckRangeproofs(vChecks, state, nullptr));
+    BOOST_CHECK(CheckTransaction(tx, state));
+
+    // A bad proof fails the deferred check with the same reason as the inline check
+    ((CTxOutCT*)txn.vpout[3].get())->vRangeproof[100] ^= 1;
+    CTransaction txBad(txn);
+    vChecks.clear();
+    BOOST_CHECK(CheckTransaction(txBad, state, true, &vChecks));
+    BOOST_CHECK(!CheckRangeproofs(vChecks, state, &queue));
+    BOOST_CHECK(state.GetRejectReason() == "bad-ctout-rangeproof-verify");
+
+    CValidationState stateInline;
+    BOOST_CHECK(!CheckTransaction(txBad, stateInline));
+    BOOST_CHECK(stateInline.GetRejectReason() == "bad-ctout-rangeproof-verify");
+
+    // Proofs verified for the mempool are found in the cache when the block is checked, a bad proof is never cached
+    uint64_t nHits, nMisses, nHitsBefore, nMissesBefore;
+    GetRangeproofCacheStats(nHitsBefore, nMissesBefore);
+    vChecks.clear();
+    BOOST_CHECK(CheckTransaction(txBad, state, true, &vChecks, false));
+    BOOST_CHECK(!CheckRangeproofs(vChecks, state, nullptr));
+    GetRangeproofCacheStats(nHits, nMisses);
+    BOOST_CHECK(nHits == nHitsBefore + 3);
+    BOOST_CHECK(nMisses == nMissesBefore + 1);
+
+    tg.interrupt_all();
+    tg.join_all();
+
+    ECC_Stop_Blinding();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
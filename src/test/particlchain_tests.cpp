@@ -256,4 +256,52 @@ BOOST_AUTO_TEST_CASE(opiscoinstake_test)
 }
 
 
+BOOST_AUTO_TEST_CASE(stake_kernel_search_test)
+{
+    CBlockIndex indexPrev;
+    indexPrev.nHeight = 1000;
+    indexPrev.nTime = 1510000000;
+    indexPrev.bnStakeModifier = GetRandHash();
+    
+    // Easy target, a kernel of value v COIN passes with probability v/128
+    arith_uint256 bnTarget = (~arith_uint256(0) >> 1) / (64 * COIN);
+    uint32_t nBits = bnTarget.GetCompact();
+    
+    CStakeKernelSearch search;
+    std::vector<COutPoint> vPrevouts;
+    for (size_t i = 0; i < 2 * KERNEL_SEARCH_CHUNK_SIZE + 100; ++i)
+    {
+        vPrevouts.push_back(COutPoint(GetRandHash(), i % 3));
+        BOOST_CHECK(search.AddCandidate(indexPrev.bnStakeModifier, nBits, i, vPrevouts.back(), indexPrev.nTime - 3600, (1 + (i % 64)) * COIN));
+    };
+    BOOST_CHECK(search.size() == vPrevouts.size());
+    
+    uint32_t nTime = indexPrev.nTime + 16;
+    std::vector<bool> vPass(search.size());
+    for (size_t i = 0; i < search.size(); ++i)
+    {
+        uint256 hashProofOfStake, targetProofOfStake;
+        vPass[i] = CheckStakeKernelHash(&indexPrev, nBits, indexPrev.nTime - 3600, (1 + (i % 64)) * COIN,
+            vPrevouts[i], nTime, hashProofOfStake, targetProofOfStake);
+        BOOST_CHECK(search.GetKernelHash(i, nTime) == hashProofOfStake);
+    };
+    
+    // Each search returns the next passing kernel, threaded or not
+    for (int nThreads : {1, 4})
+    {
+        size_t nStart = 0;
+        for (size_t i = 0; i < search.size(); ++i)
+        {
+            if (!vPass[i])
+                continue;
+            BOOST_CHECK(search.Find(nTime, nStart, nThreads) == (int64_t)i);
+            nStart = i + 1;
+        };
+        BOOST_CHECK(search.Find(nTime, nStart, nThreads) == -1);
+    };
+    
+    // Kernels can't be older than their output
+    BOOST_CHECK(search.Find(indexPrev.nTime - 3601, 0, 4) == -1);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
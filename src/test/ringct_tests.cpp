@@ -6,6 +6,9 @@
 
 #include "crypto/sha256.h"
 #include "key/stealth.h"
+#include "anon.h"
+#include "txdb.h"
+#include "random.h"
 
 #include <secp256k1.h>
 #include <secp256k1_rangeproof.h>
@@ -707,5 +710,223 @@ BOOST_AUTO_TEST_CASE(ringct_test_set_have)
     BOOST_CHECK(setHaveI.insert(2).second == true);
 }
 
+BOOST_FIXTURE_TEST_CASE(ringct_test_rct_output_cache, TestingSetup)
+{
+    CBlockTreeDB db(1 << 20, true);
+    BOOST_CHECK(db.LoadRCTOutputCache());
+    
+    std::vector<CAnonOutput> vao(5);
+    for (size_t i = 0; i < vao.size(); ++i)
+    {
+        CKey key;
+        key.MakeNewKey(true);
+        CPubKey pk = key.GetPubKey();
+        memcpy(vao[i].pubkey.ncbegin(), pk.begin(), 33);
+        GetRandBytes(vao[i].commitment.data, 33);
+        vao[i].outpoint = COutPoint(GetRandHash(), i);
+        vao[i].nBlockHeight = 100 + i;
+        BOOST_CHECK(db.WriteRCTOutput(i+1, vao[i]));
+    };
+    BOOST_CHECK(db.WriteLastRCTOutput(vao.size()));
+    BOOST_CHECK(db.rctOutputCache.GetLast() == 5);
+    
+    // Out of sequence outputs are not cached
+    BOOST_CHECK(db.WriteRCTOutput(7, vao[0]));
+    BOOST_CHECK(db.rctOutputCache.GetLast() == 5);
+    BOOST_CHECK(db.EraseRCTOutput(7));
+    BOOST_CHECK(db.rctOutputCache.GetLast() == 5);
+    
+    for (size_t i = 0; i < vao.size(); ++i)
+    {
+        CAnonOutput ao;
+        BOOST_CHECK(db.rctOutputCache.Get(i+1, ao));
+        BOOST_CHECK(ao.pubkey == vao[i].pubkey);
+        BOOST_CHECK(memcmp(ao.commitment.data, vao[i].commitment.data, 33) == 0);
+        BOOST_CHECK(ao.nBlockHeight == vao[i].nBlockHeight);
+    };
+    CAnonOutput ao;
+    BOOST_CHECK(!db.rctOutputCache.Get(0, ao));
+    BOOST_CHECK(!db.rctOutputCache.Get(6, ao));
+    BOOST_CHECK(!db.ReadRCTOutputCached(6, ao));
+    
+    // Rolling back the index drops the outputs from memory
+    BOOST_CHECK(db.EraseRCTOutput(5));
+    BOOST_CHECK(db.EraseRCTOutput(4));
+    BOOST_CHECK(db.WriteLastRCTOutput(3));
+    BOOST_CHECK(db.rctOutputCache.GetLast() == 3);
+    BOOST_CHECK(!db.ReadRCTOutputCached(4, ao));
+    
+    // Reloading from the db gives the same outputs
+    db.rctOutputCache.Clear();
+    BOOST_CHECK(!db.rctOutputCache.Get(1, ao));
+    BOOST_CHECK(db.ReadRCTOutputCached(1, ao));
+    BOOST_CHECK(ao.outpoint == vao[0].outpoint);
+    BOOST_CHECK(db.LoadRCTOutputCache());
+    BOOST_CHECK(db.rctOutputCache.GetLast() == 3);
+    BOOST_CHECK(db.rctOutputCache.Get(3, ao));
+    BOOST_CHECK(ao.pubkey == vao[2].pubkey);
+}
+
+BOOST_FIXTURE_TEST_CASE(ringct_test_key_image_filter, TestingSetup)
+{
+    CBlockTreeDB db(1 << 20, true);
+    
+    std::vector<CCmpPubKey> vki(10);
+    std::vector<uint256> vtxhash(vki.size());
+    for (size_t i = 0; i < vki.size(); ++i)
+    {
+        CKey key;
+        key.MakeNewKey(true);
+        vki[i] = CCmpPubKey(key.GetPubKey());
+        vtxhash[i] = GetRandHash();
+    };
+    
+    // Key images written before the filter is loaded are read from the db
+    BOOST_CHECK(!db.keyImageFilter.IsEnabled());
+    for (size_t i = 0; i < 5; ++i)
+        BOOST_CHECK(db.WriteRCTKeyImage(vki[i], vtxhash[i]));
+    BOOST_CHECK(db.LoadRCTIndexFilters());
+    BOOST_CHECK(db.keyImageFilter.IsEnabled());
+    
+    for (size_t i = 5; i < vki.size(); ++i)
+        BOOST_CHECK(db.WriteRCTKeyImage(vki[i], vtxhash[i]));
+    
+    uint256 txhash;
+    for (size_t i = 0; i < vki.size(); ++i)
+    {
+        BOOST_CHECK(db.keyImageFilter.MaybeContains(vki[i]));
+        BOOST_CHECK(db.ReadRCTKeyImage(vki[i], txhash));
+        BOOST_CHECK(txhash == vtxhash[i]);
+    };
+    
+    // Unspent key images are rejected by the filter
+    size_t nFalsePositives = 0;
+    for (size_t i = 0; i < 1000; ++i)
+    {
+        CKey key;
+        key.MakeNewKey(true);
+        CCmpPubKey ki(key.GetPubKey());
+        if (db.keyImageFilter.MaybeContains(ki))
+            nFalsePositives++;
+        BOOST_CHECK(!db.ReadRCTKeyImage(ki, txhash));
+    };
+    BOOST_CHECK(nFalsePositives < 5);
+    
+    // Erased key images stay in the filter but are not found
+    BOOST_CHECK(db.EraseRCTKeyImage(vki[0]));
+    BOOST_CHECK(db.keyImageFilter.MaybeContains(vki[0]));
+    BOOST_CHECK(!db.ReadRCTKeyImage(vki[0], txhash));
+    
+    // Reloading drops erased key images
+    BOOST_CHECK(db.LoadRCTIndexFilters());
+    BOOST_CHECK(!db.ReadRCTKeyImage(vki[0], txhash));
+    for (size_t i = 1; i < vki.size(); ++i)
+        BOOST_CHECK(db.ReadRCTKeyImage(vki[i], txhash));
+    
+    db.keyImageFilter.Clear();
+    BOOST_CHECK(db.keyImageFilter.MaybeContains(vki[0]));
+    BOOST_CHECK(db.ReadRCTKeyImage(vki[1], txhash));
+}
+
+BOOST_FIXTURE_TEST_CASE(ringct_test_rct_index_write_cache, TestingSetup)
+{
+    CBlockTreeDB db(1 << 20, true);
+    BOOST_CHECK(db.LoadRCTIndexFilters());
+    
+    CKey key;
+    key.MakeNewKey(true);
+    CCmpPubKey pk(key.GetPubKey());
+    key.MakeNewKey(true);
+    CCmpPubKey ki(key.GetPubKey());
+    uint256 txhash = GetRandHash();
+    
+    CAnonOutput ao;
+    ao.pubkey = pk;
+    GetRandBytes(ao.commitment.data, 33);
+    ao.outpoint = COutPoint(txhash, 0);
+    ao.nBlockHeight = 250;
+    
+    BOOST_CHECK(db.WriteRCTOutput(1, ao));
+    BOOST_CHECK(db.WriteRCTOutputLink(pk, 1));
+    BOOST_CHECK(db.WriteLastRCTOutput(1));
+    BOOST_CHECK(db.WriteRCTOutputCheckpoint(250, 1));
+    BOOST_CHECK(db.WriteRCTKeyImage(ki, txhash));
+    BOOST_CHECK(db.RCTIndexCacheUsage() > 0);
+    
+    // Pending changes are seen by reads before they reach the db
+    int64_t nIndex = 0;
+    uint256 txhashKI;
+    CAnonOutput aoRead;
+    BOOST_CHECK(db.ReadRCTOutputLink(pk, nIndex) && nIndex == 1);
+    BOOST_CHECK(db.ReadRCTOutput(1, aoRead) && aoRead.outpoint == ao.outpoint);
+    BOOST_CHECK(db.ReadLastRCTOutput(nIndex) && nIndex == 1);
+    BOOST_CHECK(db.ReadRCTOutputCheckpoint(250, nIndex) && nIndex == 1);
+    BOOST_CHECK(db.ReadRCTKeyImage(ki, txhashKI) && txhashKI == txhash);
+    BOOST_CHECK(!db.Exists(std::make_pair(DB_RCTOUTPUT_LINK, pk)));
+    BOOST_CHECK(!db.Exists(std::make_pair(DB_RCTOUTPUT, (int64_t)1)));
+    BOOST_CHECK(!db.Exists(std::make_pair(DB_RCTKEYIMAGE, ki)));
+    
+    BOOST_CHECK(db.FlushRCTIndex());
+    BOOST_CHECK(db.RCTIndexCacheUsage() == 0);
+    BOOST_CHECK(db.Exists(std::make_pair(DB_RCTOUTPUT_LINK, pk)));
+    BOOST_CHECK(db.Exists(std::make_pair(DB_RCTOUTPUT, (int64_t)1)));
+    BOOST_CHECK(db.Exists(std::make_pair(DB_RCTKEYIMAGE, ki)));
+    BOOST_CHECK(db.Exists(std::make_pair(DB_RCTOUTPUT_CHECKPOINT, 250)));
+    BOOST_CHECK(db.ReadRCTOutput(1, aoRead) && aoRead.outpoint == ao.outpoint);
+    
+    // Pending erases hide the db entries until flushed
+    BOOST_CHECK(db.EraseRCTOutputLink(pk));
+    BOOST_CHECK(db.EraseRCTKeyImage(ki));
+    BOOST_CHECK(!db.ReadRCTOutputLink(pk, nIndex));
+    BOOST_CHECK(!db.ReadRCTKeyImage(ki, txhashKI));
+    BOOST_CHECK(db.Exists(std::make_pair(DB_RCTOUTPUT_LINK, pk)));
+    
+    // The last change to a key is the one written
+    BOOST_CHECK(db.WriteRCTOutputLink(pk, 2));
+    BOOST_CHECK(db.ReadRCTOutputLink(pk, nIndex) && nIndex == 2);
+    BOOST_CHECK(db.FlushRCTIndex());
+    BOOST_CHECK(db.ReadRCTOutputLink(pk, nIndex) && nIndex == 2);
+    BOOST_CHECK(!db.Exists(std::make_pair(DB_RCTKEYIMAGE, ki)));
+    BOOST_CHECK(!db.ReadRCTKeyImage(ki, txhashKI));
+}
+
+BOOST_FIXTURE_TEST_CASE(ringct_test_decoy_selection, TestingSetup)
+{
+    CBlockTreeDB db(1 << 20, true);
+    BOOST_CHECK(db.LoadRCTIndexFilters());
+    
+    // Ten outputs per block from height 100
+    for (int64_t i = 1; i <= 200; ++i)
+    {
+        CAnonOutput ao;
+        GetRandBytes(ao.commitment.data, 33);
+        ao.outpoint = COutPoint(GetRandHash(), 0);
+        ao.nBlockHeight = 100 + (i-1) / 10;
+        BOOST_CHECK(db.WriteRCTOutput(i, ao));
+    };
+    BOOST_CHECK(db.WriteLastRCTOutput(200));
+    
+    int64_t nIndex = -1;
+    BOOST_CHECK(db.ReadLastRCTOutputAtHeight(99, nIndex) && nIndex == 0);
+    BOOST_CHECK(db.ReadLastRCTOutputAtHeight(100, nIndex) && nIndex == 10);
+    BOOST_CHECK(db.ReadLastRCTOutputAtHeight(114, nIndex) && nIndex == 150);
+    BOOST_CHECK(db.ReadLastRCTOutputAtHeight(500, nIndex) && nIndex == 200);
+    
+    std::vector<int64_t> vIndices = {150, 3, 77};
+    std::vector<CAnonOutput> vao;
+    BOOST_CHECK(db.ReadRCTOutputsCached(vIndices, vao));
+    BOOST_CHECK(vao.size() == 3 && vao[0].nBlockHeight == 114 && vao[1].nBlockHeight == 100 && vao[2].nBlockHeight == 107);
+    
+    // Every usable output is picked once before running out
+    CDecoySelector selector(150, 20, 60);
+    std::set<int64_t> setHave = {1, 75, 150};
+    for (size_t k = 0; k < 147; ++k)
+    {
+        BOOST_CHECK(selector.Pick(setHave, nIndex));
+        BOOST_CHECK(nIndex >= 1 && nIndex <= 150);
+    };
+    BOOST_CHECK(setHave.size() == 150);
+    BOOST_CHECK(!selector.Pick(setHave, nIndex));
+}
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -3,8 +3,12 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "smsg/smessage.h"
+#include "smsg/recon.h"
+#include "smsg/db.h"
+#include "smsg/store.h"
 
 #include "test/test_particl.h"
+#include "hash.h"
 #include "net.h"
 
 #ifdef ENABLE_WALLET
@@ -27,6 +31,385 @@ BOOST_AUTO_TEST_CASE(smsg_test_ckeyId_inits_null)
     BOOST_CHECK(k.IsNull());
 }
 
+BOOST_AUTO_TEST_CASE(smsg_test_pow_threads)
+{
+    // Split nonce range must find the same (lowest) nonce as a single thread
+    std::vector<uint8_t> vchA(SMSG_HDR_LEN + 256), vchB;
+    for (size_t i = 0; i < vchA.size(); ++i)
+        vchA[i] = i & 0xFF;
+    SecureMessage *psmsg = (SecureMessage*) &vchA[0];
+    psmsg->version[0] = 2;
+    psmsg->nPayload = 256;
+    vchB = vchA;
+
+    bool fEnabled = fSecMsgEnabled;
+    fSecMsgEnabled = true;
+
+    int rv = 0;
+    BOOST_CHECK_MESSAGE(0 == (rv = SecureMsgSetHash(&vchA[0], &vchA[SMSG_HDR_LEN], 256, 1)), "SecureMsgSetHash " << rv);
+    BOOST_CHECK_MESSAGE(0 == (rv = SecureMsgSetHash(&vchB[0], &vchB[SMSG_HDR_LEN], 256, 4)), "SecureMsgSetHash " << rv);
+    BOOST_CHECK(vchA == vchB);
+    BOOST_CHECK_MESSAGE(0 == (rv = SecureMsgValidate(&vchB[0], &vchB[SMSG_HDR_LEN], 256)), "SecureMsgValidate " << rv);
+
+    fSecMsgEnabled = fEnabled;
+}
+
+BOOST_AUTO_TEST_CASE(smsg_test_bucket_digest)
+{
+    std::vector<SecMsgToken> vTokens(100);
+    for (size_t i = 0; i < vTokens.size(); ++i)
+    {
+        vTokens[i].timestamp = 1500000000 + i;
+        GetRandBytes(vTokens[i].sample, 8);
+        vTokens[i].offset = i;
+    };
+
+    SecMsgBucket bucketA, bucketB;
+    for (size_t i = 0; i < vTokens.size(); ++i)
+    {
+        BOOST_CHECK(bucketA.InsertToken(vTokens[i]));
+        BOOST_CHECK(bucketB.InsertToken(vTokens[vTokens.size() - 1 - i]));
+    };
+    BOOST_CHECK(!bucketA.InsertToken(vTokens[0]));
+    bucketA.hashBucket();
+    bucketB.hashBucket();
+
+    BOOST_CHECK(bucketA.nDigest == bucketB.nDigest);
+    BOOST_CHECK(bucketA.GetLegacyHash() == bucketB.GetLegacyHash());
+    BOOST_CHECK(bucketA.timeChanged > 0);
+
+    uint64_t nDigest = bucketA.nDigest;
+    uint32_t nHash = bucketA.GetLegacyHash();
+    SecMsgToken token = vTokens[0];
+    token.sample[0] ^= 1;
+    BOOST_CHECK(bucketA.InsertToken(token));
+    BOOST_CHECK(bucketA.nDigest != nDigest);
+    BOOST_CHECK(bucketA.GetLegacyHash() != nHash);
+}
+
+BOOST_AUTO_TEST_CASE(smsg_test_bucket_shards)
+{
+    std::unique_ptr<SecMsgBucketSet> buckets(new SecMsgBucketSet());
+
+    // Consecutive buckets fall in different shards
+    int64_t nBucket = 1500000000 - (1500000000 % SMSG_BUCKET_LEN);
+    for (size_t i = 0; i < SMSG_BUCKET_SHARDS; ++i)
+        for (size_t k = i + 1; k < SMSG_BUCKET_SHARDS; ++k)
+            BOOST_CHECK(&buckets->GetShard(nBucket + i * SMSG_BUCKET_LEN) != &buckets->GetShard(nBucket + k * SMSG_BUCKET_LEN));
+    BOOST_CHECK(&buckets->GetShard(nBucket) == &buckets->GetShard(nBucket + SMSG_BUCKET_SHARDS * SMSG_BUCKET_LEN));
+
+    for (size_t i = 0; i < 40; ++i)
+    {
+        int64_t nTime = nBucket + i * SMSG_BUCKET_LEN;
+        SecMsgBucketShard &shard = buckets->GetShard(nTime);
+        LOCK(shard.cs);
+        shard.buckets[nTime].timeChanged = nTime;
+    };
+    BOOST_CHECK(buckets->Size() == 40);
+
+    buckets->Clear();
+    BOOST_CHECK(buckets->Size() == 0);
+}
+
+BOOST_AUTO_TEST_CASE(smsg_test_inventory)
+{
+    smsgBuckets.Clear();
+
+    std::shared_ptr<const SecMsgInventory> inv = SecureMsgGetInventory(false);
+    BOOST_CHECK(inv->vTimeChanged.empty());
+    BOOST_CHECK(SecureMsgGetInventory(false) == inv); // unchanged, not rebuilt
+
+    // Older buckets changed last
+    int64_t nBucket = 1500000000 - (1500000000 % SMSG_BUCKET_LEN);
+    for (int64_t i = 0; i < 3; ++i)
+    {
+        int64_t nTime = nBucket + i * SMSG_BUCKET_LEN;
+        SecMsgToken token;
+        token.timestamp = nTime;
+        GetRandBytes(token.sample, 8);
+        token.offset = 0;
+
+        SecMsgBucketShard &shard = smsgBuckets.GetShard(nTime);
+        LOCK(shard.cs);
+        SecMsgBucket &bkt = shard.buckets[nTime];
+        bkt.InsertToken(token);
+        bkt.hashBucket();
+        bkt.timeChanged = 1000 - i;
+    };
+
+    std::shared_ptr<const SecMsgInventory> inv1 = SecureMsgGetInventory(false);
+    BOOST_CHECK(inv1 != inv);
+    BOOST_CHECK(inv1->nVersion > inv->nVersion);
+    BOOST_REQUIRE(inv1->vTimeChanged.size() == 3);
+    BOOST_CHECK(std::is_sorted(inv1->vTimeChanged.begin(), inv1->vTimeChanged.end()));
+    BOOST_CHECK(inv1->vchDigest.size() == 3 * 20);
+    BOOST_CHECK(inv1->vchLegacy.empty());
+
+    int64_t nFirst;
+    memcpy(&nFirst, &inv1->vchDigest[0], 8);
+    BOOST_CHECK(nFirst == nBucket + 2 * SMSG_BUCKET_LEN);
+
+    // Legacy entries are added on the first request
+    std::shared_ptr<const SecMsgInventory> inv2 = SecureMsgGetInventory(true);
+    BOOST_CHECK(inv2->vchLegacy.size() == 3 * 16);
+    BOOST_CHECK(inv2->vchDigest == inv1->vchDigest);
+
+    smsgBuckets.Clear();
+    BOOST_CHECK(SecureMsgGetInventory(false)->vTimeChanged.empty());
+}
+
+BOOST_AUTO_TEST_CASE(smsg_test_sketch)
+{
+    // Two copies of a bucket of 2000 tokens, each missing a few of the other's
+    // Fixed samples, a few small differences fail to decode at random
+    const int64_t nBucket = 1500000000;
+    std::vector<SecMsgToken> vTokens(2000);
+    for (size_t i = 0; i < vTokens.size(); ++i)
+    {
+        vTokens[i].timestamp = nBucket + i % 600;
+        uint64_t nSample = CSipHasher(0, 0).Write(i).Finalize();
+        memcpy(vTokens[i].sample, &nSample, 8);
+        vTokens[i].offset = i;
+    };
+
+    uint32_t nCells = SecMsgSketch::CellsFor(6 + SMSG_RECON_SLACK);
+    BOOST_CHECK(nCells % 3 == 0);
+    SecMsgSketch sketchA(nBucket, nCells), sketchB(nBucket, nCells);
+    for (size_t i = 0; i < vTokens.size(); ++i)
+    {
+        if (i % 500 != 1) // B has 4 that A doesn't
+            sketchA.Insert(vTokens[i]);
+        if (i % 1000 != 7) // A has 2 that B doesn't
+            sketchB.Insert(vTokens[i]);
+    };
+
+    // Over the wire
+    std::vector<uint8_t> vchData(SecMsgSketch::SerializedSize(nCells));
+    sketchA.Write(&vchData[0]);
+    SecMsgSketch sketchPeer(nBucket, nCells);
+    sketchPeer.Read(&vchData[0]);
+
+    sketchB.Subtract(sketchPeer);
+    std::vector<SecMsgToken> vHave, vMissing;
+    BOOST_CHECK(sketchB.Decode(vHave, vMissing));
+    BOOST_CHECK(vHave.size() == 4);
+    BOOST_CHECK(vMissing.size() == 2);
+    std::set<SecMsgToken> setHave(vHave.begin(), vHave.end());
+    for (size_t i = 1; i < vTokens.size(); i += 500)
+        BOOST_CHECK(setHave.count(vTokens[i]) == 1);
+    std::set<SecMsgToken> setMissing(vMissing.begin(), vMissing.end());
+    BOOST_CHECK(setMissing.count(vTokens[7]) == 1 && setMissing.count(vTokens[1007]) == 1);
+
+    // Difference too large for the sketch
+    SecMsgSketch sketchC(nBucket, nCells);
+    for (size_t i = 0; i < 100; ++i)
+        sketchC.Insert(vTokens[i]);
+    SecMsgSketch sketchEmpty(nBucket, nCells);
+    sketchC.Subtract(sketchEmpty);
+    vHave.clear();
+    vMissing.clear();
+    BOOST_CHECK(!sketchC.Decode(vHave, vMissing));
+
+    // Sized from the difference in counts, not the number of tokens in the bucket
+    BOOST_CHECK(SecMsgSketch::CellsForBucket(2000, 1997) == SecMsgSketch::CellsFor(3 + SMSG_RECON_SLACK));
+    BOOST_CHECK(SecMsgSketch::CellsForBucket(2000, 1997) < SecMsgSketch::CellsForBucket(2000, 1900));
+    BOOST_CHECK(16 + SecMsgSketch::SerializedSize(SecMsgSketch::CellsForBucket(2000, 1997)) < 2000 * 16 / 50);
+
+    // Equal counts with different contents, 3 tokens on each side, retried with a doubled sketch
+    nCells = SecMsgSketch::CellsForBucket(1997, 1997);
+    uint32_t nRetryCells = SecMsgSketch::CellsForBucket(1997, 1997, true);
+    BOOST_CHECK(nCells == SecMsgSketch::CellsFor(SMSG_RECON_SLACK));
+    BOOST_CHECK(nRetryCells == 2 * nCells);
+    int nDecodedFirst = 0, nFailed = 0;
+    for (int k = 0; k < 200; ++k)
+    {
+        for (size_t i = 0; i < vTokens.size(); ++i)
+            GetRandBytes(vTokens[i].sample, 8);
+
+        bool fDecoded = false;
+        for (uint32_t n : {nCells, nRetryCells})
+        {
+            SecMsgSketch sketchD(nBucket, n), sketchE(nBucket, n);
+            for (size_t i = 0; i < vTokens.size(); ++i)
+            {
+                if (i % 1000 != 3 && i != 11) // E has 3 that D doesn't
+                    sketchD.Insert(vTokens[i]);
+                if (i % 1000 != 5 && i != 13) // D has 3 that E doesn't
+                    sketchE.Insert(vTokens[i]);
+            };
+            sketchE.Subtract(sketchD);
+            vHave.clear();
+            vMissing.clear();
+            if (sketchE.Decode(vHave, vMissing))
+            {
+                BOOST_CHECK(vHave.size() == 3 && vMissing.size() == 3);
+                fDecoded = true;
+                if (n == nCells)
+                    nDecodedFirst++;
+                break;
+            };
+        };
+        if (!fDecoded)
+            nFailed++;
+    };
+    BOOST_CHECK(nDecodedFirst > 100);
+    BOOST_CHECK(nFailed < 20); // ~3% expected
+
+    // A retry must be larger than the first sketch and still worth sending
+    BOOST_CHECK(SecMsgSketch::CellsForBucket(53, 50) > 0);
+    BOOST_CHECK(SecMsgSketch::CellsForBucket(53, 50, true) == 0);
+
+    // Too few tokens for a sketch to be smaller than the token list
+    BOOST_CHECK(SecMsgSketch::CellsForBucket(10, 8) == 0);
+}
+
+BOOST_AUTO_TEST_CASE(smsg_test_store_index)
+{
+    const int64_t nBucket = 1500000000 - (1500000000 % SMSG_BUCKET_LEN);
+    const uint32_t nPayload = 64;
+
+    fs::path pathStore = GetDataDir() / "smsgstore_test";
+    SecMsgFileStore store;
+    store.SetPath(pathStore);
+
+    std::vector<std::vector<uint8_t> > vMessages(10);
+    std::vector<int64_t> vOffsets(vMessages.size());
+    for (size_t i = 0; i < vMessages.size(); ++i)
+    {
+        vMessages[i].resize(SMSG_HDR_LEN + nPayload);
+        GetRandBytes(&vMessages[i][0], vMessages[i].size());
+        ((SecureMessage*) &vMessages[i][0])->timestamp = nBucket + i;
+        ((SecureMessage*) &vMessages[i][0])->nPayload = nPayload;
+        BOOST_CHECK(store.Append(nBucket, &vMessages[i][0], &vMessages[i][SMSG_HDR_LEN], nPayload, vOffsets[i]));
+    };
+    store.CloseAll();
+
+    std::vector<SecMsgIndexEntry> vEntries, vScanned;
+    int64_t nFileSize;
+    BOOST_REQUIRE(store.LoadIndex(nBucket, vEntries, nFileSize));
+    BOOST_REQUIRE(vEntries.size() == vMessages.size());
+    BOOST_CHECK(nFileSize == (int64_t)(vMessages.size() * (SMSG_HDR_LEN + nPayload)));
+    BOOST_REQUIRE(store.ScanFile(nBucket, 0, vScanned));
+    BOOST_REQUIRE(vScanned.size() == vEntries.size());
+    for (size_t i = 0; i < vEntries.size(); ++i)
+    {
+        BOOST_CHECK(vEntries[i].nOffset == vOffsets[i]);
+        BOOST_CHECK(vEntries[i].timestamp == (int64_t)(nBucket + i));
+        BOOST_CHECK(memcmp(vEntries[i].sample, &vMessages[i][SMSG_HDR_LEN], 8) == 0);
+        BOOST_CHECK(vScanned[i].nOffset == vEntries[i].nOffset);
+        BOOST_CHECK(memcmp(vScanned[i].sample, vEntries[i].sample, 8) == 0);
+    };
+
+    // Index missing the last records, the rest is read from the bucket file
+    fs::resize_file(store.PathIndex(nBucket), 3 * SMSG_INDEX_RECORD_LEN);
+    BOOST_REQUIRE(store.LoadIndex(nBucket, vEntries, nFileSize));
+    BOOST_CHECK(vEntries.size() == vMessages.size());
+    BOOST_CHECK(fs::file_size(store.PathIndex(nBucket)) == vMessages.size() * SMSG_INDEX_RECORD_LEN);
+
+    // A truncated message is dropped
+    fs::resize_file(store.PathFile(nBucket), nFileSize - 10);
+    BOOST_REQUIRE(store.LoadIndex(nBucket, vEntries, nFileSize));
+    BOOST_CHECK(vEntries.size() == vMessages.size() - 1);
+
+    // Keep every other message
+    std::vector<int64_t> vKeep;
+    for (size_t i = 0; i < vMessages.size() - 1; i += 2)
+        vKeep.push_back(vOffsets[i]);
+    BOOST_REQUIRE(store.Compact(nBucket, vKeep));
+    BOOST_REQUIRE(store.LoadIndex(nBucket, vEntries, nFileSize));
+    BOOST_REQUIRE(vEntries.size() == vKeep.size());
+    BOOST_CHECK(nFileSize == (int64_t)(vKeep.size() * (SMSG_HDR_LEN + nPayload)));
+    for (size_t i = 0; i < vKeep.size(); ++i)
+    {
+        BOOST_CHECK(vEntries[i].nOffset == vKeep[i]);
+        std::vector<uint8_t> vchData;
+        BOOST_REQUIRE(store.Read(nBucket, vKeep[i], vchData));
+        BOOST_CHECK(vchData == vMessages[i * 2]);
+    };
+
+    store.Remove(nBucket);
+    BOOST_CHECK(!fs::exists(store.PathFile(nBucket)));
+    BOOST_CHECK(!fs::exists(store.PathIndex(nBucket)));
+    fs::remove_all(pathStore);
+}
+
+BOOST_AUTO_TEST_CASE(smsg_test_db_index)
+{
+    LOCK(cs_smsgDB);
+    SecMsgDB db;
+    BOOST_REQUIRE(db.Open("cr+"));
+
+    CKeyID idA, idB;
+    memset(idA.begin(), 0xAA, 20);
+    memset(idB.begin(), 0xBB, 20);
+
+    const int nMessages = 20;
+    uint8_t chKey[18];
+    for (int i = 0; i < nMessages; ++i)
+    {
+        SecMsgStored smsgStored;
+        smsgStored.timeReceived = 1500000000 + i;
+        smsgStored.status = i % 2 == 0 ? SMSG_MASK_UNREAD : 0;
+        smsgStored.folderId = 0;
+        smsgStored.addrTo = i < 5 ? idA : idB;
+        smsgStored.vchMessage.resize(SMSG_HDR_LEN, (uint8_t)i);
+
+        memcpy(&chKey[0], i % 4 == 3 ? "sm" : "im", 2);
+        memset(&chKey[2], i, 16);
+        BOOST_CHECK(db.WriteSmesg(chKey, smsgStored));
+    };
+
+    // 15 in the inbox, received in order
+    std::vector<SecMsgListed> vListed;
+    SecMsgQuery q;
+    BOOST_CHECK(db.ListSmesg('i', q, vListed));
+    BOOST_CHECK(vListed.size() == 15);
+    for (size_t i = 1; i < vListed.size(); ++i)
+        BOOST_CHECK(vListed[i-1].meta.timeReceived < vListed[i].meta.timeReceived);
+
+    vListed.clear();
+    q.nOffset = 4;
+    q.nCount = 3;
+    BOOST_CHECK(db.ListSmesg('i', q, vListed));
+    BOOST_REQUIRE(vListed.size() == 3);
+    BOOST_CHECK(vListed[0].meta.timeReceived == 1500000005);
+    BOOST_CHECK(vListed[0].chKey[0] == 'i' && vListed[0].chKey[2] == 5);
+
+    vListed.clear();
+    q = SecMsgQuery();
+    q.nSince = 1500000010;
+    BOOST_CHECK(db.ListSmesg('s', q, vListed));
+    BOOST_CHECK(vListed.size() == 3); // 11, 15, 19
+
+    vListed.clear();
+    q = SecMsgQuery();
+    q.fUnreadOnly = true;
+    q.fAddress = true;
+    q.address = idA;
+    BOOST_CHECK(db.ListSmesg('i', q, vListed));
+    BOOST_CHECK(vListed.size() == 3); // 0, 2, 4
+
+    // Marking read and erasing update the index
+    SecMsgStored smsgStored;
+    memcpy(chKey, vListed[0].chKey, 18);
+    BOOST_REQUIRE(db.ReadSmesg(chKey, smsgStored));
+    smsgStored.status &= ~SMSG_MASK_UNREAD;
+    BOOST_CHECK(db.WriteSmesg(chKey, smsgStored));
+    memcpy(chKey, vListed[1].chKey, 18);
+    BOOST_CHECK(db.EraseSmesg(chKey));
+
+    vListed.clear();
+    BOOST_CHECK(db.ListSmesg('i', q, vListed));
+    BOOST_CHECK(vListed.size() == 1);
+
+    vListed.clear();
+    BOOST_CHECK(db.ListSmesg('i', SecMsgQuery(), vListed));
+    BOOST_CHECK(vListed.size() == 14);
+
+    delete smsgDB;
+    smsgDB = nullptr;
+}
+
 BOOST_AUTO_TEST_CASE(smsg_test)
 {
 
@@ -62,6 +445,8 @@ BOOST_AUTO_TEST_CASE(smsg_test)
     CKeyID idNull;
     BOOST_CHECK(idNull.IsNull());
 
+    std::vector<uint8_t> vchBatch;
+    std::vector<size_t> vOffsets;
     for (int i = 0; i < nKeys; i++)
     {
         SecureMessage smsg;
@@ -93,8 +478,41 @@ BOOST_AUTO_TEST_CASE(smsg_test)
             && 0 == memcmp(&msg.vchMessage[0], sTestMessage.data(), msg.vchMessage.size()-1));
 
         BOOST_CHECK_MESSAGE(1 == (rv = SecureMsgDecrypt(false, kFail, smsg, msg)), "SecureMsgDecrypt " << rv);
+
+        vOffsets.push_back(vchBatch.size());
+        vchBatch.insert(vchBatch.end(), (uint8_t*)&smsg, ((uint8_t*)&smsg) + SMSG_HDR_LEN);
+        vchBatch.insert(vchBatch.end(), smsg.pPayload, smsg.pPayload + smsg.nPayload);
     };
 
+    // Batch trial decrypt, each message must match its recipient's key among many, threaded as serial
+    const int nOtherKeys = 40;
+    std::vector<SecMsgScanKey> vScanKeys(nOtherKeys + nKeys);
+    for (int i = 0; i < nOtherKeys + nKeys; i++)
+    {
+        if (i < nOtherKeys)
+            vScanKeys[i].key.MakeNewKey(true);
+        else
+            vScanKeys[i].key = keyRemote[i - nOtherKeys];
+        vScanKeys[i].address = vScanKeys[i].key.GetPubKey().GetID();
+        vScanKeys[i].fReceiveAnon = true;
+    };
+
+    std::vector<int> vResultSerial, vResultThreads;
+    uint64_t nTrialsSerial = 0, nTrialsThreads = 0;
+    SecureMsgTrialDecryptBatch(vScanKeys, vchBatch, vOffsets, vResultSerial, 1, nTrialsSerial);
+    SecureMsgTrialDecryptBatch(vScanKeys, vchBatch, vOffsets, vResultThreads, 4, nTrialsThreads);
+    BOOST_REQUIRE(vResultSerial.size() == (size_t)nKeys);
+    for (int i = 0; i < nKeys; i++)
+        BOOST_CHECK(vResultSerial[i] == nOtherKeys + i);
+    BOOST_CHECK(vResultThreads == vResultSerial);
+    BOOST_CHECK(nTrialsThreads == nTrialsSerial);
+
+    // No key matches, every message is tried against all keys
+    vScanKeys.resize(nOtherKeys);
+    SecureMsgTrialDecryptBatch(vScanKeys, vchBatch, vOffsets, vResultThreads, 4, nTrialsThreads);
+    BOOST_CHECK(vResultThreads == std::vector<int>(nKeys, -1));
+    BOOST_CHECK(nTrialsThreads == nTrialsSerial * 2 + (uint64_t)nKeys * nOtherKeys);
+
     SecureMsgShutdown();
 
     CConnman *p = g_connman.release();
@@ -246,4 +246,95 @@ BOOST_AUTO_TEST_CASE(stealth_key)
     ECC_Stop_Stealth();
 }
 
+BOOST_AUTO_TEST_CASE(stealth_scanner)
+{
+    CBasicKeyStore keystore;
+    
+    ECC_Start_Stealth();
+    
+    CStealthScanner scanner;
+    std::vector<CStealthAddress> vAddrs(8);
+    for (size_t i = 0; i < vAddrs.size(); ++i)
+    {
+        makeNewStealthKey(vAddrs[i], keystore);
+        vAddrs[i].prefix.number_bits = i % 2 ? 4 : 0;
+        vAddrs[i].prefix.bitfield = 0xaaaaaaaa;
+        scanner.AddScanKey(vAddrs[i].scan_secret, vAddrs[i].spend_pubkey, vAddrs[i].prefix.number_bits, vAddrs[i].prefix.bitfield);
+    };
+    
+    struct TestOutput
+    {
+        CKeyID idDest;
+        CPubKey pkEphem;
+        uint32_t nPrefix;
+        bool fHavePrefix;
+        bool fOwned;
+    };
+    
+    // Every third output pays to one of the addresses, one in five of those has a prefix not matching its address
+    std::vector<TestOutput> vOutputs(300);
+    for (size_t i = 0; i < vOutputs.size(); ++i)
+    {
+        TestOutput &o = vOutputs[i];
+        const CStealthAddress &sx = vAddrs[i % vAddrs.size()];
+        
+        CKey sEphem, sShared;
+        ec_point pkSendTo;
+        do {
+            sEphem.MakeNewKey(true);
+        } while (StealthSecret(sEphem, sx.scan_pubkey, sx.spend_pubkey, sShared, pkSendTo) != 0);
+        
+        o.pkEphem = sEphem.GetPubKey();
+        o.fHavePrefix = true;
+        o.nPrefix = FillStealthPrefix(sx.prefix.number_bits, sx.prefix.bitfield);
+        o.fOwned = i % 3 == 0;
+        if (o.fOwned)
+        {
+            o.idDest = CPubKey(pkSendTo).GetID();
+            if (sx.prefix.number_bits > 0 && i % 5 == 0)
+            {
+                o.nPrefix = ~o.nPrefix;
+                o.fOwned = false;
+            };
+        } else
+        {
+            CKey kOther;
+            kOther.MakeNewKey(true);
+            o.idDest = kOther.GetPubKey().GetID();
+        };
+        scanner.AddOutput(o.idDest, o.pkEphem.begin(), o.nPrefix, o.fHavePrefix);
+    };
+    
+    for (int nThreads : {1, 4})
+    {
+        BOOST_CHECK(scanner.NumOutputs() == vOutputs.size());
+        scanner.Scan(nThreads);
+        
+        size_t nOwned = 0;
+        for (const auto &o : vOutputs)
+        {
+            BOOST_CHECK(scanner.IsUnmatched(o.idDest, o.pkEphem.begin(), o.nPrefix, o.fHavePrefix) == !o.fOwned);
+            if (o.fOwned)
+                nOwned++;
+        };
+        BOOST_CHECK(scanner.NumMatched() == nOwned);
+        
+        // Outputs not scanned are never reported as unmatched
+        const TestOutput &o = vOutputs[1];
+        BOOST_CHECK(!scanner.IsUnmatched(o.idDest, vOutputs[0].pkEphem.begin(), o.nPrefix, o.fHavePrefix));
+        
+        CStealthScanner scannerCopy = scanner;
+        BOOST_CHECK(scannerCopy.SameKeys(scanner));
+        
+        scanner.ClearOutputs();
+        for (const auto &o : vOutputs)
+            scanner.AddOutput(o.idDest, o.pkEphem.begin(), o.nPrefix, o.fHavePrefix);
+    };
+    
+    CStealthScanner scannerLess;
+    BOOST_CHECK(!scannerLess.SameKeys(scanner));
+    
+    ECC_Stop_Stealth();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
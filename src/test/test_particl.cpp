@@ -6,6 +6,7 @@
 
 #include "chainparams.h"
 #include "consensus/consensus.h"
+#include "consensus/tx_verify.h"
 #include "consensus/validation.h"
 #include "crypto/sha256.h"
 #include "fs.h"
@@ -45,6 +46,7 @@ BasicTestingSetup::BasicTestingSetup(const std::string& chainName, bool fParticl
     SetupNetworking();
     InitSignatureCache();
     InitScriptExecutionCache();
+    InitRangeproofCache();
     fPrintToDebugLog = false; // don't want to write to debug.log file
     fCheckBlockIndex = true;
     SelectParams(chainName);
@@ -79,6 +81,8 @@ TestingSetup::TestingSetup(const std::string& chainName, bool fParticlModeIn) :
 
     mempool.setSanityCheck(1.0);
     pblocktree = new CBlockTreeDB(1 << 20, true);
+    pblocktree->LoadRCTOutputCache();
+    pblocktree->LoadRCTIndexFilters();
     pcoinsdbview = new CCoinsViewDB(1 << 23, true);
     pcoinsTip = new CCoinsViewCache(pcoinsdbview);
     if (!LoadGenesisBlock(chainparams)) {
@@ -14,8 +14,10 @@
 #include "util.h"
 #include "ui_interface.h"
 #include "init.h"
+#include "memusage.h"
 
 #include <stdint.h>
+#include <algorithm>
 
 #include <boost/thread.hpp>
 
@@ -162,6 +164,161 @@ size_t CCoinsViewDB::EstimateSize() const
     return db.EstimateSize(DB_COIN, (char)(DB_COIN+1));
 }
 
+bool CRCTOutputCache::Get(int64_t i, CAnonOutput &ao) const
+{
+    LOCK(cs);
+    if (!fEnabled || i < 1 || i > (int64_t)vRecords.size())
+        return false;
+    
+    const Record &r = vRecords[i-1];
+    memcpy(ao.pubkey.ncbegin(), r.pubkey, 33);
+    memcpy(ao.commitment.data, r.commitment, 33);
+    ao.nBlockHeight = r.nBlockHeight;
+    return true;
+};
+
+void CRCTOutputCache::Append(int64_t i, const CAnonOutput &ao)
+{
+    LOCK(cs);
+    if (!fEnabled || i != (int64_t)vRecords.size() + 1)
+        return;
+    
+    Record r;
+    memcpy(r.pubkey, ao.pubkey.begin(), 33);
+    memcpy(r.commitment, ao.commitment.data, 33);
+    r.nBlockHeight = ao.nBlockHeight;
+    vRecords.push_back(r);
+};
+
+void CRCTOutputCache::Truncate(int64_t nLast)
+{
+    LOCK(cs);
+    if (nLast < 0)
+        nLast = 0;
+    if (nLast < (int64_t)vRecords.size())
+        vRecords.resize(nLast);
+};
+
+void CRCTOutputCache::Set(std::vector<Record> &vRecordsIn)
+{
+    LOCK(cs);
+    vRecords.swap(vRecordsIn);
+    fEnabled = true;
+};
+
+void CRCTOutputCache::Clear()
+{
+    LOCK(cs);
+    vRecords.clear();
+    vRecords.shrink_to_fit();
+    fEnabled = false;
+};
+
+int64_t CRCTOutputCache::GetLast() const
+{
+    LOCK(cs);
+    return vRecords.size();
+};
+
+bool CRCTOutputCache::GetLastAtHeight(int nHeight, int64_t &nIndex) const
+{
+    LOCK(cs);
+    if (!fEnabled)
+        return false;
+    
+    auto it = std::upper_bound(vRecords.begin(), vRecords.end(), nHeight,
+        [](int h, const Record &r) { return h < r.nBlockHeight; });
+    nIndex = it - vRecords.begin();
+    return true;
+};
+
+size_t CRCTOutputCache::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    return memusage::DynamicUsage(vRecords);
+};
+
+static const uint64_t RCT_INDEX_FILTER_BITS_PER_ELEMENT = 16;
+static const uint64_t RCT_INDEX_FILTER_HASH_FUNCS = 11; // ~0.05% false positives when full
+static const size_t RCT_INDEX_FILTER_MIN_ELEMENTS = 1 << 20;
+
+uint64_t CCmpPubKeyFilter::Hash(const CCmpPubKey &pk) const
+{
+    return CSipHasher(k0, k1).Write(pk.begin(), 33).Finalize();
+};
+
+void CCmpPubKeyFilter::InsertHash(uint64_t h)
+{
+    // Double hashing, indices derived from the two halves of one SipHash
+    uint64_t h1 = h & 0xFFFFFFFF, h2 = (h >> 32) | 1;
+    for (uint64_t i = 0; i < RCT_INDEX_FILTER_HASH_FUNCS; ++i)
+    {
+        uint64_t n = (h1 + i * h2) % nBits;
+        vData[n >> 6] |= (uint64_t)1 << (n & 63);
+    };
+};
+
+void CCmpPubKeyFilter::Set(size_t nElements, const std::vector<CCmpPubKey> &vKeys)
+{
+    LOCK(cs);
+    k0 = GetRand(std::numeric_limits<uint64_t>::max());
+    k1 = GetRand(std::numeric_limits<uint64_t>::max());
+    nBits = std::max(nElements, vKeys.size()) * RCT_INDEX_FILTER_BITS_PER_ELEMENT;
+    nBits = std::max(nBits, (uint64_t)64);
+    vData.assign((nBits + 63) / 64, 0);
+    nBits = vData.size() * 64;
+    
+    for (const auto &pk : vKeys)
+        InsertHash(Hash(pk));
+    fEnabled = true;
+};
+
+void CCmpPubKeyFilter::Insert(const CCmpPubKey &pk)
+{
+    LOCK(cs);
+    if (!fEnabled)
+        return;
+    InsertHash(Hash(pk));
+};
+
+bool CCmpPubKeyFilter::MaybeContains(const CCmpPubKey &pk) const
+{
+    LOCK(cs);
+    if (!fEnabled)
+        return true;
+    
+    uint64_t h = Hash(pk);
+    uint64_t h1 = h & 0xFFFFFFFF, h2 = (h >> 32) | 1;
+    for (uint64_t i = 0; i < RCT_INDEX_FILTER_HASH_FUNCS; ++i)
+    {
+        uint64_t n = (h1 + i * h2) % nBits;
+        if (!(vData[n >> 6] & ((uint64_t)1 << (n & 63))))
+            return false;
+    };
+    return true;
+};
+
+void CCmpPubKeyFilter::Clear()
+{
+    LOCK(cs);
+    vData.clear();
+    vData.shrink_to_fit();
+    nBits = 0;
+    fEnabled = false;
+};
+
+bool CCmpPubKeyFilter::IsEnabled() const
+{
+    LOCK(cs);
+    return fEnabled;
+};
+
+size_t CCmpPubKeyFilter::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    return memusage::DynamicUsage(vData);
+};
+
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe, bool compression, int maxOpenFiles) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe, false, compression, maxOpenFiles)
 {
 }
@@ -494,86 +651,340 @@ bool CBlockTreeDB::LoadBlockIndexGuts(const Consensus::Params& consensusParams,
     return true;
 }
 
-bool CBlockTreeDB::ReadLastRCTOutput(int64_t &rv)
+namespace {
+/** Key or value already in its serialized form, written as is */
+struct CSerializedData
 {
-    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+    const std::string &str;
+    explicit CSerializedData(const std::string &strIn) : str(strIn) {}
     
-    if (!Read(DB_RCTOUTPUT_LAST, rv))
-        rv = 0;
+    template <typename Stream>
+    void Serialize(Stream &s) const
+    {
+        s.write(str.data(), str.size());
+    }
+};
+
+template <typename K>
+std::string SerializeRCTKey(const K &key)
+{
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey.reserve(DBWRAPPER_PREALLOC_KEY_SIZE);
+    ssKey << key;
+    return std::string(ssKey.begin(), ssKey.end());
+}
+
+size_t RCTCacheEntryUsage(const std::string &strKey, const std::string &strValue)
+{
+    return memusage::MallocUsage(sizeof(std::pair<const std::string, std::pair<bool, std::string> >) + 4 * sizeof(void*))
+        + strKey.size() + strValue.size();
+}
+} // namespace
+
+template <typename K, typename V>
+bool CBlockTreeDB::ReadRCT(const K &key, V &value) const
+{
+    {
+        LOCK(csRCTCache);
+        auto it = mapRCTCache.find(SerializeRCTKey(key));
+        if (it != mapRCTCache.end())
+        {
+            if (it->second.first)
+                return false;
+            const std::string &strValue = it->second.second;
+            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> value;
+            return true;
+        };
+    }
+    return Read(key, value);
+};
+
+template <typename K, typename V>
+void CBlockTreeDB::WriteRCT(const K &key, const V &value)
+{
+    CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+    ssValue.reserve(DBWRAPPER_PREALLOC_VALUE_SIZE);
+    ssValue << value;
+    SetRCTCacheEntry(SerializeRCTKey(key), false, std::string(ssValue.begin(), ssValue.end()));
+};
+
+template <typename K>
+void CBlockTreeDB::EraseRCT(const K &key)
+{
+    SetRCTCacheEntry(SerializeRCTKey(key), true, std::string());
+};
+
+void CBlockTreeDB::SetRCTCacheEntry(std::string &&strKey, bool fErased, std::string &&strValue)
+{
+    LOCK(csRCTCache);
+    auto it = mapRCTCache.find(strKey);
+    if (it != mapRCTCache.end())
+    {
+        nRCTCacheUsage -= RCTCacheEntryUsage(it->first, it->second.second);
+        it->second.first = fErased;
+        it->second.second = std::move(strValue);
+    } else
+    {
+        it = mapRCTCache.emplace(std::move(strKey), std::make_pair(fErased, std::move(strValue))).first;
+    };
+    nRCTCacheUsage += RCTCacheEntryUsage(it->first, it->second.second);
+};
+
+bool CBlockTreeDB::FlushRCTIndex()
+{
+    LOCK(csRCTCache);
+    if (mapRCTCache.empty())
+        return true;
     
+    CDBBatch batch(*this);
+    for (const auto &it : mapRCTCache)
+    {
+        if (it.second.first)
+            batch.Erase(CSerializedData(it.first));
+        else
+            batch.Write(CSerializedData(it.first), CSerializedData(it.second.second));
+    };
+    
+    LogPrint(BCLog::RINGCT, "%s: Writing %u RCT index changes, %u KiB.\n", __func__, mapRCTCache.size(), nRCTCacheUsage >> 10);
+    if (!WriteBatch(batch, true))
+        return false;
+    
+    mapRCTCache.clear();
+    nRCTCacheUsage = 0;
     return true;
 };
 
+size_t CBlockTreeDB::RCTIndexCacheUsage() const
+{
+    LOCK(csRCTCache);
+    return nRCTCacheUsage;
+};
+
+bool CBlockTreeDB::ReadLastRCTOutput(int64_t &rv)
+{
+    if (!ReadRCT(DB_RCTOUTPUT_LAST, rv))
+        rv = 0;
+    
+    return true;
+};
 
 bool CBlockTreeDB::WriteLastRCTOutput(int64_t i)
 {
-    CDBBatch batch(*this);
-    batch.Write(DB_RCTOUTPUT_LAST, i);
-    return WriteBatch(batch);
+    WriteRCT(DB_RCTOUTPUT_LAST, i);
+    rctOutputCache.Truncate(i);
+    return true;
 };
 
 bool CBlockTreeDB::ReadRCTOutput(int64_t i, CAnonOutput &ao)
 {
-    return Read(std::make_pair(DB_RCTOUTPUT, i), ao);
+    return ReadRCT(std::make_pair(DB_RCTOUTPUT, i), ao);
 };
 
 bool CBlockTreeDB::WriteRCTOutput(int64_t i, const CAnonOutput &ao)
 {
-    CDBBatch batch(*this);
-    batch.Write(std::make_pair(DB_RCTOUTPUT, i), ao);
-    return WriteBatch(batch);
+    WriteRCT(std::make_pair(DB_RCTOUTPUT, i), ao);
+    rctOutputCache.Append(i, ao);
+    return true;
 };
 
 bool CBlockTreeDB::EraseRCTOutput(int64_t i)
 {
-    CDBBatch batch(*this);
-    batch.Erase(std::make_pair(DB_RCTOUTPUT, i));
-    return WriteBatch(batch);
+    // Outputs are only ever erased from the top of the index
+    rctOutputCache.Truncate(i-1);
+    EraseRCT(std::make_pair(DB_RCTOUTPUT, i));
+    return true;
+};
+
+bool CBlockTreeDB::ReadRCTOutputCached(int64_t i, CAnonOutput &ao)
+{
+    if (rctOutputCache.Get(i, ao))
+        return true;
+    return ReadRCTOutput(i, ao);
+};
+
+bool CBlockTreeDB::ReadRCTOutputsCached(const std::vector<int64_t> &vIndices, std::vector<CAnonOutput> &vao)
+{
+    vao.resize(vIndices.size());
+    
+    std::vector<std::pair<int64_t, size_t> > vMissing;
+    for (size_t k = 0; k < vIndices.size(); ++k)
+        if (!rctOutputCache.Get(vIndices[k], vao[k]))
+            vMissing.push_back(std::make_pair(vIndices[k], k));
+    
+    std::sort(vMissing.begin(), vMissing.end());
+    for (const auto &m : vMissing)
+        if (!ReadRCTOutput(m.first, vao[m.second]))
+            return false;
+    
+    return true;
+};
+
+bool CBlockTreeDB::ReadLastRCTOutputAtHeight(int nHeight, int64_t &i)
+{
+    if (rctOutputCache.GetLastAtHeight(nHeight, i))
+        return true;
+    
+    int64_t nLast = 0;
+    if (!ReadLastRCTOutput(nLast))
+        return false;
+    
+    // Binary search for the first output above nHeight
+    int64_t nLow = 1, nHigh = nLast + 1;
+    while (nLow < nHigh)
+    {
+        int64_t nMid = nLow + (nHigh - nLow) / 2;
+        CAnonOutput ao;
+        if (!ReadRCTOutput(nMid, ao))
+            return error("%s: RCT output %d missing.", __func__, nMid);
+        if (ao.nBlockHeight > nHeight)
+            nHigh = nMid;
+        else
+            nLow = nMid + 1;
+    };
+    
+    i = nLow - 1;
+    return true;
+};
+
+bool CBlockTreeDB::LoadRCTOutputCache()
+{
+    if (!FlushRCTIndex())
+        return error("%s: FlushRCTIndex failed.", __func__);
+    
+    int64_t nLast = 0;
+    if (!ReadLastRCTOutput(nLast) || nLast < 0)
+        return error("%s: ReadLastRCTOutput failed.", __func__);
+    
+    std::vector<CRCTOutputCache::Record> vRecords(nLast);
+    std::vector<bool> vHave(nLast, false);
+    
+    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+    pcursor->Seek(std::make_pair(DB_RCTOUTPUT, (int64_t)0));
+    
+    // Keys are not in index order, place each output by its index
+    while (pcursor->Valid())
+    {
+        boost::this_thread::interruption_point();
+        std::pair<char, int64_t> key;
+        if (!pcursor->GetKey(key) || key.first != DB_RCTOUTPUT)
+            break;
+        
+        CAnonOutput ao;
+        if (!pcursor->GetValue(ao))
+            return error("%s: Failed to read RCT output %d.", __func__, key.second);
+        
+        if (key.second > 0 && key.second <= nLast)
+        {
+            CRCTOutputCache::Record &r = vRecords[key.second-1];
+            memcpy(r.pubkey, ao.pubkey.begin(), 33);
+            memcpy(r.commitment, ao.commitment.data, 33);
+            r.nBlockHeight = ao.nBlockHeight;
+            vHave[key.second-1] = true;
+        };
+        pcursor->Next();
+    };
+    
+    for (int64_t i = 0; i < nLast; ++i)
+        if (!vHave[i])
+            return error("%s: RCT output %d missing.", __func__, i+1);
+    
+    rctOutputCache.Set(vRecords);
+    LogPrintf("Loaded %d RCT outputs into memory, %u MiB.\n", nLast, rctOutputCache.DynamicMemoryUsage() >> 20);
+    return true;
 };
 
 
 bool CBlockTreeDB::ReadRCTOutputLink(const CCmpPubKey &pk, int64_t &i)
 {
-    return Read(std::make_pair(DB_RCTOUTPUT_LINK, pk), i);
+    if (!rctOutputLinkFilter.MaybeContains(pk))
+        return false;
+    return ReadRCT(std::make_pair(DB_RCTOUTPUT_LINK, pk), i);
 };
 
 bool CBlockTreeDB::WriteRCTOutputLink(const CCmpPubKey &pk, int64_t i)
 {
-    CDBBatch batch(*this);
-    batch.Write(std::make_pair(DB_RCTOUTPUT_LINK, pk), i);
-    return WriteBatch(batch);
+    // Add to the filter first, a concurrent reader must never miss a written link
+    rctOutputLinkFilter.Insert(pk);
+    WriteRCT(std::make_pair(DB_RCTOUTPUT_LINK, pk), i);
+    return true;
 };
 
 bool CBlockTreeDB::EraseRCTOutputLink(const CCmpPubKey &pk)
 {
-    CDBBatch batch(*this);
-    batch.Erase(std::make_pair(DB_RCTOUTPUT_LINK, pk));
-    return WriteBatch(batch);
+    EraseRCT(std::make_pair(DB_RCTOUTPUT_LINK, pk));
+    return true;
 };
 
 bool CBlockTreeDB::ReadRCTOutputCheckpoint(int nBlock, int64_t &i)
 {
-    return Read(std::make_pair(DB_RCTOUTPUT_CHECKPOINT, nBlock), i);
+    return ReadRCT(std::make_pair(DB_RCTOUTPUT_CHECKPOINT, nBlock), i);
+};
+
+bool CBlockTreeDB::WriteRCTOutputCheckpoint(int nBlock, int64_t i)
+{
+    WriteRCT(std::make_pair(DB_RCTOUTPUT_CHECKPOINT, nBlock), i);
+    return true;
 };
 
 
 bool CBlockTreeDB::ReadRCTKeyImage(const CCmpPubKey &ki, uint256 &txhash)
 {
-    return Read(std::make_pair(DB_RCTKEYIMAGE, ki), txhash);
+    if (!keyImageFilter.MaybeContains(ki))
+        return false;
+    return ReadRCT(std::make_pair(DB_RCTKEYIMAGE, ki), txhash);
 };
 
 bool CBlockTreeDB::WriteRCTKeyImage(const CCmpPubKey &ki, const uint256 &txhash)
 {
-    CDBBatch batch(*this);
-    batch.Write(std::make_pair(DB_RCTKEYIMAGE, ki), txhash);
-    return WriteBatch(batch);
+    // Add to the filter first, a concurrent reader must never miss a written key image
+    keyImageFilter.Insert(ki);
+    WriteRCT(std::make_pair(DB_RCTKEYIMAGE, ki), txhash);
+    return true;
 };
 
 bool CBlockTreeDB::EraseRCTKeyImage(const CCmpPubKey &ki)
 {
-    CDBBatch batch(*this);
-    batch.Erase(std::make_pair(DB_RCTKEYIMAGE, ki));
-    return WriteBatch(batch);
+    EraseRCT(std::make_pair(DB_RCTKEYIMAGE, ki));
+    return true;
+};
+
+static bool LoadCmpPubKeyFilter(CDBWrapper &db, char chType, CCmpPubKeyFilter &filter, size_t &nKeys)
+{
+    std::vector<CCmpPubKey> vKeys;
+    
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+    pcursor->Seek(chType);
+    
+    while (pcursor->Valid())
+    {
+        boost::this_thread::interruption_point();
+        std::pair<char, CCmpPubKey> key;
+        if (!pcursor->GetKey(key) || key.first != chType)
+            break;
+        vKeys.push_back(key.second);
+        pcursor->Next();
+    };
+    
+    // Leave room for the filter to grow with the chain before the false positive rate rises
+    filter.Set(std::max(vKeys.size() * 2, RCT_INDEX_FILTER_MIN_ELEMENTS), vKeys);
+    nKeys = vKeys.size();
+    return true;
+};
+
+bool CBlockTreeDB::LoadRCTIndexFilters()
+{
+    if (!FlushRCTIndex())
+        return error("%s: FlushRCTIndex failed.", __func__);
+    
+    size_t nKeyImages, nLinks;
+    if (!LoadCmpPubKeyFilter(*this, DB_RCTKEYIMAGE, keyImageFilter, nKeyImages)
+        || !LoadCmpPubKeyFilter(*this, DB_RCTOUTPUT_LINK, rctOutputLinkFilter, nLinks))
+        return false;
+    
+    LogPrintf("Loaded %u spent key images and %u anon output links into the RCT index filters, %u KiB.\n",
+        nKeyImages, nLinks, (keyImageFilter.DynamicMemoryUsage() + rctOutputLinkFilter.DynamicMemoryUsage()) >> 10);
+    return true;
 };
 
 bool CCoinsViewDB::Upgrade()
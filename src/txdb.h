@@ -13,6 +13,7 @@
 #include "spentindex.h"
 #include "timestampindex.h"
 #include "rctindex.h"
+#include "sync.h"
 
 #include <map>
 #include <string>
@@ -30,6 +31,11 @@ const char DB_RCTOUTPUT_CHECKPOINT = 'H';
 const char DB_RCTKEYIMAGE = 'K';
 
 
+//! -rctoutputcache default
+static const bool DEFAULT_RCT_OUTPUT_CACHE = true;
+//! -keyimagefilter default
+static const bool DEFAULT_KEY_IMAGE_FILTER = true;
+
 //! No need to periodic flush if at least this much space still available.
 static constexpr int MAX_BLOCK_COINSDB_USAGE = 10;
 
@@ -117,6 +123,74 @@ private:
     friend class CCoinsViewDB;
 };
 
+/**
+ * Dense in memory copy of the RCT output index.
+ * RCT indices are assigned sequentially from 1 as blocks connect, output i is
+ * kept at vRecords[i-1]. Only the fields used to build and verify rings are kept.
+ */
+class CRCTOutputCache
+{
+public:
+    struct Record
+    {
+        uint8_t pubkey[33];
+        uint8_t commitment[33];
+        int32_t nBlockHeight;
+    };
+
+    /** Sets the pubkey, commitment and nBlockHeight of ao, false if i is not cached */
+    bool Get(int64_t i, CAnonOutput &ao) const;
+    /** Cache output i, ignored unless it follows the last cached output */
+    void Append(int64_t i, const CAnonOutput &ao);
+    /** Drop all outputs after nLast */
+    void Truncate(int64_t nLast);
+    void Set(std::vector<Record> &vRecordsIn);
+    void Clear();
+
+    int64_t GetLast() const;
+    /**
+     * Set nIndex to the last output at or below nHeight, 0 if none, false if not enabled.
+     * Outputs are indexed in block order, heights never decrease with the index.
+     */
+    bool GetLastAtHeight(int nHeight, int64_t &nIndex) const;
+    size_t DynamicMemoryUsage() const;
+
+private:
+    mutable CCriticalSection cs;
+    bool fEnabled = false;
+    std::vector<Record> vRecords;
+};
+
+/**
+ * Bloom filter over the compressed pubkeys keying an RCT index in the block index db,
+ * the spent key images and the anon output links.
+ * Lets the common not found case of a lookup answer without a db read.
+ * Keys can't be removed, erased keys only cost a db read until the filter is rebuilt.
+ */
+class CCmpPubKeyFilter
+{
+public:
+    /** Size the filter for nElements and set the keys it starts with, enables the filter */
+    void Set(size_t nElements, const std::vector<CCmpPubKey> &vKeys);
+    void Insert(const CCmpPubKey &pk);
+    /** False if pk is certainly not in the index, always true while the filter is not set */
+    bool MaybeContains(const CCmpPubKey &pk) const;
+    void Clear();
+
+    bool IsEnabled() const;
+    size_t DynamicMemoryUsage() const;
+
+private:
+    void InsertHash(uint64_t h);
+    uint64_t Hash(const CCmpPubKey &pk) const;
+
+    mutable CCriticalSection cs;
+    bool fEnabled = false;
+    uint64_t k0 = 0, k1 = 0;
+    std::vector<uint64_t> vData;
+    uint64_t nBits = 0;
+};
+
 /** Access to the block database (blocks/index/) */
 class CBlockTreeDB : public CDBWrapper
 {
@@ -152,6 +226,10 @@ public:
     bool ReadFlag(const std::string &name, bool &fValue);
     bool LoadBlockIndexGuts(const Consensus::Params& consensusParams, std::function<CBlockIndex*(const uint256&)> insertBlockIndex);
     
+    /**
+     * The RCT index is written through an in memory write-back cache, flushed with FlushRCTIndex.
+     * Reads see the pending changes.
+     */
     bool ReadLastRCTOutput(int64_t &rv);
     bool WriteLastRCTOutput(int64_t i);
     
@@ -159,19 +237,58 @@ public:
     bool WriteRCTOutput(int64_t i, const CAnonOutput &ao);
     bool EraseRCTOutput(int64_t i);
     
+    /**
+     * Read the fields of an RCT output used in rings from the in memory cache if loaded, else from the db.
+     * The outpoint is only set when read from the db.
+     */
+    bool ReadRCTOutputCached(int64_t i, CAnonOutput &ao);
+    /** ReadRCTOutputCached for a set of outputs, outputs not in memory are read in index order */
+    bool ReadRCTOutputsCached(const std::vector<int64_t> &vIndices, std::vector<CAnonOutput> &vao);
+    /** Set i to the last RCT output in a block at or below nHeight, 0 if none */
+    bool ReadLastRCTOutputAtHeight(int nHeight, int64_t &i);
+    /** Load all RCT outputs into the in memory cache */
+    bool LoadRCTOutputCache();
+    
+    CRCTOutputCache rctOutputCache;
+    
     bool ReadRCTOutputLink(const CCmpPubKey &pk, int64_t &i);
     bool WriteRCTOutputLink(const CCmpPubKey &pk, int64_t i);
     bool EraseRCTOutputLink(const CCmpPubKey &pk);
     
     bool ReadRCTOutputCheckpoint(int nBlock, int64_t &i);
-    
+    bool WriteRCTOutputCheckpoint(int nBlock, int64_t i);
     
     bool ReadRCTKeyImage(const CCmpPubKey &ki, uint256 &txhash);
     bool WriteRCTKeyImage(const CCmpPubKey &ki, const uint256 &txhash);
     bool EraseRCTKeyImage(const CCmpPubKey &ki);
     
+    /** Load all spent key images and anon output links into their filters */
+    bool LoadRCTIndexFilters();
+    
+    CCmpPubKeyFilter keyImageFilter;
+    CCmpPubKeyFilter rctOutputLinkFilter;
+    
+    /** Write the pending RCT index changes to the db in one batch */
+    bool FlushRCTIndex();
+    /** Approximate memory used by the pending RCT index changes */
+    size_t RCTIndexCacheUsage() const;
+    
+private:
+    template <typename K, typename V>
+    bool ReadRCT(const K &key, V &value) const;
+    template <typename K, typename V>
+    void WriteRCT(const K &key, const V &value);
+    template <typename K>
+    void EraseRCT(const K &key);
+    void SetRCTCacheEntry(std::string &&strKey, bool fErased, std::string &&strValue);
     
-    //bool WriteRCTOutputBatch(std::vector<std::pair<int64_t, CAnonOutput> > &vao);
+    /**
+     * Pending RCT index changes, serialized key -> (erased, serialized value).
+     * Layered over the db like CCoinsViewCache over the chainstate.
+     */
+    mutable CCriticalSection csRCTCache;
+    std::map<std::string, std::pair<bool, std::string> > mapRCTCache;
+    size_t nRCTCacheUsage = 0;
 };
 
 #endif // BITCOIN_TXDB_H
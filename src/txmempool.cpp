@@ -1125,8 +1125,7 @@ bool CTxMemPool::HaveKeyImage(const CCmpPubKey &ki, uint256 &hash) const
 {
     LOCK(cs);
     
-    std::map<CCmpPubKey, uint256>::const_iterator mi;
-    mi = mapKeyImages.find(ki);
+    auto mi = mapKeyImages.find(ki);
      
     if (mi != mapKeyImages.end())
     {
@@ -9,6 +9,7 @@
 #include <memory>
 #include <set>
 #include <map>
+#include <unordered_map>
 #include <vector>
 #include <utility>
 #include <string>
@@ -520,7 +521,7 @@ public:
     indirectmap<COutPoint, const CTransaction*> mapNextTx;
     std::map<uint256, CAmount> mapDeltas;
     
-    std::map<CCmpPubKey, uint256> mapKeyImages;
+    std::unordered_map<CCmpPubKey, uint256, SaltedKeyImageHasher> mapKeyImages;
     
 
     /** Create a new CTxMemPool.
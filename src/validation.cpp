@@ -494,7 +494,9 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
     if (pfMissingInputs)
         *pfMissingInputs = false;
 
-    if (!CheckTransaction(tx, state))
+    std::vector<CRangeproofCheck> vRangeproofChecks;
+    if (!CheckTransaction(tx, state, true, &vRangeproofChecks)
+        || !CheckRangeproofs(vRangeproofChecks, state))
         return false; // state filled in by CheckTransaction
 
     // Coinbase is only valid in a block, not as a loose transaction
@@ -1522,6 +1524,9 @@ void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight)
 }
 
 bool CScriptCheck::operator()() {
+    if (anonCheck)
+        return (*anonCheck)();
+    
     const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
     const CScriptWitness *witness = &ptxTo->vin[nIn].scriptWitness;
     
@@ -1668,9 +1673,15 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
                 }
             }
 
-            if (fHaveAnonIn && fAnonChecks
-                && !VerifyMLSAG(tx, state))
+            if (fHaveAnonIn && fAnonChecks)
+            {
+                // Ring members are read here, the signatures of the inputs are verified alongside the script checks
+                std::vector<std::shared_ptr<CAnonInputCheck> > vAnonChecks;
+                if (!VerifyMLSAG(tx, state, pvChecks ? &vAnonChecks : nullptr))
                     return false;
+                for (auto &anonCheck : vAnonChecks)
+                    pvChecks->push_back(CScriptCheck(anonCheck));
+            };
 
             if (cacheFullScriptStore && !pvChecks) {
                 // We executed all of the provided scripts, and were told to
@@ -2068,6 +2079,64 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
+static CCheckQueue<CRangeproofBatchCheck> rangeproofcheckqueue(16);
+
+void ThreadRangeproofCheck() {
+    RenameThread("particl-rangech");
+    rangeproofcheckqueue.Thread();
+}
+
+bool CheckRangeproofs(std::vector<CRangeproofCheck> &vChecks, CValidationState &state, CCheckQueue<CRangeproofBatchCheck> *pqueue)
+{
+    if (vChecks.empty())
+        return true;
+
+    // Verify in batches of up to RANGEPROOF_BATCH_SIZE proofs, a batch is one job for the queue.
+    // With a queue, batches are kept small enough to give every possible check thread a job.
+    size_t nBatchSize = RANGEPROOF_BATCH_SIZE;
+    if (pqueue)
+        nBatchSize = std::max((size_t)1, std::min(nBatchSize, vChecks.size() / MAX_SCRIPTCHECK_THREADS));
+
+    std::vector<CRangeproofBatchCheck> vBatches;
+    for (size_t i = 0; i < vChecks.size(); i += nBatchSize)
+        vBatches.emplace_back(vChecks.begin() + i, vChecks.begin() + std::min(i + nBatchSize, vChecks.size()));
+
+    bool fBatchesValid = true;
+    if (pqueue && vBatches.size() > 1)
+    {
+        CCheckQueueControl<CRangeproofBatchCheck> control(pqueue);
+        control.Add(vBatches);
+        fBatchesValid = control.Wait();
+    } else
+    {
+        for (auto &batch : vBatches)
+        {
+            if (!batch())
+            {
+                fBatchesValid = false;
+                break;
+            };
+        };
+    };
+    if (fBatchesValid)
+        return true;
+
+    // Rerun the checks individually to find the failing proof
+    for (auto &check : vChecks)
+    {
+        if (!check())
+            return state.DoS(100, false, REJECT_INVALID, check.GetRejectReason(), false,
+                strprintf("Transaction check failed (tx hash %s)", check.GetTransaction()->GetHash().ToString()));
+    };
+
+    return true;
+}
+
+bool CheckRangeproofs(std::vector<CRangeproofCheck> &vChecks, CValidationState &state)
+{
+    return CheckRangeproofs(vChecks, state, nScriptCheckThreads ? &rangeproofcheckqueue : nullptr);
+}
+
 // Protected by cs_main
 VersionBitsCache versionbitscache;
 
@@ -2182,7 +2251,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     int64_t nTimeStart = GetTimeMicros();
 
     // Check it again in case a previous version let a bad block in
-    if (!CheckBlock(block, state, chainparams.GetConsensus(), !fJustCheck, !fJustCheck))
+    if (!CheckBlock(block, state, chainparams.GetConsensus(), !fJustCheck, !fJustCheck, fJustCheck))
         return error("%s: Consensus::CheckBlock: %s", __func__, FormatStateMessage(state));
     
     if (block.IsProofOfStake())
@@ -2525,8 +2594,8 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                 
                 int64_t nTestExists;
                 if (!fVerifyingDB
-                    && (pblocktree->ReadRCTOutputLink(txout->pk, nTestExists)
-                        || view.ReadRCTOutputLink(txout->pk, nTestExists))) {
+                    && (view.ReadRCTOutputLink(txout->pk, nTestExists)
+                        || pblocktree->ReadRCTOutputLink(txout->pk, nTestExists))) {
                     control.Wait();
                     return error("%s: Duplicate anon-output %s, index %d.", __func__, HexStr(txout->pk.begin(), txout->pk.end()), nTestExists);
                 };
@@ -2786,7 +2855,7 @@ bool FlushStateToDisk(const CChainParams& chainparams, CValidationState &state,
             nLastSetChain = nNow;
         }
         int64_t nMempoolSizeMax = gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
-        int64_t cacheSize = pcoinsTip->DynamicMemoryUsage();
+        int64_t cacheSize = pcoinsTip->DynamicMemoryUsage() + pblocktree->RCTIndexCacheUsage();
         int64_t nTotalSpace = nCoinCacheUsage + std::max<int64_t>(nMempoolSizeMax - nMempoolUsage, 0);
         // The cache is large and we're within 10% and 10 MiB of the limit, but we have time now (not in the middle of a block processing).
         bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize > std::max((9 * nTotalSpace) / 10, nTotalSpace - MAX_BLOCK_COINSDB_USAGE * 1024 * 1024);
@@ -2837,6 +2906,9 @@ bool FlushStateToDisk(const CChainParams& chainparams, CValidationState &state,
             // overwrite one. Still, use a conservative safety factor of 2.
             if (!CheckDiskSpace(48 * 2 * 2 * pcoinsTip->GetCacheSize()))
                 return state.Error("out of disk space");
+            // Flush the RCT index changes of the blocks in the chainstate.
+            if (!pblocktree->FlushRCTIndex())
+                return AbortNode(state, "Failed to write RCT index");
             // Flush the chainstate (which may refer to block index entries).
             if (!pcoinsTip->Flush())
                 return AbortNode(state, "Failed to write to coin database");
@@ -2930,33 +3002,32 @@ bool FlushView(CCoinsViewCache *view, CValidationState& state, bool fDisconnecti
         };
     } else
     {
-        CDBBatch batch(*pblocktree);
-        
-        
+        // Written to the RCT index cache of pblocktree, flushed with the chainstate
         if (view->anonOutputs.size() > 0)
         {
-            batch.Write(DB_RCTOUTPUT_LAST, view->nLastRCTOutput);
+            if (!pblocktree->WriteLastRCTOutput(view->nLastRCTOutput))
+                return error("%s: WriteLastRCTOutput failed.", __func__);
             
             if (view->nBlockHeight % 250 == 0)
-                batch.Write(std::make_pair(DB_RCTOUTPUT_CHECKPOINT, view->nBlockHeight), view->nLastRCTOutput);
+                pblocktree->WriteRCTOutputCheckpoint(view->nBlockHeight, view->nLastRCTOutput);
         } else
         if (view->nBlockHeight % 250 == 0)
         {
             if (pblocktree->ReadLastRCTOutput(view->nLastRCTOutput))
-                batch.Write(std::make_pair(DB_RCTOUTPUT_CHECKPOINT, view->nBlockHeight), view->nLastRCTOutput);
+                pblocktree->WriteRCTOutputCheckpoint(view->nBlockHeight, view->nLastRCTOutput);
         };
         
         for (auto &it : view->keyImages)
-            batch.Write(std::make_pair(DB_RCTKEYIMAGE, it.first), it.second);
+            if (!pblocktree->WriteRCTKeyImage(it.first, it.second))
+                return error("%s: WriteRCTKeyImage failed, txn %s.", __func__, it.second.ToString());
         
         for (auto &it : view->anonOutputs)
-            batch.Write(std::make_pair(DB_RCTOUTPUT, it.first), it.second);
+            if (!pblocktree->WriteRCTOutput(it.first, it.second))
+                return error("%s: WriteRCTOutput failed.", __func__);
         
         for (auto &it : view->anonOutputLinks)
-            batch.Write(std::make_pair(DB_RCTOUTPUT_LINK, it.first), it.second);
-        
-        if (!pblocktree->WriteBatch(batch))
-            return error("%s: Write RCT outputs failed.", __func__);
+            if (!pblocktree->WriteRCTOutputLink(it.first, it.second))
+                return error("%s: WriteRCTOutputLink failed.", __func__);
     };
     
     view->nLastRCTOutput = 0;
@@ -3858,7 +3929,7 @@ bool CheckStakeUnique(const CBlock &block, bool fUpdate)
     return AddToMapStakeSeen(kernel, blockHash);
 };
 
-bool CheckBlock(const CBlock& block, CValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW, bool fCheckMerkleRoot)
+bool CheckBlock(const CBlock& block, CValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW, bool fCheckMerkleRoot, bool fCacheRangeproofs)
 {
     // These are checks that are independent of context.
 
@@ -3942,14 +4013,17 @@ bool CheckBlock(const CBlock& block, CValidationState& state, const Consensus::P
                 return state.DoS(100, false, REJECT_INVALID, "bad-cb-multiple", false, "more than one coinbase");
     };
 
-    // Check transactions
+    // Check transactions, rangeproofs are verified together once the cheap checks have passed
+    std::vector<CRangeproofCheck> vRangeproofChecks;
     for (const auto& tx : block.vtx)
     {
         //if (!CheckTransaction(*tx, state, false))
-        if (!CheckTransaction(*tx, state)) // Check for duplicate inputs, TODO: UpdateCoins should return a bool, db/coinsview txn should be undone
+        if (!CheckTransaction(*tx, state, true, &vRangeproofChecks, fCacheRangeproofs)) // Check for duplicate inputs, TODO: UpdateCoins should return a bool, db/coinsview txn should be undone
             return state.Invalid(false, state.GetRejectCode(), state.GetRejectReason(),
                                  strprintf("Transaction check failed (tx hash %s) %s", tx->GetHash().ToString(), state.GetDebugMessage()));
     };
+    if (!CheckRangeproofs(vRangeproofChecks, state))
+        return false;
     
     unsigned int nSigOps = 0;
     for (const auto& tx : block.vtx)
@@ -4657,7 +4731,8 @@ bool TestBlockValidity(CValidationState& state, const CChainParams& chainparams,
     // NOTE: CheckBlockHeader is called by CheckBlock
     if (!ContextualCheckBlockHeader(block, state, chainparams, pindexPrev, GetAdjustedTime()))
         return error("%s: Consensus::ContextualCheckBlockHeader: %s", __func__, FormatStateMessage(state));
-    if (!CheckBlock(block, state, chainparams.GetConsensus(), fCheckPOW, fCheckMerkleRoot))
+    // Keep the rangeproofs cached for when the block is connected
+    if (!CheckBlock(block, state, chainparams.GetConsensus(), fCheckPOW, fCheckMerkleRoot, true))
         return error("%s: Consensus::CheckBlock: %s", __func__, FormatStateMessage(state));
     if (!ContextualCheckBlock(block, state, chainparams.GetConsensus(), pindexPrev))
         return error("%s: Consensus::ContextualCheckBlock: %s", __func__, FormatStateMessage(state));
@@ -25,6 +25,7 @@
 #include <algorithm>
 #include <exception>
 #include <map>
+#include <memory>
 #include <set>
 #include <stdint.h>
 #include <string>
@@ -40,6 +41,10 @@ class CCoinsViewDB;
 class CInv;
 class CConnman;
 class CScriptCheck;
+class CAnonInputCheck;
+class CRangeproofCheck;
+class CRangeproofBatchCheck;
+template <typename T> class CCheckQueue;
 class CBlockPolicyEstimator;
 class CTxMemPool;
 class CValidationState;
@@ -313,6 +318,14 @@ bool LoadChainTip(const CChainParams& chainparams);
 void UnloadBlockIndex();
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the rangeproof checking thread */
+void ThreadRangeproofCheck();
+/**
+ * Verify the rangeproofs deferred by CheckTransaction in batches, spread over the rangeproof
+ * check threads when there are any, pqueue overrides the queue used.
+ */
+bool CheckRangeproofs(std::vector<CRangeproofCheck> &vChecks, CValidationState &state, CCheckQueue<CRangeproofBatchCheck> *pqueue);
+bool CheckRangeproofs(std::vector<CRangeproofCheck> &vChecks, CValidationState &state);
 /** Return the average number of blocks that other nodes claim to have */
 int GetNumBlocksOfPeers();
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
@@ -433,11 +446,15 @@ private:
     bool cacheStore;
     ScriptError error;
     PrecomputedTransactionData *txdata;
+    std::shared_ptr<CAnonInputCheck> anonCheck; // if set the MLSAG of an anon input is verified instead of a script
     //secp256k1_pedersen_commitment valueCommitment;
 
 public:
     CScriptCheck(): amount(0), ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
     
+    explicit CScriptCheck(std::shared_ptr<CAnonInputCheck> anonCheckIn) :
+        amount(0), ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(nullptr), anonCheck(anonCheckIn) { }
+    
     CScriptCheck(const CScript& scriptPubKeyIn, const std::vector<uint8_t> &vchAmountIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, PrecomputedTransactionData* txdataIn) :
         scriptPubKey(scriptPubKeyIn), vchAmount(vchAmountIn),
         ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(txdataIn) { }
@@ -462,6 +479,7 @@ public:
         std::swap(cacheStore, check.cacheStore);
         std::swap(error, check.error);
         std::swap(txdata, check.txdata);
+        std::swap(anonCheck, check.anonCheck);
     }
 
     ScriptError GetScriptError() const { return error; }
@@ -494,8 +512,12 @@ bool AddToMapStakeSeen(const COutPoint &kernel, const uint256 &blockHash);
 bool CheckStakeUnused(const COutPoint &kernel);
 bool CheckStakeUnique(const CBlock &block, bool fUpdate=true);
 
-/** Context-independent validity checks */
-bool CheckBlock(const CBlock& block, CValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW = true, bool fCheckMerkleRoot = true);
+/**
+ * Context-independent validity checks
+ * Verified rangeproofs are added to the rangeproof cache if fCacheRangeproofs is set, for blocks only being
+ * checked, else cache hits are removed as the block is about to be connected.
+ */
+bool CheckBlock(const CBlock& block, CValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW = true, bool fCheckMerkleRoot = true, bool fCacheRangeproofs = false);
 
 unsigned int GetNextTargetRequired(const CBlockIndex *pindexLast);
 
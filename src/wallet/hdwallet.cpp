@@ -842,7 +842,11 @@ bool CHDWallet::Lock()
         ExtKeyLock();
     }
 
-    return CCryptoKeyStore::Lock();
+    // Lock the keystore first, smsg can't fetch the keys again once its cache is cleared
+    bool rv = CCryptoKeyStore::Lock();
+    SecureMsgWalletLocked();
+
+    return rv;
 };
 
 bool CHDWallet::Unlock(const SecureString &strWalletPassphrase)
@@ -955,6 +959,17 @@ bool CHDWallet::HaveKey(const CKeyID &address) const
     return HaveKey(address, ak, pa);
 };
 
+bool CHDWallet::AddKeyPubKey(const CKey &key, const CPubKey &pubkey)
+{
+    LOCK(cs_wallet);
+    
+    if (!CWallet::AddKeyPubKey(key, pubkey))
+        return false;
+    
+    fStakeCandidatesDirty = true; // Outputs to the key can be staked now
+    return true;
+};
+
 bool CHDWallet::HaveExtKey(const CKeyID &keyID) const
 {
     LOCK(cs_wallet);
@@ -1757,30 +1772,9 @@ bool CHDWallet::IsTrusted(const uint256 &txhash, const uint256 &blockhash, int n
 
 CAmount CHDWallet::GetBalance() const
 {
-    CAmount nBalance = 0;
-    
-    LOCK2(cs_main, cs_wallet);
-    
-    for (const auto &ri : mapRecords)
-    {
-        const auto &txhash = ri.first;
-        const auto &rtx = ri.second;
-        if (!IsTrusted(txhash, rtx.blockHash, rtx.nIndex))
-            continue;
-        
-        for (const auto &r : rtx.vout)
-        {
-            if (r.nType == OUTPUT_STANDARD
-                && r.nFlags & ORF_OWNED && !IsSpent(txhash, r.n))
-                nBalance += r.nValue;
-        };
-        
-        if (!MoneyRange(nBalance))
-            throw std::runtime_error(std::string(__func__) + ": value out of range");
-    };
-    
-    nBalance += CWallet::GetBalance();
-    return nBalance;
+    CHDWalletBalances bal;
+    GetBalances(bal);
+    return bal.nPart;
 };
 
 CAmount CHDWallet::GetStakeableBalance() const
@@ -1789,118 +1783,56 @@ CAmount CHDWallet::GetStakeableBalance() const
     
     LOCK2(cs_main, cs_wallet);
     
-    for (const auto &ri : mapRecords)
+    RebuildStakeCandidates();
+    
+    for (const auto &sc : mapStakeCandidates)
     {
-        const auto &txhash = ri.first;
-        const auto &rtx = ri.second;
-        if (!IsTrusted(txhash, rtx.blockHash, rtx.nIndex))
+        const COutPoint &op = sc.first;
+        if (IsSpent(op.hash, op.n))
             continue;
         
-        for (const auto &r : rtx.vout)
+        if (sc.second.fRecord)
         {
-            if (r.nType == OUTPUT_STANDARD
-                && (r.nFlags & ORF_OWNED || r.nFlags & ORF_STAKEONLY)
-                && !IsSpent(txhash, r.n))
-                nBalance += r.nValue;
+            MapRecords_t::const_iterator mri = mapRecords.find(op.hash);
+            if (mri == mapRecords.end()
+                || !IsTrusted(op.hash, mri->second.blockHash, mri->second.nIndex))
+                continue;
+        } else
+        {
+            MapWallet_t::const_iterator mwi = mapWallet.find(op.hash);
+            if (mwi == mapWallet.end()
+                || !mwi->second.IsTrusted())
+                continue;
         };
         
+        nBalance += sc.second.nValue;
+        
         if (!MoneyRange(nBalance))
             throw std::runtime_error(std::string(__func__) + ": value out of range");
     };
     
-    for (MapWallet_t::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (!pcoin->IsTrusted())
-            continue;
-        nBalance += pcoin->GetAvailableCredit();
-        nBalance += pcoin->GetAvailableWatchOnlyCredit();  // TODO: split stakeable and non-stakeable watch type
-    };
-    
-    nBalance += CWallet::GetBalance();
     return nBalance;
 };
 
 CAmount CHDWallet::GetUnconfirmedBalance() const
 {
-    CAmount nBalance = 0;
-    
-    LOCK2(cs_main, cs_wallet);
-    
-    for (const auto &ri : mapRecords)
-    {
-        const auto &txhash = ri.first;
-        const auto &rtx = ri.second;
-        
-        if (IsTrusted(txhash, rtx.blockHash))
-            continue;
-        
-        for (const auto &r : rtx.vout)
-        {
-            if (r.nFlags & ORF_OWNED && !IsSpent(txhash, r.n))
-                nBalance += r.nValue;
-        };
-        
-        if (!MoneyRange(nBalance))
-            throw std::runtime_error(std::string(__func__) + ": value out of range");
-    };
-    
-    nBalance += CWallet::GetUnconfirmedBalance();
-    return nBalance;
+    CHDWalletBalances bal;
+    GetBalances(bal);
+    return bal.nPartUnconf + bal.nBlindUnconf + bal.nAnonUnconf;
 };
 
 CAmount CHDWallet::GetBlindBalance()
 {
-    CAmount nBalance = 0;
-    
-    LOCK2(cs_main, cs_wallet);
-    
-    for (const auto &ri : mapRecords)
-    {
-        const auto &txhash = ri.first;
-        const auto &rtx = ri.second;
-        
-        if (!IsTrusted(txhash, rtx.blockHash))
-            continue;
-        
-        for (const auto &r : rtx.vout)
-        {
-            if (r.nType == OUTPUT_CT
-                && r.nFlags & ORF_OWNED && !IsSpent(txhash, r.n))
-                nBalance += r.nValue;
-        };
-        
-        if (!MoneyRange(nBalance))
-            throw std::runtime_error(std::string(__func__) + ": value out of range");
-    };
-    return nBalance;
+    CHDWalletBalances bal;
+    GetBalances(bal);
+    return bal.nBlind;
 };
 
 CAmount CHDWallet::GetAnonBalance()
 {
-    CAmount nBalance = 0;
-    
-    LOCK2(cs_main, cs_wallet);
-    
-    for (const auto &ri : mapRecords)
-    {
-        const auto &txhash = ri.first;
-        const auto &rtx = ri.second;
-        
-        if (!IsTrusted(txhash, rtx.blockHash))
-            continue;
-        
-        for (const auto &r : rtx.vout)
-        {
-            if (r.nType == OUTPUT_RINGCT
-                && r.nFlags & ORF_OWNED && !IsSpent(txhash, r.n))
-                nBalance += r.nValue;
-        };
-        
-        if (!MoneyRange(nBalance))
-            throw std::runtime_error(std::string(__func__) + ": value out of range");
-    };
-    return nBalance;
+    CHDWalletBalances bal;
+    GetBalances(bal);
+    return bal.nAnon;
 };
 
 /**
@@ -1981,14 +1913,56 @@ CAmount CHDWallet::GetLegacyBalance(const isminefilter& filter, int minDepth, co
     return balance;
 }
 
-bool CHDWallet::GetBalances(CHDWalletBalances &bal)
+bool CHDWallet::GetBalances(CHDWalletBalances &bal) const
+{
+    LOCK2(cs_main, cs_wallet);
+    
+    if (fBalancesDirty)
+    {
+        mapTxBalances.clear();
+        setTxBalancesUnconfirmed.clear();
+        balancesCached.Clear();
+        
+        for (const auto &wi : mapWallet)
+            UpdateTxBalances(wi.first);
+        for (const auto &ri : mapRecords)
+            UpdateTxBalances(ri.first);
+        
+        fBalancesDirty = false;
+    } else
+    {
+        // There's no signal for txns leaving the mempool
+        std::vector<uint256> vUnconfirmed(setTxBalancesUnconfirmed.begin(), setTxBalancesUnconfirmed.end());
+        for (const auto &txhash : vUnconfirmed)
+            UpdateTxBalances(txhash);
+    };
+    
+    bal = balancesCached;
+    return true;
+};
+
+bool CHDWallet::GetBalancesFull(CHDWalletBalances &bal) const
 {
     bal.Clear();
     
     LOCK2(cs_main, cs_wallet);
-    for (MapWallet_t::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    for (const auto &wi : mapWallet)
+        GetTxBalances(wi.first, bal);
+    for (const auto &ri : mapRecords)
+        GetTxBalances(ri.first, bal);
+    
+    return true;
+};
+
+void CHDWallet::GetTxBalances(const uint256 &txhash, CHDWalletBalances &bal) const
+{
+    AssertLockHeld(cs_wallet);
+    
+    MapWallet_t::const_iterator mwi;
+    MapRecords_t::const_iterator mri;
+    if ((mwi = mapWallet.find(txhash)) != mapWallet.end())
     {
-        CWalletTx *pcoin = &(*it).second;
+        const CWalletTx *pcoin = &mwi->second;
         
         bal.nPartImmature += pcoin->GetImmatureCredit();
         
@@ -2014,14 +1988,12 @@ bool CHDWallet::GetBalances(CHDWalletBalances &bal)
                 bal.nPartWatchOnlyUnconf += pcoin->GetAvailableWatchOnlyCredit();
             };
         };
-    };
-    
-    for (const auto &ri : mapRecords)
+    } else
+    if ((mri = mapRecords.find(txhash)) != mapRecords.end())
     {
-        const auto &txhash = ri.first;
-        const auto &rtx = ri.second;
+        const auto &rtx = mri->second;
         
-        bool fTrusted = IsTrusted(txhash, rtx.blockHash);
+        bool fTrusted = IsTrusted(txhash, rtx.blockHash, rtx.nIndex);
         
         for (const auto &r : rtx.vout)
         {
@@ -2052,11 +2024,111 @@ bool CHDWallet::GetBalances(CHDWalletBalances &bal)
             };
         };
     };
+};
+
+void CHDWallet::UpdateTxBalances(const uint256 &txhash) const
+{
+    CHDWalletBalances bal;
+    GetTxBalances(txhash, bal);
+    
+    int nDepth = 1;
+    MapWallet_t::const_iterator mwi;
+    MapRecords_t::const_iterator mri;
+    if ((mwi = mapWallet.find(txhash)) != mapWallet.end())
+        nDepth = mwi->second.GetDepthInMainChain();
+    else
+    if ((mri = mapRecords.find(txhash)) != mapRecords.end())
+        nDepth = GetDepthInMainChain(mri->second.blockHash, mri->second.nIndex);
+    
+    // Trusted unconfirmed txns count as confirmed until they leave the mempool
+    if (nDepth == 0 && (!bal.IsNull() || InMempool(txhash)))
+        setTxBalancesUnconfirmed.insert(txhash);
+    else
+        setTxBalancesUnconfirmed.erase(txhash);
+    
+    auto it = mapTxBalances.find(txhash);
+    if (it != mapTxBalances.end())
+    {
+        balancesCached -= it->second;
+        if (bal.IsNull())
+        {
+            mapTxBalances.erase(it);
+            return;
+        };
+        it->second = bal;
+    } else
+    {
+        if (bal.IsNull())
+            return;
+        mapTxBalances[txhash] = bal;
+    };
+    balancesCached += bal;
+};
+
+void CHDWallet::UpdateBalances(const CTransaction &tx)
+{
+    AssertLockHeld(cs_wallet);
     
-    //if (!MoneyRange(nBalance))
-    //    throw std::runtime_error(std::string(__func__) + ": value out of range");
+    if (fBalancesDirty)
+        return; // Rebuilt in full when next read
     
-    return true;
+    UpdateTxBalances(tx.GetHash());
+    for (const auto &txin : tx.vin)
+    {
+        if (txin.IsAnonInput())
+        {
+            // Spent anon outputs are found through key images, not prevouts
+            fBalancesDirty = true;
+            return;
+        };
+        
+        // SyncTransaction only marks the inputs dirty after the txn is added
+        MapWallet_t::iterator mwi = mapWallet.find(txin.prevout.hash);
+        if (mwi != mapWallet.end())
+            mwi->second.MarkDirty();
+        UpdateTxBalances(txin.prevout.hash);
+    };
+};
+
+void CHDWallet::MarkDirty()
+{
+    LOCK(cs_wallet);
+    fStakeCandidatesDirty = true;
+    fBalancesDirty = true;
+    CWallet::MarkDirty();
+};
+
+void CHDWallet::BlockConnected(const std::shared_ptr<const CBlock>& pblock, const CBlockIndex *pindex, const std::vector<CTransactionRef>& vtxConflicted)
+{
+    CWallet::BlockConnected(pblock, pindex, vtxConflicted);
+    
+    LOCK2(cs_main, cs_wallet);
+    UpdatePendingBalances();
+};
+
+void CHDWallet::BlockDisconnected(const std::shared_ptr<const CBlock>& pblock)
+{
+    CWallet::BlockDisconnected(pblock);
+    
+    // Confirmed txns of the block become pending again, rare enough to rebuild in full
+    LOCK(cs_wallet);
+    fBalancesDirty = true;
+};
+
+void CHDWallet::UpdatePendingBalances()
+{
+    AssertLockHeld(cs_wallet);
+    
+    if (fBalancesDirty)
+        return;
+    
+    std::vector<uint256> vPending(setTxBalancesUnconfirmed.begin(), setTxBalancesUnconfirmed.end());
+    for (const auto &tb : mapTxBalances)
+        if (tb.second.IsPending() && !setTxBalancesUnconfirmed.count(tb.first))
+            vPending.push_back(tb.first);
+    
+    for (const auto &txhash : vPending)
+        UpdateTxBalances(txhash);
 };
 
 bool CHDWallet::IsChange(const CTxOutBase *txout) const
@@ -2536,46 +2608,66 @@ int CHDWallet::CreateOutput(OUTPUT_PTR<CTxOutBase> &txbout, CTempRecipient &r, s
 
 int CHDWallet::AddCTData(CTxOutBase *txout, CTempRecipient &r, std::string &sError)
 {
-    secp256k1_pedersen_commitment *pCommitment = txout->GetPCommitment();
-    std::vector<uint8_t> *pvRangeproof = txout->GetPRangeproof();
+    std::vector<CRangeproofSignData> vProofs;
+    if (0 != PrepareCTData(txout, r, vProofs, sError))
+        return 1; // sError will be set
+    
+    switch (SignRangeproof(vProofs[0]))
+    {
+        case 0:
+            break;
+        case 1:
+            return errorN(1, sError, __func__, "secp256k1_pedersen_commit failed.");
+        default:
+            return errorN(1, sError, __func__, "secp256k1_rangeproof_sign failed.");
+    };
+    
+    return 0;
+};
+
+int CHDWallet::PrepareCTData(CTxOutBase *txout, CTempRecipient &r, std::vector<CRangeproofSignData> &vProofs, std::string &sError)
+{
+    CRangeproofSignData d;
+    d.pCommitment = txout->GetPCommitment();
+    d.pvRangeproof = txout->GetPRangeproof();
     
-    if (!pCommitment || !pvRangeproof)
+    if (!d.pCommitment || !d.pvRangeproof)
         return errorN(1, sError, __func__, "Unable to get CT pointers for output type %d", txout->GetType());
     
-    uint64_t nValue = r.nAmount;
-    if (!secp256k1_pedersen_commit(secp256k1_ctx_blind,
-        pCommitment, (uint8_t*)&r.vBlind[0],
-        nValue, secp256k1_generator_h))
-        return errorN(1, sError, __func__, "secp256k1_pedersen_commit failed.");
+    if (r.vBlind.size() != 32)
+        return errorN(1, sError, __func__, "Missing blinding factor.");
     
-    uint256 nonce = r.sEphem.ECDH(r.pkTo);
-    CSHA256().Write(nonce.begin(), 32).Finalize(nonce.begin());
+    d.nValue = r.nAmount;
+    memcpy(d.blind, &r.vBlind[0], 32);
     
-    const char *message = r.sNarration.c_str();
-    size_t mlen = strlen(message);
+    uint256 nonce = r.sEphem.ECDH(r.pkTo);
+    CSHA256().Write(nonce.begin(), 32).Finalize(d.nonce);
     
-    size_t nRangeProofLen = 5134;
-    pvRangeproof->resize(nRangeProofLen);
+    d.sMessage = r.sNarration.c_str();
     
-    uint64_t min_value = 0;
-    int ct_exponent = 2;
-    int ct_bits = 32;
+    d.nMinValue = 0;
+    d.nExponent = 2;
+    d.nBits = 32;
     
-    if (0 != SelectRangeProofParameters(nValue, min_value, ct_exponent, ct_bits))
+    if (0 != SelectRangeProofParameters(d.nValue, d.nMinValue, d.nExponent, d.nBits))
         return errorN(1, sError, __func__, "SelectRangeProofParameters failed.");
     
-    if (1 != secp256k1_rangeproof_sign(secp256k1_ctx_blind,
-        &(*pvRangeproof)[0], &nRangeProofLen,
-        min_value, pCommitment,
-        &r.vBlind[0], nonce.begin(),
-        ct_exponent, ct_bits, 
-        nValue,
-        (const unsigned char*) message, mlen,
-        nullptr, 0,
-        secp256k1_generator_h))
-        return errorN(1, sError, __func__, "secp256k1_rangeproof_sign failed.");
-    
-    pvRangeproof->resize(nRangeProofLen);
+    vProofs.push_back(d);
+    return 0;
+};
+
+int CHDWallet::SignCTData(std::vector<CRangeproofSignData> &vProofs, std::string &sError)
+{
+    size_t nFailed = 0;
+    switch (SignRangeproofs(vProofs, nFailed))
+    {
+        case 0:
+            break;
+        case 1:
+            return errorN(1, sError, __func__, "secp256k1_pedersen_commit failed, output %d.", nFailed);
+        default:
+            return errorN(1, sError, __func__, "secp256k1_rangeproof_sign failed, output %d.", nFailed);
+    };
     
     return 0;
 };
@@ -3139,6 +3231,7 @@ int CHDWallet::AddStandardInputs(CWalletTx &wtx, CTransactionRecord &rtx,
                     return errorN(1, sError, __func__, "secp256k1_pedersen_commit failed for plain out.");
             };
             
+            std::vector<CRangeproofSignData> vProofs;
             for (size_t i = 0; i < vecSend.size(); ++i)
             {
                 auto &r = vecSend[i];
@@ -3160,11 +3253,14 @@ int CHDWallet::AddStandardInputs(CWalletTx &wtx, CTransactionRecord &rtx,
                     };
                     
                     assert(r.n < (int)txNew.vpout.size());
-                    if (0 != AddCTData(txNew.vpout[r.n].get(), r, sError))
+                    if (0 != PrepareCTData(txNew.vpout[r.n].get(), r, vProofs, sError))
                         return 1; // sError will be set
                 };
             };
             
+            if (0 != SignCTData(vProofs, sError))
+                return 1; // sError will be set
+            
             // Fill in dummy signatures for fee calculation.
             int nIn = 0;
             for (const auto &coin : setCoins)
@@ -3553,6 +3649,7 @@ int CHDWallet::AddBlindedInputs(CWalletTx &wtx, CTransactionRecord &rtx,
             txNew.vpout.push_back(outFee);
             
             bool fFirst = true;
+            std::vector<CRangeproofSignData> vProofs;
             for (size_t i = 0; i < vecSend.size(); ++i)
             {
                 auto &r = vecSend[i];
@@ -3581,11 +3678,14 @@ int CHDWallet::AddBlindedInputs(CWalletTx &wtx, CTransactionRecord &rtx,
                     // Need to know the fee before calulating the blind sum
                     GetStrongRandBytes(&r.vBlind[0], 32);
                     
-                    if (0 != AddCTData(txbout.get(), r, sError))
+                    if (0 != PrepareCTData(txbout.get(), r, vProofs, sError))
                         return 1; // sError will be set
                 };
             };
             
+            if (0 != SignCTData(vProofs, sError))
+                return 1; // sError will be set
+            
             // Fill in dummy signatures for fee calculation.
             int nIn = 0;
             for (const auto &coin : setCoins)
@@ -3939,13 +4039,19 @@ int CHDWallet::PickHidingOutputs(std::vector<std::vector<int64_t> > &vMI, size_t
     const Consensus::Params& consensusParams = Params().GetConsensus();
     size_t nInputs = vMI.size();
     
-    int64_t nLastRCTOutIndex = 0;
-    pblocktree->ReadLastRCTOutput(nLastRCTOutIndex);
+    int nExtraDepth = gArgs.GetBoolArg("-regtest", false) ? -1 : 2; // if not on regtest pick outputs deeper than consensus checks to prevent banning
+    int nMaxHeight = nBestHeight - (consensusParams.nMinRCTOutputDepth+nExtraDepth);
     
-    if (nLastRCTOutIndex < (int64_t)(nInputs * nRingSize))
-        return errorN(1, sError, __func__, _("Not enough anon outputs exist, last: %d, required: %d").c_str(), nLastRCTOutIndex, nInputs * nRingSize);
+    // Outputs are indexed in block order, so all outputs deep enough to spend lie in [1, nMaxIndex]
+    int64_t nMaxIndex = 0;
+    if (nMaxHeight >= 0
+        && !pblocktree->ReadLastRCTOutputAtHeight(nMaxHeight, nMaxIndex))
+        return errorN(1, sError, __func__, _("Anon output not found in db at height %d").c_str(), nMaxHeight);
     
-    int nExtraDepth = gArgs.GetBoolArg("-regtest", false) ? -1 : 2; // if not on regtest pick outputs deeper than consensus checks to prevent banning
+    if (nMaxIndex < (int64_t)(nInputs * nRingSize))
+        return errorN(1, sError, __func__, _("Not enough anon outputs exist, last: %d, required: %d").c_str(), nMaxIndex, nInputs * nRingSize);
+    
+    CDecoySelector selector(nMaxIndex, nRCTOutSelectionGroup1, nRCTOutSelectionGroup2);
     
     // Must add real outputs to setHave before adding the decoys.
     for (size_t k = 0; k < nInputs; ++k)
@@ -3954,56 +4060,8 @@ int CHDWallet::PickHidingOutputs(std::vector<std::vector<int64_t> > &vMI, size_t
         if (i == nSecretColumn)
             continue;
         
-        int64_t nMinIndex = 1;
-        if (GetRandInt(100) < 50) // 50% chance of selecting from the last 2400
-        {
-            nMinIndex = std::max((int64_t)1, nLastRCTOutIndex - nRCTOutSelectionGroup1);
-        } else
-        if (GetRandInt(100) < 70) // further 70% chance of selecting from the last 24000
-        {
-            nMinIndex = std::max((int64_t)1, nLastRCTOutIndex - nRCTOutSelectionGroup2);
-        };
-        
-        int64_t nLastDepthCheckPassed = 0;
-        size_t j = 0;
-        const static size_t nMaxTries = 1000;
-        for (j = 0; j < nMaxTries; ++j)
-        {
-            if (nLastRCTOutIndex <= nMinIndex)
-                return errorN(1, sError, __func__, _("Not enough anon outputs exist, min: %d lastpick: %d, required: %d").c_str(), nMinIndex, nLastRCTOutIndex, nInputs * nRingSize);
-            
-            int64_t nDecoy = nMinIndex + GetRand((nLastRCTOutIndex - nMinIndex) + 1);
-            
-            if (setHave.count(nDecoy) > 0)
-            {
-                if (nDecoy == nLastRCTOutIndex)
-                    nLastRCTOutIndex--;
-                continue;
-            };
-            
-            if (nDecoy > nLastDepthCheckPassed)
-            {
-                CAnonOutput ao;
-                if (!pblocktree->ReadRCTOutput(nDecoy, ao))
-                    return errorN(1, sError, __func__, _("Anon output not found in db, %d").c_str(), nDecoy);
-                
-                if (ao.nBlockHeight > nBestHeight - (consensusParams.nMinRCTOutputDepth+nExtraDepth))
-                {
-                    if (nLastRCTOutIndex > nDecoy)
-                        nLastRCTOutIndex = nDecoy-1;
-                    continue;
-                };
-                nLastDepthCheckPassed = nDecoy;
-            };
-            
-            vMI[k][i] = nDecoy;
-            setHave.insert(nDecoy);
-            break;
-        };
-        
-        if (j >= nMaxTries)
-            return errorN(1, sError, __func__, _("Hit nMaxTries limit, %d, %d").c_str(), k, i);
-        
+        if (!selector.Pick(setHave, vMI[k][i]))
+            return errorN(1, sError, __func__, _("Not enough anon outputs exist, last: %d, required: %d").c_str(), nMaxIndex, nInputs * nRingSize);
     };
     
     return 0;
@@ -4155,6 +4213,7 @@ int CHDWallet::AddAnonInputs(CWalletTx &wtx, CTransactionRecord &rtx,
             txNew.vpout.push_back(outFee);
             
             bool fFirst = true;
+            std::vector<CRangeproofSignData> vProofs;
             for (size_t i = 0; i < vecSend.size(); ++i)
             {
                 auto &r = vecSend[i];
@@ -4180,11 +4239,14 @@ int CHDWallet::AddAnonInputs(CWalletTx &wtx, CTransactionRecord &rtx,
                     r.vBlind.resize(32);
                     GetStrongRandBytes(&r.vBlind[0], 32);
                     
-                    if (0 != AddCTData(txbout.get(), r, sError))
+                    if (0 != PrepareCTData(txbout.get(), r, vProofs, sError))
                         return 1; // sError will be set
                 };
             };
             
+            if (0 != SignCTData(vProofs, sError))
+                return 1; // sError will be set
+            
             
             std::set<int64_t> setHave; // Anon prev-outputs can only be used once per transaction.
             size_t nTotalInputs = 0;
@@ -4381,7 +4443,7 @@ int CHDWallet::AddAnonInputs(CWalletTx &wtx, CTransactionRecord &rtx,
                     int64_t nIndex = vMI[l][k][i];
                     
                     CAnonOutput ao;
-                    if (!pblocktree->ReadRCTOutput(nIndex, ao))
+                    if (!pblocktree->ReadRCTOutputCached(nIndex, ao))
                         return errorN(1, sError, __func__, _("Anon output not found in db, %d").c_str(), nIndex);
                     
                     CKeyID idk = ao.pubkey.GetID();
@@ -4420,15 +4482,20 @@ int CHDWallet::AddAnonInputs(CWalletTx &wtx, CTransactionRecord &rtx,
                 
                 std::vector<uint8_t> &vKeyImages = txin.scriptData.stack[0];
                 
+                // Fetch all ring members of the input together
+                std::vector<int64_t> vIndices;
+                vIndices.reserve(nCols * nSigInputs);
+                for (size_t k = 0; k < nSigInputs; ++k)
+                    vIndices.insert(vIndices.end(), vMI[l][k].begin(), vMI[l][k].begin() + nCols);
+                
+                std::vector<CAnonOutput> vao;
+                if (!pblocktree->ReadRCTOutputsCached(vIndices, vao))
+                    return errorN(1, sError, __func__, _("Anon outputs not found in db, input %d").c_str(), l);
                 
                 for (size_t k = 0; k < nSigInputs; ++k)
                 for (size_t i = 0; i < nCols; ++i)
                 {
-                    int64_t nIndex = vMI[l][k][i];
-                    
-                    CAnonOutput ao;
-                    if (!pblocktree->ReadRCTOutput(nIndex, ao))
-                        return errorN(1, sError, __func__, _("Anon output not found in db, %d").c_str(), nIndex);
+                    const CAnonOutput &ao = vao[i+k*nCols];
                     
                     memcpy(&vm[(i+k*nCols)*33], ao.pubkey.begin(), 33);
                     vCommitments.push_back(ao.commitment);
@@ -4684,6 +4751,9 @@ int CHDWallet::UnloadTransaction(const uint256 &hash)
 {
     // Remove txn from wallet, inc TxSpends
     
+    fStakeCandidatesDirty = true;
+    fBalancesDirty = true;
+    
     MapWallet_t::iterator itw;
     MapRecords_t::iterator itr;
     if ((itw = mapWallet.find(hash)) != mapWallet.end())
@@ -4957,6 +5027,7 @@ int CHDWallet::ExtKeyImportLoose(CHDWalletDB *pwdb, CStoredExtKey &sekIn, CKeyID
             return errorN(1, "%s: DB Write failed.", __func__);
     };
 
+    fStakeCandidatesDirty = true;
     return 0;
 };
 
@@ -5048,6 +5119,7 @@ int CHDWallet::ExtKeyImportAccount(CHDWalletDB *pwdb, CStoredExtKey &sekIn, int6
                 delete sea;
                 return errorN(1, "WriteExtKey failed.");
             };
+            fStakeCandidatesDirty = true;
             if (nTimeStartScan)
                 ScanChainFromTime(nTimeStartScan);
 
@@ -5988,6 +6060,7 @@ int CHDWallet::ExtKeyAddAccountToMaps(CKeyID &idAccount, CExtKeyAccount *sea, bo
     };
 
     mapExtAccounts[idAccount] = sea;
+    fStakeCandidatesDirty = true; // Outputs to the account's keys can be staked now
     return 0;
 };
 
@@ -6005,6 +6078,7 @@ int CHDWallet::ExtKeyRemoveAccountFromMapsAndFree(CExtKeyAccount *sea)
     mapExtAccounts.erase(idAccount);
     sea->FreeChains();
     delete sea;
+    fStakeCandidatesDirty = true;
     return 0;
 };
 
@@ -7016,11 +7090,12 @@ int CHDWallet::ScanChainFromTime(int64_t nTimeStartScan)
         LOCK2(cs_main, cs_wallet);
 
         MarkDirty();
-
-        ScanForWalletTransactions(pindex, true);
-        ReacceptWalletTransactions();
     } // cs_main, cs_wallet
 
+    // Takes cs_wallet only to add the txns of each batch of blocks
+    ScanForWalletTransactions(pindex, true);
+    ReacceptWalletTransactions();
+
     return 0;
 };
 
@@ -7043,11 +7118,12 @@ int CHDWallet::ScanChainFromHeight(int nHeight)
         LOCK2(cs_main, cs_wallet);
 
         MarkDirty();
-
-        ScanForWalletTransactions(pindex, true);
-        ReacceptWalletTransactions();
     } // cs_main, cs_wallet
 
+    // Takes cs_wallet only to add the txns of each batch of blocks
+    ScanForWalletTransactions(pindex, true);
+    ReacceptWalletTransactions();
+
     return 0;
 };
 
@@ -7172,6 +7248,8 @@ bool CHDWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey, CC
             // otherwise just for transaction history.
             
             AddToWallet(wtxNew);
+            UpdateStakeCandidates(*wtxNew.tx);
+            UpdateBalances(*wtxNew.tx);
 
             // Notify that old coins are spent
             for (const auto &txin : wtxNew.tx->vin)
@@ -7507,6 +7585,8 @@ bool CHDWallet::ProcessLockedStealthOutputs()
         pwalletdbEncryption = nullptr;
         
         nExpanded++;
+        fStakeCandidatesDirty = true; // Outputs to the key can be staked now
+        fBalancesDirty = true;
         
         int rv = pcursor->del(0);
         if (rv != 0)
@@ -7625,6 +7705,7 @@ bool CHDWallet::ProcessLockedAnonOutputs()
             if (!wdb.WriteTxRecord(op.hash, rtx)
                 || !wdb.WriteStoredTx(op.hash, stx))
                 return false;
+            fBalancesDirty = true;
         };
         
         nExpanded++;
@@ -7639,18 +7720,6 @@ bool CHDWallet::ProcessLockedAnonOutputs()
     return true;
 };
 
-inline bool MatchPrefix(uint32_t nAddrBits, uint32_t addrPrefix, uint32_t outputPrefix, bool fHavePrefix)
-{
-    if (nAddrBits < 1) // addresses without prefixes scan all incoming stealth outputs
-        return true;
-    if (!fHavePrefix) // don't check when address has a prefix and no prefix on output
-        return false;
-    
-    uint32_t mask = SetStealthMask(nAddrBits);
-    
-    return (addrPrefix & mask) == (outputPrefix & mask);
-};
-
 bool CHDWallet::ProcessStealthOutput(const CTxDestination &address,
     std::vector<uint8_t> &vchEphemPK, uint32_t prefix, bool fHavePrefix, CKey &sShared, bool fNeedShared)
 {
@@ -7674,6 +7743,11 @@ bool CHDWallet::ProcessStealthOutput(const CTxDestination &address,
         return true;
     };
     
+    if (pStealthScan
+        && vchEphemPK.size() == EC_COMPRESSED_SIZE
+        && pStealthScan->IsUnmatched(ckidMatch, &vchEphemPK[0], prefix, fHavePrefix))
+        return false; // Already tried against all scan keys by ScanForWalletTransactions
+    
     std::set<CStealthAddress>::iterator it;
     for (it = stealthAddresses.begin(); it != stealthAddresses.end(); ++it)
     {
@@ -7845,13 +7919,36 @@ bool CHDWallet::ProcessStealthOutput(const CTxDestination &address,
     return false;
 };
 
-int CHDWallet::CheckForStealthAndNarration(const CTxOutBase *pb, const CTxOutData *pdata, std::string &sNarr)
+void CHDWallet::AddStealthScanKeys(CStealthScanner &scanner) const
 {
-    // returns: -1 error, 0 nothing found, 1 narration, 2 stealth
+    AssertLockHeld(cs_wallet);
     
-    CKey sShared;
-    std::vector<uint8_t> vchEphemPK, vchENarr;
-    const std::vector<uint8_t> &vData = pdata->vData;
+    for (const auto &sx : stealthAddresses)
+    {
+        if (!sx.scan_secret.IsValid())
+            continue; // stealth address is not owned
+        scanner.AddScanKey(sx.scan_secret, sx.spend_pubkey, sx.prefix.number_bits, sx.prefix.bitfield);
+    };
+    
+    for (const auto &mi : mapExtAccounts)
+    {
+        for (const auto &ki : mi.second->mapStealthKeys)
+        {
+            const CEKAStealthKey &aks = ki.second;
+            if (!aks.skScan.IsValid())
+                continue;
+            scanner.AddScanKey(aks.skScan, aks.pkSpend, aks.nPrefixBits, aks.nPrefix);
+        };
+    };
+};
+
+int CHDWallet::CheckForStealthAndNarration(const CTxOutBase *pb, const CTxOutData *pdata, std::string &sNarr)
+{
+    // returns: -1 error, 0 nothing found, 1 narration, 2 stealth
+    
+    CKey sShared;
+    std::vector<uint8_t> vchEphemPK, vchENarr;
+    const std::vector<uint8_t> &vData = pdata->vData;
     
     if (vData.size() < 1)
         return -1;
@@ -8087,6 +8184,199 @@ bool CHDWallet::ScanForOwnedOutputs(const CTransaction &tx, size_t &nCT, size_t
     return fIsMine;
 };
 
+static void AddStealthOutputs(CStealthScanner &scanner, const CTransaction &tx)
+{
+    // Parse as ScanForOwnedOutputs and CheckForStealthAndNarration do, outputs not added are processed in full
+    for (size_t i = 0; i < tx.vpout.size(); ++i)
+    {
+        const CTxOutBase *txout = tx.vpout[i].get();
+        
+        CKeyID idDest;
+        const uint8_t *pEphemPK = nullptr;
+        uint32_t prefix = 0;
+        bool fHavePrefix = false;
+        
+        if (txout->IsType(OUTPUT_CT)
+            || txout->IsType(OUTPUT_RINGCT))
+        {
+            const std::vector<uint8_t> *pvData;
+            if (txout->IsType(OUTPUT_CT))
+            {
+                const CTxOutCT *ctout = (const CTxOutCT*) txout;
+                CTxDestination address;
+                if (!ExtractDestination(ctout->scriptPubKey, address)
+                    || address.type() != typeid(CKeyID))
+                    continue;
+                idDest = boost::get<CKeyID>(address);
+                pvData = &ctout->vData;
+            } else
+            {
+                const CTxOutRingCT *rctout = (const CTxOutRingCT*) txout;
+                idDest = rctout->pk.GetID();
+                pvData = &rctout->vData;
+            };
+            
+            const std::vector<uint8_t> &vData = *pvData;
+            if (vData.size() == 38 && vData[33] == DO_STEALTH_PREFIX)
+            {
+                fHavePrefix = true;
+                memcpy(&prefix, &vData[34], 4);
+            } else
+            if (vData.size() != 33)
+                continue;
+            pEphemPK = &vData[0];
+        } else
+        if (txout->IsType(OUTPUT_STANDARD))
+        {
+            if (i + 1 >= tx.vpout.size()
+                || !tx.vpout[i+1]->IsType(OUTPUT_DATA))
+                continue;
+            
+            const std::vector<uint8_t> &vData = ((const CTxOutData*) tx.vpout[i+1].get())->vData;
+            if (vData.size() < 34 || vData[0] != DO_STEALTH)
+                continue;
+            
+            CTxDestination address;
+            if (!ExtractDestination(((const CTxOutStandard*) txout)->scriptPubKey, address)
+                || address.type() != typeid(CKeyID))
+                continue;
+            idDest = boost::get<CKeyID>(address);
+            
+            if (vData.size() >= 34 + 5
+                && vData[34] == DO_STEALTH_PREFIX)
+            {
+                fHavePrefix = true;
+                memcpy(&prefix, &vData[35], 4);
+            };
+            pEphemPK = &vData[1];
+        } else
+            continue;
+        
+        scanner.AddOutput(idDest, pEphemPK, prefix, fHavePrefix);
+    };
+};
+
+CBlockIndex *CHDWallet::ScanForWalletTransactions(CBlockIndex *pindexStart, bool fUpdate)
+{
+    int64_t nNow = GetTime();
+    const CChainParams &chainParams = Params();
+    int nThreads = std::max(GetNumCores(), 1);
+    
+    CBlockIndex *pindex = pindexStart;
+    CBlockIndex *ret = nullptr;
+    
+    fAbortRescan = false;
+    fScanningWallet = true;
+    
+    ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
+    double dProgressStart, dProgressTip;
+    {
+        LOCK(cs_main);
+        dProgressStart = GuessVerificationProgress(chainParams.TxData(), pindex);
+        dProgressTip = GuessVerificationProgress(chainParams.TxData(), chainActive.Tip());
+    }
+    
+    CStealthScanner scanner;
+    std::vector<std::pair<CBlockIndex*, CBlock> > vBlocks;
+    while (pindex && !fAbortRescan)
+    {
+        scanner.Clear();
+        {
+            LOCK(cs_wallet);
+            AddStealthScanKeys(scanner);
+        }
+        
+        vBlocks.clear();
+        {
+            LOCK(cs_main);
+            if (!chainActive.Contains(pindex))
+            {
+                // Reorganised since the last batch was read
+                const CBlockIndex *pindexFork = chainActive.FindFork(pindex);
+                pindex = pindexFork ? chainActive[pindexFork->nHeight] : nullptr;
+                LogPrint(BCLog::HDWALLET, "%s: Chain reorganised, restarting from block %d.\n", __func__, pindex ? pindex->nHeight : -1);
+            };
+            size_t nBytes = 0;
+            for (; pindex && vBlocks.size() < STEALTH_SCAN_MAX_BLOCKS
+                && nBytes < STEALTH_SCAN_MAX_BYTES
+                && scanner.NumOutputs() < STEALTH_SCAN_MAX_OUTPUTS; pindex = chainActive.Next(pindex))
+            {
+                vBlocks.emplace_back(pindex, CBlock());
+                if (!ReadBlockFromDisk(vBlocks.back().second, pindex, chainParams.GetConsensus()))
+                {
+                    ret = pindex;
+                    vBlocks.pop_back();
+                    continue;
+                };
+                nBytes += ::GetSerializeSize(vBlocks.back().second, SER_NETWORK, PROTOCOL_VERSION);
+                
+                for (const auto &tx : vBlocks.back().second.vtx)
+                    AddStealthOutputs(scanner, *tx);
+            };
+        } // cs_main
+        
+        // The EC multiplications for every output and scan key, without cs_wallet
+        scanner.Scan(nThreads);
+        LogPrint(BCLog::HDWALLET, "%s: Checked %u stealth outputs from %u blocks against %u scan keys, %u matched.\n",
+            __func__, scanner.NumOutputs(), vBlocks.size(), scanner.NumKeys(), scanner.NumMatched());
+        
+        LOCK2(cs_main, cs_wallet);
+        
+        // Stealth addresses added since the keys were copied must be tried on all outputs
+        CStealthScanner scannerKeys;
+        AddStealthScanKeys(scannerKeys);
+        pStealthScan = scanner.SameKeys(scannerKeys) ? &scanner : nullptr;
+        
+        try {
+            for (const auto &b : vBlocks)
+            {
+                CBlockIndex *pindexBlock = b.first;
+                if (fAbortRescan)
+                {
+                    pindex = pindexBlock;
+                    break;
+                };
+                
+                // Blocks may have been disconnected while the batch was scanned without cs_main
+                if (!chainActive.Contains(pindexBlock))
+                {
+                    const CBlockIndex *pindexFork = chainActive.FindFork(pindexBlock);
+                    pindex = pindexFork ? chainActive[pindexFork->nHeight] : nullptr;
+                    LogPrint(BCLog::HDWALLET, "%s: Chain reorganised, restarting from block %d.\n", __func__, pindex ? pindex->nHeight : -1);
+                    break;
+                };
+                
+                if (pindexBlock->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
+                    ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((GuessVerificationProgress(chainParams.TxData(), pindexBlock) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+                if (GetTime() >= nNow + 60)
+                {
+                    nNow = GetTime();
+                    LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindexBlock->nHeight, GuessVerificationProgress(chainParams.TxData(), pindexBlock));
+                };
+                
+                for (size_t posInBlock = 0; posInBlock < b.second.vtx.size(); ++posInBlock)
+                    AddToWalletIfInvolvingMe(b.second.vtx[posInBlock], pindexBlock, posInBlock, fUpdate);
+            };
+        } catch (...)
+        {
+            pStealthScan = nullptr;
+            fScanningWallet = false;
+            throw;
+        };
+        pStealthScan = nullptr;
+    };
+    
+    if (pindex && fAbortRescan)
+    {
+        LOCK(cs_main);
+        LogPrintf("Rescan aborted at block %d. Progress=%f\n", pindex->nHeight, GuessVerificationProgress(chainParams.TxData(), pindex));
+    };
+    ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
+    
+    fScanningWallet = false;
+    return ret;
+};
+
 bool CHDWallet::AddToWalletIfInvolvingMe(const CTransactionRef& ptx, const CBlockIndex* pIndex, int posInBlock, bool fUpdate)
 {
     const CTransaction& tx = *ptx;
@@ -8227,6 +8517,8 @@ bool CHDWallet::AddToWalletIfInvolvingMe(const CTransactionRef& ptx, const CBloc
             if (pIndex != nullptr)
                 wtx.SetMerkleBranch(pIndex, posInBlock);
             bool rv = AddToWallet(wtx, false);
+            UpdateStakeCandidates(tx);
+            UpdateBalances(tx);
             WakeThreadStakeMiner(this); // wallet balance may have changed
             return rv;
         };
@@ -8811,6 +9103,9 @@ bool CHDWallet::AddToRecord(CTransactionRecord &rtxIn, const CTransaction &tx,
             return false;
     };
     
+    UpdateStakeCandidates(tx);
+    UpdateBalances(tx);
+    
     // Notify UI of new or updated transaction
     NotifyTransactionChanged(this, txhash, fInsertedNew ? CT_NEW : CT_UPDATED);
     // notify an external script when a wallet transaction comes in or is updated
@@ -9713,6 +10008,9 @@ std::set<uint256> CHDWallet::GetConflicts(const uint256 &txid) const
 bool CHDWallet::AbandonTransaction(const uint256 &hashTx)
 {
     LOCK2(cs_main, cs_wallet);
+    
+    fStakeCandidatesDirty = true; // Inputs may be unspent again
+    fBalancesDirty = true;
 
     CHDWalletDB walletdb(*dbw, "r+");
 
@@ -9825,6 +10123,9 @@ bool CHDWallet::AbandonTransaction(const uint256 &hashTx)
 void CHDWallet::MarkConflicted(const uint256 &hashBlock, const uint256 &hashTx)
 {
     LOCK2(cs_main, cs_wallet);
+    
+    fStakeCandidatesDirty = true; // Inputs may be unspent again
+    fBalancesDirty = true;
 
     int conflictconfirms = 0;
     
@@ -10028,6 +10329,99 @@ bool CHDWallet::SetReserveBalance(CAmount nNewReserveBalance)
     return true;
 };
 
+static bool GetStakingKeyID(const CScript &scriptPubKey, CKeyID &keyID)
+{
+    const CScript *pscriptPubKey = &scriptPubKey;
+    CScript coinstakePath;
+    if (HasIsCoinstakeOp(scriptPubKey))
+    {
+        if (!GetCoinstakeScriptPath(scriptPubKey, coinstakePath))
+            return false;
+        pscriptPubKey = &coinstakePath;
+    };
+    
+    std::vector<std::vector<uint8_t> > vSolutionsRet;
+    txnouttype typeRet;
+    if (!Solver(*pscriptPubKey, typeRet, vSolutionsRet)
+        || typeRet != TX_PUBKEYHASH)
+        return false;
+    
+    keyID = CKeyID(uint160(vSolutionsRet[0]));
+    return true;
+};
+
+void CHDWallet::AddStakeCandidates(const uint256 &txhash) const
+{
+    AssertLockHeld(cs_wallet);
+    
+    CKeyID keyID;
+    MapWallet_t::const_iterator mwi;
+    MapRecords_t::const_iterator mri;
+    if ((mwi = mapWallet.find(txhash)) != mapWallet.end())
+    {
+        const CTransactionRef &tx = mwi->second.tx;
+        for (size_t i = 0; i < tx->vpout.size(); ++i)
+        {
+            const auto &txout = tx->vpout[i];
+            if (!txout->IsType(OUTPUT_STANDARD)
+                || IsSpent(txhash, i)
+                || !GetStakingKeyID(*txout->GetPScriptPubKey(), keyID)
+                || !HaveKey(keyID))
+                continue;
+            
+            mapStakeCandidates[COutPoint(txhash, i)] = CStakeCandidate(txout->GetValue(), keyID, false);
+        };
+    } else
+    if ((mri = mapRecords.find(txhash)) != mapRecords.end())
+    {
+        for (const auto &r : mri->second.vout)
+        {
+            if (r.nType != OUTPUT_STANDARD
+                || !(r.nFlags & ORF_OWNED)
+                || IsSpent(txhash, r.n)
+                || !GetStakingKeyID(r.scriptPubKey, keyID))
+                continue;
+            
+            mapStakeCandidates[COutPoint(txhash, r.n)] = CStakeCandidate(r.nValue, keyID, true);
+        };
+    };
+};
+
+void CHDWallet::UpdateStakeCandidates(const CTransaction &tx)
+{
+    AssertLockHeld(cs_wallet);
+    
+    if (fStakeCandidatesDirty)
+        return; // Rebuilt in full when next read
+    
+    for (const auto &txin : tx.vin)
+    {
+        if (txin.IsAnonInput())
+            continue;
+        if (IsSpent(txin.prevout.hash, txin.prevout.n))
+            mapStakeCandidates.erase(txin.prevout);
+    };
+    
+    AddStakeCandidates(tx.GetHash());
+};
+
+void CHDWallet::RebuildStakeCandidates() const
+{
+    AssertLockHeld(cs_wallet);
+    
+    if (!fStakeCandidatesDirty)
+        return;
+    
+    mapStakeCandidates.clear();
+    for (const auto &wi : mapWallet)
+        AddStakeCandidates(wi.first);
+    for (const auto &ri : mapRecords)
+        AddStakeCandidates(ri.first);
+    
+    fStakeCandidatesDirty = false;
+    LogPrint(BCLog::POS, "%s: %u candidates.\n", __func__, mapStakeCandidates.size());
+};
+
 uint64_t CHDWallet::GetStakeWeight() const
 {
     // Choose coins to use
@@ -10078,107 +10472,82 @@ void CHDWallet::AvailableCoinsForStaking(std::vector<COutput> &vCoins, int64_t n
         int nHeight = chainActive.Tip()->nHeight;
         int nRequiredDepth = std::min((int)(Params().GetStakeMinConfirmations()-1), (int)(nHeight / 2));
         
-        for (MapWallet_t::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        RebuildStakeCandidates();
+        
+        for (auto it = mapStakeCandidates.begin(); it != mapStakeCandidates.end(); )
         {
-            const CWalletTx *pcoin = &it->second;
-            CTransactionRef tx = pcoin->tx;
+            const COutPoint &kernel = it->first;
             
-            int nDepth = pcoin->GetDepthInMainChainCached();
-            
-            if (nDepth > deepestTxnDepth)
-                deepestTxnDepth = nDepth;
-            
-            if (nDepth < nRequiredDepth)
+            // Outputs only become unspent again where the map is marked dirty
+            if (IsSpent(kernel.hash, kernel.n))
+            {
+                mapStakeCandidates.erase(it++);
                 continue;
+            };
             
-            const uint256 &wtxid = it->first;
-            for (size_t i = 0; i < tx->vpout.size(); ++i)
+            const CWalletTx *pcoin;
+            int nDepth;
+            if (it->second.fRecord)
             {
-                const auto &txout = tx->vpout[i];
-                if (!txout->IsType(OUTPUT_STANDARD))
-                    continue;
-                
-                COutPoint kernel(wtxid, i);
-                if (!CheckStakeUnused(kernel)
-                     || IsSpent(wtxid, i))
+                MapRecords_t::const_iterator mri = mapRecords.find(kernel.hash);
+                if (mri == mapRecords.end())
+                {
+                    mapStakeCandidates.erase(it++);
                     continue;
+                };
                 
-                std::vector<std::vector<uint8_t> > vSolutionsRet;
-                txnouttype typeRet;
+                const CTransactionRecord &rtx = mri->second;
+                nDepth = GetDepthInMainChain(rtx.blockHash, rtx.nIndex);
+                if (nDepth > deepestTxnDepth)
+                    deepestTxnDepth = nDepth;
                 
-                const CScript *pscriptPubKey = txout->GetPScriptPubKey();
-                CScript coinstakePath;
-                if ((HasIsCoinstakeOp(*pscriptPubKey)))
+                if (nDepth < nRequiredDepth
+                    || !CheckStakeUnused(kernel))
                 {
-                    if (!GetCoinstakeScriptPath(*pscriptPubKey, coinstakePath))
-                        continue;
-                    pscriptPubKey = &coinstakePath;
-                };
-                
-                if (!Solver(*pscriptPubKey, typeRet, vSolutionsRet)
-                    || typeRet != TX_PUBKEYHASH)
+                    ++it;
                     continue;
+                };
                 
-                CKeyID keyID = CKeyID(uint160(vSolutionsRet[0]));
-                
-                if (HaveKey(keyID))
-                    vCoins.push_back(COutput(pcoin, i, nDepth, true, true, true));
-            };
-        };
-        
-        for (MapRecords_t::const_iterator it = mapRecords.begin(); it != mapRecords.end(); ++it)
-        {
-            const uint256 &txid = it->first;
-            const CTransactionRecord &rtx = it->second;
-            
-            int nDepth = GetDepthInMainChain(rtx.blockHash, rtx.nIndex);
-            if (nDepth > deepestTxnDepth)
-                deepestTxnDepth = nDepth;
-            
-            if (nDepth < nRequiredDepth)
-                continue;
-            
-            MapWallet_t::const_iterator twi = mapTempWallet.end();
-            for (auto &r : rtx.vout)
+                MapWallet_t::const_iterator twi = mapTempWallet.find(kernel.hash);
+                if (twi == mapTempWallet.end())
+                {
+                    if (0 != InsertTempTxn(kernel.hash, &rtx)
+                        || (twi = mapTempWallet.find(kernel.hash)) == mapTempWallet.end())
+                    {
+                        LogPrintf("ERROR: %s - InsertTempTxn failed %s.", __func__, kernel.hash.ToString());
+                        return;
+                    };
+                };
+                pcoin = &twi->second;
+            } else
             {
-                if (r.nType != OUTPUT_STANDARD)
+                MapWallet_t::const_iterator mwi = mapWallet.find(kernel.hash);
+                if (mwi == mapWallet.end())
+                {
+                    mapStakeCandidates.erase(it++);
                     continue;
+                };
                 
-                if (r.nFlags & ORF_OWNED && !(IsSpent(txid, r.n)))
+                pcoin = &mwi->second;
+                nDepth = pcoin->GetDepthInMainChainCached();
+                if (nDepth > deepestTxnDepth)
+                    deepestTxnDepth = nDepth;
+                
+                if (nDepth < nRequiredDepth
+                    || !CheckStakeUnused(kernel))
                 {
-                    std::vector<std::vector<uint8_t> > vSolutionsRet;
-                    txnouttype typeRet;
-                    const CScript *pscriptPubKey = &r.scriptPubKey;
-                    CScript coinstakePath;
-                    if ((HasIsCoinstakeOp(r.scriptPubKey)))
-                    {
-                        if (!GetCoinstakeScriptPath(r.scriptPubKey, coinstakePath))
-                            continue;
-                        pscriptPubKey = &coinstakePath;
-                    };
-                    
-                    if (!Solver(*pscriptPubKey, typeRet, vSolutionsRet)
-                        || typeRet != TX_PUBKEYHASH)
-                        continue;
-                    
-                    if (twi == mapTempWallet.end()
-                        && (twi = mapTempWallet.find(txid)) == mapTempWallet.end())
-                    {
-                        if (0 != InsertTempTxn(txid, &rtx)
-                            || (twi = mapTempWallet.find(txid)) == mapTempWallet.end())
-                        {
-                            LogPrintf("ERROR: %s - InsertTempTxn failed %s.", __func__, txid.ToString());
-                            return;
-                        };
-                    };
-                    vCoins.push_back(COutput(&twi->second, r.n, nDepth, true, true, true));
+                    ++it;
+                    continue;
                 };
             };
+            
+            vCoins.push_back(COutput(pcoin, kernel.n, nDepth, true, true, true));
+            ++it;
         };
-        
     }
     
-    std::shuffle(std::begin(vCoins), std::end(vCoins), std::default_random_engine(unsigned(time(NULL))));
+    // Seeded from the search time, so every selection for the same slot picks the same coins
+    std::shuffle(std::begin(vCoins), std::end(vCoins), std::default_random_engine(unsigned(nTime)));
 };
 
 bool CHDWallet::SelectCoinsForStaking(int64_t nTargetValue, int64_t nTime, int nHeight, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const
@@ -10220,6 +10589,34 @@ bool CHDWallet::SelectCoinsForStaking(int64_t nTargetValue, int64_t nTime, int n
     return true;
 }
 
+bool CHDWallet::SelectCoinsForStakeSearch(int64_t nTime, int nHeight, CAmount &nBalance, std::set<std::pair<const CWalletTx*,unsigned int> > &setCoins,
+    std::vector<std::pair<COutPoint, std::set<std::pair<const CWalletTx*,unsigned int> >::iterator> > &vCoinIts) const
+{
+    setCoins.clear();
+    vCoinIts.clear();
+    
+    nBalance = GetStakeableBalance();
+    if (nBalance <= nReserveBalance)
+        return false;
+    
+    // Select coins with suitable depth
+    CAmount nValueIn = 0;
+    if (!SelectCoinsForStaking(nBalance - nReserveBalance, nTime, nHeight, setCoins, nValueIn))
+        return false;
+    
+    if (setCoins.empty())
+        return false;
+    
+    for (auto it = setCoins.begin(); it != setCoins.end(); ++it)
+        vCoinIts.push_back(std::make_pair(COutPoint(it->first->GetHash(), it->second), it));
+    
+    std::sort(vCoinIts.begin(), vCoinIts.end(),
+        [](const std::pair<COutPoint, std::set<std::pair<const CWalletTx*,unsigned int> >::iterator> &a,
+           const std::pair<COutPoint, std::set<std::pair<const CWalletTx*,unsigned int> >::iterator> &b) { return a.first < b.first; });
+    
+    return true;
+};
+
 typedef std::vector<unsigned char> valtype;
 
 bool CHDWallet::CreateCoinStake(unsigned int nBits, int64_t nTime, int nBlockHeight, int64_t nFees, CMutableTransaction &txNew, CKey &key)
@@ -10236,186 +10633,184 @@ bool CHDWallet::CreateCoinStake(unsigned int nBits, int64_t nTime, int nBlockHei
     txNew.nVersion = PARTICL_TXN_VERSION;
     txNew.SetType(TXN_COINSTAKE);
     
-    CAmount nBalance = GetStakeableBalance();
-    if (nBalance <= nReserveBalance)
-        return false;
-    
-    // Choose coins to use
+    // Choose coins to use, FindStakeKernel prepared the search for the same coins at nTime
     std::vector<const CWalletTx*> vwtxPrev;
+    CAmount nBalance;
     std::set<std::pair<const CWalletTx*,unsigned int> > setCoins;
-    CAmount nValueIn = 0;
-
-    // Select coins with suitable depth
-    if (!SelectCoinsForStaking(nBalance - nReserveBalance, nTime, nBlockHeight, setCoins, nValueIn))
+    std::vector<std::pair<COutPoint, std::set<std::pair<const CWalletTx*,unsigned int> >::iterator> > vCoinIts;
+    if (!SelectCoinsForStakeSearch(nTime, nBlockHeight, nBalance, setCoins, vCoinIts))
         return false;
     
-    if (setCoins.empty())
-        return false;
-
     CAmount nCredit = 0;
     CScript scriptPubKeyKernel;
-
-    std::set<std::pair<const CWalletTx*,unsigned int> >::iterator it = setCoins.begin();
-
-    for (; it != setCoins.end(); ++it)
+    std::set<std::pair<const CWalletTx*,unsigned int> >::iterator it;
+    
+    std::vector<COutPoint> vPrevouts;
+    for (const auto &ci : vCoinIts)
+        vPrevouts.push_back(ci.first);
+    
+    {
+        LOCK(cs_main);
+        if (!stakeKernelSearch.Prepare(pindexPrev, nBits, vPrevouts))
+            return false;
+    }
+    
+    int nThreads = stakeKernelSearch.size() > KERNEL_SEARCH_CHUNK_SIZE ? GetNumCores() : 1;
+    int64_t nFound;
+    for (size_t nStart = 0; (nFound = stakeKernelSearch.Find(nTime, nStart, nThreads)) >= 0; nStart = nFound + 1)
     {
+        it = vCoinIts[stakeKernelSearch[nFound].nInput].second;
         auto pcoin = *it;
         if (ThreadStakeMinerStopped()) // interruption_point
             return false;
-
-        COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-
-        int64_t nBlockTime;
-        if (CheckKernel(pindexPrev, nBits, nTime, prevoutStake, &nBlockTime))
+        
+        LOCK(cs_wallet);
+        // Found a kernel
+        LogPrint(BCLog::POS, "%s: Kernel found.\n", __func__);
+        
+        if (!pcoin.first->tx->vpout[pcoin.second]->IsStandardOutput())
+            continue;
+        CTxOutStandard *kernelOut = (CTxOutStandard*)pcoin.first->tx->vpout[pcoin.second].get();
+        
+        std::vector<valtype> vSolutions;
+        txnouttype whichType;
+        
+        const CScript *pscriptPubKey = &kernelOut->scriptPubKey;
+        CScript coinstakePath;
+        bool fConditionalStake = false;
+        if ((HasIsCoinstakeOp(*pscriptPubKey)))
         {
-            LOCK(cs_wallet);
-            // Found a kernel
-            LogPrint(BCLog::POS, "%s: Kernel found.\n", __func__);
-            
-            if (!pcoin.first->tx->vpout[pcoin.second]->IsStandardOutput())
+            fConditionalStake = true;
+            if (!GetCoinstakeScriptPath(*pscriptPubKey, coinstakePath))
                 continue;
-            CTxOutStandard *kernelOut = (CTxOutStandard*)pcoin.first->tx->vpout[pcoin.second].get();
-            
-            std::vector<valtype> vSolutions;
-            txnouttype whichType;
-            
-            const CScript *pscriptPubKey = &kernelOut->scriptPubKey;
-            CScript coinstakePath;
-            bool fConditionalStake = false;
-            if ((HasIsCoinstakeOp(*pscriptPubKey)))
-            {
-                fConditionalStake = true;
-                if (!GetCoinstakeScriptPath(*pscriptPubKey, coinstakePath))
-                    continue;
-                pscriptPubKey = &coinstakePath;
-            };
+            pscriptPubKey = &coinstakePath;
+        };
 
-            if (!Solver(*pscriptPubKey, whichType, vSolutions))
-            {
-                LogPrint(BCLog::POS, "%s: Failed to parse kernel.\n", __func__);
-                break;
-            };
+        if (!Solver(*pscriptPubKey, whichType, vSolutions))
+        {
+            LogPrint(BCLog::POS, "%s: Failed to parse kernel.\n", __func__);
+            break;
+        };
 
-            LogPrint(BCLog::POS, "%s: Parsed kernel type=%d.\n", __func__, whichType);
-            if (whichType != TX_PUBKEYHASH)
-            {
-                LogPrint(BCLog::POS, "%s: No support for kernel type=%d.\n", __func__, whichType);
-                break;  // only support pay to address (pay to pubkey hash)
-            };
-            
-            CKeyID spendId = uint160(vSolutions[0]);
-            if (!GetKey(spendId, key))
-            {
-                LogPrint(BCLog::POS, "%s: Failed to get key for kernel type=%d.\n", __func__, whichType);
-                break;  // unable to find corresponding key
-            };
+        LogPrint(BCLog::POS, "%s: Parsed kernel type=%d.\n", __func__, whichType);
+        if (whichType != TX_PUBKEYHASH)
+        {
+            LogPrint(BCLog::POS, "%s: No support for kernel type=%d.\n", __func__, whichType);
+            break;  // only support pay to address (pay to pubkey hash)
+        };
+        
+        CKeyID spendId = uint160(vSolutions[0]);
+        if (!GetKey(spendId, key))
+        {
+            LogPrint(BCLog::POS, "%s: Failed to get key for kernel type=%d.\n", __func__, whichType);
+            break;  // unable to find corresponding key
+        };
+        
+        if (fConditionalStake)
+        {
+            scriptPubKeyKernel = kernelOut->scriptPubKey;
+        } else
+        {
+            scriptPubKeyKernel << OP_DUP << OP_HASH160 << ToByteVector(spendId) << OP_EQUALVERIFY << OP_CHECKSIG;
             
-            if (fConditionalStake)
+            // If the wallet has a coldstaking-change-address loaded, send the output to a coldstaking-script.
+            UniValue jsonSettings;
+            if (GetSetting("changeaddress", jsonSettings)
+                && jsonSettings["coldstakingaddress"].isStr())
             {
-                scriptPubKeyKernel = kernelOut->scriptPubKey;
-            } else
-            {
-                scriptPubKeyKernel << OP_DUP << OP_HASH160 << ToByteVector(spendId) << OP_EQUALVERIFY << OP_CHECKSIG;
+                std::string sAddress;
+                try { sAddress = jsonSettings["coldstakingaddress"].get_str();
+                } catch (std::exception &e) {
+                    return error("%s: Get coldstakingaddress failed %s.", __func__, e.what());
+                };
                 
-                // If the wallet has a coldstaking-change-address loaded, send the output to a coldstaking-script.
-                UniValue jsonSettings;
-                if (GetSetting("changeaddress", jsonSettings)
-                    && jsonSettings["coldstakingaddress"].isStr())
+                LogPrint(BCLog::POS, "%s: Sending output to coldstakingscript %s.\n", __func__, sAddress);
+                
+                CBitcoinAddress addrColdStaking(sAddress);
+                CTxDestination destColdStaking = addrColdStaking.Get();
+                
+                CScript scriptStaking;
+                if (destColdStaking.type() == typeid(CExtKeyPair))
                 {
-                    std::string sAddress;
-                    try { sAddress = jsonSettings["coldstakingaddress"].get_str();
-                    } catch (std::exception &e) {
-                        return error("%s: Get coldstakingaddress failed %s.", __func__, e.what());
-                    };
+                    CExtKeyPair ek = boost::get<CExtKeyPair>(destColdStaking);
+                    uint32_t nChildKey;
                     
-                    LogPrint(BCLog::POS, "%s: Sending output to coldstakingscript %s.\n", __func__, sAddress);
+                    CPubKey pkTemp;
+                    if (0 != ExtKeyGetDestination(ek, pkTemp, nChildKey))
+                        return error("%s: ExtKeyGetDestination failed.", __func__);
                     
-                    CBitcoinAddress addrColdStaking(sAddress);
-                    CTxDestination destColdStaking = addrColdStaking.Get();
+                    nChildKey++;
+                    ExtKeyUpdateLooseKey(ek, nChildKey, false);
                     
-                    CScript scriptStaking;
-                    if (destColdStaking.type() == typeid(CExtKeyPair))
-                    {
-                        CExtKeyPair ek = boost::get<CExtKeyPair>(destColdStaking);
-                        uint32_t nChildKey;
-                        
-                        CPubKey pkTemp;
-                        if (0 != ExtKeyGetDestination(ek, pkTemp, nChildKey))
-                            return error("%s: ExtKeyGetDestination failed.", __func__);
-                        
-                        nChildKey++;
-                        ExtKeyUpdateLooseKey(ek, nChildKey, false);
-                        
-                        scriptStaking = GetScriptForDestination(pkTemp.GetID());
-                    } else
-                    if (destColdStaking.type() == typeid(CKeyID))
-                    {
-                        CKeyID idk = boost::get<CKeyID>(destColdStaking);
-                        scriptStaking = GetScriptForDestination(idk);
-                    } else
-                    {
-                        return error("%s: Unknown coldstakingaddress type.", __func__);
-                    };
-                    
-                    // Get new key from the active internal chain
-                    CPubKey pkSpend;
-                    if (0 != GetChangeAddress(pkSpend))
-                        return error("%s: GetChangeAddress failed.", __func__);
-                    CKeyID256 id256 = pkSpend.GetID256();
-                    scriptPubKeyKernel = GetScriptForDestination(id256);
+                    scriptStaking = GetScriptForDestination(pkTemp.GetID());
+                } else
+                if (destColdStaking.type() == typeid(CKeyID))
+                {
+                    CKeyID idk = boost::get<CKeyID>(destColdStaking);
+                    scriptStaking = GetScriptForDestination(idk);
+                } else
+                {
+                    return error("%s: Unknown coldstakingaddress type.", __func__);
+                };
+                
+                // Get new key from the active internal chain
+                CPubKey pkSpend;
+                if (0 != GetChangeAddress(pkSpend))
+                    return error("%s: GetChangeAddress failed.", __func__);
+                CKeyID256 id256 = pkSpend.GetID256();
+                scriptPubKeyKernel = GetScriptForDestination(id256);
+                
+                if (scriptStaking.IsPayToPublicKeyHash())
+                {
+                    CScript script = CScript() << OP_ISCOINSTAKE << OP_IF;
+                    script += scriptStaking;
+                    script << OP_ELSE;
+                    script += scriptPubKeyKernel;
+                    script << OP_ENDIF;
                     
-                    if (scriptStaking.IsPayToPublicKeyHash())
-                    {
-                        CScript script = CScript() << OP_ISCOINSTAKE << OP_IF;
-                        script += scriptStaking;
-                        script << OP_ELSE;
-                        script += scriptPubKeyKernel;
-                        script << OP_ENDIF;
-                        
-                        scriptPubKeyKernel = script;
-                    } else
-                    {
-                        return error("%s: Unknown scriptStaking type, must be pay-to-public-key-hash.", __func__);
-                    };
+                    scriptPubKeyKernel = script;
+                } else
+                {
+                    return error("%s: Unknown scriptStaking type, must be pay-to-public-key-hash.", __func__);
                 };
             };
-            
-            txNew.nVersion = PARTICL_TXN_VERSION;
-            txNew.SetType(TXN_COINSTAKE);
-            txNew.vin.clear();
-            txNew.vout.clear();
-            
-            txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
-            
-            nCredit += kernelOut->nValue;
-            vwtxPrev.push_back(pcoin.first);
-            
-            
-            std::shared_ptr<CTxOutData> out0 = MAKE_OUTPUT<CTxOutData>();
-            out0->vData.resize(4);
-            memcpy(&out0->vData[0], &nBlockHeight, 4);
-            
-            uint32_t voteToken = 0;
-            if (GetVote(nBlockHeight, voteToken))
-            {
-                size_t origSize = out0->vData.size();
-                out0->vData.resize(origSize + 5);
-                out0->vData[origSize] = DO_VOTE;
-                memcpy(&out0->vData[origSize+1], &voteToken, 4);
-            };
-            
-            txNew.vpout.push_back(out0);
-            
-            std::shared_ptr<CTxOutStandard> out1 = MAKE_OUTPUT<CTxOutStandard>();
-            out1->nValue = 0;
-            out1->scriptPubKey = scriptPubKeyKernel;
-            txNew.vpout.push_back(out1);
-            
-            LogPrint(BCLog::POS, "%s: Added kernel.\n", __func__);
-            
-            setCoins.erase(it);
-            break;
         };
+        
+        txNew.nVersion = PARTICL_TXN_VERSION;
+        txNew.SetType(TXN_COINSTAKE);
+        txNew.vin.clear();
+        txNew.vout.clear();
+        
+        txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
+        
+        nCredit += kernelOut->nValue;
+        vwtxPrev.push_back(pcoin.first);
+        
+        
+        std::shared_ptr<CTxOutData> out0 = MAKE_OUTPUT<CTxOutData>();
+        out0->vData.resize(4);
+        memcpy(&out0->vData[0], &nBlockHeight, 4);
+        
+        uint32_t voteToken = 0;
+        if (GetVote(nBlockHeight, voteToken))
+        {
+            size_t origSize = out0->vData.size();
+            out0->vData.resize(origSize + 5);
+            out0->vData[origSize] = DO_VOTE;
+            memcpy(&out0->vData[origSize+1], &voteToken, 4);
+        };
+        
+        txNew.vpout.push_back(out0);
+        
+        std::shared_ptr<CTxOutStandard> out1 = MAKE_OUTPUT<CTxOutStandard>();
+        out1->nValue = 0;
+        out1->scriptPubKey = scriptPubKeyKernel;
+        txNew.vpout.push_back(out1);
+        
+        LogPrint(BCLog::POS, "%s: Added kernel.\n", __func__);
+        
+        setCoins.erase(it);
+        break;
     };
     
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance)
@@ -10574,6 +10969,40 @@ bool CHDWallet::CreateCoinStake(unsigned int nBits, int64_t nTime, int nBlockHei
     return true;
 };
 
+bool CHDWallet::FindStakeKernel(int64_t nSearchTime)
+{
+    int nHeight;
+    {
+        LOCK(cs_main);
+        nHeight = chainActive.Height()+1;
+    }
+    
+    CAmount nBalance;
+    std::set<std::pair<const CWalletTx*,unsigned int> > setCoins;
+    std::vector<std::pair<COutPoint, std::set<std::pair<const CWalletTx*,unsigned int> >::iterator> > vCoinIts;
+    if (!SelectCoinsForStakeSearch(nSearchTime, nHeight, nBalance, setCoins, vCoinIts))
+        return false;
+    
+    std::vector<COutPoint> vPrevouts;
+    vPrevouts.reserve(vCoinIts.size());
+    for (const auto &ci : vCoinIts)
+        vPrevouts.push_back(ci.first);
+    
+    {
+        LOCK(cs_main);
+        CBlockIndex *pindexPrev = chainActive.Tip();
+        if (!stakeKernelSearch.Prepare(pindexPrev, GetNextTargetRequired(pindexPrev), vPrevouts))
+            return false;
+    }
+    
+    int nThreads = stakeKernelSearch.size() > KERNEL_SEARCH_CHUNK_SIZE ? GetNumCores() : 1;
+    if (stakeKernelSearch.Find(nSearchTime, 0, nThreads) < 0)
+        return false;
+    
+    nStakeKernelsFound++;
+    return true;
+};
+
 bool CHDWallet::SignBlock(CBlockTemplate *pblocktemplate, int nHeight, int64_t nSearchTime)
 {
     LogPrint(BCLog::POS, "%s, nHeight %d\n", __func__, nHeight);
@@ -14,6 +14,7 @@
 #include "key/stealth.h"
 
 #include "../miner.h"
+#include "pos/kernel.h"
 
 typedef std::map<CKeyID, CStealthKeyMetadata> StealthKeyMetaMap;
 typedef std::map<CKeyID, CExtKeyAccount*> ExtKeyAccountMap;
@@ -25,8 +26,15 @@ typedef std::map<uint256, CTransactionRecord> MapRecords_t;
 typedef std::multimap<int64_t, std::map<uint256, CTransactionRecord>::iterator> RtxOrdered_t;
 
 class UniValue;
+struct CRangeproofSignData;
 
 const uint16_t PLACEHOLDER_N = 0xFFFF;
+
+/** Limits on the blocks read, their serialized size and their stealth outputs, per batch of a rescan */
+const size_t STEALTH_SCAN_MAX_BLOCKS = 500;
+const size_t STEALTH_SCAN_MAX_BYTES = 32 * 1024 * 1024;
+const size_t STEALTH_SCAN_MAX_OUTPUTS = 16384;
+
 enum OutputRecordFlags
 {
     ORF_OWNED        = (1 << 0),
@@ -266,6 +274,24 @@ public:
     bool fMature;
 };
 
+/**
+ * An owned output the staker can sign for, see CHDWallet::mapStakeCandidates.
+ * Spent state and depth change with the chain and are checked when read.
+ */
+class CStakeCandidate
+{
+public:
+    CStakeCandidate() {};
+    CStakeCandidate(CAmount nValue_, const CKeyID &keyID_, bool fRecord_)
+        : nValue(nValue_), keyID(keyID_), fRecord(fRecord_) {};
+    
+    CAmount nValue;
+    CKeyID keyID; // key of the staking path
+    bool fRecord; // txn is in mapRecords, else mapWallet
+};
+
+typedef std::map<COutPoint, CStakeCandidate> MapStakeCandidates_t;
+
 
 class CStoredTransaction
 {
@@ -345,6 +371,70 @@ public:
     
     CAmount nAnon = 0;
     CAmount nAnonUnconf = 0;
+    
+    CHDWalletBalances &operator+=(const CHDWalletBalances &b)
+    {
+        nPart += b.nPart;
+        nPartUnconf += b.nPartUnconf;
+        nPartStaked += b.nPartStaked;
+        nPartImmature += b.nPartImmature;
+        nPartWatchOnly += b.nPartWatchOnly;
+        nPartWatchOnlyUnconf += b.nPartWatchOnlyUnconf;
+        nPartWatchOnlyStaked += b.nPartWatchOnlyStaked;
+        
+        nBlind += b.nBlind;
+        nBlindUnconf += b.nBlindUnconf;
+        
+        nAnon += b.nAnon;
+        nAnonUnconf += b.nAnonUnconf;
+        return *this;
+    };
+    
+    CHDWalletBalances &operator-=(const CHDWalletBalances &b)
+    {
+        nPart -= b.nPart;
+        nPartUnconf -= b.nPartUnconf;
+        nPartStaked -= b.nPartStaked;
+        nPartImmature -= b.nPartImmature;
+        nPartWatchOnly -= b.nPartWatchOnly;
+        nPartWatchOnlyUnconf -= b.nPartWatchOnlyUnconf;
+        nPartWatchOnlyStaked -= b.nPartWatchOnlyStaked;
+        
+        nBlind -= b.nBlind;
+        nBlindUnconf -= b.nBlindUnconf;
+        
+        nAnon -= b.nAnon;
+        nAnonUnconf -= b.nAnonUnconf;
+        return *this;
+    };
+    
+    bool operator==(const CHDWalletBalances &b) const
+    {
+        return nPart == b.nPart
+            && nPartUnconf == b.nPartUnconf
+            && nPartStaked == b.nPartStaked
+            && nPartImmature == b.nPartImmature
+            && nPartWatchOnly == b.nPartWatchOnly
+            && nPartWatchOnlyUnconf == b.nPartWatchOnlyUnconf
+            && nPartWatchOnlyStaked == b.nPartWatchOnlyStaked
+            && nBlind == b.nBlind
+            && nBlindUnconf == b.nBlindUnconf
+            && nAnon == b.nAnon
+            && nAnonUnconf == b.nAnonUnconf;
+    };
+    
+    bool IsNull() const
+    {
+        return *this == CHDWalletBalances();
+    };
+    
+    /** True if any part can change with depth or the mempool alone */
+    bool IsPending() const
+    {
+        return nPartUnconf || nPartStaked || nPartImmature
+            || nPartWatchOnlyUnconf || nPartWatchOnlyStaked
+            || nBlindUnconf || nAnonUnconf;
+    };
 };
 
 class CHDWallet : public CWallet
@@ -371,6 +461,11 @@ public:
         fUnlockForStakingOnly = false;
         nRCTOutSelectionGroup1 = 2400;
         nRCTOutSelectionGroup2 = 24000;
+        
+        fStakeCandidatesDirty = true;
+        fBalancesDirty = true;
+        
+        pStealthScan = nullptr;
     };
     
     ~CHDWallet()
@@ -408,6 +503,8 @@ public:
     bool HaveKey(const CKeyID &address, CEKAKey &ak, CExtKeyAccount *&pa) const;
     bool HaveKey(const CKeyID &address) const;
     
+    bool AddKeyPubKey(const CKey &key, const CPubKey &pubkey) override;
+    
     bool HaveExtKey(const CKeyID &address) const;
     
     bool HaveTransaction(const uint256 &txhash) const;
@@ -470,7 +567,18 @@ public:
     CAmount GetStaked();
     CAmount GetLegacyBalance(const isminefilter& filter, int minDepth, const std::string* account) const override;
     
-    bool GetBalances(CHDWalletBalances &bal);
+    /** Get the cached balances, updated as txns and blocks are added */
+    bool GetBalances(CHDWalletBalances &bal) const;
+    /** Sum the balances over all txns, without the cache */
+    bool GetBalancesFull(CHDWalletBalances &bal) const;
+    /** Add the balance contributions of txhash to bal */
+    void GetTxBalances(const uint256 &txhash, CHDWalletBalances &bal) const;
+    /** Recompute the cached contribution of txhash */
+    void UpdateTxBalances(const uint256 &txhash) const;
+    /** Update the cached balances for a txn added to the wallet or changed, and the txns it spends from */
+    void UpdateBalances(const CTransaction &tx);
+    /** Recompute the cached contributions that can change with depth or the mempool */
+    void UpdatePendingBalances();
     
     
     bool IsChange(const CTxOutBase *txout) const;
@@ -482,6 +590,10 @@ public:
     
     int CreateOutput(OUTPUT_PTR<CTxOutBase> &txbout, CTempRecipient &r, std::string &sError);
     int AddCTData(CTxOutBase *txout, CTempRecipient &r, std::string &sError);
+    /** Choose the rangeproof parameters of a blinded output, signing is left to SignCTData */
+    int PrepareCTData(CTxOutBase *txout, CTempRecipient &r, std::vector<CRangeproofSignData> &vProofs, std::string &sError);
+    /** Set the commitments and rangeproofs prepared by PrepareCTData, in parallel */
+    int SignCTData(std::vector<CRangeproofSignData> &vProofs, std::string &sError);
     
     bool SetChangeDest(const CCoinControl *coinControl, CTempRecipient &r, std::string &sError);
     
@@ -617,10 +729,18 @@ public:
     bool ProcessStealthOutput(const CTxDestination &address,
         std::vector<uint8_t> &vchEphemPK, uint32_t prefix, bool fHavePrefix, CKey &sShared, bool fNeedShared=false);
     
+    /** Add the scan keys of all owned stealth addresses, as ProcessStealthOutput tries them */
+    void AddStealthScanKeys(CStealthScanner &scanner) const;
+    
     int CheckForStealthAndNarration(const CTxOutBase *pb, const CTxOutData *pdata, std::string &sNarr);
     bool FindStealthTransactions(const CTransaction &tx, mapValue_t &mapNarr);
     
     bool ScanForOwnedOutputs(const CTransaction &tx, size_t &nCT, size_t &nRingCT, mapValue_t &mapNarr);
+    /**
+     * Rescan in batches of blocks, the stealth outputs of each batch are checked over multiple
+     * threads without cs_wallet, then the txns are added under cs_main and cs_wallet.
+     */
+    CBlockIndex *ScanForWalletTransactions(CBlockIndex *pindexStart, bool fUpdate=false) override;
     bool AddToWalletIfInvolvingMe(const CTransactionRef& ptx, const CBlockIndex* pIndex, int posInBlock, bool fUpdate);
     
     CWalletTx *GetTempWalletTx(const uint256& hash);
@@ -646,6 +766,10 @@ public:
     std::vector<uint256> ResendRecordTransactionsBefore(int64_t nTime, CConnman *connman);
     void ResendWalletTransactions(int64_t nBestBlockTime, CConnman *connman) override;
     
+    void MarkDirty() override;
+    void BlockConnected(const std::shared_ptr<const CBlock>& pblock, const CBlockIndex *pindex, const std::vector<CTransactionRef>& vtxConflicted) override;
+    void BlockDisconnected(const std::shared_ptr<const CBlock>& pblock) override;
+    
     
     /**
      * populate vCoins with vector of available COutputs.
@@ -676,14 +800,38 @@ public:
     bool EraseSetting(const std::string &setting);
     
     bool SetReserveBalance(CAmount nNewReserveBalance);
+    
+    /** Add the stakeable outputs of txhash to mapStakeCandidates */
+    void AddStakeCandidates(const uint256 &txhash) const;
+    /** Update mapStakeCandidates for a txn added to the wallet or changed */
+    void UpdateStakeCandidates(const CTransaction &tx);
+    /** Rebuild mapStakeCandidates from all txns if marked dirty */
+    void RebuildStakeCandidates() const;
+    
     uint64_t GetStakeWeight() const;
     void AvailableCoinsForStaking(std::vector<COutput> &vCoins, int64_t nTime, int nHeight) const;
     bool SelectCoinsForStaking(int64_t nTargetValue, int64_t nTime, int nHeight, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const;
+    /**
+     * Select the coins above the reserve balance to stake at nTime, with their outpoints in kernel search order.
+     * FindStakeKernel and CreateCoinStake both select through here, so the search prepared by one is reused by the other.
+     */
+    bool SelectCoinsForStakeSearch(int64_t nTime, int nHeight, CAmount &nBalance, std::set<std::pair<const CWalletTx*,unsigned int> > &setCoins,
+        std::vector<std::pair<COutPoint, std::set<std::pair<const CWalletTx*,unsigned int> >::iterator> > &vCoinIts) const;
     bool CreateCoinStake(unsigned int nBits, int64_t nTime, int nBlockHeight, int64_t nFees, CMutableTransaction &txNew, CKey &key);
+    /**
+     * Check for a kernel meeting the target at nSearchTime among the coins CreateCoinStake would stake,
+     * without a block template. CreateCoinStake reuses the prepared search.
+     */
+    bool FindStakeKernel(int64_t nSearchTime);
     bool SignBlock(CBlockTemplate *pblocktemplate, int nHeight, int64_t nSearchTime);
     
     int64_t nLastCoinStakeSearchTime = 0;
+    std::atomic<int64_t> nStakeKernelsFound{0}; // searches where FindStakeKernel found a kernel
+    std::atomic<int64_t> nStakeTemplatesBuilt{0}; // block templates assembled for this wallet to stake
+    std::atomic<int64_t> nStakesFound{0}; // signed blocks that passed CheckStake
+    CStakeKernelSearch stakeKernelSearch; // prepared kernels of the last stake search
     uint32_t nStealth, nFoundStealth; // for reporting, zero before use
+    const CStealthScanner *pStealthScan; // outputs checked by ScanForWalletTransactions, set while adding its txns
     int64_t nReserveBalance;
     size_t nStakeThread = 9999999; // unset
     mutable int deepestTxnDepth = 0; // for stake mining
@@ -707,6 +855,24 @@ public:
     
     mutable MapWallet_t mapTempWallet;
     
+    /**
+     * Unspent stakeable outputs, kept up to date as txns are added to the wallet.
+     * Set fStakeCandidatesDirty where outputs may become unspent or lose their owner,
+     * the map is then rebuilt in full when next read.
+     */
+    mutable MapStakeCandidates_t mapStakeCandidates;
+    mutable bool fStakeCandidatesDirty;
+    
+    /**
+     * Cached balances and the nonzero contribution of each txn to them.
+     * Set fBalancesDirty where txns change other than through UpdateBalances, the cache is
+     * then rebuilt in full when next read.
+     */
+    mutable std::map<uint256, CHDWalletBalances> mapTxBalances;
+    mutable std::set<uint256> setTxBalancesUnconfirmed; // depth 0 txns that count or are in the mempool, recomputed on every read
+    mutable CHDWalletBalances balancesCached;
+    mutable bool fBalancesDirty;
+    
     MapRecords_t mapRecords;
     RtxOrdered_t rtxOrdered;
     
@@ -3104,6 +3104,9 @@ UniValue getstakinginfo(const JSONRPCRequest &request)
 
     obj.pushKV("difficulty", GetDifficulty());
     obj.pushKV("last-search-time", (uint64_t)pwallet->nLastCoinStakeSearchTime);
+    obj.pushKV("kernelsfound", (int64_t)pwallet->nStakeKernelsFound);
+    obj.pushKV("templatesbuilt", (int64_t)pwallet->nStakeTemplatesBuilt);
+    obj.pushKV("stakesfound", (int64_t)pwallet->nStakesFound);
 
     obj.pushKV("weight", (uint64_t)nWeight);
     obj.pushKV("netstakeweight", (uint64_t)nNetworkWeight);
@@ -4326,6 +4329,21 @@ UniValue debugwallet(const JSONRPCRequest &request)
         LogPrintf("nMapWallet %d\n", nMapWallet);
         result.pushKV("unabandoned_orphans", (int)nUnabandonedOrphans);
         
+        // Check the cached balances against a full recompute
+        CHDWalletBalances balCached, balFull;
+        pwallet->GetBalances(balCached);
+        pwallet->GetBalancesFull(balFull);
+        bool fBalancesConsistent = balCached == balFull;
+        if (!fBalancesConsistent)
+        {
+            LogPrintf("Cached balances differ: part %d/%d, part unconf %d/%d, blind %d/%d, anon %d/%d\n",
+                balCached.nPart, balFull.nPart, balCached.nPartUnconf, balFull.nPartUnconf,
+                balCached.nBlind, balFull.nBlind, balCached.nAnon, balFull.nAnon);
+            if (fAttemptRepair)
+                pwallet->MarkDirty();
+        };
+        result.pushKV("balances_consistent", fBalancesConsistent);
+
         // Check for gaps in the hd key chains
         ExtKeyAccountMap::const_iterator itam = pwallet->mapExtAccounts.begin();
         for ( ; itam != pwallet->mapExtAccounts.end(); ++itam)
@@ -139,6 +139,236 @@ static void AddAnonTxn(CHDWallet *pwallet, CBitcoinAddress &address, CAmount amo
     BOOST_CHECK(wtx.AcceptToMemoryPool(maxTxFee, state));
 }
 
+static void CheckStakeCandidates(CHDWallet *pwallet)
+{
+    std::vector<COutput> vCoins;
+    pwallet->AvailableCoinsForStaking(vCoins, GetAdjustedTime(), chainActive.Height()); // Drops spent candidates
+    
+    LOCK(pwallet->cs_wallet);
+    BOOST_CHECK(!pwallet->fStakeCandidatesDirty);
+    
+    // The incrementally updated candidates must match a full rebuild
+    MapStakeCandidates_t mapIncremental = pwallet->mapStakeCandidates;
+    pwallet->fStakeCandidatesDirty = true;
+    pwallet->RebuildStakeCandidates();
+    
+    BOOST_CHECK(mapIncremental.size() == pwallet->mapStakeCandidates.size());
+    for (const auto &sc : pwallet->mapStakeCandidates)
+    {
+        MapStakeCandidates_t::const_iterator it = mapIncremental.find(sc.first);
+        BOOST_REQUIRE(it != mapIncremental.end());
+        BOOST_CHECK(it->second.nValue == sc.second.nValue);
+        BOOST_CHECK(it->second.keyID == sc.second.keyID);
+        BOOST_CHECK(it->second.fRecord == sc.second.fRecord);
+    };
+}
+
+static bool IsStakeCandidate(CHDWallet *pwallet, const COutPoint &op)
+{
+    LOCK(pwallet->cs_wallet);
+    return pwallet->mapStakeCandidates.count(op);
+}
+
+BOOST_AUTO_TEST_CASE(stake_candidates_test)
+{
+    CHDWallet *pwallet = (CHDWallet*) pwalletMain;
+    UniValue rv;
+    
+    // Import the key to the last 5 outputs in the regtest genesis coinbase
+    BOOST_CHECK_NO_THROW(rv = CallRPC("extkeyimportmaster tprv8ZgxMBicQKsPe3x7bUzkHAJZzCuGqN6y28zFFyg5i7Yqxqm897VCnmMJz6QScsftHDqsyWW5djx6FzrbkF9HSD3ET163z1SzRhfcWxvwL4G"));
+    CheckStakeCandidates(pwallet);
+    
+    g_connman = std::unique_ptr<CConnman>(new CConnman(GetRand(std::numeric_limits<uint64_t>::max()), GetRand(std::numeric_limits<uint64_t>::max())));
+    pwallet->SetBroadcastTransactions(true);
+    
+    // Receive and spend, send to an own address and to a key the wallet doesn't have yet
+    BOOST_CHECK_NO_THROW(rv = CallRPC("getnewaddress"));
+    CBitcoinAddress addrOwn(StripQuotes(rv.write()));
+    BOOST_REQUIRE(addrOwn.IsValid());
+    
+    CKey kRecv;
+    kRecv.MakeNewKey(true);
+    
+    std::vector<CRecipient> vecSend;
+    vecSend.push_back(CRecipient(GetScriptForDestination(addrOwn.Get()), 10000 * COIN, false));
+    vecSend.push_back(CRecipient(GetScriptForDestination(kRecv.GetPubKey().GetID()), 20000 * COIN, false));
+    
+    CWalletTx wtx;
+    CReserveKey reservekey(pwallet);
+    CAmount nFeeRequired;
+    std::string strError;
+    int nChangePosRet = -1;
+    CCoinControl coinControl;
+    BOOST_REQUIRE(pwallet->CreateTransaction(vecSend, wtx, reservekey, nFeeRequired, nChangePosRet, strError, coinControl));
+    {
+        CValidationState state;
+        BOOST_REQUIRE(pwallet->CommitTransaction(wtx, reservekey, g_connman.get(), state));
+    }
+    CheckStakeCandidates(pwallet);
+    
+    int nOwn = -1, nRecv = -1;
+    for (size_t i = 0; i < wtx.tx->vpout.size(); ++i)
+    {
+        const CTxOutBase *txout = wtx.tx->vpout[i].get();
+        if (!txout->IsStandardOutput())
+            continue;
+        if (*txout->GetPScriptPubKey() == vecSend[0].scriptPubKey)
+            nOwn = i;
+        if (*txout->GetPScriptPubKey() == vecSend[1].scriptPubKey)
+            nRecv = i;
+    };
+    BOOST_REQUIRE(nOwn > -1 && nRecv > -1);
+    BOOST_CHECK(IsStakeCandidate(pwallet, COutPoint(wtx.GetHash(), nOwn)));
+    BOOST_CHECK(!IsStakeCandidate(pwallet, COutPoint(wtx.GetHash(), nRecv)));
+    for (const auto &txin : wtx.tx->vin)
+        BOOST_CHECK(!IsStakeCandidate(pwallet, txin.prevout));
+    
+    // Adding the key makes the output to it a candidate
+    {
+        LOCK(pwallet->cs_wallet);
+        BOOST_REQUIRE(pwallet->AddKeyPubKey(kRecv, kRecv.GetPubKey()));
+        BOOST_CHECK(pwallet->fStakeCandidatesDirty);
+    }
+    CheckStakeCandidates(pwallet);
+    BOOST_CHECK(IsStakeCandidate(pwallet, COutPoint(wtx.GetHash(), nRecv)));
+}
+
+BOOST_AUTO_TEST_CASE(stake_kernel_test)
+{
+    CHDWallet *pwallet = (CHDWallet*) pwalletMain;
+    UniValue rv;
+    
+    int nBestHeight;
+    {
+        LOCK(cs_main);
+        nBestHeight = chainActive.Height();
+    }
+    CScript scriptCoinbase;
+    
+    // Without coins there's no kernel, the staker builds no template and none could be signed
+    int64_t nSearchTime = GetAdjustedTime() & ~Params().GetStakeTimestampMask(nBestHeight+1);
+    BOOST_CHECK(!pwallet->FindStakeKernel(nSearchTime));
+    BOOST_CHECK(pwallet->nStakeKernelsFound == 0);
+    {
+        std::unique_ptr<CBlockTemplate> pblocktemplate(BlockAssembler(Params()).CreateNewBlock(scriptCoinbase));
+        BOOST_REQUIRE(pblocktemplate.get());
+        BOOST_CHECK(!pwallet->SignBlock(pblocktemplate.get(), nBestHeight+1, nSearchTime));
+    }
+    
+    // Import the key to the last 5 outputs in the regtest genesis coinbase
+    BOOST_CHECK_NO_THROW(rv = CallRPC("extkeyimportmaster tprv8ZgxMBicQKsPe3x7bUzkHAJZzCuGqN6y28zFFyg5i7Yqxqm897VCnmMJz6QScsftHDqsyWW5djx6FzrbkF9HSD3ET163z1SzRhfcWxvwL4G"));
+    
+    // Nothing to stake above the reserve balance, the kernel search must select what CreateCoinStake would
+    BOOST_REQUIRE(pwallet->GetStakeableBalance() > 0);
+    pwallet->SetReserveBalance(pwallet->GetStakeableBalance());
+    BOOST_CHECK(!pwallet->FindStakeKernel(nSearchTime));
+    {
+        std::unique_ptr<CBlockTemplate> pblocktemplate(BlockAssembler(Params()).CreateNewBlock(scriptCoinbase));
+        BOOST_REQUIRE(pblocktemplate.get());
+        BOOST_CHECK(!pwallet->SignBlock(pblocktemplate.get(), nBestHeight+1, nSearchTime));
+    }
+    BOOST_CHECK(pwallet->nStakeKernelsFound == 0);
+    pwallet->SetReserveBalance(0);
+    
+    // A found kernel must yield a signed block at the same search time
+    size_t k, nTries = 10000;
+    int64_t nKernelsFound = 0;
+    for (k = 0; k < nTries; ++k)
+    {
+        nSearchTime = GetAdjustedTime() & ~Params().GetStakeTimestampMask(nBestHeight+1);
+        if (nSearchTime <= pwallet->nLastCoinStakeSearchTime)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(250));
+            continue;
+        };
+        
+        bool fFound = pwallet->FindStakeKernel(nSearchTime);
+        if (fFound)
+            nKernelsFound++;
+        BOOST_CHECK(pwallet->nStakeKernelsFound == nKernelsFound);
+        
+        std::unique_ptr<CBlockTemplate> pblocktemplate(BlockAssembler(Params()).CreateNewBlock(scriptCoinbase));
+        BOOST_REQUIRE(pblocktemplate.get());
+        
+        bool fSigned = pwallet->SignBlock(pblocktemplate.get(), nBestHeight+1, nSearchTime);
+        BOOST_CHECK(fSigned == fFound);
+        if (fSigned)
+        {
+            BOOST_REQUIRE(CheckStake(&pblocktemplate->block));
+            break;
+        };
+        std::this_thread::sleep_for(std::chrono::milliseconds(250));
+    };
+    BOOST_REQUIRE(k < nTries);
+    BOOST_CHECK(chainActive.Height() == nBestHeight+1);
+}
+
+static void CheckBalances(CHDWallet *pwallet)
+{
+    // Deliver the queued wallet notifications, no scheduler thread runs in the tests
+    GetMainSignals().FlushBackgroundCallbacks();
+    
+    // Cached balances must match a full recompute
+    CHDWalletBalances balCached, balFull;
+    BOOST_CHECK(pwallet->GetBalances(balCached));
+    BOOST_CHECK(pwallet->GetBalancesFull(balFull));
+    BOOST_CHECK(balCached == balFull);
+}
+
+BOOST_AUTO_TEST_CASE(stake_balances_test)
+{
+    CHDWallet *pwallet = (CHDWallet*) pwalletMain;
+    UniValue rv;
+    
+    // Import the key to the last 5 outputs in the regtest genesis coinbase
+    BOOST_CHECK_NO_THROW(rv = CallRPC("extkeyimportmaster tprv8ZgxMBicQKsPe3x7bUzkHAJZzCuGqN6y28zFFyg5i7Yqxqm897VCnmMJz6QScsftHDqsyWW5djx6FzrbkF9HSD3ET163z1SzRhfcWxvwL4G"));
+    CheckBalances(pwallet);
+    
+    g_connman = std::unique_ptr<CConnman>(new CConnman(GetRand(std::numeric_limits<uint64_t>::max()), GetRand(std::numeric_limits<uint64_t>::max())));
+    pwallet->SetBroadcastTransactions(true);
+    
+    BOOST_CHECK_NO_THROW(rv = CallRPC("getnewstealthaddress"));
+    std::string sSxAddr = StripQuotes(rv.write());
+    BOOST_CHECK_NO_THROW(rv = CallRPC("getnewaddress"));
+    std::string sAddr = StripQuotes(rv.write());
+    
+    // Blinded outputs are kept in records
+    BOOST_CHECK_NO_THROW(rv = CallRPC("sendparttoblind " + sSxAddr + " 100"));
+    CheckBalances(pwallet);
+    
+    StakeNBlocks(pwallet, 1);
+    CheckBalances(pwallet);
+    
+    // Disconnect the block and connect it again
+    std::string sTipHash;
+    {
+        LOCK(cs_main);
+        sTipHash = chainActive.Tip()->GetBlockHash().ToString();
+    }
+    BOOST_CHECK_NO_THROW(rv = CallRPC("invalidateblock " + sTipHash));
+    CheckBalances(pwallet);
+    BOOST_CHECK_NO_THROW(rv = CallRPC("reconsiderblock " + sTipHash));
+    CheckBalances(pwallet);
+    
+    // Spend a record output
+    BOOST_CHECK_NO_THROW(rv = CallRPC("sendblindtopart " + sAddr + " 10"));
+    CheckBalances(pwallet);
+    
+    // A trusted unconfirmed txn stops counting when it leaves the mempool, without any notification
+    BOOST_CHECK_NO_THROW(rv = CallRPC("sendtoaddress " + sAddr + " 1"));
+    std::string sTxid = StripQuotes(rv.write());
+    CheckBalances(pwallet);
+    {
+        CTransactionRef ptx = mempool.get(uint256S(sTxid));
+        BOOST_REQUIRE(ptx);
+        mempool.removeRecursive(*ptx);
+    }
+    CheckBalances(pwallet);
+    
+    BOOST_CHECK_NO_THROW(rv = CallRPC("abandontransaction " + sTxid));
+    CheckBalances(pwallet);
+}
+
 BOOST_AUTO_TEST_CASE(stake_test)
 {
     CHDWallet *pwallet = (CHDWallet*) pwalletMain;
@@ -300,6 +530,14 @@ BOOST_AUTO_TEST_CASE(stake_test)
     
     BOOST_CHECK(pwallet->GetBalance() + pwallet->GetStaked() == 12500000108911);
     
+    {
+        // Cached balances must match a full recompute
+        CHDWalletBalances balCached, balFull;
+        BOOST_CHECK(pwallet->GetBalances(balCached));
+        BOOST_CHECK(pwallet->GetBalancesFull(balFull));
+        BOOST_CHECK(balCached == balFull);
+    }
+    
     
     {
         LOCK2(cs_main, pwallet->cs_wallet);
@@ -79,6 +79,11 @@ class SmsgTest(ParticlTestFramework):
         assert(len(ro['messages']) == 1)
         assert(ro['messages'][0]['from'] == address1)
         assert(ro['messages'][0]['text'] == 'Test 1->0.')
+
+        ro = nodes[0].smsgscanstats()
+        assert(int(ro['messages scanned']) > 0)
+        assert(int(ro['messages matched']) > 0)
+        assert(ro['unlock scan']['running'] == 'false')
         
         # - node0 should have got pubkey for address1 by receiving msg from address1
         
@@ -117,6 +122,17 @@ class SmsgTest(ParticlTestFramework):
         assert(len(ro['messages']) == 1)
         assert(ro['messages'][0]['from'] == address1)
         assert(ro['messages'][0]['text'] == 'Test 1->0. 2')
+
+        ro = nodes[0].smsginbox('all', {'count': 1})
+        assert(len(ro['messages']) == 1)
+        assert(ro['messages'][0]['text'] == 'Test 1->0.')
+
+        ro = nodes[0].smsginbox('all', {'offset': 1, 'address': address0})
+        assert(len(ro['messages']) == 1)
+        assert(ro['messages'][0]['text'] == 'Test 1->0. 2')
+
+        ro = nodes[1].smsgoutbox('all', {'address': address1})
+        assert(len(ro['messages']) == 0)
         
         
         #print(json.dumps(ro, indent=4, default=self.jsonDecimal))
@@ -0,0 +1,106 @@
+#!/usr/bin/env python3
+# Copyright (c) 2017 The Particl Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+from test_framework.test_particl import ParticlTestFramework
+from test_framework.util import *
+
+
+class SmsgReconTest(ParticlTestFramework):
+
+    def __init__(self):
+        super().__init__()
+        self.setup_clean_chain = True   # don't copy from cache
+        self.num_nodes = 2
+        self.extra_args = [ ['-smsgpowthreads=0'] for i in range(self.num_nodes) ]
+
+    def setup_network(self, split=False):
+        self.nodes = self.start_nodes(self.num_nodes, self.options.tmpdir, self.extra_args)
+        connect_nodes_bi(self.nodes,0,1)
+
+
+    def waitForMessages(self, nMessages, node):
+        for i in range(240):
+            ro = self.nodes[node].smsgbuckets()
+            if ro['total']['messages'] == str(nMessages):
+                return
+            time.sleep(0.5)
+        assert(False), "node%d has %s messages, expected %d." % (node, ro['total']['messages'], nMessages)
+
+
+    def run_test (self):
+        nodes = self.nodes
+
+        ro = nodes[0].mnemonic("new");
+        roImport0 = nodes[0].extkeyimportmaster(ro["master"])
+        roImport1 = nodes[1].extkeyimportmaster("abandon baby cabbage dad eager fabric gadget habit ice kangaroo lab absorb")
+
+        address0 = nodes[0].getnewaddress()
+        address1 = nodes[1].getnewaddress()
+
+        ro = nodes[0].smsglocalkeys()
+        ro = nodes[1].smsgaddkey(address0, ro['keys'][0]['public_key'])
+        assert(ro['result'] == 'Added public key to db.')
+
+        # Keep all messages in one bucket, sketches are only sent for large buckets
+        nBucketLen = 600
+        if int(time.time()) % nBucketLen > nBucketLen - 180:
+            time.sleep(nBucketLen - int(time.time()) % nBucketLen + 1)
+
+        nMessages = 100
+        for i in range(nMessages):
+            ro = nodes[1].smsgsend(address1, address0, "Test 1->0 %d." % (i))
+            assert(ro['result'] == 'Sent.')
+
+        self.waitForMessages(nMessages, 1)
+        self.waitForMessages(nMessages, 0)
+
+        ro = nodes[0].smsgbuckets()
+        assert(ro['total']['buckets'] == "1")
+
+        # Diverge by a few messages, then by more, the sketches must grow with the difference
+        nTotal = nMessages
+        vBytesPerSketch = []
+        for nExtra in [2, 10]:
+            disconnect_nodes(nodes[0], 1)
+            disconnect_nodes(nodes[1], 0)
+
+            for i in range(nExtra):
+                ro = nodes[1].smsgsend(address1, address0, "Test offline 1->0 %d %d." % (nExtra, i))
+                assert(ro['result'] == 'Sent.')
+            self.waitForMessages(nTotal + nExtra, 1)
+
+            ro = nodes[0].smsgbuckets()
+            assert(ro['total']['messages'] == str(nTotal))
+            nSketchesBefore = int(ro['reconciliation']['sketches sent'])
+            nBytesBefore = int(ro['reconciliation']['sketch bytes sent'])
+
+            connect_nodes_bi(nodes, 0, 1)
+            nTotal += nExtra
+            self.waitForMessages(nTotal, 0)
+
+            ro = nodes[0].smsgbuckets()
+            nSketches = int(ro['reconciliation']['sketches sent']) - nSketchesBefore
+            nBytes = int(ro['reconciliation']['sketch bytes sent']) - nBytesBefore
+            assert(nSketches > 0)
+            vBytesPerSketch.append(nBytes / nSketches)
+
+        # Well under the token list of 16 bytes per message, even if the first sketch was retried
+        assert(vBytesPerSketch[0] < nMessages * 16 / 2)
+        assert(vBytesPerSketch[1] > vBytesPerSketch[0])
+
+        ro = nodes[1].smsgbuckets()
+        assert(int(ro['reconciliation']['sketches received']) > 0)
+        assert(int(ro['reconciliation']['decoded']) > 0)
+        assert(int(ro['reconciliation']['bytes saved']) > 0)
+        assert(int(ro['inventory']['rebuilds']) > 0)
+        assert(int(ro['inventory']['sends']) > 0)
+        assert(int(ro['inventory']['unchanged']) > 0)
+
+        ro = nodes[0].smsginbox()
+        assert(len(ro['messages']) == nTotal)
+
+
+if __name__ == '__main__':
+    SmsgReconTest().main()
@@ -161,6 +161,7 @@ PARTICL_SCRIPTS = [
     'wallet-particl.py',
     'mnemonic.py',
     'smsg.py',
+    'smsg_recon.py',
     'multisig.py',
     'coldstaking.py',
 ]